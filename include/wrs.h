@@ -18,6 +18,10 @@ typedef enum {
 typedef struct WrsConfig {
     char*       document_root;          // Document root path
     int         listening_port;         // HTTP server listening port (0 for auto port)
+    int         num_threads;            // Number of server worker threads (0 for default). Each WebSocket client uses one thread.
+    bool        metrics;                // Serve Prometheus text format metrics at "/metrics"
+    const CxAllocator* alloc;           // Allocator for all the server allocations (NULL for default)
+    size_t      mem_budget;             // Memory budget in bytes: new received messages which would exceed it are rejected (0 for no limit)
     bool        use_staticfs;           // Use internal embedded static filesystem (zip)                                       
     char*       staticfs_prefix;        // Static filesystem (zip) prefix
     const void* staticfs_data;          // Pointer to static filesystem zip data
@@ -43,6 +47,22 @@ Wrs* wrs_create(const WrsConfig* cfg);
 // Stops and destroy previously create WRS server
 void wrs_destroy(Wrs* wrs); 
 
+// Returns the listening port used by the server
+int wrs_get_port(Wrs* wrs);
+
+// Server memory statistics
+typedef struct WrsMemStats {
+    size_t      used;           // Number of bytes currently allocated by the server
+    size_t      peak;           // Maximum number of bytes allocated by the server
+    size_t      budget;         // Configured memory budget in bytes (0 for no limit)
+    uint64_t    rejected;       // Number of received messages rejected by the memory budget
+} WrsMemStats;
+
+// Returns the server memory statistics.
+// Only the memory allocated through the configured allocator is accounted:
+// the memory allocated internally by the HTTP server is not included.
+WrsMemStats wrs_mem_stats(Wrs* wrs);
+
 
 // Type for local C functions called by remote clients
 // rpc - pointer to RPC endpoint which received the message
@@ -64,8 +84,9 @@ typedef enum {
 typedef void (*WrsEventCallback)(WrsRpc* rpc, size_t connid, WrsEvent ev);
 
 // Open RPC endpoint and returns its pointer
-// wrs - WRS server
-// url - Relative url for this endpoint
+// wrs - WRS server or NULL for an endpoint which only accepts loopback connections
+// url - Relative url for this endpoint or "unix:<path>" for a local endpoint
+//       using a Unix domain socket at the specified path.
 // max_conns - Maximum number of client connections
 // cb - Optional callback to receive events for this endpoint
 // Returns NULL pointer on error.
@@ -76,6 +97,27 @@ WrsRpc* wrs_rpc_open(Wrs* wrs, const char* url, size_t max_conns, WrsEventCallba
 // Returns non zero error code on errors.
 void wrs_rpc_close(WrsRpc* rpc);
 
+// RPC endpoint options
+typedef struct WrsRpcOptions {
+    size_t  max_msg_size;       // Maximum size in bytes of received messages (0 for default of 64MB, SIZE_MAX for no limit)
+    size_t  rx_promote_len;     // Minimum length of received numeric arrays decoded as float64 buffers (0 to disable)
+    size_t  tx_promote_len;     // Minimum length of sent numeric arrays encoded as float64 buffers (0 to disable)
+    size_t  slow_call_us;       // Minimum duration in microseconds of local function calls recorded as slow calls (0 to disable)
+    size_t  rx_block_size;      // Block size in bytes of the memory pool for received messages (0 for default)
+    size_t  tx_block_size;      // Block size in bytes of the memory pools for sent messages (0 for default)
+    size_t  ping_interval_ms;   // Interval in milliseconds between keepalive pings sent to WebSocket connections (0 to disable)
+    size_t  ping_max_missed;    // Number of consecutive pings not answered before the connection is closed (0 for default of 3)
+    size_t  frag_size;          // Maximum size in bytes of the fragments of large normal priority messages (0 to disable)
+    size_t  max_tx_queued;      // Maximum number of bytes queued for each connection before it is closed (0 for default of 64MB)
+} WrsRpcOptions;
+
+// Sets the options of the RPC endpoint.
+// The options are applied to the connections opened after this call,
+// except the keepalive, fragment size and send queue options which apply to all the connections.
+// Connections which don't answer the keepalive pings are sent a close frame
+// and generate the WrsEventClose event when the server closes them.
+void wrs_rpc_set_options(WrsRpc* rpc, const WrsRpcOptions* opts);
+
 // Sets user data associated with this RPC endpoint
 void wrs_rpc_set_userdata(WrsRpc* rpc, void* userdata); 
 
@@ -94,6 +136,22 @@ CxError wrs_rpc_bind(WrsRpc* rpc, const char* remote_name, WrsRpcFn local_fn);
 // remote_name - the name used by remote client to call this local function.
 CxError wrs_rpc_unbind(WrsRpc* rpc, const char* remote_name);
 
+// Message priorities
+// When the endpoint fragment size option is set, normal priority messages
+// larger than the fragment size are sent in fragments by the endpoint sender thread,
+// which serves the connections in turns. High priority messages are sent
+// immediately, between the fragments of the messages being sent.
+typedef enum {
+    WrsPriorityNormal,  // Default priority
+    WrsPriorityHigh,    // Not delayed by large messages
+} WrsPriority;
+
+// Sets the priority of the responses of a binded local function
+// rpc - RPC endpoint
+// remote_name - the name used by remote client to call the local function.
+// prio - priority of the responses
+CxError wrs_rpc_bind_priority(WrsRpc* rpc, const char* remote_name, WrsPriority prio);
+
 // Type for RPC response function
 // rpc - RPC endpoint from which the response arrived
 // connid - identifies the connection id
@@ -111,20 +169,302 @@ typedef int (*WrsResponseFn)(WrsRpc* rpc, size_t connid, CxVar* resp);
 // After the function returns, the 'params' CxVar may be destroyed.
 CxError wrs_rpc_call(WrsRpc* rpc, size_t connid, const char* remote_name, CxVar* params, WrsResponseFn cb);
 
+// Calls remote function using RPC connection with the specified message priority
+// The other parameters are the same as wrs_rpc_call().
+CxError wrs_rpc_call_priority(WrsRpc* rpc, size_t connid, const char* remote_name, CxVar* params,
+    WrsResponseFn cb, WrsPriority prio);
+
+// Type for the function called when the client grants credits to a stream
+// rpc - RPC endpoint
+// connid - identifies the connection
+// sid - stream id
+// credits - number of frames which can be pushed without being coalesced
+typedef void (*WrsStreamFn)(WrsRpc* rpc, size_t connid, size_t sid, size_t credits);
+
+// Opens stream of frames pushed to the client without the call and response envelope.
+// The client must grant credits for the stream name and each frame pushed consumes
+// one credit. Frames pushed without credits are coalesced, keeping only the
+// latest frame, which is sent when the client grants more credits.
+// rpc - RPC endpoint
+// connid - identifies the connection
+// name - stream name used by the client
+// cb - Optional function called when the client grants credits
+// sid - returns the stream id
+CxError wrs_rpc_stream_open(WrsRpc* rpc, size_t connid, const char* name, WrsStreamFn cb, size_t* sid);
+
+// Pushes frame to the stream or keeps it as the latest frame if the client has no credits
+// rpc - RPC endpoint
+// connid - identifies the connection
+// sid - stream id
+// data - frame data, which may be reused after the function returns
+// len - length in bytes of the frame data
+// Returns error if the stream is not open.
+CxError wrs_rpc_stream_push(WrsRpc* rpc, size_t connid, size_t sid, const void* data, size_t len);
+
+// Closes the stream discarding any frame not sent
+CxError wrs_rpc_stream_close(WrsRpc* rpc, size_t connid, size_t sid);
+
+// Statistics of one stream
+typedef struct WrsRpcStreamStats {
+    uint64_t    pushed;         // Number of frames pushed
+    uint64_t    sent;           // Number of frames sent
+    uint64_t    coalesced;      // Number of frames replaced by later frames before being sent
+    size_t      credits;        // Current number of credits
+} WrsRpcStreamStats;
+
+// Returns the statistics of the specified stream
+CxError wrs_rpc_stream_stats(WrsRpc* rpc, size_t connid, size_t sid, WrsRpcStreamStats* stats);
+
+// Release function for buffers taken from received messages
+typedef struct WrsBufRelease {
+    void (*fn)(void* ctx);  // Function to call to release the buffer
+    void* ctx;              // Release function context
+} WrsBufRelease;
+
+// Takes ownership of the buffer of a received message without copying it.
+// Should be called from inside the local function or response callback
+// which received the message.
+// rpc - RPC endpoint
+// connid - identifies the connection which received the message
+// msg - received 'params' or 'resp' CxVar map
+// key - key of the buffer in the map
+// ptr - returns pointer to the buffer data
+// len - returns length in bytes of the buffer data
+// release - returns function which must be called to release the buffer
+// The receive storage of the message is detached from the connection and is
+// freed when all the buffers taken from the message are released, which may
+// happen after the connection or the endpoint is closed, but not after the server is destroyed.
+CxError wrs_rpc_take_buf(WrsRpc* rpc, size_t connid, CxVar* msg, const char* key,
+    const void** ptr, size_t* len, WrsBufRelease* release);
+
+// Type for function receiving the messages written to a loopback connection
+// ctx - context supplied to wrs_rpc_loopback_open()
+// text - true for text (JSON) messages and false for binary messages
+// data - message data which is only valid during the call
+// len - message length in bytes
+// The function is called with exclusive write access to the connection and must
+// not call other endpoint functions: messages to inject should be copied and sent later.
+typedef void (*WrsLoopbackFn)(void* ctx, bool text, const void* data, size_t len);
+
+// Opens an in-memory loopback connection to the RPC endpoint.
+// The messages sent by the endpoint to this connection are passed to the
+// output function and the messages received are injected with wrs_rpc_loopback_send().
+// Allows testing and profiling the RPC dispatch, codec and response path
+// without sockets.
+// rpc - RPC endpoint
+// pack - true to use the MessagePack envelope to send messages
+// out - function to receive the messages sent by the endpoint
+// ctx - context for the output function
+// connid - returns the id of the new connection
+CxError wrs_rpc_loopback_open(WrsRpc* rpc, bool pack, WrsLoopbackFn out, void* ctx, size_t* connid);
+
+// Injects a complete message as received by the loopback connection.
+// The message is processed synchronously in the caller thread.
+// Returns error and closes the connection if the message is invalid.
+CxError wrs_rpc_loopback_send(WrsRpc* rpc, size_t connid, bool text, const void* data, size_t len);
+
+// Closes loopback connection
+void wrs_rpc_loopback_close(WrsRpc* rpc, size_t connid);
+
 // Returns information about specified RPC endpoint
 typedef struct WrsRpcInfo {
     const char* url;        // Associated url
     size_t  nconns;         // Current number of connection
     size_t  max_connid;     // Maximum valid connection id
+    uint64_t allocs;        // Number of heap allocations and resizes made for the connections
 } WrsRpcInfo;
 WrsRpcInfo wrs_rpc_info(WrsRpc* rpc);
 
+// Statistics of one RPC connection
+typedef struct WrsRpcConnStats {
+    uint64_t    msgs_in;        // Number of messages received
+    uint64_t    msgs_out;       // Number of messages sent
+    uint64_t    bytes_in;       // Number of bytes received
+    uint64_t    bytes_out;      // Number of bytes sent
+    size_t      rx_bytes;       // Size in bytes of the message being received or last received
+    size_t      rx_peak;        // Maximum size in bytes of the received messages
+    size_t      tx_cap;         // Current capacity in bytes of the message encoders
+    size_t      tx_peak;        // Maximum capacity in bytes of the message encoders
+    size_t      pending;        // Number of calls waiting for responses
+    int64_t     last_rtt_us;    // Round trip time in microseconds of the last call answered or -1
+    uint64_t    idle_ms;        // Time in milliseconds since the last message received or sent
+    int64_t     ping_rtt_us;    // Smoothed round trip time in microseconds of the keepalive pings or -1
+    int64_t     ping_rtt_min_us;// Minimum round trip time in microseconds of the keepalive pings or -1
+    int64_t     ping_rtt_max_us;// Maximum round trip time in microseconds of the keepalive pings or -1
+    uint32_t    pings_missed;   // Number of consecutive keepalive pings not answered
+    size_t      tx_queued;      // Number of bytes queued to be sent in fragments
+} WrsRpcConnStats;
+
+// Returns the statistics of the specified connection
+// rpc - RPC endpoint
+// connid - identifies the connection
+// stats - returns the connection statistics
+// Returns error if the connection id is invalid or closed.
+CxError wrs_rpc_conn_stats(WrsRpc* rpc, size_t connid, WrsRpcConnStats* stats);
+
+// Statistics of a local function binding
+typedef struct WrsRpcBindStats {
+    uint64_t    calls;          // Number of calls
+    uint64_t    wall_us;        // Total wall time in microseconds spent in the local function
+    uint64_t    cpu_us;         // Total thread CPU time in microseconds spent in the local function
+    uint64_t    req_bytes;      // Total size in bytes of the received call messages
+    uint64_t    resp_bytes;     // Total size in bytes of the sent response messages
+} WrsRpcBindStats;
+
+// Returns the statistics of the specified local function binding
+CxError wrs_rpc_bind_stats(WrsRpc* rpc, const char* remote_name, WrsRpcBindStats* stats);
+
+// Record of a local function call which took longer than the 'slow_call_us' option
+typedef struct WrsRpcSlowCall {
+    uint64_t    seq;            // Record sequence number starting from 1
+    size_t      connid;         // Connection which received the call
+    char        name[64];       // Binding name (truncated)
+    size_t      params_size;    // Size in bytes of the encoded call parameters, excluding binary buffer chunks
+    uint64_t    wall_us;        // Wall time in microseconds spent in the local function
+    uint64_t    cpu_us;         // Thread CPU time in microseconds spent in the local function
+} WrsRpcSlowCall;
+
+// Copies the slow call records with sequence numbers greater than 'after_seq',
+// oldest first. The endpoint keeps only the most recent records.
+// rpc - RPC endpoint
+// after_seq - sequence number of the last record already read or 0
+// calls - array to copy the records to
+// max - maximum number of records to copy
+// Returns the number of records copied.
+size_t wrs_rpc_slow_calls(WrsRpc* rpc, uint64_t after_seq, WrsRpcSlowCall* calls, size_t max);
+
+// State store replicated to the subscribed connections of an RPC endpoint.
+// The state is a map whose values are set and read by paths of map keys
+// separated by dots, as "audio.gain". Each subscribed connection receives
+// a snapshot of the state followed by batches with the values of the changed
+// paths only, sent at most once per store interval.
+typedef struct WrsStore WrsStore;
+
+// Opens state store attached to RPC endpoint
+// rpc - RPC endpoint
+// name - store name used by the clients
+// interval_ms - minimum interval in milliseconds between batches of changes (0 to send each change)
+// The changes delayed by the interval are sent by the server timer.
+// Stores of endpoints without server must send them with wrs_store_flush().
+// Returns NULL pointer on error.
+WrsStore* wrs_store_open(WrsRpc* rpc, const char* name, size_t interval_ms);
+
+// Closes state store, which must be closed before its RPC endpoint
+void wrs_store_close(WrsStore* store);
+
+// Sets copy of value at the specified path, replacing the path keys
+// which are not maps by maps.
+// Returns error if the path is invalid.
+CxError wrs_store_set(WrsStore* store, const char* path, const CxVar* val);
+
+// Copies the value at the specified path to 'val'
+// Returns error if the path is not found.
+CxError wrs_store_get(WrsStore* store, const char* path, CxVar* val);
+
+// Subscribes connection to the store sending it a snapshot of the state.
+// Connections are unsubscribed when closed.
+CxError wrs_store_subscribe(WrsStore* store, size_t connid);
+
+// Unsubscribes connection from the store
+CxError wrs_store_unsubscribe(WrsStore* store, size_t connid);
+
+// Sends the pending changes to the subscribed connections
+void wrs_store_flush(WrsStore* store);
+
+#define WRS_LOCK_HIST   (16)    // Number of buckets of the lock time histograms
+
+// Statistics of an internal lock.
+// Only available if the library was built with the WRS_LOCK_STATS CMake option.
+// The histogram bucket 'i' counts the times shorter than 2^i microseconds
+// and the last bucket also counts all the longer times.
+typedef struct WrsLockStats {
+    const char* name;                       // Lock name
+    uint64_t    count;                      // Number of acquisitions
+    uint64_t    contended;                  // Number of acquisitions which waited for the lock
+    uint64_t    wait_ns;                    // Total wait time in nanoseconds
+    uint64_t    hold_ns;                    // Total hold time in nanoseconds
+    uint64_t    wait_hist[WRS_LOCK_HIST];   // Histogram of the wait times of contended acquisitions
+    uint64_t    hold_hist[WRS_LOCK_HIST];   // Histogram of the hold times
+    uint64_t    max_hold_ns;                // Longest hold time in nanoseconds
+    const char* max_hold_func;              // Function which held the lock for the longest time
+    int         max_hold_line;              // Source line where that function acquired the lock
+} WrsLockStats;
+
+// Returns the statistics of the server lock.
+// Returns error if the library was built without lock statistics.
+CxError wrs_lock_stats(Wrs* wrs, WrsLockStats* stats);
+
+// Returns the statistics of the RPC endpoint lock.
+// Returns error if the library was built without lock statistics.
+CxError wrs_rpc_lock_stats(WrsRpc* rpc, WrsLockStats* stats);
+
+// Starts recording trace events of the RPC messages processing stages:
+// frame received, reassembly, decoding, binding lookup, local function,
+// encoding and write, and the round trips of the calls to remote functions.
+// Each thread records its events in its own ring buffer keeping the most
+// recent events. The buffers are created with the specified number of
+// events (0 for default). Previously recorded events are discarded.
+void wrs_trace_start(size_t nevents);
+
+// Stops recording trace events keeping the recorded events
+void wrs_trace_stop(void);
+
+// Writes the recorded events to the specified file in the Chrome trace event
+// JSON format, which can be opened by Perfetto UI or chrome://tracing.
+CxError wrs_trace_dump(const char* path);
+
+// Starts asynchronous logging.
+// The messages logged by WRS_LOG*() are queued in a lock-free ring buffer
+// with the specified number of slots (0 for default) and written to the
+// logger handlers by a background thread. Messages logged when the
+// ring buffer is full are dropped and their number reported later.
+void wrs_logger_async_start(size_t nslots);
+
+// Stops asynchronous logging writing all the queued messages.
+// Should be called when no other threads are logging (after wrs_destroy())
+// and before the internal logger is changed or destroyed.
+void wrs_logger_async_stop(void);
+
+// Logs message with the internal logger.
+// Messages longer than 255 bytes are truncated.
+void wrs_log(CxLoggerLevel level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// State of rate limited log call site
+typedef struct WrsLogLimit {
+    _Atomic uint64_t    next;       // Time in ms from which the next message is logged
+    _Atomic uint32_t    suppressed; // Number of messages suppressed since the last logged
+} WrsLogLimit;
+
+// Returns true if the message of a rate limited call site should be logged.
+// Allows one message per interval and logs the number of messages suppressed.
+bool wrs_log_limit(WrsLogLimit* lim, CxLoggerLevel level, unsigned interval_ms);
+
+// Minimum level of the messages compiled in.
+// Calls to the logger macros for lower levels generate no code.
+#ifndef WRS_LOG_MIN_LEVEL
+#define WRS_LOG_MIN_LEVEL CxLoggerDebug
+#endif
+
 // Logger utility macros
-#define WRS_LOGD(...) cx_logger_log(wrs_logger(), CxLoggerDebug, __VA_ARGS__)
-#define WRS_LOGI(...) cx_logger_log(wrs_logger(), CxLoggerInfo, __VA_ARGS__)
-#define WRS_LOGW(...) cx_logger_log(wrs_logger(), CxLoggerWarn, __VA_ARGS__)
-#define WRS_LOGE(...) cx_logger_log(wrs_logger(), CxLoggerError, __VA_ARGS__)
-#define WRS_LOGF(...) cx_logger_log(wrs_logger(), CxLoggerFatal, __VA_ARGS__)
+#define WRS_LOG_(level, ...)\
+    do { if (level >= WRS_LOG_MIN_LEVEL) wrs_log(level, __VA_ARGS__); } while (0)
+#define WRS_LOGD(...) WRS_LOG_(CxLoggerDebug, __VA_ARGS__)
+#define WRS_LOGI(...) WRS_LOG_(CxLoggerInfo, __VA_ARGS__)
+#define WRS_LOGW(...) WRS_LOG_(CxLoggerWarn, __VA_ARGS__)
+#define WRS_LOGE(...) WRS_LOG_(CxLoggerError, __VA_ARGS__)
+#define WRS_LOGF(...) WRS_LOG_(CxLoggerFatal, __VA_ARGS__)
+
+// Rate limited logger utility macros for messages which can be triggered by remote clients.
+// Each call site logs at most one message per 'ms' milliseconds.
+#define WRS_LOG_RL_(level, ms, ...)\
+    do {\
+        static WrsLogLimit lim_;\
+        if (level >= WRS_LOG_MIN_LEVEL && wrs_log_limit(&lim_, level, ms)) wrs_log(level, __VA_ARGS__);\
+    } while (0)
+#define WRS_LOGD_RL(ms, ...) WRS_LOG_RL_(CxLoggerDebug, ms, __VA_ARGS__)
+#define WRS_LOGI_RL(ms, ...) WRS_LOG_RL_(CxLoggerInfo, ms, __VA_ARGS__)
+#define WRS_LOGW_RL(ms, ...) WRS_LOG_RL_(CxLoggerWarn, ms, __VA_ARGS__)
+#define WRS_LOGE_RL(ms, ...) WRS_LOG_RL_(CxLoggerError, ms, __VA_ARGS__)
 
 #endif
 
@@ -0,0 +1,67 @@
+#ifndef WRS_CLIENT_H
+#define WRS_CLIENT_H
+
+#include "cx_error.h"
+#include "cx_var.h"
+
+// Native RPC client which connects to a WRS RPC endpoint using WebSocket.
+// The messages are encoded/decoded with the same codec used by the server and
+// the calls and bindings have the same semantics as the browser client (rpc.js).
+typedef struct WrsClient WrsClient;
+
+// Type for local C functions called by the remote server
+// client - client which received the call
+// params - call parameters
+// resp - optional response data
+// Must return 0 to allow response to be sent back to remote caller.
+typedef int (*WrsClientFn)(WrsClient* client, CxVar* params, CxVar* resp);
+
+// Type for client response callback
+// client - client which received the response
+// resp - response message
+// cbdata - data supplied to wrs_client_call()
+// Returns zero to keep the connection open
+typedef int (*WrsClientResponseFn)(WrsClient* client, CxVar* resp, void* cbdata);
+
+// Type for callback called when the connection is closed by the server
+typedef void (*WrsClientCloseFn)(WrsClient* client);
+
+// Client configuration
+typedef struct WrsClientConfig {
+    const char*         host;       // Server host name or address
+    int                 port;       // Server port
+    const char*         url;        // Url of the RPC endpoint
+    bool                pack;       // Sends messages using MessagePack envelope
+    WrsClientCloseFn    closecb;    // Optional close callback
+    void*               userdata;   // Optional user data
+} WrsClientConfig;
+
+// Connects to remote RPC endpoint.
+// Returns NULL on error.
+WrsClient* wrs_client_connect(const WrsClientConfig* cfg);
+
+// Closes the connection and destroys the client.
+void wrs_client_close(WrsClient* client);
+
+// Returns the user data set in the client configuration
+void* wrs_client_get_userdata(WrsClient* client);
+
+// Binds a local C function to be called by the remote server.
+// Only one function can be binded to a remote name.
+CxError wrs_client_bind(WrsClient* client, const char* remote_name, WrsClientFn local_fn);
+
+// Unbinds a previously binded local function
+CxError wrs_client_unbind(WrsClient* client, const char* remote_name);
+
+// Calls remote function
+// client - RPC client
+// remote_name - the name of the remote function to call
+// params - message with parameters to send to remote function
+// cb - Optional callback to receive response from remote function
+// cbdata - Optional data passed to the response callback
+// Returns non zero value on errors.
+// After the function returns, the 'params' CxVar may be destroyed.
+CxError wrs_client_call(WrsClient* client, const char* remote_name, CxVar* params, WrsClientResponseFn cb, void* cbdata);
+
+#endif
+
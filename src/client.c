@@ -0,0 +1,394 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cx_error.h"
+#include "cx_var.h"
+#include "cx_alloc.h"
+#include "cx_pool_allocator.h"
+#include "civetweb.h"
+
+#include "wrs.h"
+#include "wrs_client.h"
+#include "rpc_codec.h"
+
+// Define internal hashmap from remote name to local function
+#define cx_hmap_name                map_cbind
+#define cx_hmap_key                 char*
+#define cx_hmap_val                 WrsClientFn
+#define cx_hmap_cmp_key(k1,k2,s)    strcmp(*(char**)k1,*(char**)k2)
+#define cx_hmap_hash_key(k,s)       cx_hmap_hash_fnv1a32(*((char**)k), strlen(*(char**)k))
+#define cx_hmap_free_key(k)         free(*k)
+#define cx_hmap_implement
+#define cx_hmap_static
+#include "cx_hmap.h"
+
+// Response callback info
+typedef struct ClientResponse {
+    WrsClientResponseFn fn;     // Function to call when response arrives
+    void*               cbdata; // Data for the callback
+} ClientResponse;
+
+// Define map of call id to response callback
+#define cx_hmap_name map_cresp
+#define cx_hmap_key  uint64_t
+#define cx_hmap_val  ClientResponse
+#define cx_hmap_implement
+#define cx_hmap_static
+#include "cx_hmap.h"
+
+// RPC client state
+typedef struct WrsClient {
+    pthread_mutex_t         lock;       // For exclusive access to this state
+    WrsClientConfig         cfg;        // Copy of user configuration
+    struct mg_connection*   conn;       // CivetWeb client connection
+    int                     opcode;     // Initial opcode of group of fragments
+    CxPoolAllocator*        rxalloc;    // Pool allocator for received msg CxVar
+    CxPoolAllocator*        txalloc;    // Pool allocator for transmitted msg CxVar
+    WrsDecoder*             dec;        // Message decoder
+    WrsEncoder*             enc;        // Message encoder
+    uint64_t                cid;        // Next call id
+    map_cbind               binds;      // Map remote name to local function
+    map_cresp               responses;  // Map of call cid to response callback
+} WrsClient;
+
+// Forward declaration of local functions
+static int wrs_client_data_handler(struct mg_connection* conn, int opcode, char* data, size_t data_size, void* user_data);
+static void wrs_client_close_handler(const struct mg_connection* conn, void* user_data);
+static int wrs_client_call_handler(WrsClient* client, const WrsEnvelope* env);
+static int wrs_client_response_handler(WrsClient* client, const WrsEnvelope* env);
+static int wrs_client_send(WrsClient* client, CxVar* msg);
+
+#define WEBSOCKET_FIN_MASK   (0x80)  // FIN bit mask
+#define WEBSOCKET_OP_MASK    (0x0F)  // Opcode mask
+#define MAX_CALL_NAME        (256)   // Maximum length of remote call name
+
+
+WrsClient* wrs_client_connect(const WrsClientConfig* cfg) {
+
+    mg_init_library(0);
+    WrsClient* client = calloc(1, sizeof(WrsClient));
+    CXCHKZ(pthread_mutex_init(&client->lock, NULL));
+    client->cfg = *cfg;
+    client->opcode = -1;
+    client->rxalloc = cx_pool_allocator_create(4*4096, NULL);
+    client->txalloc = cx_pool_allocator_create(4*4096, NULL);
+    client->dec = wrs_decoder_new(cx_def_allocator());
+    client->enc = wrs_encoder_new(cx_def_allocator());
+    client->cid = 1;
+    client->binds = map_cbind_init(0);
+    client->responses = map_cresp_init(0);
+    if (cfg->pack) {
+        wrs_encoder_set_format(client->enc, WrsFormatPack);
+    }
+
+    // Connects to the server. The handlers may be called before the function returns,
+    // so the connection pointer is saved with the lock acquired.
+    char ebuf[256] = {0};
+    CXCHKZ(pthread_mutex_lock(&client->lock));
+    client->conn = mg_connect_websocket_client(cfg->host, cfg->port, 0, ebuf, sizeof(ebuf),
+        cfg->url, NULL, wrs_client_data_handler, wrs_client_close_handler, client);
+    CXCHKZ(pthread_mutex_unlock(&client->lock));
+    if (client->conn == NULL) {
+        WRS_LOGE("%s: error connecting to %s:%d%s: %s", __func__, cfg->host, cfg->port, cfg->url, ebuf);
+        client->cfg.closecb = NULL;
+        wrs_client_close(client);
+        return NULL;
+    }
+    return client;
+}
+
+void wrs_client_close(WrsClient* client) {
+
+    // Closes connection waiting for the client thread
+    if (client->conn) {
+        mg_close_connection(client->conn);
+    }
+    map_cbind_free(&client->binds);
+    map_cresp_free(&client->responses);
+    wrs_decoder_del(client->dec);
+    wrs_encoder_del(client->enc);
+    cx_pool_allocator_destroy(client->rxalloc);
+    cx_pool_allocator_destroy(client->txalloc);
+    CXCHKZ(pthread_mutex_destroy(&client->lock));
+    free(client);
+    mg_exit_library();
+}
+
+void* wrs_client_get_userdata(WrsClient* client) {
+
+    return client->cfg.userdata;
+}
+
+CxError wrs_client_bind(WrsClient* client, const char* remote_name, WrsClientFn local_fn) {
+
+    CXCHKZ(pthread_mutex_lock(&client->lock));
+    CxError err = {};
+    if (map_cbind_get(&client->binds, (char*)remote_name)) {
+        err = CXERR("binding already exists");
+        goto exit;
+    }
+    map_cbind_set(&client->binds, strdup(remote_name), local_fn);
+
+exit:
+    CXCHKZ(pthread_mutex_unlock(&client->lock));
+    return err;
+}
+
+CxError wrs_client_unbind(WrsClient* client, const char* remote_name) {
+
+    CXCHKZ(pthread_mutex_lock(&client->lock));
+    CxError err = {};
+    if (!map_cbind_get(&client->binds, (char*)remote_name)) {
+        err = CXERR("binding not found");
+        goto exit;
+    }
+    map_cbind_del(&client->binds, (char*)remote_name);
+
+exit:
+    CXCHKZ(pthread_mutex_unlock(&client->lock));
+    return err;
+}
+
+CxError wrs_client_call(WrsClient* client, const char* remote_name, CxVar* params, WrsClientResponseFn cb, void* cbdata) {
+
+    CXCHKZ(pthread_mutex_lock(&client->lock));
+    CxError err = {};
+
+    // Creates message envelope
+    CxVar* msg = cx_var_new(cx_pool_allocator_iface(client->txalloc));
+    cx_var_set_map(msg);
+    const uint64_t cid = client->cid++;
+    cx_var_set_map_int(msg, "cid", cid);
+    cx_var_set_map_str(msg, "call", remote_name);
+    CxVar* msg_params = cx_var_set_map_map(msg, "params");
+    cx_var_cpy_val(params, msg_params);
+
+    // The response callback is saved before sending the message
+    // as the response could arrive before the write returns.
+    if (cb) {
+        map_cresp_set(&client->responses, cid, (ClientResponse){.fn = cb, .cbdata = cbdata});
+    }
+    if (wrs_client_send(client, msg) <= 0) {
+        map_cresp_del(&client->responses, cid);
+        err = CXERR("error writing message");
+    }
+
+    CXCHKZ(pthread_mutex_unlock(&client->lock));
+    return err;
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Handler called when message is received from the server
+// The handler should return 1 to keep the WebSocket connection open or 0 to close it.
+static int wrs_client_data_handler(struct mg_connection* conn, int opcode, char* data, size_t data_size, void* user_data) {
+
+    WrsClient* client = user_data;
+
+    // Answers the server keepalive pings, which may be interleaved with the fragments of a message
+    if ((opcode & WEBSOCKET_OP_MASK) == MG_WEBSOCKET_OPCODE_PING) {
+        mg_lock_connection(conn);
+        mg_websocket_client_write(conn, MG_WEBSOCKET_OPCODE_PONG, data, data_size);
+        mg_unlock_connection(conn);
+        return 1;
+    }
+    const bool is_final = (opcode & WEBSOCKET_FIN_MASK) != 0;
+    const bool is_cont = (opcode & WEBSOCKET_OP_MASK) == MG_WEBSOCKET_OPCODE_CONTINUATION;
+    if (!is_cont) {
+        client->opcode = opcode;
+    }
+    const int frame_flags = client->opcode & WEBSOCKET_OP_MASK;
+    if (is_final) {
+        client->opcode = -1;
+    }
+
+    // Accepts text or binary messages only.
+    if (frame_flags != MG_WEBSOCKET_OPCODE_TEXT && frame_flags != MG_WEBSOCKET_OPCODE_BINARY) {
+        return 1;
+    }
+    const bool text = frame_flags == MG_WEBSOCKET_OPCODE_TEXT;
+
+    // Streams opened by the server are not supported and are closed
+    WrsStreamMsg smsg;
+    if (!text && is_final && !is_cont && wrs_stream_decode(data, data_size, &smsg)) {
+        if (smsg.kind == WRS_STREAM_OPEN) {
+            uint8_t msg[WRS_STREAM_OVERHEAD];
+            const size_t len = wrs_stream_encode(msg, &(WrsStreamMsg){.sid = smsg.sid, .kind = WRS_STREAM_CLOSE});
+            mg_lock_connection(conn);
+            mg_websocket_client_write(conn, MG_WEBSOCKET_OPCODE_BINARY, (const char*)msg, len);
+            mg_unlock_connection(conn);
+        }
+        return 1;
+    }
+
+    // Scans the message envelope, decoding fragmented messages incrementally.
+    // Fragment messages sent by endpoints with a fragment size are reassembled
+    // in the same way as WebSocket fragmented messages.
+    WrsEnvelope env;
+    CxError err;
+    WrsFrag frag;
+    const bool fragmented = !is_final || is_cont;
+    const bool is_frag = !fragmented && !text && wrs_frag_decode(data, data_size, &frag);
+    if (is_frag) {
+        if (frag.flags & WRS_FRAG_FIRST) {
+            wrs_decoder_begin(client->dec, (frag.flags & WRS_FRAG_TEXT) != 0);
+        }
+        err = wrs_decoder_feed(client->dec, frag.data, frag.len);
+        if (err.code == 0 && !(frag.flags & WRS_FRAG_LAST)) {
+            return 1;
+        }
+        if (err.code == 0) {
+            err = wrs_decoder_end(client->dec, &env);
+        }
+    } else if (fragmented) {
+        if (!is_cont) {
+            wrs_decoder_begin(client->dec, text);
+        }
+        err = wrs_decoder_feed(client->dec, data, data_size);
+        if (err.code == 0 && !is_final) {
+            return 1;
+        }
+        if (err.code == 0) {
+            err = wrs_decoder_end(client->dec, &env);
+        }
+    } else {
+        err = wrs_decoder_scan(client->dec, text, data, data_size, &env);
+    }
+    if (err.code) {
+        WRS_LOGE("%s: error decoding message: %s", __func__, err.msg);
+        return 0;
+    }
+
+    int res = 1;
+    if (env.has_cid) {
+        res = wrs_client_call_handler(client, &env);
+    } else if (env.has_rid) {
+        res = wrs_client_response_handler(client, &env);
+    } else {
+        WRS_LOGE("%s: received invalid message", __func__);
+    }
+    cx_pool_allocator_clear(client->rxalloc);
+    if (fragmented || is_frag) {
+        wrs_decoder_release(client->dec);
+    }
+    return res;
+}
+
+// Handler called when the connection is closed
+static void wrs_client_close_handler(const struct mg_connection* conn, void* user_data) {
+
+    WrsClient* client = user_data;
+    if (client->cfg.closecb) {
+        client->cfg.closecb(client);
+    }
+}
+
+// Process remote call from the server
+// Returns 1 to keep the connection open
+static int wrs_client_call_handler(WrsClient* client, const WrsEnvelope* env) {
+
+    if (env->call == NULL || env->body == NULL || env->call_len >= MAX_CALL_NAME) {
+        WRS_LOGE("%s: invalid remote call", __func__);
+        return 1;
+    }
+    char pcall[MAX_CALL_NAME];
+    memcpy(pcall, env->call, env->call_len);
+    pcall[env->call_len] = 0;
+
+    // Get local function binding for the received "call"
+    CXCHKZ(pthread_mutex_lock(&client->lock));
+    WrsClientFn* pfn = map_cbind_get(&client->binds, pcall);
+    WrsClientFn fn = pfn ? *pfn : NULL;
+    CXCHKZ(pthread_mutex_unlock(&client->lock));
+    if (fn == NULL) {
+        WRS_LOGE("%s: bind for:%s not found", __func__, pcall);
+        return 1;
+    }
+
+    // Decodes the call parameters
+    CxVar* params = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
+    CxError err = wrs_decoder_dec_body(client->dec, env, params);
+    if (err.code) {
+        WRS_LOGE("%s: error decoding 'params' of:%s", __func__, pcall);
+        return 1;
+    }
+
+    // Calls local function and sends response if generated.
+    // The response is built with the receive allocator as the transmit
+    // allocator may be used concurrently by wrs_client_call().
+    CxVar* txmsg = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
+    cx_var_set_map(txmsg);
+    cx_var_set_map_int(txmsg, "rid", env->cid);
+    CxVar* resp = cx_var_set_map_map(txmsg, "resp");
+    if (fn(client, params, resp)) {
+        return 1;
+    }
+    if (cx_var_get_map_val(resp, "err") || cx_var_get_map_val(resp, "data")) {
+        CXCHKZ(pthread_mutex_lock(&client->lock));
+        wrs_client_send(client, txmsg);
+        CXCHKZ(pthread_mutex_unlock(&client->lock));
+    }
+    return 1;
+}
+
+// Process response from previous call
+// Returns 1 to keep the connection open
+static int wrs_client_response_handler(WrsClient* client, const WrsEnvelope* env) {
+
+    CXCHKZ(pthread_mutex_lock(&client->lock));
+    ClientResponse* presp = map_cresp_get(&client->responses, env->rid);
+    ClientResponse info = {0};
+    if (presp) {
+        info = *presp;
+        map_cresp_del(&client->responses, env->rid);
+    }
+    CXCHKZ(pthread_mutex_unlock(&client->lock));
+    if (info.fn == NULL) {
+        WRS_LOGE("%s: response with no callback rid:%ld", __func__, (long)env->rid);
+        return 1;
+    }
+    if (env->body == NULL) {
+        WRS_LOGE("%s: response with missing 'resp' field", __func__);
+        return 1;
+    }
+
+    // Decodes the response and calls response callback
+    CxVar* resp = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
+    CxError err = wrs_decoder_dec_body(client->dec, env, resp);
+    if (err.code) {
+        WRS_LOGE("%s: error decoding response rid:%ld", __func__, (long)env->rid);
+        return 1;
+    }
+    return info.fn(client, resp, info.cbdata) == 0;
+}
+
+// Encodes and sends message to the server and clears the transmit allocator.
+// Must be called with the lock acquired.
+// Returns number of bytes written or <= 0 on errors.
+static int wrs_client_send(WrsClient* client, CxVar* msg) {
+
+    CxError err = wrs_encoder_enc(client->enc, msg);
+    cx_pool_allocator_clear(client->txalloc);
+    if (err.code) {
+        WRS_LOGE("%s: error encoding message", __func__);
+        return -1;
+    }
+    bool text;
+    size_t len;
+    void* encoded = wrs_encoder_get_msg(client->enc, &text, &len);
+    const int opcode = text ? MG_WEBSOCKET_OPCODE_TEXT : MG_WEBSOCKET_OPCODE_BINARY;
+    mg_lock_connection(client->conn);
+    int res = mg_websocket_client_write(client->conn, opcode, encoded, len);
+    mg_unlock_connection(client->conn);
+    if (res <= 0) {
+        WRS_LOGE("%s: error:%d writing message", __func__, res);
+    }
+    return res;
+}
+
@@ -0,0 +1,329 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "cx_error.h"
+#include "wrs.h"
+#include "ipc.h"
+
+// Frame header preceding each message
+typedef struct FrameHeader {
+    uint32_t    opcode;     // WebSocket opcode
+    uint32_t    size;       // Size of message data in bytes
+} FrameHeader;
+
+// State of each IPC connection
+typedef struct IpcConn {
+    IpcServer*      srv;        // Associated server
+    int             fd;         // Connection socket
+    pthread_t       thread;     // Reader thread
+    pthread_mutex_t wlock;      // Serializes writes of messages
+    void*           userdata;   // Optional user data
+    bool            done;       // Reader thread finished
+    uint8_t*        rxbuf;      // Receive buffer
+    size_t          rxcap;      // Receive buffer capacity
+    struct IpcConn* next;       // Next connection in the server list
+} IpcConn;
+
+// IPC server state
+typedef struct IpcServer {
+    pthread_mutex_t lock;       // For exclusive access to this state
+    const CxAllocator* alloc;   // Allocator for the server memory
+    char*           path;       // Socket path
+    int             fd;         // Listening socket
+    pthread_t       thread;     // Accept thread
+    IpcHandlers     handlers;   // Connection handlers
+    void*           userdata;   // User data passed to handlers
+    size_t          max_size;   // Maximum received message size (0 for no limit)
+    bool            stop;       // Server is stopping
+    IpcConn*        conns;      // List of connections
+} IpcServer;
+
+#define WEBSOCKET_FIN_MASK   (0x80)  // FIN bit mask
+#define RXBUF_KEEP_SIZE      (64*1024) // Receive buffers larger than this are freed after each message
+
+// Forward declaration of local functions
+static void* ipc_accept_thread(void* arg);
+static void* ipc_conn_thread(void* arg);
+static void ipc_reap_conns(IpcServer* srv, bool all);
+static bool ipc_read_full(int fd, void* data, size_t len);
+
+
+IpcServer* ipc_server_start(const char* path, const IpcHandlers* handlers, const CxAllocator* alloc, void* userdata) {
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        WRS_LOGE("%s: socket path too long:%s", __func__, path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Creates listening socket, removing possible stale socket file
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        WRS_LOGE("%s: error creating socket:%s", __func__, strerror(errno));
+        return NULL;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        WRS_LOGE("%s: error listening at:%s:%s", __func__, path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    IpcServer* srv = cx_alloc_mallocz(alloc, sizeof(IpcServer));
+    CXCHKZ(pthread_mutex_init(&srv->lock, NULL));
+    srv->alloc = alloc;
+    srv->path = cx_alloc_malloc(alloc, strlen(path) + 1);
+    strcpy(srv->path, path);
+    srv->fd = fd;
+    srv->handlers = *handlers;
+    srv->userdata = userdata;
+    CXCHKZ(pthread_create(&srv->thread, NULL, ipc_accept_thread, srv));
+    return srv;
+}
+
+void ipc_server_stop(IpcServer* srv) {
+
+    // Wakes up and waits for the accept thread
+    CXCHKZ(pthread_mutex_lock(&srv->lock));
+    srv->stop = true;
+    CXCHKZ(pthread_mutex_unlock(&srv->lock));
+    shutdown(srv->fd, SHUT_RDWR);
+    CXCHKZ(pthread_join(srv->thread, NULL));
+    close(srv->fd);
+    unlink(srv->path);
+
+    // Closes all connections and waits for their threads
+    ipc_reap_conns(srv, true);
+    CXCHKZ(pthread_mutex_destroy(&srv->lock));
+    cx_alloc_free(srv->alloc, srv->path, strlen(srv->path) + 1);
+    cx_alloc_free(srv->alloc, srv, sizeof(IpcServer));
+}
+
+void ipc_server_set_max_msg_size(IpcServer* srv, size_t max_size) {
+
+    CXCHKZ(pthread_mutex_lock(&srv->lock));
+    srv->max_size = max_size;
+    CXCHKZ(pthread_mutex_unlock(&srv->lock));
+}
+
+void ipc_conn_set_userdata(IpcConn* conn, void* userdata) {
+
+    conn->userdata = userdata;
+}
+
+void* ipc_conn_get_userdata(IpcConn* conn) {
+
+    return conn->userdata;
+}
+
+int ipc_conn_write(IpcConn* conn, int opcode, const void* data, size_t len) {
+
+    if (len > UINT32_MAX) {
+        return -1;
+    }
+    FrameHeader header = {.opcode = opcode, .size = len};
+    struct iovec iov[2] = {
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = (void*)data, .iov_len = len},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+
+    // Writes the frame header and message data, continuing after partial writes
+    CXCHKZ(pthread_mutex_lock(&conn->wlock));
+    int res = 1;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            res = -1;
+            break;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    CXCHKZ(pthread_mutex_unlock(&conn->wlock));
+    return res;
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Accepts new connections and starts a reader thread for each one
+static void* ipc_accept_thread(void* arg) {
+
+    IpcServer* srv = arg;
+    while (true) {
+        int fd = accept(srv->fd, NULL, NULL);
+        CXCHKZ(pthread_mutex_lock(&srv->lock));
+        const bool stop = srv->stop;
+        CXCHKZ(pthread_mutex_unlock(&srv->lock));
+        if (stop) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            WRS_LOGE("%s: accept error:%s", __func__, strerror(errno));
+            break;
+        }
+
+        // Frees resources of previously closed connections
+        ipc_reap_conns(srv, false);
+
+        // Creates the connection and calls the connect handler
+        IpcConn* conn = cx_alloc_mallocz(srv->alloc, sizeof(IpcConn));
+        conn->srv = srv;
+        conn->fd = fd;
+        CXCHKZ(pthread_mutex_init(&conn->wlock, NULL));
+        if (srv->handlers.connect(conn, srv->userdata)) {
+            CXCHKZ(pthread_mutex_destroy(&conn->wlock));
+            close(fd);
+            cx_alloc_free(srv->alloc, conn, sizeof(IpcConn));
+            continue;
+        }
+        CXCHKZ(pthread_mutex_lock(&srv->lock));
+        conn->next = srv->conns;
+        srv->conns = conn;
+        CXCHKZ(pthread_mutex_unlock(&srv->lock));
+        CXCHKZ(pthread_create(&conn->thread, NULL, ipc_conn_thread, conn));
+    }
+    return NULL;
+}
+
+// Reads messages from the connection and calls the data handler
+// until the connection is closed by the peer, the server or the handler.
+static void* ipc_conn_thread(void* arg) {
+
+    IpcConn* conn = arg;
+    IpcServer* srv = conn->srv;
+    if (srv->handlers.ready) {
+        srv->handlers.ready(conn, srv->userdata);
+    }
+
+    while (true) {
+        FrameHeader header;
+        if (!ipc_read_full(conn->fd, &header, sizeof(header))) {
+            break;
+        }
+
+        // Checks the message size before allocating the receive buffer
+        CXCHKZ(pthread_mutex_lock(&srv->lock));
+        const size_t max_size = srv->max_size;
+        CXCHKZ(pthread_mutex_unlock(&srv->lock));
+        if (max_size && header.size > max_size) {
+            WRS_LOGE_RL(1000, "%s: message size:%u exceeds maximum", __func__, header.size);
+            break;
+        }
+        if (srv->handlers.check && srv->handlers.check(conn, header.size, srv->userdata)) {
+            break;
+        }
+        if (header.size > conn->rxcap) {
+            if (conn->rxbuf) {
+                cx_alloc_free(srv->alloc, conn->rxbuf, conn->rxcap);
+            }
+            conn->rxcap = 0;
+            conn->rxbuf = cx_alloc_malloc(srv->alloc, header.size);
+            if (conn->rxbuf == NULL) {
+                WRS_LOGE_RL(1000, "%s: error allocating message size:%u", __func__, header.size);
+                break;
+            }
+            conn->rxcap = header.size;
+        }
+
+        // Reads the message directly into the receive buffer
+        if (!ipc_read_full(conn->fd, conn->rxbuf, header.size)) {
+            break;
+        }
+        if (!srv->handlers.data(conn, header.opcode | WEBSOCKET_FIN_MASK, (char*)conn->rxbuf, header.size, srv->userdata)) {
+            break;
+        }
+
+        // Doesn't keep the buffer of oversized messages for the life of the connection
+        if (conn->rxcap > RXBUF_KEEP_SIZE) {
+            cx_alloc_free(srv->alloc, conn->rxbuf, conn->rxcap);
+            conn->rxbuf = NULL;
+            conn->rxcap = 0;
+        }
+    }
+
+    shutdown(conn->fd, SHUT_RDWR);
+    srv->handlers.close(conn, srv->userdata);
+    CXCHKZ(pthread_mutex_lock(&srv->lock));
+    conn->done = true;
+    CXCHKZ(pthread_mutex_unlock(&srv->lock));
+    return NULL;
+}
+
+// Joins the threads and frees the resources of the finished connections
+// or of all connections if 'all' is true.
+static void ipc_reap_conns(IpcServer* srv, bool all) {
+
+    CXCHKZ(pthread_mutex_lock(&srv->lock));
+    IpcConn** pnext = &srv->conns;
+    while (*pnext) {
+        IpcConn* conn = *pnext;
+        if (!all && !conn->done) {
+            pnext = &conn->next;
+            continue;
+        }
+        *pnext = conn->next;
+
+        // Wakes up the reader thread of opened connections
+        CXCHKZ(pthread_mutex_unlock(&srv->lock));
+        shutdown(conn->fd, SHUT_RDWR);
+        CXCHKZ(pthread_join(conn->thread, NULL));
+        CXCHKZ(pthread_mutex_lock(&srv->lock));
+
+        close(conn->fd);
+        CXCHKZ(pthread_mutex_destroy(&conn->wlock));
+        if (conn->rxbuf) {
+            cx_alloc_free(srv->alloc, conn->rxbuf, conn->rxcap);
+        }
+        cx_alloc_free(srv->alloc, conn, sizeof(IpcConn));
+    }
+    CXCHKZ(pthread_mutex_unlock(&srv->lock));
+}
+
+// Reads the specified number of bytes from the socket
+static bool ipc_read_full(int fd, void* data, size_t len) {
+
+    uint8_t* curr = data;
+    while (len > 0) {
+        ssize_t n = read(fd, curr, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        curr += n;
+        len -= n;
+    }
+    return true;
+}
+
@@ -0,0 +1,51 @@
+#ifndef IPC_H
+#define IPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cx_alloc.h"
+
+// Local IPC transport for RPC endpoints using Unix domain sockets.
+// Each message is sent as a frame header followed by the message data:
+// uint32_t opcode - WebSocket opcode: MG_WEBSOCKET_OPCODE_TEXT or MG_WEBSOCKET_OPCODE_BINARY
+// uint32_t size   - size in bytes of the message data
+// The message data has the same format as the WebSocket messages.
+// The header fields use the native byte order as both ends are in the same host.
+
+typedef struct IpcServer IpcServer;
+typedef struct IpcConn IpcConn;
+
+// Connection handlers, similar to the civetweb WebSocket handlers.
+// The data handler receives complete messages with the FIN bit set in the opcode.
+typedef struct IpcHandlers {
+    int  (*connect)(IpcConn* conn, void* userdata);     // Returns 0 to accept connection
+    void (*ready)(IpcConn* conn, void* userdata);       // Connection ready
+    int  (*data)(IpcConn* conn, int opcode, char* data, size_t len, void* userdata); // Returns 1 to keep connection open
+    void (*close)(IpcConn* conn, void* userdata);       // Connection closed
+    int  (*check)(IpcConn* conn, size_t len, void* userdata); // Optional: returns 0 to accept a message before allocating it
+} IpcHandlers;
+
+// Starts listening for connections at the specified Unix domain socket path.
+// All the server memory is allocated with the specified allocator.
+// Returns NULL on error.
+IpcServer* ipc_server_start(const char* path, const IpcHandlers* handlers, const CxAllocator* alloc, void* userdata);
+
+// Stops the server closing all its connections.
+// The close handler is called for each opened connection.
+void ipc_server_stop(IpcServer* srv);
+
+// Sets the maximum size of received messages (0 for no limit).
+// Connections which send bigger messages are closed before allocating memory.
+void ipc_server_set_max_msg_size(IpcServer* srv, size_t max_size);
+
+// Sets/gets the connection user data
+void ipc_conn_set_userdata(IpcConn* conn, void* userdata);
+void* ipc_conn_get_userdata(IpcConn* conn);
+
+// Writes message to the connection.
+// Returns 1 if the complete message was written or -1 on error.
+int ipc_conn_write(IpcConn* conn, int opcode, const void* data, size_t len);
+
+#endif
+
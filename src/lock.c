@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <time.h>
+
+#include "lock.h"
+
+#ifdef WRS_LOCK_STATS
+// Forward declarations of local functions
+static uint64_t lock_now(void);
+static size_t lock_bucket(uint64_t ns);
+static void lock_hold_end(Lock* l);
+#endif
+
+
+void lock_init(Lock* l, const char* name) {
+
+    *l = (Lock){0};
+    CXCHKZ(pthread_mutex_init(&l->mutex, NULL));
+#ifdef WRS_LOCK_STATS
+    l->stats.name = name;
+#else
+    (void)name;
+#endif
+}
+
+void lock_destroy(Lock* l) {
+
+    CXCHKZ(pthread_mutex_destroy(&l->mutex));
+}
+
+CxError lock_stats(Lock* l, WrsLockStats* stats) {
+
+#ifdef WRS_LOCK_STATS
+    CXCHKZ(pthread_mutex_lock(&l->mutex));
+    *stats = l->stats;
+    CXCHKZ(pthread_mutex_unlock(&l->mutex));
+    return (CxError){0};
+#else
+    return CXERR("library built without lock statistics");
+#endif
+}
+
+#ifdef WRS_LOCK_STATS
+
+void lock_acquire(Lock* l, const char* func, int line) {
+
+    // Only measures the wait time if the lock is busy
+    uint64_t wait = 0;
+    const int res = pthread_mutex_trylock(&l->mutex);
+    if (res == EBUSY) {
+        const uint64_t start = lock_now();
+        CXCHKZ(pthread_mutex_lock(&l->mutex));
+        l->acquired = lock_now();
+        wait = l->acquired - start;
+    } else {
+        CXCHKZ(res);
+        l->acquired = lock_now();
+    }
+
+    l->func = func;
+    l->line = line;
+    l->stats.count++;
+    if (wait) {
+        l->stats.contended++;
+        l->stats.wait_ns += wait;
+        l->stats.wait_hist[lock_bucket(wait)]++;
+    }
+}
+
+void lock_release(Lock* l) {
+
+    lock_hold_end(l);
+    CXCHKZ(pthread_mutex_unlock(&l->mutex));
+}
+
+// The time waiting for the condition is not accounted as hold time
+// and reacquiring the lock after the wait counts as a new acquisition.
+void lock_wait(Lock* l, pthread_cond_t* cond) {
+
+    const char* func = l->func;
+    const int line = l->line;
+    lock_hold_end(l);
+    CXCHKZ(pthread_cond_wait(cond, &l->mutex));
+    l->acquired = lock_now();
+    l->func = func;
+    l->line = line;
+    l->stats.count++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+static uint64_t lock_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Accounts the time the lock was held by the current holder
+static void lock_hold_end(Lock* l) {
+
+    const uint64_t hold = lock_now() - l->acquired;
+    l->stats.hold_ns += hold;
+    l->stats.hold_hist[lock_bucket(hold)]++;
+    if (hold > l->stats.max_hold_ns) {
+        l->stats.max_hold_ns = hold;
+        l->stats.max_hold_func = l->func;
+        l->stats.max_hold_line = l->line;
+    }
+}
+
+// Returns the histogram bucket of the specified time
+static size_t lock_bucket(uint64_t ns) {
+
+    const uint64_t us = ns / 1000;
+    if (us == 0) {
+        return 0;
+    }
+    const size_t b = 64 - __builtin_clzll(us);
+    return b < WRS_LOCK_HIST ? b : WRS_LOCK_HIST - 1;
+}
+
+#endif
+
@@ -0,0 +1,48 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cx_error.h"
+#include "wrs.h"
+
+// Mutex used for the server and RPC endpoint states.
+// When the library is built with the WRS_LOCK_STATS CMake option, the lock
+// records the number of acquisitions, the wait and hold time histograms and
+// the call site which held the lock for the longest time.
+// The statistics are updated while holding the lock, so they don't need atomics.
+typedef struct Lock {
+    pthread_mutex_t     mutex;          // Wrapped mutex
+#ifdef WRS_LOCK_STATS
+    const char*         func;           // Function of the current holder
+    int                 line;           // Source line of the current holder
+    uint64_t            acquired;       // Time in nanoseconds when the lock was acquired
+    WrsLockStats        stats;          // Lock statistics
+#endif
+} Lock;
+
+// Initializes the lock with the name reported in its statistics
+void lock_init(Lock* l, const char* name);
+
+// Destroys the lock
+void lock_destroy(Lock* l);
+
+// Returns the lock statistics
+CxError lock_stats(Lock* l, WrsLockStats* stats);
+
+#ifdef WRS_LOCK_STATS
+void lock_acquire(Lock* l, const char* func, int line);
+void lock_release(Lock* l);
+void lock_wait(Lock* l, pthread_cond_t* cond);
+#define LOCK(l)     lock_acquire(l, __func__, __LINE__)
+#define UNLOCK(l)   lock_release(l)
+#define WAIT(l,c)   lock_wait(l, c)
+#else
+#define LOCK(l)     CXCHKZ(pthread_mutex_lock(&(l)->mutex))
+#define UNLOCK(l)   CXCHKZ(pthread_mutex_unlock(&(l)->mutex))
+#define WAIT(l,c)   CXCHKZ(pthread_cond_wait(c, &(l)->mutex))
+#endif
+
+#endif
+
@@ -0,0 +1,232 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "cx_error.h"
+#include "wrs.h"
+
+// Asynchronous logging backend.
+// Messages are formatted by the logging thread into the slots of a bounded
+// lock-free ring buffer and a background thread passes them to the logger
+// handlers, so console or file I/O never blocks request threads.
+// The ring buffer uses per slot sequence numbers allowing multiple producers
+// and the single flusher thread as consumer. When the ring buffer is full
+// messages are dropped and counted instead of blocking the producers.
+
+#define LOG_MSG_SIZE        (256)       // Maximum size of each message including terminator
+#define LOG_DEFAULT_SLOTS   (4096)      // Default number of slots
+
+// Ring buffer slot
+typedef struct LogSlot {
+    atomic_size_t   seq;                // Slot sequence number
+    CxLoggerLevel   level;              // Message level
+    char            msg[LOG_MSG_SIZE];  // Formatted message
+} LogSlot;
+
+// Asynchronous logger state
+typedef struct LogQueue {
+    LogSlot*        slots;              // Ring buffer slots
+    size_t          mask;               // Number of slots minus one
+    atomic_size_t   tail;               // Next position to write
+    size_t          head;               // Next position to read (flusher only)
+    atomic_size_t   dropped;            // Number of messages dropped as the ring buffer was full
+    atomic_bool     stop;               // Requests the flusher to stop
+    sem_t           sem;                // Wakes up the flusher
+    pthread_t       thread;             // Flusher thread
+} LogQueue;
+
+// Current asynchronous logger or NULL if messages are logged synchronously
+static _Atomic(LogQueue*) glogq = NULL;
+
+// Number of threads which may be using the current asynchronous logger
+static atomic_int gproducers = 0;
+
+// Forward declarations of local functions
+static bool wrs_logq_push(LogQueue* q, CxLoggerLevel level, const char* fmt, va_list ap);
+static void wrs_logq_flush(LogQueue* q);
+static void* wrs_logq_thread(void* arg);
+static uint64_t wrs_log_now_ms(void);
+
+
+void wrs_logger_async_start(size_t nslots) {
+
+    if (atomic_load(&glogq)) {
+        return;
+    }
+
+    // The number of slots is rounded up to a power of two
+    size_t size = 2;
+    while (size < (nslots ? nslots : LOG_DEFAULT_SLOTS)) {
+        size *= 2;
+    }
+    LogQueue* q = calloc(1, sizeof(LogQueue));
+    q->slots = malloc(size * sizeof(LogSlot));
+    q->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->slots[i].seq, i);
+    }
+    CXCHKZ(sem_init(&q->sem, 0, 0));
+    CXCHKZ(pthread_create(&q->thread, NULL, wrs_logq_thread, q));
+    atomic_store(&glogq, q);
+}
+
+void wrs_logger_async_stop(void) {
+
+    LogQueue* q = atomic_exchange(&glogq, NULL);
+    if (q == NULL) {
+        return;
+    }
+
+    // Waits for the producers which loaded the queue before it was unpublished
+    while (atomic_load(&gproducers) > 0) {
+        sched_yield();
+    }
+
+    // Wakes up the flusher which writes the queued messages before exiting
+    atomic_store(&q->stop, true);
+    CXCHKZ(sem_post(&q->sem));
+    CXCHKZ(pthread_join(q->thread, NULL));
+    CXCHKZ(sem_destroy(&q->sem));
+    free(q->slots);
+    free(q);
+}
+
+void wrs_log(CxLoggerLevel level, const char* fmt, ...) {
+
+    CxLogger* logger = wrs_logger();
+    if (logger == NULL) {
+        return;
+    }
+
+    // Queues message for the flusher thread
+    // The producer count keeps the queue from being freed while in use.
+    va_list ap;
+    atomic_fetch_add(&gproducers, 1);
+    LogQueue* q = atomic_load(&glogq);
+    if (q) {
+        va_start(ap, fmt);
+        const bool queued = wrs_logq_push(q, level, fmt, ap);
+        va_end(ap);
+        if (queued) {
+            sem_post(&q->sem);
+        } else {
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        }
+        atomic_fetch_sub(&gproducers, 1);
+        return;
+    }
+    atomic_fetch_sub(&gproducers, 1);
+
+    // Logs synchronously
+    char msg[LOG_MSG_SIZE];
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    cx_logger_log(logger, level, "%s", msg);
+}
+
+bool wrs_log_limit(WrsLogLimit* lim, CxLoggerLevel level, unsigned interval_ms) {
+
+    const uint64_t now = wrs_log_now_ms();
+    uint64_t next = atomic_load_explicit(&lim->next, memory_order_relaxed);
+    if (now < next || !atomic_compare_exchange_strong(&lim->next, &next, now + interval_ms)) {
+        atomic_fetch_add_explicit(&lim->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+
+    // Reports the messages suppressed since the last logged message of this call site
+    const uint32_t suppressed = atomic_exchange_explicit(&lim->suppressed, 0, memory_order_relaxed);
+    if (suppressed) {
+        wrs_log(level, "%u similar messages suppressed", suppressed);
+    }
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Formats message into the next free slot.
+// Returns false if the ring buffer is full.
+static bool wrs_logq_push(LogQueue* q, CxLoggerLevel level, const char* fmt, va_list ap) {
+
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    LogSlot* slot;
+    while (true) {
+        slot = &q->slots[pos & q->mask];
+        const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // Slot is free: tries to claim it
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Slot still not consumed: ring buffer is full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    // Formats the message and publishes the slot to the flusher
+    slot->level = level;
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+// Passes all the published messages to the logger handlers
+static void wrs_logq_flush(LogQueue* q) {
+
+    CxLogger* logger = wrs_logger();
+    while (true) {
+        LogSlot* slot = &q->slots[q->head & q->mask];
+        const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != q->head + 1) {
+            break;
+        }
+        if (logger) {
+            cx_logger_log(logger, slot->level, "%s", slot->msg);
+        }
+        atomic_store_explicit(&slot->seq, q->head + q->mask + 1, memory_order_release);
+        q->head++;
+    }
+
+    const size_t dropped = atomic_exchange_explicit(&q->dropped, 0, memory_order_relaxed);
+    if (dropped && logger) {
+        cx_logger_log(logger, CxLoggerWarn, "%zu log messages dropped", dropped);
+    }
+}
+
+// Flusher thread
+static void* wrs_logq_thread(void* arg) {
+
+    LogQueue* q = arg;
+    while (true) {
+        while (sem_wait(&q->sem) != 0) {
+            ;
+        }
+        wrs_logq_flush(q);
+        if (atomic_load(&q->stop)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t wrs_log_now_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
@@ -0,0 +1,144 @@
+#include <limits.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// Upper bounds in microseconds of the histogram buckets
+static const uint64_t metrics_bounds[METRICS_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000,
+};
+
+// Next thread index and the index of the current thread
+static atomic_uint metrics_next_index = 0;
+static _Thread_local unsigned metrics_index = UINT_MAX;
+
+// Forward declarations of local functions
+static unsigned metrics_shard(void);
+
+
+void* metrics_alloc(const CxAllocator* alloc, size_t size) {
+
+    // Allocates space for the alignment and the pointer to the allocated block,
+    // which is saved just before the aligned block.
+    uint8_t* raw = cx_alloc_mallocz(alloc, size + 64 + sizeof(void*));
+    void** p = (void**)(((uintptr_t)raw + sizeof(void*) + 63) & ~(uintptr_t)63);
+    p[-1] = raw;
+    return p;
+}
+
+void metrics_free(const CxAllocator* alloc, void* p, size_t size) {
+
+    if (p) {
+        cx_alloc_free(alloc, ((void**)p)[-1], size + 64 + sizeof(void*));
+    }
+}
+
+void metrics_add(MetricsCounter* c, uint64_t v) {
+
+    atomic_fetch_add_explicit(&c->shards[metrics_shard()].v, v, memory_order_relaxed);
+}
+
+uint64_t metrics_get(const MetricsCounter* c) {
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < METRICS_SHARDS; i++) {
+        sum += atomic_load_explicit(&c->shards[i].v, memory_order_relaxed);
+    }
+    return sum;
+}
+
+void metrics_observe(MetricsHistogram* h, uint64_t us) {
+
+    size_t b = 0;
+    while (b < METRICS_BUCKETS && us > metrics_bounds[b]) {
+        b++;
+    }
+    const unsigned s = metrics_shard();
+    atomic_fetch_add_explicit(&h->shards[s].buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->shards[s].sum, us, memory_order_relaxed);
+}
+
+uint64_t metrics_now_us(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t metrics_cpu_us(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_write_header(FILE* f, const char* name, const char* type, const char* help) {
+
+    fprintf(f, "# HELP %s %s\n", name, help);
+    fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+void metrics_write_label(FILE* f, const char* value) {
+
+    fputc('"', f);
+    for (const char* p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            fputc('\\', f);
+            fputc(*p, f);
+        } else if (*p == '\n') {
+            fputs("\\n", f);
+        } else {
+            fputc(*p, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void metrics_write_histogram(FILE* f, const char* name, const char* label, const MetricsHistogram* h) {
+
+    // Sums the shards
+    uint64_t buckets[METRICS_BUCKETS+1] = {0};
+    uint64_t sum = 0;
+    for (size_t s = 0; s < METRICS_SHARDS; s++) {
+        for (size_t b = 0; b <= METRICS_BUCKETS; b++) {
+            buckets[b] += atomic_load_explicit(&h->shards[s].buckets[b], memory_order_relaxed);
+        }
+        sum += atomic_load_explicit(&h->shards[s].sum, memory_order_relaxed);
+    }
+
+    // Writes cumulative buckets, sum and count
+    const char* sep = label ? "," : "";
+    label = label ? label : "";
+    uint64_t count = 0;
+    for (size_t b = 0; b <= METRICS_BUCKETS; b++) {
+        count += buckets[b];
+        if (b < METRICS_BUCKETS) {
+            fprintf(f, "%s_bucket{%s%sle=\"%g\"} %"PRIu64"\n", name, label, sep, metrics_bounds[b] / 1e6, count);
+        } else {
+            fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n", name, label, sep, count);
+        }
+    }
+    const char* lb = *label ? "{" : "";
+    const char* rb = *label ? "}" : "";
+    fprintf(f, "%s_sum%s%s%s %.6f\n", name, lb, label, rb, sum / 1e6);
+    fprintf(f, "%s_count%s%s%s %"PRIu64"\n", name, lb, label, rb, count);
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Returns the shard index of the current thread
+static unsigned metrics_shard(void) {
+
+    if (metrics_index == UINT_MAX) {
+        metrics_index = atomic_fetch_add(&metrics_next_index, 1) % METRICS_SHARDS;
+    }
+    return metrics_index;
+}
+
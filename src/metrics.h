@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "cx_alloc.h"
+
+// Counters and histograms for the Prometheus "/metrics" endpoint.
+// The values are sharded: each thread updates the shard selected by its
+// thread index so that concurrent updates from the server threads do not
+// share cache lines or locks. Readers sum the values of all shards.
+
+#define METRICS_SHARDS      (16)    // Number of shards of each metric
+#define METRICS_BUCKETS     (12)    // Number of histogram buckets excluding "+Inf"
+
+// Sharded counter
+typedef struct MetricsCounter {
+    struct {
+        _Alignas(64) _Atomic uint64_t v;
+    } shards[METRICS_SHARDS];
+} MetricsCounter;
+
+// Sharded histogram of durations in microseconds
+typedef struct MetricsHistogram {
+    struct {
+        _Alignas(64) _Atomic uint64_t buckets[METRICS_BUCKETS+1];  // Non cumulative bucket counts
+        _Atomic uint64_t sum;                                       // Sum of observed durations
+    } shards[METRICS_SHARDS];
+} MetricsHistogram;
+
+// Allocates zeroed memory for structures with metrics aligned to the cache line size
+void* metrics_alloc(const CxAllocator* alloc, size_t size);
+
+// Frees memory allocated by metrics_alloc() with the same allocator and size
+void metrics_free(const CxAllocator* alloc, void* p, size_t size);
+
+// Adds value to counter
+void metrics_add(MetricsCounter* c, uint64_t v);
+
+// Returns the current value of the counter
+uint64_t metrics_get(const MetricsCounter* c);
+
+// Adds observed duration in microseconds to histogram
+void metrics_observe(MetricsHistogram* h, uint64_t us);
+
+// Returns monotonic time in microseconds
+uint64_t metrics_now_us(void);
+
+// Returns the CPU time in microseconds used by the current thread
+uint64_t metrics_cpu_us(void);
+
+// Writes metric family header
+void metrics_write_header(FILE* f, const char* name, const char* type, const char* help);
+
+// Writes quoted label value escaping the characters not allowed by the text format
+void metrics_write_label(FILE* f, const char* value);
+
+// Writes the samples of histogram with the specified label (name="value" without braces) or NULL
+void metrics_write_histogram(FILE* f, const char* name, const char* label, const MetricsHistogram* h);
+
+#endif
+
@@ -0,0 +1,31 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT static tracepoints compiled in when the library is built with the
+// WRS_USDT CMake option. Each probe is a single nop when no tracer is attached.
+// To list the probes: bpftrace -l 'usdt:<binary>:wrs:*'
+//
+// Provider "wrs" probes and arguments:
+// conn_open(url, connid)                   - RPC connection opened
+// conn_close(url, connid)                  - RPC connection closed
+// msg_received(url, connid, opcode, size)  - RPC message or fragment received
+// msg_decoded(url, connid, error)          - RPC message envelope decoded (error is 0 if OK)
+// handler_start(connid, cid, name)         - Local function called
+// handler_end(connid, cid, name, result)   - Local function returned
+// call_sent(connid, cid, name, size)       - Call to remote function sent
+// response_matched(connid, rid, rtt_us)    - Response to call received
+// static_served(path, size)                - Static file served from the zip filesystem
+
+#ifdef WRS_USDT
+#include <sys/sdt.h>
+#define WRS_PROBE2(name, a1, a2)            DTRACE_PROBE2(wrs, name, a1, a2)
+#define WRS_PROBE3(name, a1, a2, a3)        DTRACE_PROBE3(wrs, name, a1, a2, a3)
+#define WRS_PROBE4(name, a1, a2, a3, a4)    DTRACE_PROBE4(wrs, name, a1, a2, a3, a4)
+#else
+#define WRS_PROBE2(name, a1, a2)
+#define WRS_PROBE3(name, a1, a2, a3)
+#define WRS_PROBE4(name, a1, a2, a3, a4)
+#endif
+
+#endif
+
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
 
 #include "cx_error.h"
 #include "cx_var.h"
@@ -11,77 +13,229 @@
 #include "wrs.h"
 #include "server.h"
 #include "rpc_codec.h"
+#include "ipc.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "lock.h"
+
+// Local function binding metrics
+typedef struct BindMetrics {
+    MetricsCounter  calls;          // Number of calls
+    MetricsCounter  time_us;        // Total wall time in microseconds spent in the local function
+    MetricsCounter  cpu_us;         // Total thread CPU time in microseconds spent in the local function
+    MetricsCounter  req_bytes;      // Total size of the received call messages
+    MetricsCounter  resp_bytes;     // Total size of the sent response messages
+    atomic_int      refs;           // Binding reference plus one for each call in progress
+} BindMetrics;
 
 // Local function binding info
 typedef struct BindInfo {
-    WrsRpcFn fn;
+    WrsRpcFn        fn;
+    BindMetrics*    metrics;
+    char*           name;       // Remote name used as the map key
+    WrsPriority     prio;       // Priority of the responses
 } BindInfo;
 
 // Define internal hashmap from remote name to local rpc function
+// The name keys are owned by the bindings.
 #define cx_hmap_name                map_bind
 #define cx_hmap_key                 char*
 #define cx_hmap_val                 BindInfo
 #define cx_hmap_cmp_key(k1,k2,s)    strcmp(*(char**)k1,*(char**)k2)
 #define cx_hmap_hash_key(k,s)       cx_hmap_hash_fnv1a32(*((char**)k), strlen(*(char**)k))
-#define cx_hmap_free_key(k)         free(*k)
+#define cx_hmap_instance_allocator
 #define cx_hmap_implement
 #define cx_hmap_static
 #include "cx_hmap.h"
 
 // Callback info
 typedef struct ResponseInfo {
+    uint64_t        cid;    // Call id or 0 for empty slot
     WrsResponseFn   fn;     // Function to call when response arrives
-    struct timespec time;   // Time when call was sent to client
+    uint64_t        time;   // Monotonic time in microseconds when call was sent to client
 } ResponseInfo;
 
-
-// Define map of call id to local rpc callback function pointer
-#define cx_hmap_name map_resp
-#define cx_hmap_key  uint64_t
-#define cx_hmap_val  ResponseInfo
-#define cx_hmap_implement
-#define cx_hmap_static
-#include "cx_hmap.h"
-
-// Define array websocket received bytes
-#define cx_array_name arru8
-#define cx_array_type uint8_t
-#define cx_array_static
-#define cx_array_instance_allocator
-#define cx_array_implement
-#include "cx_array.h"
+// Table of call id to local rpc callback function.
+// Open addressing table with linear probing indexed by the sequential call ids,
+// which only allocates memory when the number of calls in flight grows.
+typedef struct RespTable {
+    ResponseInfo*   slots;  // Array of slots with power of 2 length
+    size_t          cap;    // Number of slots
+    size_t          count;  // Number of used slots
+} RespTable;
+
+// RPC endpoint metrics
+typedef struct RpcMetrics {
+    MetricsCounter      msgs_in;        // Number of messages received
+    MetricsCounter      msgs_out;       // Number of messages sent
+    MetricsCounter      bytes_in;       // Number of bytes received
+    MetricsCounter      bytes_out;      // Number of bytes sent
+    MetricsCounter      decode_errors;  // Number of received messages which could not be decoded
+    MetricsCounter      unknown_binds;  // Number of received calls for functions not bound
+    MetricsCounter      allocs;         // Number of heap allocations and resizes of the connections
+    MetricsCounter      expired;        // Number of connections closed for not answering the keepalive pings
+} RpcMetrics;
+
+// Allocator of the connections which counts the allocations in the endpoint metrics.
+// It is shared by the endpoint and the receive storages detached from its
+// connections, which may outlive the endpoint, and it is freed with the
+// endpoint metrics when the last reference is dropped.
+typedef struct RpcAlloc {
+    CxAllocator         iface;      // Counting allocator interface
+    const CxAllocator*  base;       // Server allocator or default allocator for loopback only endpoint
+    RpcMetrics*         metrics;    // Endpoint metrics
+    atomic_int          refs;       // Endpoint reference plus one for each detached receive storage
+} RpcAlloc;
+
+// Receive storage detached from a connection by wrs_rpc_take_buf().
+// The storage references the counting allocator of its pool, so the taken
+// buffers remain valid after the endpoint is closed.
+typedef struct RxStorage {
+    RpcAlloc*           alloc;  // Allocator of this storage and of its pool
+    CxPoolAllocator*    pool;   // Pool allocator with the received message
+    atomic_int          refs;   // Number of taken buffers plus the connection reference
+} RxStorage;
+
+// Transport used by RPC client connections
+typedef struct RpcTransport {
+    int (*write)(void* conn, int opcode, const void* data, size_t len);  // Writes message, returns <= 0 on errors
+    bool keepalive;     // Connections are checked with WebSocket pings
+    bool fragment;      // Large messages may be sent in fragment messages
+} RpcTransport;
+
+// Normal priority message queued to be written by the endpoint sender thread
+typedef struct TxMsg {
+    struct TxMsg*   next;       // Next queued message or NULL
+    size_t          len;        // Length in bytes of the encoded message
+    size_t          sent;       // Number of bytes already sent
+    uint32_t        id;         // Id used in the message fragments
+    bool            text;       // Text or binary message
+    uint8_t         data[];     // Encoded message
+} TxMsg;
+
+// Send queue of each connection.
+// Normal priority messages are queued while the connection has a message
+// larger than the fragment size being sent, keeping their order.
+typedef struct RpcTxQueue {
+    TxMsg*          head;       // First queued message or NULL
+    TxMsg*          tail;       // Last queued message
+    size_t          bytes;      // Number of bytes queued
+    size_t          deficit;    // Deficit round robin counter in bytes
+    uint32_t        next_id;    // Id of the next fragmented message
+} RpcTxQueue;
+
+// Stream of frames pushed to the client.
+// While the client has no credits, the latest frame pushed is kept
+// encoded in the stream buffer and replaced by the next frame pushed.
+typedef struct RpcStream {
+    struct RpcStream*   next;       // Next stream of the connection or NULL
+    uint32_t            sid;        // Stream id
+    uint32_t            seq;        // Sequence number of the next frame pushed
+    WrsStreamFn         cb;         // Optional function called when the client grants credits
+    size_t              credits;    // Number of frames which can be sent
+    bool                pending;    // The buffer has a frame not sent
+    uint8_t*            buf;        // Encoded stream message of the latest frame
+    size_t              cap;        // Capacity in bytes of the buffer
+    size_t              len;        // Length in bytes of the encoded stream message
+    uint64_t            pushed;     // Number of frames pushed
+    uint64_t            sent;       // Number of frames sent
+    uint64_t            coalesced;  // Number of frames replaced before being sent
+} RpcStream;
+
+// Keepalive state of each WebSocket connection.
+// Updated with the endpoint locked.
+typedef struct RpcPing {
+    uint64_t    sent;       // Monotonic time in microseconds of the last ping sent, used as its payload
+    bool        pending;    // Last ping sent is waiting for its pong
+    uint32_t    missed;     // Number of consecutive pings not answered
+    int64_t     srtt;       // Smoothed round trip time in microseconds or -1
+    int64_t     min;        // Minimum round trip time in microseconds or -1
+    int64_t     max;        // Maximum round trip time in microseconds or -1
+} RpcPing;
+
+// Statistics of each RPC client.
+// Updated with relaxed atomic operations as the responses of the local
+// functions are sent without the endpoint lock.
+typedef struct RpcConnStats {
+    _Atomic uint64_t        msgs_in;        // Number of messages received
+    _Atomic uint64_t        msgs_out;       // Number of messages sent
+    _Atomic uint64_t        bytes_in;       // Number of bytes received
+    _Atomic uint64_t        bytes_out;      // Number of bytes sent
+    _Atomic size_t          rx_bytes;       // Size of the message being received or last received
+    _Atomic size_t          rx_peak;        // Maximum size of the received messages
+    _Atomic size_t          tx_peak;        // Maximum capacity of the message encoders
+    _Atomic int64_t         last_rtt;       // Round trip time in microseconds of the last call answered
+    _Atomic uint64_t        last_active;    // Monotonic time in microseconds of the last message received or sent
+} RpcConnStats;
 
 // State for each RPC client
 typedef struct RpcClient {
-    struct mg_connection*   conn;           // CivitWeb server WebSocket client connection
+    void*                   conn;           // Transport connection: CivitWeb WebSocket or IPC connection
+    const RpcTransport*     tp;             // Connection transport
     int                     opcode;         // Initial opcode of group of fragments
-    arru8                   rxbytes;        // Received WebSocket bytes
     CxPoolAllocator*        rxalloc;        // Pool allocator for received msg CxVar
+    RxStorage*              rxtaken;        // Detached receive storage of current message or NULL
     CxPoolAllocator*        txalloc;        // Pool allocator for transmitted msg CxVar 
+    CxPoolAllocator*        callalloc;      // Pool allocator for the messages of calls to the client
     WrsDecoder*             dec;            // Message decoder
-    WrsEncoder*             enc;            // Message encoder
+    WrsEncoder*             enc;            // Encoder of the responses, used by the connection handler thread
+    WrsEncoder*             callenc;        // Encoder of the calls to the client, used with write access
     uint64_t                cid;            // Next call id
-    map_resp                responses;      // Map of call cid to local callback function
+    RespTable               responses;      // Map of call cid to local callback function
+    RpcConnStats            stats;          // Connection statistics
+    RpcPing                 ping;           // Keepalive state
+    RpcTxQueue              txq;            // Queue of messages written by the sender thread
+    RpcStream*              streams;        // List of streams opened to the client
+    uint32_t                next_sid;       // Id of the next stream opened
+    uint64_t                serial;         // Serial number of the connection, unique in the endpoint
+    bool                    writing;        // A thread has exclusive write access to the connection
+    uint32_t                waiting;        // Number of threads waiting for write access, kept when the slot is reused
+    bool                    closing;        // Connection is closing and accepts no more messages
 } RpcClient;
 
 // Define array of RPC client connections
 #define cx_array_name arr_conn
 #define cx_array_type RpcClient
+#define cx_array_instance_allocator
 #define cx_array_implement
 #define cx_array_static
 #include "cx_array.h"
 
+// In-memory loopback connection
+typedef struct LoopbackConn {
+    WrsLoopbackFn   out;            // Receives the messages written to the connection
+    void*           ctx;            // Output function context
+} LoopbackConn;
+
+#define RPC_SLOW_CALLS  (64)    // Number of slow call records kept by each endpoint
+
 // WebSocket RPC handler state
 typedef struct WrsRpc {
-    pthread_mutex_t     lock;           // For exclusive access to this state
-    Wrs*                wrs;            // Associated server
-    const char*         url;            // This websocket handler URL
+    Lock                lock;           // For exclusive access to this state
+    Wrs*                wrs;            // Associated server or NULL for loopback only endpoint
+    const CxAllocator*  base_alloc;     // Server allocator or default allocator for loopback only endpoint
+    char*               url;            // This websocket handler URL
     uint32_t            max_conns;      // Maximum number of connection
     size_t              nconns;         // Current number of connections
     arr_conn            conns;          // Array of connections info
     map_bind            binds;          // Map remote name to local bind info
     WrsEventCallback    evcb;           // Optional user event callback
     void*               userdata;       // Optional user data
+    WrsRpcOptions       opts;           // Options for new connections
+    IpcServer*          ipc;            // IPC server for "unix:" endpoints or NULL
+    RpcMetrics*         metrics;        // Endpoint metrics
+    RpcAlloc*           alloc;          // Allocator of the connections which counts the allocations
+    WrsRpcSlowCall      slow[RPC_SLOW_CALLS];   // Ring buffer of the most recent slow calls
+    uint64_t            nslow;          // Total number of slow calls recorded
+    pthread_t           sender;         // Thread writing the queued messages in fragments
+    pthread_cond_t      txcond;         // Signals the sender thread when messages are queued or to stop
+    pthread_cond_t      wcond;          // Signals the end of the writes made without the endpoint lock
+    bool                txstarted;      // Sender thread was started
+    bool                txstop;         // Requests the sender thread to stop
+    uint8_t*            txbuf;          // Fragment message buffer of the sender thread
+    size_t              txbuf_len;      // Length in bytes of the fragment message buffer
+    uint64_t            next_serial;    // Serial number of the last connection opened
 } WrsRpc;
 
 
@@ -89,17 +243,102 @@ typedef struct WrsRpc {
 static int wrs_rpc_connect_handler(const struct mg_connection *conn, void *user_data);
 static void wrs_rpc_ready_handler(struct mg_connection *conn, void *user_data);
 static int wrs_rpc_data_handler(struct mg_connection *conn, int opcode, char *data, size_t dataSize, void *user_data);
-static int wrs_rpc_call_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const CxVar* rxmsg);
-static int wrs_rpc_response_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const CxVar* msg);
 static void wrs_rpc_close_handler(const struct mg_connection *conn, void *user_data);
-static void wrs_rpc_free_conn(RpcClient* client);
+static int wrs_rpc_ipc_connect_handler(IpcConn* conn, void* user_data);
+static void wrs_rpc_ipc_ready_handler(IpcConn* conn, void* user_data);
+static int wrs_rpc_ipc_data_handler(IpcConn* conn, int opcode, char* data, size_t data_size, void* user_data);
+static void wrs_rpc_ipc_close_handler(IpcConn* conn, void* user_data);
+static int wrs_rpc_ipc_check_handler(IpcConn* conn, size_t len, void* user_data);
+static int wrs_rpc_add_conn(WrsRpc* rpc, void* conn, const RpcTransport* tp, WrsFormat format, size_t* connid);
+static int wrs_rpc_msg_handler(WrsRpc* rpc, size_t connid, int opcode, char* data, size_t data_size);
+static void wrs_rpc_del_conn(WrsRpc* rpc, size_t connid);
+static int wrs_rpc_call_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const WrsEnvelope* env);
+static int wrs_rpc_response_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const WrsEnvelope* env);
+static int wrs_rpc_ws_write(void* conn, int opcode, const void* data, size_t len);
+static int wrs_rpc_ipc_write(void* conn, int opcode, const void* data, size_t len);
+static int wrs_rpc_loopback_write(void* conn, int opcode, const void* data, size_t len);
+static WrsRpc* wrs_rpc_new(Wrs* wrs, const char* url, size_t max_conns, WrsEventCallback cb);
+static void wrs_rpc_del(WrsRpc* rpc);
+static size_t wrs_rpc_rx_block(WrsRpc* rpc);
+static size_t wrs_rpc_max_msg_size(WrsRpc* rpc);
+static bool wrs_rpc_mem_check(void* ctx, size_t size);
+static int wrs_rpc_reject(WrsRpc* rpc, size_t connid, const WrsEnvelope* env);
+static void wrs_rpc_free_conn(WrsRpc* rpc, RpcClient* client);
+static void wrs_rpc_expire_conn(WrsRpc* rpc, size_t connid);
+static void wrs_rpc_pong(RpcClient* client, const char* data, size_t len);
+static RpcClient* wrs_rpc_acquire(WrsRpc* rpc, size_t connid);
+static int wrs_rpc_write_unlocked(WrsRpc* rpc, size_t connid, int opcode, const void* data, size_t len);
+static RpcClient* wrs_rpc_release(WrsRpc* rpc, size_t connid);
+static int wrs_rpc_write(WrsRpc* rpc, size_t connid, WrsPriority prio, bool text, const void* data, size_t len);
+static CxError wrs_rpc_call_conn(WrsRpc* rpc, size_t connid, uint64_t serial, const char* remote_name, CxVar* params,
+    WrsResponseFn cb, WrsPriority prio);
+static void* wrs_rpc_sender(void* arg);
+static bool wrs_rpc_send_round(WrsRpc* rpc);
+static size_t wrs_rpc_send_next(WrsRpc* rpc, size_t connid);
+static void wrs_rpc_txq_pop(WrsRpc* rpc, RpcTxQueue* txq);
+static RpcStream* wrs_rpc_stream_get(WrsRpc* rpc, size_t connid, size_t sid, RpcClient** client);
+static int wrs_rpc_stream_send(WrsRpc* rpc, size_t connid, RpcStream* st);
+static void wrs_rpc_stream_handler(WrsRpc* rpc, size_t connid, const WrsStreamMsg* msg);
+static void wrs_rpc_stream_del(WrsRpc* rpc, RpcClient* client, RpcStream* st);
+static void wrs_rpc_reset_rxalloc(WrsRpc* rpc, RpcClient* client);
+static void wrs_rpc_storage_release(void* ctx);
+static void wrs_rpc_alloc_release(RpcAlloc* alloc);
+static void wrs_rpc_bind_release(WrsRpc* rpc, BindMetrics* metrics);
+static void wrs_rpc_stats_sent(RpcClient* client, size_t len);
+static void wrs_rpc_slow_call(WrsRpc* rpc, size_t connid, const char* name, size_t params_size, uint64_t wall_us, uint64_t cpu_us);
+static void wrs_rpc_stats_max(_Atomic size_t* peak, size_t value);
+static void wrs_rpc_write_counter(FILE* f, WrsRpc** rpcs, size_t count, const char* name, const char* help, size_t offset);
+static void* wrs_rpc_alloc(void* ctx, size_t size);
+static void wrs_rpc_free(void* ctx, void* p, size_t size);
+static void* wrs_rpc_resize(void* ctx, void* p, size_t old_size, size_t size);
+static ResponseInfo* wrs_rpc_resp_get(RespTable* t, uint64_t cid);
+static void wrs_rpc_resp_set(const CxAllocator* alloc, RespTable* t, ResponseInfo info);
+static void wrs_rpc_resp_del(RespTable* t, uint64_t cid);
 
 #define WEBSOCKET_FIN_MASK   (0x80)  // FIN bit mask
 #define WEBSOCKET_OP_MASK    (0x0F)  // Opcode mask
+#define MAX_CALL_NAME        (256)   // Maximum length of remote call name
+#define MIN_RESP_SLOTS       (16)    // Initial number of slots of the table of pending responses
+#define POOL_BLOCK_SIZE      (4*4096)// Default block size of the connection memory pools
+#define ERR_MEM_BUDGET       "memory budget exceeded"  // Error sent for rejected calls
+#define PING_MAX_MISSED      (3)     // Default number of pings not answered before closing the connection
+#define MAX_MSG_SIZE         (64*1024*1024) // Default maximum size of received messages
+#define MAX_TX_QUEUED        (64*1024*1024) // Default maximum number of bytes queued for each connection
+#define IPC_URL_PREFIX       "unix:" // Prefix of endpoint urls using Unix domain sockets
+
+// Transports for WebSocket, IPC and loopback connections
+static const RpcTransport wrs_ws_transport = {.write = wrs_rpc_ws_write, .keepalive = true, .fragment = true};
+static const RpcTransport wrs_ipc_transport = {.write = wrs_rpc_ipc_write};
+static const RpcTransport wrs_loopback_transport = {.write = wrs_rpc_loopback_write, .fragment = true};
+
+// IPC connection handlers
+static const IpcHandlers wrs_ipc_handlers = {
+    .connect = wrs_rpc_ipc_connect_handler,
+    .ready = wrs_rpc_ipc_ready_handler,
+    .data = wrs_rpc_ipc_data_handler,
+    .close = wrs_rpc_ipc_close_handler,
+    .check = wrs_rpc_ipc_check_handler,
+};
+
+// WebSocket subprotocols accepted by the RPC endpoints
+static const char* wrs_subprotocol_names[] = {WRS_SUBPROTOCOL_PACK, WRS_SUBPROTOCOL_JSON};
+static struct mg_websocket_subprotocols wrs_subprotocols = {
+    .nb_subprotocols = 2,
+    .subprotocols = wrs_subprotocol_names,
+};
 
 WrsRpc* wrs_rpc_open(Wrs* wrs, const char* url, size_t max_conns, WrsEventCallback cb) {
 
-    CXCHKZ(pthread_mutex_lock(&wrs->lock));
+    // Endpoints without server only accept loopback connections
+    if (wrs == NULL) {
+        if (wrs_logger() == NULL) {
+            wrs_logger_init(NULL, "WRS");
+        }
+        return wrs_rpc_new(NULL, url, max_conns, cb);
+    }
+
+    LOCK(&wrs->tick_lock);
+    LOCK(&wrs->lock);
     WrsRpc* handler = NULL;
 
     // Checks if there is already a handler for this url
@@ -108,57 +347,98 @@ WrsRpc* wrs_rpc_open(Wrs* wrs, const char* url, size_t max_conns, WrsEventCallba
     }
 
     // Creates and initializes the new RPC handler state
-    handler = malloc(sizeof(WrsRpc));
-    *handler = (WrsRpc) {
-        .wrs = wrs,
-        .url = url,
-        .max_conns = max_conns,
-        .conns = arr_conn_init(),
-        .binds = map_bind_init(0),
-        .evcb = cb,
-    };
-    CXCHKZ(pthread_mutex_init(&handler->lock, NULL));
+    handler = wrs_rpc_new(wrs, url, max_conns, cb);
+
+    // Urls with "unix:" prefix use a Unix domain socket at the specified path
+    // instead of a WebSocket handler.
+    const size_t prefix_len = strlen(IPC_URL_PREFIX);
+    if (strncmp(url, IPC_URL_PREFIX, prefix_len) == 0) {
+        handler->ipc = ipc_server_start(url + prefix_len, &wrs_ipc_handlers, &handler->alloc->iface, handler);
+        if (handler->ipc == NULL) {
+            wrs_rpc_del(handler);
+            handler = NULL;
+            goto exit;
+        }
+        ipc_server_set_max_msg_size(handler->ipc, wrs_rpc_max_msg_size(handler));
+    } else {
+        // Register the websocket callback functions.
+        mg_set_websocket_handler_with_subprotocols(wrs->ctx, url, &wrs_subprotocols,
+            wrs_rpc_connect_handler, wrs_rpc_ready_handler, wrs_rpc_data_handler, wrs_rpc_close_handler, handler);
+    }
 
     // Save association of the url with new handler
-    char* url_key = strdup(url);
-    map_rpc_set(&wrs->rpc_handlers, url_key, handler);
-
-    // Register the websocket callback functions.
-    mg_set_websocket_handler(wrs->ctx, url,
-        wrs_rpc_connect_handler, wrs_rpc_ready_handler, wrs_rpc_data_handler, wrs_rpc_close_handler, handler);
+    map_rpc_set(&wrs->rpc_handlers, handler->url, handler);
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&wrs->lock));
+    UNLOCK(&wrs->lock);
+    UNLOCK(&wrs->tick_lock);
     return handler;
 }
 
 
 void wrs_rpc_close(WrsRpc* rpc) {
 
-    // Remove WebSocket handler
-    mg_set_websocket_handler(rpc->wrs->ctx, rpc->url, NULL, NULL, NULL, NULL, NULL);
+    // Remove WebSocket handler or stops the IPC server closing its connections
+    if (rpc->ipc) {
+        ipc_server_stop(rpc->ipc);
+    } else if (rpc->wrs) {
+        mg_set_websocket_handler(rpc->wrs->ctx, rpc->url, NULL, NULL, NULL, NULL, NULL);
+    }
+
+    // Stops the sender thread discarding the queued messages
+    LOCK(&rpc->lock);
+    const bool txstarted = rpc->txstarted;
+    rpc->txstop = true;
+    CXCHKZ(pthread_cond_signal(&rpc->txcond));
+    UNLOCK(&rpc->lock);
+    if (txstarted) {
+        CXCHKZ(pthread_join(rpc->sender, NULL));
+    }
+
+    // Waits for the writes in progress made without the endpoint lock
+    LOCK(&rpc->lock);
+    for (size_t i = 0; i < arr_conn_len(&rpc->conns); i++) {
+        rpc->conns.data[i].closing = true;
+        while (rpc->conns.data[i].writing) {
+            WAIT(&rpc->lock, &rpc->wcond);
+        }
+    }
+    UNLOCK(&rpc->lock);
 
-    CXCHKZ(pthread_mutex_lock(&rpc->wrs->lock));
+    // The server timer is stopped while the endpoint is removed
+    if (rpc->wrs) {
+        LOCK(&rpc->wrs->tick_lock);
+        LOCK(&rpc->wrs->lock);
+    }
 
     // Destroy all connections
     for (size_t i = 0; i < arr_conn_len(&rpc->conns); i++) {
         RpcClient* client = &rpc->conns.data[i];
         if (client->conn) {
-            wrs_rpc_free_conn(client);
+            wrs_rpc_free_conn(rpc, client);
         }
     }
-    arr_conn_free(&rpc->conns);
-
-    // Destroy bindings
-    map_bind_free(&rpc->binds);
-
-    CXCHKZ(pthread_mutex_destroy(&rpc->lock));
 
     // Remove association of url with this RPC handler
-    map_rpc_del(&rpc->wrs->rpc_handlers, (char*)rpc->url);
+    Wrs* wrs = rpc->wrs;
+    if (wrs) {
+        map_rpc_del(&wrs->rpc_handlers, rpc->url);
+    }
+    wrs_rpc_del(rpc);
+    if (wrs) {
+        UNLOCK(&wrs->lock);
+        UNLOCK(&wrs->tick_lock);
+    }
+}
+
+void wrs_rpc_set_options(WrsRpc* rpc, const WrsRpcOptions* opts) {
 
-    CXCHKZ(pthread_mutex_unlock(&rpc->wrs->lock));
-    free(rpc); 
+    LOCK(&rpc->lock);
+    rpc->opts = *opts;
+    if (rpc->ipc) {
+        ipc_server_set_max_msg_size(rpc->ipc, wrs_rpc_max_msg_size(rpc));
+    }
+    UNLOCK(&rpc->lock);
 }
 
 void wrs_rpc_set_userdata(WrsRpc* rpc, void* userdata) {
@@ -173,7 +453,7 @@ void* wrs_rpc_get_userdata(WrsRpc* rpc) {
 
 CxError wrs_rpc_bind(WrsRpc* rpc, const char* remote_name, WrsRpcFn fn) {
 
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
+    LOCK(&rpc->lock);
     CxError err = {};
 
     // Checks if there is already an association in this handler with the specified remote name
@@ -184,17 +464,41 @@ CxError wrs_rpc_bind(WrsRpc* rpc, const char* remote_name, WrsRpcFn fn) {
     }
 
     // Maps the remote name with the specified local function
-    char* remote_name_key = strdup(remote_name);
-    map_bind_set(&rpc->binds, remote_name_key, (BindInfo){.fn = fn});
+    const size_t len = strlen(remote_name) + 1;
+    char* name = cx_alloc_malloc(rpc->base_alloc, len);
+    memcpy(name, remote_name, len);
+    BindMetrics* metrics = metrics_alloc(rpc->base_alloc, sizeof(BindMetrics));
+    atomic_init(&metrics->refs, 1);
+    map_bind_set(&rpc->binds, name, (BindInfo){
+        .fn = fn,
+        .metrics = metrics,
+        .name = name,
+    });
+
+exit:
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+CxError wrs_rpc_bind_priority(WrsRpc* rpc, const char* remote_name, WrsPriority prio) {
+
+    LOCK(&rpc->lock);
+    CxError err = {};
+    BindInfo* bind = map_bind_get(&rpc->binds, (char*)remote_name);
+    if (bind == NULL) {
+        err = CXERR("binding not found");
+        goto exit;
+    }
+    bind->prio = prio;
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
+    UNLOCK(&rpc->lock);
     return err;
 }
 
 CxError wrs_rpc_unbind(WrsRpc* rpc, const char* remote_name) {
 
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
+    LOCK(&rpc->lock);
     CxError err = {};
 
     // Checks if there is already an association in this RPC endpoint with the specified remote name
@@ -204,147 +508,499 @@ CxError wrs_rpc_unbind(WrsRpc* rpc, const char* remote_name) {
         goto exit;
     }
 
+    wrs_rpc_bind_release(rpc, bind->metrics);
+    char* name = bind->name;
     map_bind_del(&rpc->binds, (char*)remote_name);
+    cx_alloc_free(rpc->base_alloc, name, strlen(name) + 1);
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
+    UNLOCK(&rpc->lock);
     return err;
 }
 
 CxError wrs_rpc_call(WrsRpc* rpc, size_t connid, const char* remote_name, CxVar* params, WrsResponseFn cb) {
 
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
-    CxError error = {0};
+    return wrs_rpc_call_priority(rpc, connid, remote_name, params, cb, WrsPriorityNormal);
+}
 
-    // Checks if this connection id is valid
-    if (connid >= arr_conn_len(&rpc->conns)) {
-        WRS_LOGW("%s: connection:%zu is invalid", __func__, connid);
-        error = CXERR("invalid connection id");
-        goto exit;
+CxError wrs_rpc_call_priority(WrsRpc* rpc, size_t connid, const char* remote_name, CxVar* params,
+    WrsResponseFn cb, WrsPriority prio) {
+
+    return wrs_rpc_call_conn(rpc, connid, 0, remote_name, params, cb, prio);
+}
+
+CxError wrs_rpc_call_serial(WrsRpc* rpc, size_t connid, uint64_t serial, const char* remote_name, CxVar* params) {
+
+    return wrs_rpc_call_conn(rpc, connid, serial, remote_name, params, NULL, WrsPriorityNormal);
+}
+
+uint64_t wrs_rpc_conn_serial(WrsRpc* rpc, size_t connid) {
+
+    LOCK(&rpc->lock);
+    uint64_t serial = 0;
+    if (connid < arr_conn_len(&rpc->conns) && rpc->conns.data[connid].conn) {
+        serial = rpc->conns.data[connid].serial;
     }
+    UNLOCK(&rpc->lock);
+    return serial;
+}
 
-    // Get the RPC client associated with this connection id and checks if it is active.
-    RpcClient* client = &rpc->conns.data[connid];
-    if (client->conn == NULL) {
-        WRS_LOGW("%s: connection:%zu closed with no associated client", __func__, connid);
-        error = CXERR("connection id is closed");
+Wrs* wrs_rpc_get_server(WrsRpc* rpc) {
+
+    return rpc->wrs;
+}
+
+CxError wrs_rpc_stream_open(WrsRpc* rpc, size_t connid, const char* name, WrsStreamFn cb, size_t* sid) {
+
+    LOCK(&rpc->lock);
+    CxError err = {};
+
+    // Checks stream name and connection id, getting write access to the connection
+    const size_t name_len = strlen(name);
+    if (name_len >= MAX_CALL_NAME) {
+        err = CXERR("stream name too long");
         goto exit;
     }
-  
-    // Creates message envelope
-    CxVar* msg = cx_var_new(NULL);
-    cx_var_set_map(msg);
-    int64_t cid = client->cid;
-    cx_var_set_map_int(msg, "cid", cid);
-    cx_var_set_map_str(msg, "call", remote_name);
-    CxVar* msg_params = cx_var_set_map_map(msg, "params");
-    // Copy user parameters to message
-    cx_var_cpy_val(params, msg_params);
-    client->cid++;
+    RpcClient* client = wrs_rpc_acquire(rpc, connid);
+    if (client == NULL) {
+        err = CXERR("invalid connection id");
+        goto exit;
+    }
+    RpcStream* st = cx_alloc_malloc(&rpc->alloc->iface, sizeof(RpcStream));
+    *st = (RpcStream){.next = client->streams, .sid = client->next_sid++, .cb = cb};
+    client->streams = st;
+
+    // Announces the stream to the client, which answers granting credits
+    uint8_t msg[MAX_CALL_NAME + WRS_STREAM_OVERHEAD];
+    const size_t len = wrs_stream_encode(msg,
+        &(WrsStreamMsg){.sid = st->sid, .kind = WRS_STREAM_OPEN, .data = name, .len = name_len});
+    if (wrs_rpc_write(rpc, connid, WrsPriorityNormal, false, msg, len) <= 0) {
+        wrs_rpc_stream_del(rpc, &rpc->conns.data[connid], st);
+        err = CXERR("error writing message");
+    } else {
+        *sid = st->sid;
+    }
+    wrs_rpc_release(rpc, connid);
 
-    // Encodes message and free
-    error = wrs_encoder_enc(client->enc, msg);
-    cx_var_del(msg);
-    if (error.code) {
+exit:
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+CxError wrs_rpc_stream_push(WrsRpc* rpc, size_t connid, size_t sid, const void* data, size_t len) {
+
+    // The stream buffer is only changed with write access to the connection
+    LOCK(&rpc->lock);
+    CxError err = {};
+    RpcClient* client = wrs_rpc_acquire(rpc, connid);
+    RpcStream* st = client ? wrs_rpc_stream_get(rpc, connid, sid, &client) : NULL;
+    if (st == NULL) {
+        err = CXERR("stream not open");
         goto exit;
     }
 
-    // Get encoded message type and buffer
-    bool text;
-    size_t len;
-    void* encoded = wrs_encoder_get_msg(client->enc, &text, &len);
-    int opcode = text ? MG_WEBSOCKET_OPCODE_TEXT : MG_WEBSOCKET_OPCODE_BINARY;
+    // Encodes the frame replacing the frame not sent, if any
+    const size_t size = len + WRS_STREAM_OVERHEAD;
+    if (st->cap < size) {
+        if (st->buf) {
+            cx_alloc_free(&rpc->alloc->iface, st->buf, st->cap);
+        }
+        st->buf = cx_alloc_malloc(&rpc->alloc->iface, size);
+        st->cap = size;
+    }
+    if (st->pending) {
+        st->coalesced++;
+    }
+    st->len = wrs_stream_encode(st->buf,
+        &(WrsStreamMsg){.sid = st->sid, .kind = WRS_STREAM_DATA, .value = st->seq++, .data = data, .len = len});
+    st->pending = true;
+    st->pushed++;
+    if (st->credits && wrs_rpc_stream_send(rpc, connid, st) <= 0) {
+        err = CXERR("error writing stream frame");
+    }
 
-    // Sends message to remote client
-    mg_lock_connection((struct mg_connection*)client->conn);
-    int res = mg_websocket_write((struct mg_connection*)client->conn, opcode, encoded, len);
-    mg_unlock_connection((struct mg_connection*)client->conn);
-    if (res <= 0) {
-        WRS_LOGE("%s: error:%d writing websocket message", __func__, res);
-        error = CXERR("error to writing websocket");
+exit:
+    if (client) {
+        wrs_rpc_release(rpc, connid);
+    }
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+CxError wrs_rpc_stream_close(WrsRpc* rpc, size_t connid, size_t sid) {
+
+    LOCK(&rpc->lock);
+    CxError err = {};
+    RpcClient* client = wrs_rpc_acquire(rpc, connid);
+    RpcStream* st = client ? wrs_rpc_stream_get(rpc, connid, sid, &client) : NULL;
+    if (st == NULL) {
+        err = CXERR("stream not open");
         goto exit;
     }
+    uint8_t msg[WRS_STREAM_OVERHEAD];
+    const size_t len = wrs_stream_encode(msg, &(WrsStreamMsg){.sid = st->sid, .kind = WRS_STREAM_CLOSE});
+    wrs_rpc_write(rpc, connid, WrsPriorityNormal, false, msg, len);
+    wrs_rpc_stream_del(rpc, &rpc->conns.data[connid], st);
 
-    // If callback supplied, saves information to map response to the callback
-    if (cb) {
-        ResponseInfo rinfo = {.fn = cb };
-        clock_gettime(CLOCK_REALTIME, &rinfo.time);
-        map_resp_set(&client->responses, cid, rinfo);
-        //WRS_LOGD("%s: map_resp_len:%zu", __func__, map_resp_count(&client->responses));
+exit:
+    if (client) {
+        wrs_rpc_release(rpc, connid);
+    }
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+CxError wrs_rpc_stream_stats(WrsRpc* rpc, size_t connid, size_t sid, WrsRpcStreamStats* stats) {
+
+    LOCK(&rpc->lock);
+    CxError err = {};
+    RpcClient* client;
+    RpcStream* st = wrs_rpc_stream_get(rpc, connid, sid, &client);
+    if (st == NULL) {
+        err = CXERR("stream not open");
+        goto exit;
     }
+    *stats = (WrsRpcStreamStats){
+        .pushed = st->pushed,
+        .sent = st->sent,
+        .coalesced = st->coalesced,
+        .credits = st->credits,
+    };
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
-    return error;
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+CxError wrs_rpc_loopback_open(WrsRpc* rpc, bool pack, WrsLoopbackFn out, void* ctx, size_t* connid) {
+
+    LoopbackConn* conn = cx_alloc_malloc(&rpc->alloc->iface, sizeof(LoopbackConn));
+    *conn = (LoopbackConn){.out = out, .ctx = ctx};
+    if (wrs_rpc_add_conn(rpc, conn, &wrs_loopback_transport, pack ? WrsFormatPack : WrsFormatJson, connid)) {
+        cx_alloc_free(&rpc->alloc->iface, conn, sizeof(LoopbackConn));
+        return CXERR("connection count exceeded");
+    }
+
+    // The loopback connection is ready to send as soon as it is opened
+    if (rpc->evcb) {
+        rpc->evcb(rpc, *connid, WrsEventOpen);
+        rpc->evcb(rpc, *connid, WrsEventReady);
+    }
+    return (CxError){0};
+}
+
+CxError wrs_rpc_loopback_send(WrsRpc* rpc, size_t connid, bool text, const void* data, size_t len) {
+
+    // Delivers the message as a single final WebSocket frame.
+    // If the message is invalid the connection is closed as done by the other transports.
+    const int opcode = (text ? MG_WEBSOCKET_OPCODE_TEXT : MG_WEBSOCKET_OPCODE_BINARY) | WEBSOCKET_FIN_MASK;
+    if (wrs_rpc_msg_handler(rpc, connid, opcode, (char*)data, len) == 0) {
+        wrs_rpc_del_conn(rpc, connid);
+        return CXERR("loopback connection closed");
+    }
+    return (CxError){0};
+}
+
+void wrs_rpc_loopback_close(WrsRpc* rpc, size_t connid) {
+
+    wrs_rpc_del_conn(rpc, connid);
 }
 
 WrsRpcInfo wrs_rpc_info(WrsRpc* rpc) {
 
     WrsRpcInfo info = {0};
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
+    LOCK(&rpc->lock);
 
     info.url = rpc->url;
     info.nconns = rpc->nconns;
     info.max_connid = arr_conn_len(&rpc->conns);
+    info.allocs = metrics_get(&rpc->metrics->allocs);
 
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
+    UNLOCK(&rpc->lock);
     return info;
 }
 
 
-//-----------------------------------------------------------------------------
-// Local functions
-//-----------------------------------------------------------------------------
+CxError wrs_rpc_take_buf(WrsRpc* rpc, size_t connid, CxVar* msg, const char* key,
+    const void** ptr, size_t* len, WrsBufRelease* release) {
 
+    LOCK(&rpc->lock);
+    CxError err = {};
 
-// Handler for new websocket connections
-// The handler should return 0 to keep the WebSocket connection open
-static int wrs_rpc_connect_handler(const struct mg_connection *conn, void *user_data) {
+    // Checks connection id
+    if (connid >= arr_conn_len(&rpc->conns) || rpc->conns.data[connid].conn == NULL) {
+        err = CXERR("invalid connection id");
+        goto exit;
+    }
+    RpcClient* client = &rpc->conns.data[connid];
 
-    WrsRpc* rpc = user_data;
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
-    int res = 0;
+    // Get the buffer which was decoded into the connection receive storage
+    const CxVar* buf = cx_var_get_map_val(msg, key);
+    if (buf == NULL || !cx_var_get_buf(buf, ptr, len)) {
+        err = CXERR("buffer not found");
+        goto exit;
+    }
 
-    // If maximum number of connections reached, returns 1 to close the connection.
-    if (rpc->nconns >= rpc->max_conns) {
-        WRS_LOGW("%s: connection count exceeded for:%s", __func__, rpc->url);
-        res = 1;
+    // Detaches the receive storage from the connection. The connection
+    // keeps a reference until the current message is processed.
+    if (client->rxtaken == NULL) {
+        client->rxtaken = cx_alloc_malloc(&rpc->alloc->iface, sizeof(RxStorage));
+        client->rxtaken->alloc = rpc->alloc;
+        client->rxtaken->pool = client->rxalloc;
+        atomic_init(&client->rxtaken->refs, 1);
+        atomic_fetch_add(&rpc->alloc->refs, 1);
+    }
+    atomic_fetch_add(&client->rxtaken->refs, 1);
+    *release = (WrsBufRelease){.fn = wrs_rpc_storage_release, .ctx = client->rxtaken};
+
+exit:
+    UNLOCK(&rpc->lock);
+    return err;
+}
+CxError wrs_rpc_bind_stats(WrsRpc* rpc, const char* remote_name, WrsRpcBindStats* stats) {
+
+    LOCK(&rpc->lock);
+    CxError err = {};
+
+    BindInfo* bind = map_bind_get(&rpc->binds, (char*)remote_name);
+    if (bind == NULL) {
+        err = CXERR("binding not found");
         goto exit;
     }
+    *stats = (WrsRpcBindStats){
+        .calls = metrics_get(&bind->metrics->calls),
+        .wall_us = metrics_get(&bind->metrics->time_us),
+        .cpu_us = metrics_get(&bind->metrics->cpu_us),
+        .req_bytes = metrics_get(&bind->metrics->req_bytes),
+        .resp_bytes = metrics_get(&bind->metrics->resp_bytes),
+    };
 
-    // Create new RPC client state
-    RpcClient new_client = {
-        .conn = (struct mg_connection*)conn,
-        .opcode = -1,
-        .rxbytes = arru8_init(cx_def_allocator()),
-        .dec = wrs_decoder_new(cx_def_allocator()),
-        .enc = wrs_encoder_new(cx_def_allocator()),
-        .rxalloc = cx_pool_allocator_create(4*4096, NULL),
-        .txalloc = cx_pool_allocator_create(4*4096, NULL),
-        .cid = 100,
-        .responses = map_resp_init(0),
+exit:
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+size_t wrs_rpc_slow_calls(WrsRpc* rpc, uint64_t after_seq, WrsRpcSlowCall* calls, size_t max) {
+
+    LOCK(&rpc->lock);
+
+    // Sequence number of the oldest record still kept
+    uint64_t seq = rpc->nslow > RPC_SLOW_CALLS ? rpc->nslow - RPC_SLOW_CALLS + 1 : 1;
+    if (after_seq >= seq) {
+        seq = after_seq + 1;
+    }
+    size_t count = 0;
+    for (; seq <= rpc->nslow && count < max; seq++) {
+        calls[count++] = rpc->slow[(seq - 1) % RPC_SLOW_CALLS];
+    }
+
+    UNLOCK(&rpc->lock);
+    return count;
+}
+
+CxError wrs_rpc_lock_stats(WrsRpc* rpc, WrsLockStats* stats) {
+
+    return lock_stats(&rpc->lock, stats);
+}
+
+CxError wrs_rpc_conn_stats(WrsRpc* rpc, size_t connid, WrsRpcConnStats* stats) {
+
+    LOCK(&rpc->lock);
+    CxError err = {};
+
+    // Checks connection id
+    if (connid >= arr_conn_len(&rpc->conns) || rpc->conns.data[connid].conn == NULL) {
+        err = CXERR("invalid connection id");
+        goto exit;
+    }
+    RpcClient* client = &rpc->conns.data[connid];
+    const RpcConnStats* cs = &client->stats;
+
+    *stats = (WrsRpcConnStats){
+        .msgs_in = atomic_load_explicit(&cs->msgs_in, memory_order_relaxed),
+        .msgs_out = atomic_load_explicit(&cs->msgs_out, memory_order_relaxed),
+        .bytes_in = atomic_load_explicit(&cs->bytes_in, memory_order_relaxed),
+        .bytes_out = atomic_load_explicit(&cs->bytes_out, memory_order_relaxed),
+        .rx_bytes = atomic_load_explicit(&cs->rx_bytes, memory_order_relaxed),
+        .rx_peak = atomic_load_explicit(&cs->rx_peak, memory_order_relaxed),
+        .tx_cap = wrs_encoder_capacity(client->enc) + wrs_encoder_capacity(client->callenc),
+        .tx_peak = atomic_load_explicit(&cs->tx_peak, memory_order_relaxed),
+        .pending = client->responses.count,
+        .last_rtt_us = atomic_load_explicit(&cs->last_rtt, memory_order_relaxed),
+        .idle_ms = (metrics_now_us() - atomic_load_explicit(&cs->last_active, memory_order_relaxed)) / 1000,
+        .ping_rtt_us = client->ping.srtt,
+        .ping_rtt_min_us = client->ping.min,
+        .ping_rtt_max_us = client->ping.max,
+        .pings_missed = client->ping.missed,
+        .tx_queued = client->txq.bytes,
     };
 
-    // Looks for empty slot in the connections array
-    size_t connid = SIZE_MAX;
-    for (size_t i = 0; i < arr_conn_len(&rpc->conns); i++) {
-        if (rpc->conns.data[i].conn == NULL) {
-            rpc->conns.data[i] = new_client;
-            connid = i;
-            break;
-        }
+exit:
+    UNLOCK(&rpc->lock);
+    return err;
+}
+
+void wrs_rpc_keepalive(WrsRpc* rpc) {
+
+    LOCK(&rpc->lock);
+    const uint64_t interval = (uint64_t)rpc->opts.ping_interval_ms * 1000;
+    const uint32_t max_missed = rpc->opts.ping_max_missed ? rpc->opts.ping_max_missed : PING_MAX_MISSED;
+    if (interval == 0) {
+        goto exit;
     }
 
-    // If empty slot not found, adds a new RpcClient to connections array
-    if (connid == SIZE_MAX) {
-        arr_conn_push(&rpc->conns, new_client);
-        connid = arr_conn_len(&rpc->conns)-1;
+    // The array length is read in each iteration as the endpoint
+    // is unlocked to write the pings.
+    // Connections being written by other threads are checked in the next tick.
+    for (size_t connid = 0; connid < arr_conn_len(&rpc->conns); connid++) {
+        RpcClient* client = &rpc->conns.data[connid];
+        const uint64_t now = metrics_now_us();
+        if (client->conn == NULL || !client->tp->keepalive || client->closing || client->writing ||
+            now - client->ping.sent < interval) {
+            continue;
+        }
+
+        // Closes the connection if the previous pings were not answered
+        if (client->ping.pending) {
+            client->ping.missed++;
+            if (client->ping.missed >= max_missed) {
+                WRS_LOGW("%s: closing connid:%zu of:%s after %u pings not answered", __func__, connid, rpc->url, client->ping.missed);
+                wrs_rpc_expire_conn(rpc, connid);
+                continue;
+            }
+        }
+
+        // Sends ping with its send time as payload
+        client->ping.sent = now;
+        client->ping.pending = true;
+        client->writing = true;
+        const int res = wrs_rpc_write_unlocked(rpc, connid, MG_WEBSOCKET_OPCODE_PING, &now, sizeof(now));
+        wrs_rpc_release(rpc, connid);
+        if (res <= 0) {
+            WRS_LOGE_RL(1000, "%s: error writing ping to connid:%zu", __func__, connid);
+        }
     }
-    rpc->nconns++;
-    mg_set_user_connection_data(conn, (void*)(connid));
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
+    UNLOCK(&rpc->lock);
+}
+
+void wrs_rpc_write_metrics(Wrs* wrs, FILE* f) {
+
+    LOCK(&wrs->lock);
+
+    // Get the server endpoints
+    const size_t count = map_rpc_count(&wrs->rpc_handlers);
+    WrsRpc** rpcs = cx_alloc_malloc(&wrs->alloc, (count + 1) * sizeof(WrsRpc*));
+    size_t n = 0;
+    map_rpc_iter iter = {0};
+    map_rpc_entry* e;
+    while ((e = map_rpc_next(&wrs->rpc_handlers, &iter)) != NULL) {
+        rpcs[n++] = e->val;
+    }
+
+    // Connections and pending responses are read with the endpoint locked
+    metrics_write_header(f, "wrs_rpc_connections", "gauge", "Number of open connections");
+    for (size_t i = 0; i < n; i++) {
+        LOCK(&rpcs[i]->lock);
+        fputs("wrs_rpc_connections{endpoint=", f);
+        metrics_write_label(f, rpcs[i]->url);
+        fprintf(f, "} %zu\n", rpcs[i]->nconns);
+        UNLOCK(&rpcs[i]->lock);
+    }
+    metrics_write_header(f, "wrs_rpc_pending_responses", "gauge", "Number of calls to remote functions waiting for responses");
+    for (size_t i = 0; i < n; i++) {
+        LOCK(&rpcs[i]->lock);
+        size_t pending = 0;
+        for (size_t c = 0; c < arr_conn_len(&rpcs[i]->conns); c++) {
+            if (rpcs[i]->conns.data[c].conn) {
+                pending += rpcs[i]->conns.data[c].responses.count;
+            }
+        }
+        fputs("wrs_rpc_pending_responses{endpoint=", f);
+        metrics_write_label(f, rpcs[i]->url);
+        fprintf(f, "} %zu\n", pending);
+        UNLOCK(&rpcs[i]->lock);
+    }
+
+    // Endpoint counters
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_received_messages_total", "Number of messages received",
+        offsetof(RpcMetrics, msgs_in));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_sent_messages_total", "Number of messages sent",
+        offsetof(RpcMetrics, msgs_out));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_received_bytes_total", "Number of bytes received",
+        offsetof(RpcMetrics, bytes_in));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_sent_bytes_total", "Number of bytes sent",
+        offsetof(RpcMetrics, bytes_out));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_decode_errors_total", "Number of received messages which could not be decoded",
+        offsetof(RpcMetrics, decode_errors));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_unknown_binding_total", "Number of calls received for functions not bound",
+        offsetof(RpcMetrics, unknown_binds));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_allocations_total", "Number of heap allocations of the connections",
+        offsetof(RpcMetrics, allocs));
+    wrs_rpc_write_counter(f, rpcs, n, "wrs_rpc_keepalive_closed_total", "Number of connections closed for not answering the keepalive pings",
+        offsetof(RpcMetrics, expired));
+
+    // Local function bindings
+    static const struct {
+        const char* name;
+        const char* help;
+        size_t      offset;
+        double      scale;
+    } bind_counters[] = {
+        {"wrs_rpc_handler_calls_total", "Number of calls of the local functions", offsetof(BindMetrics, calls), 1},
+        {"wrs_rpc_handler_seconds_total", "Wall time spent in the local functions", offsetof(BindMetrics, time_us), 1e-6},
+        {"wrs_rpc_handler_cpu_seconds_total", "Thread CPU time spent in the local functions", offsetof(BindMetrics, cpu_us), 1e-6},
+        {"wrs_rpc_handler_request_bytes_total", "Size of the received call messages", offsetof(BindMetrics, req_bytes), 1},
+        {"wrs_rpc_handler_response_bytes_total", "Size of the sent response messages", offsetof(BindMetrics, resp_bytes), 1},
+    };
+    for (size_t c = 0; c < sizeof(bind_counters)/sizeof(bind_counters[0]); c++) {
+        const char* name = bind_counters[c].name;
+        metrics_write_header(f, name, "counter", bind_counters[c].help);
+        for (size_t i = 0; i < n; i++) {
+            LOCK(&rpcs[i]->lock);
+            map_bind_iter biter = {0};
+            map_bind_entry* b;
+            while ((b = map_bind_next(&rpcs[i]->binds, &biter)) != NULL) {
+                const MetricsCounter* counter = (const MetricsCounter*)((char*)b->val.metrics + bind_counters[c].offset);
+                fprintf(f, "%s{endpoint=", name);
+                metrics_write_label(f, rpcs[i]->url);
+                fputs(",binding=", f);
+                metrics_write_label(f, b->key);
+                fprintf(f, "} %.15g\n", metrics_get(counter) * bind_counters[c].scale);
+            }
+            UNLOCK(&rpcs[i]->lock);
+        }
+    }
+
+    cx_alloc_free(&wrs->alloc, rpcs, (count + 1) * sizeof(WrsRpc*));
+    UNLOCK(&wrs->lock);
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Handler for new websocket connections
+// The handler should return 0 to keep the WebSocket connection open
+static int wrs_rpc_connect_handler(const struct mg_connection *conn, void *user_data) {
+
+    // Uses MessagePack envelope if negotiated by the client
+    WrsFormat format = WrsFormatJson;
+    const struct mg_request_info* rinfo = mg_get_request_info(conn);
+    if (rinfo->acceptedWebSocketSubprotocol && strcmp(rinfo->acceptedWebSocketSubprotocol, WRS_SUBPROTOCOL_PACK) == 0) {
+        format = WrsFormatPack;
+    }
+
+    WrsRpc* rpc = user_data;
+    size_t connid;
+    int res = wrs_rpc_add_conn(rpc, (struct mg_connection*)conn, &wrs_ws_transport, format, &connid);
+    if (res == 0) {
+        mg_set_user_connection_data(conn, (void*)(connid));
+    }
+
     // Calls user handler if defined and if no errors occurred.
     if (res == 0 && rpc->evcb) {
         rpc->evcb(rpc, connid, WrsEventOpen);
@@ -368,14 +1024,23 @@ static void wrs_rpc_ready_handler(struct mg_connection *conn, void *user_data) {
 // The handler should return 1 to keep the WebSocket connection open or 0 to close it.
 static int wrs_rpc_data_handler(struct mg_connection *conn, int opcode, char *data, size_t data_size, void *user_data) {
 
-    WrsRpc* rpc = user_data;
-    uintptr_t connid = (uintptr_t)mg_get_user_connection_data(conn);
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
+    const uintptr_t connid = (uintptr_t)mg_get_user_connection_data(conn);
+    return wrs_rpc_msg_handler(user_data, connid, opcode, data, data_size);
+}
+
+// Processes message or message fragment received by the specified connection
+// Returns 1 to keep the connection open or 0 to close it.
+static int wrs_rpc_msg_handler(WrsRpc* rpc, size_t connid, int opcode, char* data, size_t data_size) {
+
+    const uint64_t tframe = trace_begin();
+    WRS_PROBE4(msg_received, rpc->url, connid, opcode, data_size);
+    LOCK(&rpc->lock);
     int keep_open = 1;
+    WrsDecoder* release_dec = NULL;
 
     // Checks connection id and closes connection if invalid.
     if (connid >= arr_conn_len(&rpc->conns)) {
-        WRS_LOGW("%s: message received with invalid connid:%zu", __func__, connid);
+        WRS_LOGW_RL(1000, "%s: message received with invalid connid:%zu", __func__, connid);
         keep_open = 0;  // Close connection
         goto exit; 
     }
@@ -384,29 +1049,47 @@ static int wrs_rpc_data_handler(struct mg_connection *conn, int opcode, char *da
     // closes connection if client is not opened.
     RpcClient* client = &rpc->conns.data[connid];
     if (client->conn == NULL) {
-        WRS_LOGW("%s: message received for closed connid:%zu", __func__, connid);
+        WRS_LOGW_RL(1000, "%s: message received for closed connid:%zu", __func__, connid);
         keep_open = 0;    // Close connection
         goto exit; 
     }
 
-    // Saves first opcode of fragment group
-    if (client->opcode < 0) {
-        client->opcode = opcode;
-        arru8_clear(&client->rxbytes);
+    // Connections expired by the keepalive are closed by their next message
+    if (client->closing) {
+        keep_open = 0;    // Close connection
+        goto exit;
     }
 
-    // Accumulates possible WebSocket message fragments data in internal buffer
+    // Pongs answering the keepalive pings may be interleaved with the fragments of a message
+    if ((opcode & WEBSOCKET_OP_MASK) == MG_WEBSOCKET_OPCODE_PONG) {
+        wrs_rpc_pong(client, data, data_size);
+        keep_open = 1;  // Keep connection open
+        goto exit;
+    }
+
+    metrics_add(&rpc->metrics->bytes_in, data_size);
+
+    // Saves first opcode of fragment group
     const bool is_final = (opcode & WEBSOCKET_FIN_MASK) != 0; 
     const bool is_cont = (opcode & WEBSOCKET_OP_MASK) == MG_WEBSOCKET_OPCODE_CONTINUATION;
-    if (!is_final || is_cont) {
-        arru8_pushn(&client->rxbytes, data, data_size);
-        if (!is_final) {
-            keep_open = 1;    // Keep connection open and returns to get more fragments
-            goto exit;
-        }
+
+    // Updates connection statistics
+    RpcConnStats* stats = &client->stats;
+    const size_t rx_bytes = (is_cont ? atomic_load_explicit(&stats->rx_bytes, memory_order_relaxed) : 0) + data_size;
+    atomic_store_explicit(&stats->rx_bytes, rx_bytes, memory_order_relaxed);
+    wrs_rpc_stats_max(&stats->rx_peak, rx_bytes);
+    atomic_fetch_add_explicit(&stats->bytes_in, data_size, memory_order_relaxed);
+    atomic_store_explicit(&stats->last_active, metrics_now_us(), memory_order_relaxed);
+    if (is_final) {
+        atomic_fetch_add_explicit(&stats->msgs_in, 1, memory_order_relaxed);
+    }
+    if (!is_cont) {
+        client->opcode = opcode;
     }
     const int frame_flags = client->opcode & WEBSOCKET_OP_MASK;
-    client->opcode = -1;
+    if (is_final) {
+        client->opcode = -1;
+    }
 
     // Accepts text or binary messages only.
     bool text = true;
@@ -415,47 +1098,91 @@ static int wrs_rpc_data_handler(struct mg_connection *conn, int opcode, char *da
     } else if (frame_flags == MG_WEBSOCKET_OPCODE_BINARY) {
         text = false;
     } else {
-        WRS_LOGW("%s: WebSocket msg type:%d ignored", __func__, frame_flags);
+        WRS_LOGW_RL(1000, "%s: WebSocket msg type:%d ignored", __func__, frame_flags);
         keep_open = 1;    // Keep connection open
         goto exit;
     }
 
-    // Sets the pointer and length of message to decode, depending on
-    // it came directly from WebSocket server or the accumulated buffer.
-    void* msg_data = data;
-    size_t msg_len = data_size;
-    if (arru8_len(&client->rxbytes) > 0) {
-        msg_data = client->rxbytes.data;
-        msg_len = arru8_len(&client->rxbytes);
-        WRS_LOGD("%s: received fragmented message with total length:%zu", __func__, msg_len);
+    // Stream messages from the client skip the message envelope
+    WrsStreamMsg smsg;
+    if (!text && is_final && !is_cont && wrs_stream_decode(data, data_size, &smsg)) {
+        wrs_rpc_stream_handler(rpc, connid, &smsg);
+        keep_open = 1;  // Keep connection open
+        goto exit;
     }
 
-    // Decodes message and closes connection if invalid
-    CxVar* rxmsg = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
-    CxError err = wrs_decoder_dec(client->dec, text, msg_data, msg_len, rxmsg);
+    // Scans only the message envelope and closes connection if invalid.
+    // The message body is decoded later only if it will be used.
+    // Unfragmented messages are scanned directly from the WebSocket server buffer
+    // and fragmented messages are decoded incrementally as the fragments arrive.
+    WrsEnvelope env;
+    CxError err;
+    const bool fragmented = !is_final || is_cont;
+    if (fragmented) {
+        if (!is_cont) {
+            wrs_decoder_begin(client->dec, text);
+        }
+        // The decoder checks the memory budget before allocating the declared chunk sizes.
+        // The fragments already received can't be answered, so errors close the connection.
+        const uint64_t tstart = trace_begin();
+        err = wrs_decoder_feed(client->dec, data, data_size);
+        trace_end("reassembly", tstart, connid, -1, NULL);
+        if (err.code) {
+            WRS_LOGE_RL(1000, "%s: error decoding message fragment: %s", __func__, err.msg);
+            metrics_add(&rpc->metrics->decode_errors, 1);
+            release_dec = client->dec;
+            keep_open = 0;  // Close connection
+            goto exit; 
+        }
+        if (!is_final) {
+            keep_open = 1;    // Keep connection open and returns to get more fragments
+            goto exit;
+        }
+        release_dec = client->dec;
+        const uint64_t tend = trace_begin();
+        err = wrs_decoder_end(client->dec, &env);
+        trace_end("decode_envelope", tend, connid, -1, NULL);
+    } else {
+        const uint64_t tstart = trace_begin();
+        err = wrs_decoder_scan(client->dec, text, data, data_size, &env);
+        trace_end("decode_envelope", tstart, connid, -1, NULL);
+    }
+    metrics_add(&rpc->metrics->msgs_in, 1);
+    WRS_PROBE3(msg_decoded, rpc->url, connid, err.code);
     if (err.code) {
-        cx_pool_allocator_clear(client->rxalloc);
-        WRS_LOGE("%s: error decoding message", __func__);
+        WRS_LOGE_RL(1000, "%s: error decoding message: %s", __func__, err.msg);
+        metrics_add(&rpc->metrics->decode_errors, 1);
         keep_open = 0;  // Close connection
         goto exit; 
     }
 
-    // Try to process this message as remote call
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
-    int res = wrs_rpc_call_handler(rpc, client, connid, rxmsg);
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
-    if (res == 0) {
-        cx_pool_allocator_clear(client->rxalloc);
-        keep_open = 1;    // Keep connection open
+    // Rejects the message if it would exceed the server memory budget
+    if (!fragmented && rpc->wrs && !wrs_mem_check(rpc->wrs, data_size)) {
+        keep_open = wrs_rpc_reject(rpc, connid, &env);
         goto exit;
     }
 
+    // Try to process this message as remote call
+    int res = 1;
+    if (env.has_cid) {
+        UNLOCK(&rpc->lock);
+        res = wrs_rpc_call_handler(rpc, client, connid, &env);
+        LOCK(&rpc->lock);
+        client = &rpc->conns.data[connid];
+        wrs_rpc_reset_rxalloc(rpc, client);
+        if (res == 0) {
+            keep_open = 1;    // Keep connection open
+            goto exit;
+        }
+    }
+
     // Try to process this message as response from previous local call.
-    if (res == 1) {
-        CXCHKZ(pthread_mutex_unlock(&rpc->lock));
-        res = wrs_rpc_response_handler(rpc, client, connid,rxmsg);
-        CXCHKZ(pthread_mutex_lock(&rpc->lock));
-        cx_pool_allocator_clear(client->rxalloc);
+    if (res == 1 && env.has_rid) {
+        UNLOCK(&rpc->lock);
+        res = wrs_rpc_response_handler(rpc, client, connid, &env);
+        LOCK(&rpc->lock);
+        client = &rpc->conns.data[connid];
+        wrs_rpc_reset_rxalloc(rpc, client);
         if (res == 0) {
             keep_open = 1;    // Keep connection open
             goto exit;
@@ -463,47 +1190,83 @@ static int wrs_rpc_data_handler(struct mg_connection *conn, int opcode, char *da
     }
 
     // Received invalid message
-    WRS_LOGE("%s: received invalid message", __func__);
+    WRS_LOGE_RL(1000, "%s: received invalid message", __func__);
     keep_open = 0;    // Close connection
     goto exit;
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
+    // Releases the memory of the last fragmented message
+    if (release_dec) {
+        wrs_decoder_release(release_dec);
+    }
+    UNLOCK(&rpc->lock);
+    trace_end("frame", tframe, connid, -1, NULL);
     return keep_open;
 }
 
 // Called by RPC data handler to process remote calls.
+// The call parameters are only decoded if the local function binding exists.
 // Returns 0 if OK
-// Returns 1 if not a call handler (cid undefined)
-// Returns 2 for other errors
-static int wrs_rpc_call_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const CxVar* rxmsg) {
+// Returns 2 for errors
+static int wrs_rpc_call_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const WrsEnvelope* env) {
 
     // Checks message fields for remote call:
     // cid:     <number>
     // call:    <string>
     // params:  <any>
-    int64_t cid;
-    if (!cx_var_get_map_int(rxmsg, "cid", &cid)) {
-        return 1;
+    const int64_t cid = env->cid;
+    if (env->call == NULL) {
+        WRS_LOGE_RL(1000, "%s: 'call' field not found", __func__);
+        return 2;
     }
-    const char* pcall;
-    if (!cx_var_get_map_str(rxmsg, "call", &pcall)) {
-        WRS_LOGE("%s: 'call' field not found", __func__);
+    if (env->body == NULL) {
+        WRS_LOGE_RL(1000, "%s: 'params' field not found", __func__);
         return 2;
     }
-    CxVar* params = cx_var_get_map_val(rxmsg, "params");
-    if (!params) {
-        WRS_LOGE("%s: 'params' field not found", __func__);
+    char pcall[MAX_CALL_NAME];
+    if (env->call_len >= sizeof(pcall)) {
+        WRS_LOGE_RL(1000, "%s: 'call' field too long", __func__);
         return 2;
     }
-
-    // Get local function binding for the received "call"
+    memcpy(pcall, env->call, env->call_len);
+    pcall[env->call_len] = 0;
+
+    // Get local function binding for the received "call".
+    // The binding may be removed while the local function is called, so its
+    // fields are copied with the endpoint locked and its metrics are referenced.
+    uint64_t tstart = trace_begin();
+    LOCK(&rpc->lock);
     BindInfo* rinfo = map_bind_get(&rpc->binds, (char*)pcall);
-    if (rinfo == NULL) {
-        WRS_LOGE("%s: bind for:%s not found", __func__, pcall);
+    WrsRpcFn fn = NULL;
+    WrsPriority prio = WrsPriorityNormal;
+    BindMetrics* bm = NULL;
+    if (rinfo) {
+        fn = rinfo->fn;
+        prio = rinfo->prio;
+        bm = rinfo->metrics;
+        atomic_fetch_add(&bm->refs, 1);
+    }
+    UNLOCK(&rpc->lock);
+    trace_end("bind_lookup", tstart, connid, cid, pcall);
+    if (bm == NULL) {
+        WRS_LOGE_RL(1000, "%s: bind for:%s not found", __func__, pcall);
+        metrics_add(&rpc->metrics->unknown_binds, 1);
         return 2;
     }
 
+    // Decodes the call parameters
+    int ret = 0;
+    CxVar* params = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
+    tstart = trace_begin();
+    CxError err = wrs_decoder_dec_body(client->dec, env, params);
+    trace_end("decode", tstart, connid, cid, pcall);
+    if (err.code) {
+        WRS_LOGE_RL(1000, "%s: error decoding 'params' of:%s", __func__, pcall);
+        metrics_add(&rpc->metrics->decode_errors, 1);
+        ret = 2;
+        goto exit;
+    }
+
     // Prepare response
     CxVar* txmsg = cx_var_new(cx_pool_allocator_iface(client->txalloc));
     cx_var_set_map(txmsg);
@@ -512,85 +1275,138 @@ static int wrs_rpc_call_handler(WrsRpc* rpc, RpcClient* client, size_t connid, c
 
     // Calls local function and if it returns error,
     // does not send any response to remote caller.
-    int res = rinfo->fn(rpc, connid, params, resp);
+    tstart = trace_begin();
+    const uint64_t start = metrics_now_us();
+    const uint64_t start_cpu = metrics_cpu_us();
+    WRS_PROBE3(handler_start, connid, cid, pcall);
+    int res = fn(rpc, connid, params, resp);
+    WRS_PROBE4(handler_end, connid, cid, pcall, res);
+    const uint64_t wall_us = metrics_now_us() - start;
+    const uint64_t cpu_us = metrics_cpu_us() - start_cpu;
+    trace_end("handler", tstart, connid, cid, pcall);
+
+    // Updates the binding statistics and records slow call
+    const size_t msg_size = atomic_load_explicit(&client->stats.rx_bytes, memory_order_relaxed);
+    metrics_add(&bm->calls, 1);
+    metrics_add(&bm->time_us, wall_us);
+    metrics_add(&bm->cpu_us, cpu_us);
+    metrics_add(&bm->req_bytes, msg_size);
+    if (rpc->opts.slow_call_us && wall_us >= rpc->opts.slow_call_us) {
+        wrs_rpc_slow_call(rpc, connid, pcall, env->body_len, wall_us, cpu_us);
+    }
     if (res) {
         WRS_LOGW("%s: local rpc function returned error", __func__);
         cx_pool_allocator_clear(client->txalloc);
-        return 0;
+        goto exit;
     }
 
     // If local function didn't generate a response, nothing else to do.
     if (!cx_var_get_map_val(resp, "err") && !cx_var_get_map_val(resp, "data")) {
         cx_pool_allocator_clear(client->txalloc);
-        return 0;
+        goto exit;
     }
 
-    // Encodes message
-    CxError err = wrs_encoder_enc(client->enc, txmsg);
+    // Encodes message with the response encoder, which is only used by the connection
+    // handler thread, as the calls to the client made by other threads use the call encoder.
+    tstart = trace_begin();
+    err = wrs_encoder_enc(client->enc, txmsg);
+    trace_end("encode", tstart, connid, cid, pcall);
     cx_pool_allocator_clear(client->txalloc);
     if (err.code) {
         WRS_LOGE("%s: error encoding message", __func__);
-        return 0;
+        goto exit;
     }
 
     // Get encoded message type and buffer
     bool text;
     size_t len;
     void* msg = wrs_encoder_get_msg(client->enc, &text, &len);
-    int opcode = text ? MG_WEBSOCKET_OPCODE_TEXT : MG_WEBSOCKET_OPCODE_BINARY;
 
-    // Sends response to remote client
-    mg_lock_connection((struct mg_connection*)client->conn);
-    res = mg_websocket_write((struct mg_connection*)client->conn, opcode, msg, len);
-    mg_unlock_connection((struct mg_connection*)client->conn);
+    // Sends response to remote client.
+    // The endpoint is unlocked while the response is written.
+    tstart = trace_begin();
+    LOCK(&rpc->lock);
+    res = 0;
+    if (wrs_rpc_acquire(rpc, connid)) {
+        res = wrs_rpc_write(rpc, connid, prio, text, msg, len);
+        wrs_rpc_release(rpc, connid);
+    }
+    UNLOCK(&rpc->lock);
+    trace_end("write", tstart, connid, cid, pcall);
     if (res <= 0) {
-        WRS_LOGE("%s: error:%d writing websocket message", __func__, res);
+        WRS_LOGE("%s: error:%d writing message", __func__, res);
+        goto exit;
     }
-    return 0;
+    metrics_add(&rpc->metrics->msgs_out, 1);
+    metrics_add(&rpc->metrics->bytes_out, len);
+    metrics_add(&bm->resp_bytes, len);
+    wrs_rpc_stats_sent(client, len);
+
+exit:
+    wrs_rpc_bind_release(rpc, bm);
+    return ret;
 }
 
 // Called by RPC data handler to process received possible response
+// The response is only decoded if there is a local callback waiting for it.
 // Returns 0 if OK
 // Returns 1 for other errors
-static int wrs_rpc_response_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const CxVar* msg) {
+static int wrs_rpc_response_handler(WrsRpc* rpc, RpcClient* client, size_t connid, const WrsEnvelope* env) {
 
     // The response message body must have the following format:
     // { rid: <number>, resp: {err: <any> OR data: <any>}}
-    int64_t rid;
-    if (!cx_var_get_map_int(msg, "rid", &rid)) {
-        WRS_LOGE("%s: response with missing 'rid' field", __func__);
+    const int64_t rid = env->rid;
+    if (env->body == NULL) {
+        WRS_LOGE_RL(1000, "%s: response with missing 'resp' field", __func__);
         return 1;
     }
 
-    // Get the response field
-    CxVar* resp = cx_var_get_map_val(msg, "resp");
-    if (resp == NULL) {
-        WRS_LOGE("%s: response with missing 'resp' field", __func__);
-        return 1;
-    }
-    
     // Get information for the local callback for this response
-    ResponseInfo* info = map_resp_get(&client->responses, rid);
+    ResponseInfo* info = wrs_rpc_resp_get(&client->responses, rid);
     if (info == NULL) {
-        WRS_LOGE("%s: response with no callback connid:%zu rid:%zu", __func__, connid, rid);
+        WRS_LOGE_RL(1000, "%s: response with no callback connid:%zu rid:%zu", __func__, connid, rid);
+        return 1;
+    }
+
+    // Decodes the response field
+    CxVar* resp = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
+    uint64_t tstart = trace_begin();
+    CxError err = wrs_decoder_dec_body(client->dec, env, resp);
+    trace_end("decode", tstart, connid, rid, NULL);
+    if (err.code) {
+        WRS_LOGE_RL(1000, "%s: error decoding response connid:%zu rid:%zu", __func__, connid, rid);
+        metrics_add(&rpc->metrics->decode_errors, 1);
         return 1;
     }
 
     // Removes response callback association and calls response callback
     // The response callback should return 0 to keep the connection open.
-    map_resp_del(&client->responses, rid);
-    return info->fn(rpc, connid, resp);
+    const WrsResponseFn fn = info->fn;
+    const int64_t rtt = metrics_now_us() - info->time;
+    atomic_store_explicit(&client->stats.last_rtt, rtt, memory_order_relaxed);
+    WRS_PROBE3(response_matched, connid, rid, rtt);
+    wrs_rpc_resp_del(&client->responses, rid);
+    trace_async("call", TRACE_ASYNC_END, connid, rid);
+    tstart = trace_begin();
+    const int res = fn(rpc, connid, resp);
+    trace_end("response_handler", tstart, connid, rid, NULL);
+    return res;
 }
 
 // Handler called when RPC client connection is closed.
 static void wrs_rpc_close_handler(const struct mg_connection *conn, void *user_data) {
 
-    WrsRpc* rpc = user_data;
     const uintptr_t connid = (uintptr_t)mg_get_user_connection_data(conn);
+    wrs_rpc_del_conn(user_data, connid);
+}
+
+// Removes closed connection and calls user event handler
+static void wrs_rpc_del_conn(WrsRpc* rpc, size_t connid) {
+
     int res = 0;
 
     // Checks if this connection id is valid
-    CXCHKZ(pthread_mutex_lock(&rpc->lock));
+    LOCK(&rpc->lock);
     if (connid >= arr_conn_len(&rpc->conns)) {
         WRS_LOGW("%s: connection:%zu is invalid", __func__, connid);
         res = 1;
@@ -605,27 +1421,961 @@ static void wrs_rpc_close_handler(const struct mg_connection *conn, void *user_d
         goto exit;
     }
 
-    // Deallocates all memory used by this client connection
-    wrs_rpc_free_conn(client);
+    // Waits for the writes in progress by other threads and
+    // deallocates all memory used by this client connection
+    client->closing = true;
+    while (client->writing) {
+        WAIT(&rpc->lock, &rpc->wcond);
+        client = &rpc->conns.data[connid];
+    }
+    wrs_rpc_free_conn(rpc, client);
     rpc->nconns--;
+    WRS_PROBE2(conn_close, rpc->url, connid);
 
 exit:
-    CXCHKZ(pthread_mutex_unlock(&rpc->lock));
+    UNLOCK(&rpc->lock);
     // Calls user handler if defined and if no errors occurred.
     if (res == 0 && rpc->evcb) {
         rpc->evcb(rpc, connid, WrsEventClose);
     }
 }
 
+// Handler for new IPC connections
+// Returns 0 to accept the connection.
+static int wrs_rpc_ipc_connect_handler(IpcConn* conn, void* user_data) {
+
+    WrsRpc* rpc = user_data;
+    size_t connid;
+    int res = wrs_rpc_add_conn(rpc, conn, &wrs_ipc_transport, WrsFormatJson, &connid);
+    if (res == 0) {
+        ipc_conn_set_userdata(conn, (void*)connid);
+        if (rpc->evcb) {
+            rpc->evcb(rpc, connid, WrsEventOpen);
+        }
+    }
+    return res;
+}
+
+// Handler indicating the IPC connection is ready to receive data.
+static void wrs_rpc_ipc_ready_handler(IpcConn* conn, void* user_data) {
+
+    WrsRpc* rpc = user_data;
+    const uintptr_t connid = (uintptr_t)ipc_conn_get_userdata(conn);
+    if (rpc->evcb) {
+        rpc->evcb(rpc, connid, WrsEventReady);
+    }
+}
+
+// Handler called when a complete message is received by IPC connection
+static int wrs_rpc_ipc_data_handler(IpcConn* conn, int opcode, char* data, size_t data_size, void* user_data) {
+
+    const uintptr_t connid = (uintptr_t)ipc_conn_get_userdata(conn);
+    return wrs_rpc_msg_handler(user_data, connid, opcode, data, data_size);
+}
+
+// Handler called before the receive buffer of an IPC message is allocated.
+// Returns 0 to accept the message or 1 to close the connection.
+static int wrs_rpc_ipc_check_handler(IpcConn* conn, size_t len, void* user_data) {
+
+    WrsRpc* rpc = user_data;
+    if (rpc->wrs && !wrs_mem_check(rpc->wrs, len)) {
+        const uintptr_t connid = (uintptr_t)ipc_conn_get_userdata(conn);
+        WRS_LOGE_RL(1000, "%s: memory budget exceeded by message connid:%zu len:%zu", __func__, connid, len);
+        return 1;
+    }
+    return 0;
+}
+
+// Handler called when IPC connection is closed.
+static void wrs_rpc_ipc_close_handler(IpcConn* conn, void* user_data) {
+
+    const uintptr_t connid = (uintptr_t)ipc_conn_get_userdata(conn);
+    wrs_rpc_del_conn(user_data, connid);
+}
+
+// Called with the endpoint locked to reject a message which would exceed the memory budget
+// without decoding its body. Calls receive an error response and pending local calls
+// have their response callbacks called with an error.
+// Returns 1 to keep the connection open.
+static int wrs_rpc_reject(WrsRpc* rpc, size_t connid, const WrsEnvelope* env) {
+
+    if (env->has_cid) {
+        WRS_LOGW_RL(1000, "%s: call rejected connid:%zu cid:%zu", __func__, connid, env->cid);
+        RpcClient* client = wrs_rpc_acquire(rpc, connid);
+        if (client == NULL) {
+            return 1;
+        }
+        CxVar* txmsg = cx_var_new(cx_pool_allocator_iface(client->txalloc));
+        cx_var_set_map(txmsg);
+        cx_var_set_map_int(txmsg, "rid", env->cid);
+        CxVar* resp = cx_var_set_map_map(txmsg, "resp");
+        cx_var_set_map_str(resp, "err", ERR_MEM_BUDGET);
+        CxError err = wrs_encoder_enc(client->enc, txmsg);
+        cx_pool_allocator_clear(client->txalloc);
+        if (err.code) {
+            WRS_LOGE("%s: error encoding message", __func__);
+            wrs_rpc_release(rpc, connid);
+            return 1;
+        }
+        bool text;
+        size_t len;
+        void* msg = wrs_encoder_get_msg(client->enc, &text, &len);
+        const int res = wrs_rpc_write(rpc, connid, WrsPriorityNormal, text, msg, len);
+        client = wrs_rpc_release(rpc, connid);
+        if (res <= 0) {
+            WRS_LOGE("%s: error:%d writing message", __func__, res);
+            return 1;
+        }
+        metrics_add(&rpc->metrics->msgs_out, 1);
+        metrics_add(&rpc->metrics->bytes_out, len);
+        wrs_rpc_stats_sent(client, len);
+        return 1;
+    }
+
+    if (env->has_rid) {
+        RpcClient* client = &rpc->conns.data[connid];
+        ResponseInfo* info = wrs_rpc_resp_get(&client->responses, env->rid);
+        if (info == NULL) {
+            return 1;
+        }
+        WRS_LOGW_RL(1000, "%s: response rejected connid:%zu rid:%zu", __func__, connid, env->rid);
+        const WrsResponseFn fn = info->fn;
+        wrs_rpc_resp_del(&client->responses, env->rid);
+        trace_async("call", TRACE_ASYNC_END, connid, env->rid);
+        CxVar* resp = cx_var_new(cx_pool_allocator_iface(client->rxalloc));
+        cx_var_set_map(resp);
+        cx_var_set_map_str(resp, "err", ERR_MEM_BUDGET);
+        UNLOCK(&rpc->lock);
+        fn(rpc, connid, resp);
+        LOCK(&rpc->lock);
+        client = &rpc->conns.data[connid];
+        wrs_rpc_reset_rxalloc(rpc, client);
+    }
+    return 1;
+}
+
+// Creates the state of a new client connection
+// Returns 0 if OK or 1 if the maximum number of connections was reached.
+static int wrs_rpc_add_conn(WrsRpc* rpc, void* conn, const RpcTransport* tp, WrsFormat format, size_t* connid) {
+
+    LOCK(&rpc->lock);
+    int res = 0;
+
+    // If maximum number of connections reached, returns 1 to close the connection.
+    if (rpc->nconns >= rpc->max_conns) {
+        WRS_LOGW_RL(1000, "%s: connection count exceeded for:%s", __func__, rpc->url);
+        res = 1;
+        goto exit;
+    }
+
+    // Create new RPC client state.
+    // All the connection memory is allocated with the endpoint counting allocator.
+    const size_t tx_block = rpc->opts.tx_block_size ? rpc->opts.tx_block_size : POOL_BLOCK_SIZE;
+    RpcClient new_client = {
+        .conn = conn,
+        .tp = tp,
+        .opcode = -1,
+        .dec = wrs_decoder_new(&rpc->alloc->iface),
+        .enc = wrs_encoder_new(&rpc->alloc->iface),
+        .callenc = wrs_encoder_new(&rpc->alloc->iface),
+        .rxalloc = cx_pool_allocator_create(wrs_rpc_rx_block(rpc), &rpc->alloc->iface),
+        .txalloc = cx_pool_allocator_create(tx_block, &rpc->alloc->iface),
+        .callalloc = cx_pool_allocator_create(tx_block, &rpc->alloc->iface),
+        .cid = 100,
+        .stats = {.last_rtt = -1, .last_active = metrics_now_us()},
+        .ping = {.sent = metrics_now_us(), .srtt = -1, .min = -1, .max = -1},
+        .serial = ++rpc->next_serial,
+    };
+    wrs_decoder_set_parse_allocator(new_client.dec, cx_pool_allocator_iface(new_client.rxalloc));
+    wrs_decoder_set_max_size(new_client.dec, wrs_rpc_max_msg_size(rpc));
+    if (rpc->wrs) {
+        wrs_decoder_set_check(new_client.dec, wrs_rpc_mem_check, rpc->wrs);
+    }
+    wrs_decoder_set_promote(new_client.dec, rpc->opts.rx_promote_len);
+    wrs_encoder_set_promote(new_client.enc, rpc->opts.tx_promote_len);
+    wrs_encoder_set_format(new_client.enc, format);
+    wrs_encoder_set_promote(new_client.callenc, rpc->opts.tx_promote_len);
+    wrs_encoder_set_format(new_client.callenc, format);
+
+    // Looks for empty slot in the connections array
+    *connid = SIZE_MAX;
+    for (size_t i = 0; i < arr_conn_len(&rpc->conns); i++) {
+        if (rpc->conns.data[i].conn == NULL) {
+            new_client.waiting = rpc->conns.data[i].waiting;
+            rpc->conns.data[i] = new_client;
+            *connid = i;
+            break;
+        }
+    }
+
+    // If empty slot not found, adds a new RpcClient to connections array
+    if (*connid == SIZE_MAX) {
+        arr_conn_push(&rpc->conns, new_client);
+        *connid = arr_conn_len(&rpc->conns)-1;
+    }
+    rpc->nconns++;
+    WRS_PROBE2(conn_open, rpc->url, *connid);
+
+exit:
+    UNLOCK(&rpc->lock);
+    return res;
+}
+
+// Starts closing WebSocket connection which didn't answer the keepalive pings.
+// Called by the server timer, which may run concurrently with the handlers of the
+// connection, so only the close frame is sent and the connection resources are
+// freed later by the close handler of the server.
+static void wrs_rpc_expire_conn(WrsRpc* rpc, size_t connid) {
+
+    RpcClient* client = &rpc->conns.data[connid];
+    client->closing = true;
+    client->writing = true;
+    metrics_add(&rpc->metrics->expired, 1);
+    wrs_rpc_write_unlocked(rpc, connid, MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE, NULL, 0);
+    wrs_rpc_release(rpc, connid);
+}
+
+// Called with the endpoint locked to get exclusive write access to the connection,
+// waiting for the thread which has it, if any. The encoder of the calls, streams and
+// send queue head are only used with write access, which allows writing without
+// holding the endpoint lock. Write access must be returned with wrs_rpc_release().
+// Returns the connection client or NULL if the connection is closed or closing.
+static RpcClient* wrs_rpc_acquire(WrsRpc* rpc, size_t connid) {
+
+    while (connid < arr_conn_len(&rpc->conns)) {
+        RpcClient* client = &rpc->conns.data[connid];
+        if (client->conn == NULL || client->closing) {
+            return NULL;
+        }
+        if (!client->writing) {
+            client->writing = true;
+            return client;
+        }
+        client->waiting++;
+        WAIT(&rpc->lock, &rpc->wcond);
+        rpc->conns.data[connid].waiting--;
+    }
+    return NULL;
+}
+
+// Called with the endpoint locked and write access to the connection
+// to write a message without holding the endpoint lock during the blocking write.
+// Returns the result of the transport write.
+static int wrs_rpc_write_unlocked(WrsRpc* rpc, size_t connid, int opcode, const void* data, size_t len) {
+
+    RpcClient* client = &rpc->conns.data[connid];
+    void* conn = client->conn;
+    const RpcTransport* tp = client->tp;
+    UNLOCK(&rpc->lock);
+    const int res = tp->write(conn, opcode, data, len);
+    LOCK(&rpc->lock);
+    return res;
+}
+
+// Called with the endpoint locked to return the write access to the connection,
+// waking up the threads waiting to write or to close the connection and the
+// sender thread, which skips the queues of connections being written.
+// Returns the connection client, as the connections array may have been reallocated.
+static RpcClient* wrs_rpc_release(WrsRpc* rpc, size_t connid) {
+
+    RpcClient* client = &rpc->conns.data[connid];
+    client->writing = false;
+    CXCHKZ(pthread_cond_broadcast(&rpc->wcond));
+    if (client->txq.head) {
+        CXCHKZ(pthread_cond_signal(&rpc->txcond));
+    }
+    return client;
+}
+
+// Processes pong received from connection updating its round trip times.
+// Pongs which don't match the last ping sent are ignored.
+static void wrs_rpc_pong(RpcClient* client, const char* data, size_t len) {
+
+    RpcPing* ping = &client->ping;
+    uint64_t sent;
+    if (!ping->pending || len != sizeof(sent)) {
+        return;
+    }
+    memcpy(&sent, data, sizeof(sent));
+    if (sent != ping->sent) {
+        return;
+    }
+
+    // Smooths the round trip time as TCP (RFC 6298)
+    const int64_t rtt = metrics_now_us() - sent;
+    ping->pending = false;
+    ping->missed = 0;
+    ping->srtt = ping->srtt < 0 ? rtt : ping->srtt + (rtt - ping->srtt) / 8;
+    if (ping->min < 0 || rtt < ping->min) {
+        ping->min = rtt;
+    }
+    if (rtt > ping->max) {
+        ping->max = rtt;
+    }
+}
+
 // Frees all connection allocated resources 
-static void wrs_rpc_free_conn(RpcClient* client) {
+static void wrs_rpc_free_conn(WrsRpc* rpc, RpcClient* client) {
 
+    if (client->tp == &wrs_loopback_transport) {
+        cx_alloc_free(&rpc->alloc->iface, client->conn, sizeof(LoopbackConn));
+    }
     client->conn = NULL;
-    arru8_free(&client->rxbytes);
     cx_pool_allocator_destroy(client->txalloc);
-    cx_pool_allocator_destroy(client->rxalloc);
+    cx_pool_allocator_destroy(client->callalloc);
+    if (client->rxtaken) {
+        wrs_rpc_storage_release(client->rxtaken);
+        client->rxtaken = NULL;
+    } else {
+        cx_pool_allocator_destroy(client->rxalloc);
+    }
     wrs_decoder_del(client->dec);
     wrs_encoder_del(client->enc);
-    map_resp_free(&client->responses);
+    wrs_encoder_del(client->callenc);
+    cx_alloc_free(&rpc->alloc->iface, client->responses.slots, client->responses.cap * sizeof(ResponseInfo));
+    client->responses = (RespTable){0};
+    while (client->txq.head) {
+        wrs_rpc_txq_pop(rpc, &client->txq);
+    }
+    client->txq = (RpcTxQueue){0};
+    while (client->streams) {
+        wrs_rpc_stream_del(rpc, client, client->streams);
+    }
 }
 
+// Calls remote function of the specified connection.
+// If 'serial' is not zero, the connection must have this serial number.
+static CxError wrs_rpc_call_conn(WrsRpc* rpc, size_t connid, uint64_t serial, const char* remote_name, CxVar* params,
+    WrsResponseFn cb, WrsPriority prio) {
+
+    LOCK(&rpc->lock);
+    CxError error = {0};
+    RpcClient* client = NULL;
+
+    // Checks if this connection id is valid
+    if (connid >= arr_conn_len(&rpc->conns)) {
+        WRS_LOGW("%s: connection:%zu is invalid", __func__, connid);
+        error = CXERR("invalid connection id");
+        goto exit;
+    }
+
+    // Gets write access to the connection, which is not given for closed
+    // connections or connections being closed by the keepalive.
+    client = wrs_rpc_acquire(rpc, connid);
+    if (client == NULL) {
+        WRS_LOGW("%s: connection:%zu closed with no associated client", __func__, connid);
+        error = CXERR("connection id is closed");
+        goto exit;
+    }
+
+    // Checks if the connection was replaced by a new connection with the same id
+    if (serial && client->serial != serial) {
+        error = CXERR("connection id is closed");
+        goto exit;
+    }
+  
+    // Creates message envelope in the connection call pool
+    CxVar* msg = cx_var_new(cx_pool_allocator_iface(client->callalloc));
+    cx_var_set_map(msg);
+    int64_t cid = client->cid;
+    cx_var_set_map_int(msg, "cid", cid);
+    cx_var_set_map_str(msg, "call", remote_name);
+    CxVar* msg_params = cx_var_set_map_map(msg, "params");
+    // Copy user parameters to message
+    cx_var_cpy_val(params, msg_params);
+    client->cid++;
+
+    // Encodes message and free
+    uint64_t tstart = trace_begin();
+    error = wrs_encoder_enc(client->callenc, msg);
+    trace_end("encode", tstart, connid, cid, remote_name);
+    cx_pool_allocator_clear(client->callalloc);
+    if (error.code) {
+        goto exit;
+    }
+
+    // Get encoded message type and buffer
+    bool text;
+    size_t len;
+    void* encoded = wrs_encoder_get_msg(client->callenc, &text, &len);
+
+    // If callback supplied, saves information to map response to the callback.
+    // Saved before writing, as the endpoint is unlocked during the write.
+    if (cb) {
+        ResponseInfo rinfo = {.cid = cid, .fn = cb, .time = metrics_now_us()};
+        wrs_rpc_resp_set(&rpc->alloc->iface, &client->responses, rinfo);
+        //WRS_LOGD("%s: map_resp_len:%zu", __func__, map_resp_count(&client->responses));
+    }
+
+    // Sends message to remote client
+    tstart = trace_begin();
+    int res = wrs_rpc_write(rpc, connid, prio, text, encoded, len);
+    trace_end("write", tstart, connid, cid, remote_name);
+    client = &rpc->conns.data[connid];
+    if (res <= 0) {
+        WRS_LOGE("%s: error:%d writing message", __func__, res);
+        error = CXERR("error writing message");
+        if (cb) {
+            wrs_rpc_resp_del(&client->responses, cid);
+        }
+        goto exit;
+    }
+    if (cb) {
+        trace_async("call", TRACE_ASYNC_BEGIN, connid, cid);
+    }
+    metrics_add(&rpc->metrics->msgs_out, 1);
+    metrics_add(&rpc->metrics->bytes_out, len);
+    wrs_rpc_stats_sent(client, len);
+    WRS_PROBE4(call_sent, connid, cid, remote_name, len);
+
+exit:
+    if (client) {
+        wrs_rpc_release(rpc, connid);
+    }
+    UNLOCK(&rpc->lock);
+    return error;
+}
+
+// Writes encoded message to the connection or queues it to be written by the sender thread.
+// High priority messages are always written directly. Normal priority messages larger
+// than the fragment size or sent while other messages are queued for the connection
+// are queued, so they can be interleaved with high priority messages.
+// Must be called with the endpoint locked and write access to the connection.
+// Messages are written directly with the endpoint unlocked and queued messages are copied.
+// Connections whose queue would exceed the maximum queued bytes or the server memory
+// budget are closed by their next received message.
+// Returns > 0 if the message was written or queued or <= 0 on errors.
+static int wrs_rpc_write(WrsRpc* rpc, size_t connid, WrsPriority prio, bool text, const void* data, size_t len) {
+
+    RpcClient* client = &rpc->conns.data[connid];
+    const size_t frag_size = rpc->opts.frag_size;
+    if (prio == WrsPriorityHigh || frag_size == 0 || !client->tp->fragment ||
+        (len <= frag_size && client->txq.head == NULL)) {
+        return wrs_rpc_write_unlocked(rpc, connid, text ? MG_WEBSOCKET_OPCODE_TEXT : MG_WEBSOCKET_OPCODE_BINARY, data, len);
+    }
+
+    // Starts the sender thread when the first message is queued
+    if (!rpc->txstarted) {
+        if (pthread_create(&rpc->sender, NULL, wrs_rpc_sender, rpc)) {
+            WRS_LOGE("%s: error creating sender thread", __func__);
+            return -1;
+        }
+        rpc->txstarted = true;
+    }
+
+    // Limits the bytes queued by slow connections
+    RpcTxQueue* txq = &client->txq;
+    const size_t max_queued = rpc->opts.max_tx_queued ? rpc->opts.max_tx_queued : MAX_TX_QUEUED;
+    if (txq->bytes + len > max_queued || (rpc->wrs && !wrs_mem_check(rpc->wrs, len))) {
+        WRS_LOGE_RL(1000, "%s: closing connid:%zu with %zu bytes queued", __func__, connid, txq->bytes);
+        client->closing = true;
+        return -1;
+    }
+
+    // Appends copy of the message to the connection queue
+    TxMsg* msg = cx_alloc_malloc(&rpc->alloc->iface, sizeof(TxMsg) + len);
+    if (msg == NULL) {
+        WRS_LOGE("%s: error allocating queued message", __func__);
+        return -1;
+    }
+    *msg = (TxMsg){.len = len, .id = client->txq.next_id++, .text = text};
+    memcpy(msg->data, data, len);
+    if (txq->head == NULL) {
+        txq->head = msg;
+    } else {
+        txq->tail->next = msg;
+    }
+    txq->tail = msg;
+    txq->bytes += len;
+    CXCHKZ(pthread_cond_signal(&rpc->txcond));
+    return 1;
+}
+
+// Sender thread which writes the queued messages in fragments
+static void* wrs_rpc_sender(void* arg) {
+
+    WrsRpc* rpc = arg;
+    LOCK(&rpc->lock);
+    while (!rpc->txstop) {
+        if (!wrs_rpc_send_round(rpc)) {
+            WAIT(&rpc->lock, &rpc->txcond);
+        }
+    }
+    UNLOCK(&rpc->lock);
+    return NULL;
+}
+
+// Runs one deficit round robin round over the connections with queued messages.
+// Each connection receives a quantum of the fragment size, so the connections
+// with large messages queued get the same share of the sender thread.
+// Each message or fragment is written with the endpoint unlocked, allowing
+// other threads to write high priority messages between the fragments.
+// Connections being written or waited for by other threads are skipped until
+// they are released, so the direct writes are not delayed by the queued messages.
+// Returns false if no connection with queued messages could be written.
+static bool wrs_rpc_send_round(WrsRpc* rpc) {
+
+    bool served = false;
+    for (size_t connid = 0; connid < arr_conn_len(&rpc->conns) && !rpc->txstop; connid++) {
+        RpcClient* client = &rpc->conns.data[connid];
+        if (client->conn == NULL || client->txq.head == NULL || client->writing || client->waiting || client->closing) {
+            continue;
+        }
+        served = true;
+        client->txq.deficit += rpc->opts.frag_size ? rpc->opts.frag_size : client->txq.head->len;
+        while (client->conn && client->txq.head && !client->writing && !client->waiting && !client->closing && !rpc->txstop) {
+            const size_t cost = wrs_rpc_send_next(rpc, connid);
+            // The connections array may have been reallocated
+            client = &rpc->conns.data[connid];
+            if (cost == 0) {
+                break;
+            }
+            client->txq.deficit -= cost;
+        }
+        if (client->conn == NULL || client->txq.head == NULL) {
+            client->txq.deficit = 0;
+        }
+    }
+    return served;
+}
+
+// Writes the next message or message fragment of the connection queue
+// if the connection deficit allows it.
+// Must be called with the endpoint locked for a connection not being written.
+// Returns the number of message bytes written or 0 if the deficit is not enough.
+static size_t wrs_rpc_send_next(WrsRpc* rpc, size_t connid) {
+
+    RpcClient* client = &rpc->conns.data[connid];
+    RpcTxQueue* txq = &client->txq;
+    TxMsg* msg = txq->head;
+    const size_t frag_size = rpc->opts.frag_size ? rpc->opts.frag_size : msg->len;
+
+    // Messages which fit in one fragment are written complete
+    int opcode;
+    const void* data;
+    size_t len;
+    size_t n;
+    if (msg->sent == 0 && msg->len <= frag_size) {
+        n = msg->len;
+        if (txq->deficit < n) {
+            return 0;
+        }
+        opcode = msg->text ? MG_WEBSOCKET_OPCODE_TEXT : MG_WEBSOCKET_OPCODE_BINARY;
+        data = msg->data;
+        len = n;
+    } else {
+        n = msg->len - msg->sent < frag_size ? msg->len - msg->sent : frag_size;
+        if (txq->deficit < n) {
+            return 0;
+        }
+        if (rpc->txbuf_len < frag_size + WRS_FRAG_OVERHEAD) {
+            if (rpc->txbuf) {
+                cx_alloc_free(rpc->base_alloc, rpc->txbuf, rpc->txbuf_len);
+            }
+            rpc->txbuf_len = frag_size + WRS_FRAG_OVERHEAD;
+            rpc->txbuf = cx_alloc_malloc(rpc->base_alloc, rpc->txbuf_len);
+        }
+        const WrsFrag frag = {
+            .id = msg->id,
+            .flags = (msg->sent == 0 ? WRS_FRAG_FIRST : 0) | (msg->sent + n == msg->len ? WRS_FRAG_LAST : 0) |
+                (msg->text ? WRS_FRAG_TEXT : 0),
+            .data = msg->data + msg->sent,
+            .len = n,
+        };
+        opcode = MG_WEBSOCKET_OPCODE_BINARY;
+        data = rpc->txbuf;
+        len = wrs_frag_encode(rpc->txbuf, &frag);
+    }
+
+    // Writes with the endpoint unlocked. The queue head is only removed
+    // by this thread or after the connection write access is released.
+    client->writing = true;
+    const int res = wrs_rpc_write_unlocked(rpc, connid, opcode, data, len);
+    client = wrs_rpc_release(rpc, connid);
+    txq = &client->txq;
+
+    // Discards the message if it could not be written
+    if (res <= 0) {
+        WRS_LOGE_RL(1000, "%s: error:%d writing queued message to connid:%zu", __func__, res, connid);
+        wrs_rpc_txq_pop(rpc, txq);
+        return n;
+    }
+    msg->sent += n;
+    if (msg->sent == msg->len) {
+        wrs_rpc_txq_pop(rpc, txq);
+    }
+    return n;
+}
+
+// Removes and frees the first message of the send queue
+static void wrs_rpc_txq_pop(WrsRpc* rpc, RpcTxQueue* txq) {
+
+    TxMsg* msg = txq->head;
+    txq->head = msg->next;
+    txq->bytes -= msg->len;
+    cx_alloc_free(&rpc->alloc->iface, msg, sizeof(TxMsg) + msg->len);
+}
+
+// Returns the open stream with the specified id and its client or NULL.
+// Must be called with the endpoint locked.
+static RpcStream* wrs_rpc_stream_get(WrsRpc* rpc, size_t connid, size_t sid, RpcClient** client) {
+
+    if (connid >= arr_conn_len(&rpc->conns) || rpc->conns.data[connid].conn == NULL) {
+        return NULL;
+    }
+    *client = &rpc->conns.data[connid];
+    for (RpcStream* st = (*client)->streams; st; st = st->next) {
+        if (st->sid == sid) {
+            return st;
+        }
+    }
+    return NULL;
+}
+
+// Sends the frame kept in the stream buffer consuming one credit.
+// Must be called with the endpoint locked and write access to the connection.
+// Returns > 0 if the frame was written or queued or <= 0 on errors.
+static int wrs_rpc_stream_send(WrsRpc* rpc, size_t connid, RpcStream* st) {
+
+    st->pending = false;
+    st->credits--;
+    const int res = wrs_rpc_write(rpc, connid, WrsPriorityNormal, false, st->buf, st->len);
+    if (res > 0) {
+        st->sent++;
+        metrics_add(&rpc->metrics->msgs_out, 1);
+        metrics_add(&rpc->metrics->bytes_out, st->len);
+        wrs_rpc_stats_sent(&rpc->conns.data[connid], st->len);
+    }
+    return res;
+}
+
+// Processes stream message received from the client.
+// Called with the endpoint locked, which is unlocked to call the stream credit function.
+static void wrs_rpc_stream_handler(WrsRpc* rpc, size_t connid, const WrsStreamMsg* msg) {
+
+    if (wrs_rpc_acquire(rpc, connid) == NULL) {
+        return;
+    }
+    RpcClient* client;
+    RpcStream* st = wrs_rpc_stream_get(rpc, connid, msg->sid, &client);
+    WrsStreamFn cb = NULL;
+    size_t credits = 0;
+    if (st == NULL) {
+        // The stream may have been closed by the server
+    } else if (msg->kind == WRS_STREAM_CLOSE) {
+        wrs_rpc_stream_del(rpc, client, st);
+    } else if (msg->kind != WRS_STREAM_CREDIT) {
+        WRS_LOGW_RL(1000, "%s: invalid stream message kind:%u from connid:%zu", __func__, msg->kind, connid);
+    } else {
+        // Sends the latest frame pushed while the client had no credits
+        st->credits += msg->value;
+        if (st->pending && st->credits) {
+            wrs_rpc_stream_send(rpc, connid, st);
+        }
+        cb = st->cb;
+        credits = st->credits;
+    }
+    wrs_rpc_release(rpc, connid);
+
+    // The credit function may push frames to the stream
+    if (cb && credits) {
+        UNLOCK(&rpc->lock);
+        cb(rpc, connid, msg->sid, credits);
+        LOCK(&rpc->lock);
+    }
+}
+
+// Removes stream from the client list of streams and frees it
+static void wrs_rpc_stream_del(WrsRpc* rpc, RpcClient* client, RpcStream* st) {
+
+    RpcStream** prev = &client->streams;
+    while (*prev != st) {
+        prev = &(*prev)->next;
+    }
+    *prev = st->next;
+    if (st->buf) {
+        cx_alloc_free(&rpc->alloc->iface, st->buf, st->cap);
+    }
+    cx_alloc_free(&rpc->alloc->iface, st, sizeof(RpcStream));
+}
+
+// Clears the connection receive storage after a message was processed.
+// If the storage was detached by wrs_rpc_take_buf(), drops the connection
+// reference to it and creates a new receive storage.
+static void wrs_rpc_reset_rxalloc(WrsRpc* rpc, RpcClient* client) {
+
+    if (client->rxtaken == NULL) {
+        cx_pool_allocator_clear(client->rxalloc);
+        return;
+    }
+    wrs_rpc_storage_release(client->rxtaken);
+    client->rxtaken = NULL;
+    client->rxalloc = cx_pool_allocator_create(wrs_rpc_rx_block(rpc), &rpc->alloc->iface);
+    wrs_decoder_set_parse_allocator(client->dec, cx_pool_allocator_iface(client->rxalloc));
+}
+
+// Releases reference to detached receive storage
+static void wrs_rpc_storage_release(void* ctx) {
+
+    RxStorage* storage = ctx;
+    if (atomic_fetch_sub(&storage->refs, 1) == 1) {
+        RpcAlloc* alloc = storage->alloc;
+        cx_pool_allocator_destroy(storage->pool);
+        cx_alloc_free(&alloc->iface, storage, sizeof(RxStorage));
+        wrs_rpc_alloc_release(alloc);
+    }
+}
+
+// Releases reference to the metrics of a binding, freeing them
+// when the binding was removed and no call is in progress.
+static void wrs_rpc_bind_release(WrsRpc* rpc, BindMetrics* metrics) {
+
+    if (atomic_fetch_sub(&metrics->refs, 1) == 1) {
+        metrics_free(rpc->base_alloc, metrics, sizeof(BindMetrics));
+    }
+}
+
+// Releases reference to the counting allocator, freeing it with the
+// endpoint metrics when the last reference is dropped.
+static void wrs_rpc_alloc_release(RpcAlloc* alloc) {
+
+    if (atomic_fetch_sub(&alloc->refs, 1) == 1) {
+        metrics_free(alloc->base, alloc->metrics, sizeof(RpcMetrics));
+        cx_alloc_free(alloc->base, alloc, sizeof(RpcAlloc));
+    }
+}
+
+// Writes message to WebSocket connection
+static int wrs_rpc_ws_write(void* conn, int opcode, const void* data, size_t len) {
+
+    mg_lock_connection(conn);
+    int res = mg_websocket_write(conn, opcode, data, len);
+    mg_unlock_connection(conn);
+    return res;
+}
+
+// Writes message to IPC connection
+static int wrs_rpc_ipc_write(void* conn, int opcode, const void* data, size_t len) {
+
+    return ipc_conn_write(conn, opcode, data, len);
+}
+
+// Writes message to loopback connection passing it to the output function
+static int wrs_rpc_loopback_write(void* conn, int opcode, const void* data, size_t len) {
+
+    LoopbackConn* lconn = conn;
+    lconn->out(lconn->ctx, (opcode & WEBSOCKET_OP_MASK) == MG_WEBSOCKET_OPCODE_TEXT, data, len);
+    return 1;
+}
+
+// Creates and initializes the state of a new RPC endpoint
+// The endpoint state is allocated with the server allocator.
+static WrsRpc* wrs_rpc_new(Wrs* wrs, const char* url, size_t max_conns, WrsEventCallback cb) {
+
+    const CxAllocator* base_alloc = wrs ? &wrs->alloc : cx_def_allocator();
+    RpcAlloc* alloc = cx_alloc_malloc(base_alloc, sizeof(RpcAlloc));
+    *alloc = (RpcAlloc){
+        .iface = {
+            .ctx = alloc,
+            .alloc = wrs_rpc_alloc,
+            .free = wrs_rpc_free,
+            .resize = wrs_rpc_resize,
+        },
+        .base = base_alloc,
+        .metrics = metrics_alloc(base_alloc, sizeof(RpcMetrics)),
+    };
+    atomic_init(&alloc->refs, 1);
+    WrsRpc* rpc = cx_alloc_malloc(base_alloc, sizeof(WrsRpc));
+    *rpc = (WrsRpc) {
+        .wrs = wrs,
+        .base_alloc = base_alloc,
+        .url = cx_alloc_malloc(base_alloc, strlen(url) + 1),
+        .max_conns = max_conns,
+        .conns = arr_conn_init(base_alloc),
+        .binds = map_bind_init(base_alloc, 0),
+        .evcb = cb,
+        .metrics = alloc->metrics,
+        .alloc = alloc,
+    };
+    strcpy(rpc->url, url);
+    lock_init(&rpc->lock, rpc->url);
+    CXCHKZ(pthread_cond_init(&rpc->txcond, NULL));
+    CXCHKZ(pthread_cond_init(&rpc->wcond, NULL));
+    return rpc;
+}
+
+// Frees the state of a RPC endpoint with no connections
+static void wrs_rpc_del(WrsRpc* rpc) {
+
+    map_bind_iter iter = {0};
+    map_bind_entry* e;
+    while ((e = map_bind_next(&rpc->binds, &iter)) != NULL) {
+        wrs_rpc_bind_release(rpc, e->val.metrics);
+        cx_alloc_free(rpc->base_alloc, e->val.name, strlen(e->val.name) + 1);
+    }
+    map_bind_free(&rpc->binds);
+    arr_conn_free(&rpc->conns);
+    lock_destroy(&rpc->lock);
+    CXCHKZ(pthread_cond_destroy(&rpc->txcond));
+    CXCHKZ(pthread_cond_destroy(&rpc->wcond));
+    if (rpc->txbuf) {
+        cx_alloc_free(rpc->base_alloc, rpc->txbuf, rpc->txbuf_len);
+    }
+    wrs_rpc_alloc_release(rpc->alloc);
+    cx_alloc_free(rpc->base_alloc, rpc->url, strlen(rpc->url) + 1);
+    cx_alloc_free(rpc->base_alloc, rpc, sizeof(WrsRpc));
+}
+
+// Returns the block size of the receive memory pools
+static size_t wrs_rpc_rx_block(WrsRpc* rpc) {
+
+    return rpc->opts.rx_block_size ? rpc->opts.rx_block_size : POOL_BLOCK_SIZE;
+}
+
+// Returns the maximum size of the received messages.
+// The decoders allocate the chunk sizes declared by the clients, so they are always limited by default.
+static size_t wrs_rpc_max_msg_size(WrsRpc* rpc) {
+
+    if (rpc->opts.max_msg_size == 0) {
+        return MAX_MSG_SIZE;
+    }
+    return rpc->opts.max_msg_size == SIZE_MAX ? 0 : rpc->opts.max_msg_size;
+}
+
+// Checks the server memory budget before the decoder allocates the received fragments
+static bool wrs_rpc_mem_check(void* ctx, size_t size) {
+
+    return wrs_mem_check(ctx, size);
+}
+
+// Updates the connection statistics after a message was sent
+static void wrs_rpc_stats_sent(RpcClient* client, size_t len) {
+
+    RpcConnStats* stats = &client->stats;
+    atomic_fetch_add_explicit(&stats->msgs_out, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->bytes_out, len, memory_order_relaxed);
+    atomic_store_explicit(&stats->last_active, metrics_now_us(), memory_order_relaxed);
+    wrs_rpc_stats_max(&stats->tx_peak, wrs_encoder_capacity(client->enc) + wrs_encoder_capacity(client->callenc));
+}
+
+// Records slow call
+static void wrs_rpc_slow_call(WrsRpc* rpc, size_t connid, const char* name, size_t params_size, uint64_t wall_us, uint64_t cpu_us) {
+
+    LOCK(&rpc->lock);
+    rpc->nslow++;
+    WrsRpcSlowCall* rec = &rpc->slow[(rpc->nslow - 1) % RPC_SLOW_CALLS];
+    *rec = (WrsRpcSlowCall){
+        .seq = rpc->nslow,
+        .connid = connid,
+        .params_size = params_size,
+        .wall_us = wall_us,
+        .cpu_us = cpu_us,
+    };
+    strncat(rec->name, name, sizeof(rec->name) - 1);
+    UNLOCK(&rpc->lock);
+    WRS_LOGW_RL(1000, "%s: slow call of:%s connid:%zu params:%zu bytes wall:%"PRIu64"us cpu:%"PRIu64"us",
+        __func__, name, connid, params_size, wall_us, cpu_us);
+}
+
+// Updates peak value
+static void wrs_rpc_stats_max(_Atomic size_t* peak, size_t value) {
+
+    size_t curr = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > curr && !atomic_compare_exchange_weak_explicit(peak, &curr, value,
+        memory_order_relaxed, memory_order_relaxed)) {
+        ;
+    }
+}
+
+// Writes the values of one counter of all the endpoints
+static void wrs_rpc_write_counter(FILE* f, WrsRpc** rpcs, size_t count, const char* name, const char* help, size_t offset) {
+
+    metrics_write_header(f, name, "counter", help);
+    for (size_t i = 0; i < count; i++) {
+        const MetricsCounter* c = (const MetricsCounter*)((char*)rpcs[i]->metrics + offset);
+        fprintf(f, "%s{endpoint=", name);
+        metrics_write_label(f, rpcs[i]->url);
+        fprintf(f, "} %"PRIu64"\n", metrics_get(c));
+    }
+}
+
+// Allocates memory for the connections with the server allocator counting the allocation
+static void* wrs_rpc_alloc(void* ctx, size_t size) {
+
+    RpcAlloc* alloc = ctx;
+    metrics_add(&alloc->metrics->allocs, 1);
+    return cx_alloc_malloc(alloc->base, size);
+}
+
+static void wrs_rpc_free(void* ctx, void* p, size_t size) {
+
+    RpcAlloc* alloc = ctx;
+    cx_alloc_free(alloc->base, p, size);
+}
+
+static void* wrs_rpc_resize(void* ctx, void* p, size_t old_size, size_t size) {
+
+    RpcAlloc* alloc = ctx;
+    metrics_add(&alloc->metrics->allocs, 1);
+    return cx_alloc_realloc(alloc->base, p, old_size, size);
+}
+
+// Returns the pending response info for the specified call id or NULL if not found
+static ResponseInfo* wrs_rpc_resp_get(RespTable* t, uint64_t cid) {
+
+    if (t->count == 0) {
+        return NULL;
+    }
+    const size_t mask = t->cap - 1;
+    for (size_t i = cid & mask; t->slots[i].cid; i = (i + 1) & mask) {
+        if (t->slots[i].cid == cid) {
+            return &t->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Saves pending response info, doubling the table when it is half full
+static void wrs_rpc_resp_set(const CxAllocator* alloc, RespTable* t, ResponseInfo info) {
+
+    if ((t->count + 1) * 2 > t->cap) {
+        const size_t cap = t->cap ? t->cap * 2 : MIN_RESP_SLOTS;
+        RespTable nt = {.slots = cx_alloc_mallocz(alloc, cap * sizeof(ResponseInfo)), .cap = cap};
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].cid) {
+                wrs_rpc_resp_set(alloc, &nt, t->slots[i]);
+            }
+        }
+        cx_alloc_free(alloc, t->slots, t->cap * sizeof(ResponseInfo));
+        *t = nt;
+    }
+    const size_t mask = t->cap - 1;
+    size_t i = info.cid & mask;
+    while (t->slots[i].cid) {
+        i = (i + 1) & mask;
+    }
+    t->slots[i] = info;
+    t->count++;
+}
+
+// Removes pending response info, moving back the following entries
+// of the same probe sequence to keep them reachable.
+static void wrs_rpc_resp_del(RespTable* t, uint64_t cid) {
+
+    ResponseInfo* info = wrs_rpc_resp_get(t, cid);
+    if (info == NULL) {
+        return;
+    }
+    const size_t mask = t->cap - 1;
+    size_t hole = info - t->slots;
+    for (size_t i = (hole + 1) & mask; t->slots[i].cid; i = (i + 1) & mask) {
+        // Moves the entry to the hole if the hole is between its home slot and its current slot
+        const size_t home = t->slots[i].cid & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole] = (ResponseInfo){0};
+    t->count--;
+}
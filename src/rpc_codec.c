@@ -42,6 +42,39 @@
             - data
             - padding to align to multiple of 4
 
+    If the client negotiates the "wrs.pack" WebSocket subprotocol, the message
+    is encoded with MessagePack instead of JSON and sent as a binary message
+    with a single WrsChunkPack chunk. Buffers are embedded as MessagePack
+    'bin' objects, so no buffer chunks or buffer string replacement are used.
+    Supported MessagePack types are: nil, bool, int, float, str, bin, array and
+    map with string keys.
+
+    Large encoded messages may be sent in application level fragments, each one
+    a binary message with a single WrsChunkFrag chunk:
+        - type (uint32_t)
+        - size (uint32_t)
+        - message id (uint32_t)
+        - flags (uint32_t): first, last and text message
+        - fragment of the encoded message
+        - padding to align to multiple of 4
+    The receiver concatenates the fragments of the message and decodes it as
+    a text or binary message.
+
+    Stream messages skip the call and response envelope and are binary
+    messages with a single WrsChunkStream chunk:
+        - type (uint32_t)
+        - size (uint32_t)
+        - stream id (uint32_t)
+        - kind (uint32_t): open, data, credit or close
+        - value (uint32_t): frame sequence number or number of credits
+        - stream name or frame payload
+        - padding to align to multiple of 4
+
+    Optionally numeric arrays with a minimum number of elements may be promoted
+    to float64 buffers. The encoder sends these arrays as buffers and the decoder
+    parses received numeric arrays directly into buffers, which are much cheaper
+    to process than CxVar arrays of numbers.
+
 */
 #include <stddef.h>
 #include <stdio.h>
@@ -49,6 +82,7 @@
 #include "cx_var.h"
 #include "cx_json_build.h"
 #include "cx_json_parse.h"
+#include "rpc_codec.h"
 
 // Define internal array for encoded binary data
 #define cx_array_name cxarr_u8
@@ -72,6 +106,35 @@ typedef struct BufInfo {
 #define cx_array_static
 #include "cx_array.h"
 
+// Describe a promoted numeric array in the decoder storage
+typedef struct PromInfo {
+    size_t  offset;     // Offset of the first element in the storage
+    size_t  len;        // Length in bytes
+} PromInfo;
+
+// Define internal array of promoted arrays info
+#define cx_array_name cxarr_prom
+#define cx_array_type PromInfo
+#define cx_array_implement
+#define cx_array_instance_allocator
+#define cx_array_static
+#include "cx_array.h"
+
+// Chunk of incrementally decoded message
+typedef struct StreamChunk {
+    uint32_t    type;       // Chunk type
+    uint32_t    len;        // Chunk length in bytes
+    uint8_t*    data;       // Chunk data allocated with exact length
+} StreamChunk;
+
+// Define internal array of incrementally decoded chunks
+#define cx_array_name cxarr_chunk
+#define cx_array_type StreamChunk
+#define cx_array_implement
+#define cx_array_instance_allocator
+#define cx_array_static
+#include "cx_array.h"
+
 // Define internal array of CxVar*
 #define cx_array_name cxarr_var
 #define cx_array_type CxVar*
@@ -89,28 +152,65 @@ typedef struct ChunkHeader {
 // Encoder state
 typedef struct WrsEncoder {
     const CxAllocator* alloc;
+    WrsFormat   format;     // Envelope format
+    size_t      promote_len;// Minimum length of numeric arrays encoded as buffers
     cxarr_u8    encoded;    // Buffer with encoded message chunks
     cxarr_buf   buffers;    // Array of buffers to encode
+    cxarr_u8    bufdata;    // Data of the buffers to encode, kept between messages
 } WrsEncoder;
 
+// JSON envelope scanner state
+typedef struct JsonScanner {
+    const char*     curr;   // Current scan position
+    const char*     last;   // End of data
+} JsonScanner;
+
+// MessagePack reader state
+typedef struct PackReader {
+    const uint8_t*  curr;   // Current read position
+    const uint8_t*  last;   // End of data
+} PackReader;
+
 
 #define BUFFER_PREFIX   "\b\b\b\b\b\b"
+#define BUFFER_PREFIX_JSON "\\b\\b\\b\\b\\b\\b"  // BUFFER_PREFIX escaped as JSON string
 #define CHUNK_ALIGNMENT sizeof(uint32_t)
+#define PACK_MAX_DEPTH  64
 
 static int enc_writer(void* ctx, const void* data, size_t len);
 static void enc_json_replacer(CxVar* val, void* userdata);
 static uintptr_t align_forward(uintptr_t ptr, size_t align);
 static void add_padding(WrsEncoder*e, size_t align);
 static void dec_json_replacer(CxVar* val, void* userdata);
-
-#include "rpc_codec.h"
+static void enc_pack_var(WrsEncoder* e, const CxVar* var);
+static CxError dec_pack_val(WrsDecoder* d, PackReader* r, CxVar* var, int depth);
+static bool pack_read_num(PackReader* r, double* val);
+static CxError dec_chunks(WrsDecoder* d, const void* data, size_t len, WrsFormat* format, const void** msg_data, size_t* msg_len);
+static CxError dec_json(WrsDecoder* d, const void* data, size_t len, CxVar* var);
+static CxError dec_pack(WrsDecoder* d, const void* data, size_t len, CxVar* var);
+static CxError scan_json(WrsDecoder* d, const void* data, size_t len, WrsEnvelope* env);
+static bool json_unescape(const char* src, size_t len, cxarr_u8* out);
+static CxError scan_pack(WrsDecoder* d, const void* data, size_t len, WrsEnvelope* env);
+static bool pack_read(PackReader* r, size_t nbytes, uint64_t* val);
+static bool pack_read_int(PackReader* r, int64_t* val);
+static bool arr_is_numeric(const CxVar* var, size_t min_len, size_t* len);
+static double var_get_number(const CxVar* var);
+static void arr_push_numbers(const CxVar* var, size_t len, cxarr_u8* out);
+static void dec_promote(WrsDecoder* d, const void** data, size_t* len);
+static const char* pack_read_key(WrsDecoder* d, PackReader* r);
+static size_t field_chunk_encode(void* dst, WrsChunkType type, const uint32_t* fields, size_t nfields, const void* data, size_t len);
+static bool field_chunk_decode(const void* src, size_t src_len, WrsChunkType type, uint32_t* fields, size_t nfields,
+    const void** data, size_t* len);
 
 WrsEncoder* wrs_encoder_new(const CxAllocator* alloc) {
 
     WrsEncoder* e = cx_alloc_malloc(alloc, sizeof(WrsEncoder));
     e->alloc = alloc;
+    e->format = WrsFormatJson;
+    e->promote_len = 0;
     e->encoded = cxarr_u8_init(alloc); 
     e->buffers = cxarr_buf_init(alloc);
+    e->bufdata = cxarr_u8_init(alloc);
     return e;
 }
 
@@ -118,6 +218,7 @@ void wrs_encoder_del(WrsEncoder* e) {
 
     cxarr_u8_free(&e->encoded);
     cxarr_buf_free(&e->buffers);
+    cxarr_u8_free(&e->bufdata);
     cx_alloc_free(e->alloc, e, sizeof(WrsEncoder));
 }
 
@@ -125,6 +226,17 @@ void wrs_encoder_clear(WrsEncoder* e) {
 
     cxarr_u8_clear(&e->encoded);
     cxarr_buf_clear(&e->buffers);
+    cxarr_u8_clear(&e->bufdata);
+}
+
+void wrs_encoder_set_format(WrsEncoder* e, WrsFormat format) {
+
+    e->format = format;
+}
+
+void wrs_encoder_set_promote(WrsEncoder* e, size_t min_len) {
+
+    e->promote_len = min_len;
 }
 
 CxError wrs_encoder_enc(WrsEncoder* e, CxVar* msg) {
@@ -132,6 +244,19 @@ CxError wrs_encoder_enc(WrsEncoder* e, CxVar* msg) {
     // Clear the internal buffers
     cxarr_u8_clear(&e->encoded);
     cxarr_buf_clear(&e->buffers);
+    cxarr_u8_clear(&e->bufdata);
+
+    // MessagePack messages consist of a single chunk with the
+    // buffers embedded as 'bin' objects.
+    if (e->format == WrsFormatPack) {
+        ChunkHeader header = {.type = WrsChunkPack };
+        cxarr_u8_pushn(&e->encoded, (uint8_t*)&header, sizeof(ChunkHeader));
+        enc_pack_var(e, msg);
+        uint32_t msg_size = cxarr_u8_len(&e->encoded) - sizeof(ChunkHeader);
+        ((ChunkHeader*)e->encoded.data)->size = msg_size;
+        add_padding(e, CHUNK_ALIGNMENT);
+        return CXOK();
+    }
 
     // Write JSON chunk header
     ChunkHeader header = {.type = WrsChunkMsg };
@@ -152,7 +277,9 @@ CxError wrs_encoder_enc(WrsEncoder* e, CxVar* msg) {
     ((ChunkHeader*)e->encoded.data)->size = msg_size;
     add_padding(e, CHUNK_ALIGNMENT);
 
-    // Appends binary buffers to encoded data
+    // Appends binary buffers to encoded data.
+    // The buffers data are stored consecutively in the buffers storage.
+    size_t offset = 0;
     for (size_t i = 0; i < cxarr_buf_len(&e->buffers); i++) {
 
         // Writes the chunk header
@@ -161,14 +288,9 @@ CxError wrs_encoder_enc(WrsEncoder* e, CxVar* msg) {
         cxarr_u8_pushn(&e->encoded, (uint8_t*)&header, sizeof(ChunkHeader));
 
         // Writes the chunk data and padding
-        cxarr_u8_pushn(&e->encoded, (uint8_t*)buf->data, buf->len);
+        cxarr_u8_pushn(&e->encoded, e->bufdata.data + offset, buf->len);
         add_padding(e, CHUNK_ALIGNMENT);
-    }
-
-    // Free binary buffers
-    for (size_t i = 0; i < cxarr_buf_len(&e->buffers); i++) {
-        BufInfo* buf = &e->buffers.data[i];
-        cx_alloc_free(e->alloc, buf->data, buf->len);
+        offset += buf->len;
     }
 
     return CXOK();
@@ -185,7 +307,7 @@ void* wrs_encoder_get_msg(WrsEncoder* e, bool* text, size_t* len) {
 
     // If no binary buffers present, this is a text message.
     // Get its length from the chunk header.
-    if (cxarr_buf_len(&e->buffers) == 0) {
+    if (e->format == WrsFormatJson && cxarr_buf_len(&e->buffers) == 0) {
         *text = true;
         *len = *(uint32_t*)(&e->encoded.data[4]);
         return e->encoded.data + sizeof(ChunkHeader);
@@ -198,15 +320,49 @@ void* wrs_encoder_get_msg(WrsEncoder* e, bool* text, size_t* len) {
     return NULL;
 }
 
+size_t wrs_encoder_capacity(WrsEncoder* e) {
+
+    return cxarr_u8_cap(&e->encoded) + cxarr_u8_cap(&e->bufdata) +
+        cxarr_buf_cap(&e->buffers) * sizeof(e->buffers.data[0]);
+}
+
 //-----------------------------------------------------------------------------
 // Decoder
 //-----------------------------------------------------------------------------
 
+// Incremental decoder states
+typedef enum {
+    StreamHeader,               // Receiving chunk header
+    StreamPayload,              // Receiving chunk payload
+    StreamPadding,              // Receiving chunk padding
+} StreamState;
+
 // Decoder state
 typedef struct WrsDecoder {
     const CxAllocator* alloc;   // Custom allocator
+    const CxAllocator* parse_alloc; // Allocator of the JSON parser
     cxarr_buf   buffers;        // Array of decoded buffers
     cxarr_var   vars;           // Array of CxVar buffers
+    cxarr_u8    scratch;        // Scratch buffer for MessagePack strings and numbers
+    size_t      promote_len;    // Minimum length of numeric arrays decoded as buffers
+    cxarr_u8    promoted;       // Storage for promoted numeric arrays
+    cxarr_prom  proms;          // Promoted arrays found in last JSON value
+    cxarr_u8    text;           // JSON text with promoted arrays replaced
+    cxarr_u8    call;           // Unescaped call name of the last scanned JSON message
+    size_t      max_size;       // Maximum message size in bytes (0 for no limit)
+    WrsDecoderCheckFn check;    // Optional check of the fragment allocations
+    void*       check_ctx;      // Context of the check function
+    struct {
+        bool        text;       // Incrementally decoded message is text
+        cxarr_u8    rxtext;     // Received text message fragments
+        cxarr_chunk chunks;     // Received binary message chunks
+        size_t      size;       // Declared size of received chunks
+        StreamState state;      // Current state
+        uint8_t     header[sizeof(ChunkHeader)]; // Partially received chunk header
+        size_t      header_len; // Number of bytes received of chunk header
+        uint8_t*    dst;        // Destination of next chunk payload bytes
+        size_t      remaining;  // Remaining bytes of current state
+    } stream;
 } WrsDecoder;
 
 
@@ -214,8 +370,24 @@ WrsDecoder* wrs_decoder_new(const CxAllocator* alloc) {
 
     WrsDecoder* d = cx_alloc_malloc(alloc, sizeof(WrsDecoder));
     d->alloc = alloc;
+    d->parse_alloc = alloc;
     d->buffers = cxarr_buf_init(alloc);
     d->vars = cxarr_var_init(alloc);
+    d->scratch = cxarr_u8_init(alloc);
+    d->promote_len = 0;
+    d->promoted = cxarr_u8_init(alloc);
+    d->proms = cxarr_prom_init(alloc);
+    d->text = cxarr_u8_init(alloc);
+    d->call = cxarr_u8_init(alloc);
+    d->max_size = 0;
+    d->check = NULL;
+    d->check_ctx = NULL;
+    d->stream.text = false;
+    d->stream.rxtext = cxarr_u8_init(alloc);
+    d->stream.chunks = cxarr_chunk_init(alloc);
+    d->stream.size = 0;
+    d->stream.state = StreamHeader;
+    d->stream.header_len = 0;
     return d;
 }
 
@@ -223,6 +395,14 @@ void wrs_decoder_del(WrsDecoder* d) {
 
     cxarr_buf_free(&d->buffers);
     cxarr_var_free(&d->vars);
+    cxarr_u8_free(&d->scratch);
+    cxarr_u8_free(&d->promoted);
+    cxarr_prom_free(&d->proms);
+    cxarr_u8_free(&d->text);
+    cxarr_u8_free(&d->call);
+    wrs_decoder_release(d);
+    cxarr_u8_free(&d->stream.rxtext);
+    cxarr_chunk_free(&d->stream.chunks);
     cx_alloc_free(d->alloc, d, sizeof(WrsDecoder));
 }
 
@@ -232,83 +412,269 @@ void wrs_decoder_clear(WrsDecoder* d) {
     cxarr_var_clear(&d->vars);
 }
 
+void wrs_decoder_set_max_size(WrsDecoder* d, size_t max_size) {
+
+    d->max_size = max_size;
+}
+
+void wrs_decoder_set_check(WrsDecoder* d, WrsDecoderCheckFn fn, void* ctx) {
+
+    d->check = fn;
+    d->check_ctx = ctx;
+}
+
+void wrs_decoder_set_promote(WrsDecoder* d, size_t min_len) {
+
+    d->promote_len = min_len;
+}
+
+void wrs_decoder_set_parse_allocator(WrsDecoder* d, const CxAllocator* alloc) {
+
+    d->parse_alloc = alloc ? alloc : d->alloc;
+}
+
 CxError wrs_decoder_dec(WrsDecoder* d, bool text, void* data, size_t len, CxVar* msg) {
 
-    // Sets the configuration for JSON parser
-    CxJsonParseCfg cfg = {
-        .alloc = d->alloc,
-        .replacer_fn = dec_json_replacer,
-        .replacer_data = d,
-    };
+    cxarr_buf_clear(&d->buffers);
+    cxarr_var_clear(&d->vars);
+    if (d->max_size && len > d->max_size) {
+        return CXERR("maximum message size exceeded");
+    }
 
     // Text messages only contains a JSON string
     if (text) {
-        return cx_json_parse(data, len, msg, &cfg);
+        return dec_json(d, data, len, msg);
     }
 
+    // Get the message chunk and the buffer chunks
+    WrsFormat format;
+    const void* msg_data;
+    size_t msg_len;
+    CXERR_RET(dec_chunks(d, data, len, &format, &msg_data, &msg_len));
+    if (format == WrsFormatPack) {
+        return dec_pack(d, msg_data, msg_len, msg);
+    }
+    return dec_json(d, msg_data, msg_len, msg);
+}
+
+CxError wrs_decoder_scan(WrsDecoder* d, bool text, void* data, size_t len, WrsEnvelope* env) {
+
     cxarr_buf_clear(&d->buffers);
     cxarr_var_clear(&d->vars);
+    *env = (WrsEnvelope){.format = WrsFormatJson};
+    if (d->max_size && len > d->max_size) {
+        return CXERR("maximum message size exceeded");
+    }
 
-    // Decode the message chunks in any order
-    void* last = data + len;
-    void* curr = data;
-    bool json = false;
-    while (curr < last) {
-        // Checks available size for chunk header
-        if (curr + sizeof(uint32_t)*2 > last) {
-            return CXERR("chunk size size exceeded");
-        }
+    // Get the message chunk and the buffer chunks of binary messages
+    const void* msg_data = data;
+    size_t msg_len = len;
+    if (!text) {
+        CXERR_RET(dec_chunks(d, data, len, &env->format, &msg_data, &msg_len));
+    }
+    if (env->format == WrsFormatPack) {
+        return scan_pack(d, msg_data, msg_len, env);
+    }
+    return scan_json(d, msg_data, msg_len, env);
+}
 
-        // Get the chunk type and length in bytes
-        uint32_t chunk_type = *(uint32_t*)curr;
-        curr += sizeof(uint32_t);
-        uint32_t chunk_len = *(uint32_t*)curr;
-        curr += sizeof(uint32_t);
+void wrs_decoder_begin(WrsDecoder* d, bool text) {
 
-        // Checks available size for chunk data
-        if (curr + chunk_len > last) {
-            return CXERR("chunk size size exceeded");
+    wrs_decoder_release(d);
+    d->stream.text = text;
+    d->stream.size = 0;
+    d->stream.state = StreamHeader;
+    d->stream.header_len = 0;
+}
+
+CxError wrs_decoder_feed(WrsDecoder* d, const void* data, size_t len) {
+
+    // Text messages don't declare their sizes and are only accumulated
+    if (d->stream.text) {
+        if (d->max_size && cxarr_u8_len(&d->stream.rxtext) + len > d->max_size) {
+            return CXERR("maximum message size exceeded");
+        }
+        if (d->check && !d->check(d->check_ctx, len)) {
+            return CXERR("memory budget exceeded");
         }
+        cxarr_u8_pushn(&d->stream.rxtext, data, len);
+        return CXOK();
+    }
 
-        // Checks for JSON chunk
-        if (chunk_type == WrsChunkMsg) {
-            // Checks if JSON already decoded.
-            // Only one JSON chunk is allowed.
-            if (json) {
-                return CXERR("more than 1 JSON chunk found");
+    const uint8_t* curr = data;
+    const uint8_t* last = curr + len;
+    while (curr < last) {
+        const size_t avail = last - curr;
+        if (d->stream.state == StreamHeader) {
+            // Accumulates the chunk header which may be split between fragments
+            size_t n = sizeof(ChunkHeader) - d->stream.header_len;
+            n = n < avail ? n : avail;
+            memcpy(d->stream.header + d->stream.header_len, curr, n);
+            d->stream.header_len += n;
+            curr += n;
+            if (d->stream.header_len < sizeof(ChunkHeader)) {
+                break;
+            }
+            d->stream.header_len = 0;
+            ChunkHeader header;
+            memcpy(&header, d->stream.header, sizeof(header));
+
+            // Checks the chunk type and the message size before allocating the chunk
+            if (header.type != WrsChunkMsg && header.type != WrsChunkBuf && header.type != WrsChunkPack) {
+                return CXERR("invalid chunk type");
+            }
+            const size_t padded = align_forward(header.size, CHUNK_ALIGNMENT);
+            if (padded < header.size || d->stream.size > SIZE_MAX - sizeof(ChunkHeader) - padded) {
+                return CXERR("invalid chunk size");
+            }
+            d->stream.size += sizeof(ChunkHeader) + padded;
+            if (d->max_size && d->stream.size > d->max_size) {
+                return CXERR("maximum message size exceeded");
+            }
+            if (d->check && !d->check(d->check_ctx, header.size)) {
+                return CXERR("memory budget exceeded");
+            }
+            StreamChunk chunk = {
+                .type = header.type,
+                .len = header.size,
+                .data = header.size ? cx_alloc_malloc(d->alloc, header.size) : NULL,
+            };
+            if (header.size && chunk.data == NULL) {
+                return CXERR("chunk allocation failed");
+            }
+            cxarr_chunk_push(&d->stream.chunks, chunk);
+            d->stream.dst = chunk.data;
+            d->stream.remaining = header.size;
+            d->stream.state = StreamPayload;
+            if (header.size == 0) {
+                d->stream.remaining = padded;
+                d->stream.state = padded ? StreamPadding : StreamHeader;
+            }
+        } else if (d->stream.state == StreamPayload) {
+            // Copies the payload directly to the chunk
+            const size_t n = d->stream.remaining < avail ? d->stream.remaining : avail;
+            memcpy(d->stream.dst, curr, n);
+            d->stream.dst += n;
+            d->stream.remaining -= n;
+            curr += n;
+            if (d->stream.remaining == 0) {
+                const StreamChunk* chunk = &d->stream.chunks.data[cxarr_chunk_len(&d->stream.chunks) - 1];
+                d->stream.remaining = align_forward(chunk->len, CHUNK_ALIGNMENT) - chunk->len;
+                d->stream.state = d->stream.remaining ? StreamPadding : StreamHeader;
             }
-            CXERR_RET(cx_json_parse(curr, chunk_len, msg, &cfg));
-        // Checks for Buffer chunk
-        } else if (chunk_type == WrsChunkBuf) {
-            cxarr_buf_push(&d->buffers, (BufInfo){
-                 .len = chunk_len,
-                 .data = curr,
-            });
-        // Invalid chunk type
         } else {
-            return CXERR("invalid chunk type");
+            // Skips the chunk padding
+            const size_t n = d->stream.remaining < avail ? d->stream.remaining : avail;
+            d->stream.remaining -= n;
+            curr += n;
+            if (d->stream.remaining == 0) {
+                d->stream.state = StreamHeader;
+            }
         }
+    }
+    return CXOK();
+}
 
-        // Advance pointer to start of next possible chunk
-        curr += chunk_len;
-        curr = (void*)align_forward((uintptr_t)curr, 4);
+CxError wrs_decoder_end(WrsDecoder* d, WrsEnvelope* env) {
+
+    cxarr_buf_clear(&d->buffers);
+    cxarr_var_clear(&d->vars);
+    *env = (WrsEnvelope){.format = WrsFormatJson};
+
+    // Text messages only contains a JSON string
+    if (d->stream.text) {
+        return scan_json(d, d->stream.rxtext.data, cxarr_u8_len(&d->stream.rxtext), env);
     }
-   
-    // Checks for exact length of binary message
-    if (curr != last) {
+
+    // Checks that the last chunk was completely received
+    if (d->stream.state != StreamHeader || d->stream.header_len) {
         return CXERR("invalid message length");
     }
 
-    // Converts decoded string CxVars to corresponding buffers
-    if (cxarr_var_len(&d->vars) != cxarr_buf_len(&d->buffers)) {
-        return CXERR("error converting buffers");
+    // Get the message chunk and the buffer chunks in any order
+    const StreamChunk* msg = NULL;
+    for (size_t i = 0; i < cxarr_chunk_len(&d->stream.chunks); i++) {
+        const StreamChunk* chunk = &d->stream.chunks.data[i];
+        if (chunk->type == WrsChunkBuf) {
+            cxarr_buf_push(&d->buffers, (BufInfo){.data = chunk->data, .len = chunk->len});
+            continue;
+        }
+        if (msg) {
+            return CXERR("more than 1 message chunk found");
+        }
+        msg = chunk;
     }
-    for (size_t i = 0; i < cxarr_var_len(&d->vars); i++) {
-        BufInfo* buf = &d->buffers.data[i];
-        cx_var_set_buf(d->vars.data[i], (void*)buf->data, buf->len);
+    if (msg == NULL) {
+        return CXERR("message chunk not found");
+    }
+    if (msg->type == WrsChunkPack) {
+        env->format = WrsFormatPack;
+        return scan_pack(d, msg->data, msg->len, env);
+    }
+    return scan_json(d, msg->data, msg->len, env);
+}
+
+void wrs_decoder_release(WrsDecoder* d) {
+
+    for (size_t i = 0; i < cxarr_chunk_len(&d->stream.chunks); i++) {
+        StreamChunk* chunk = &d->stream.chunks.data[i];
+        if (chunk->data) {
+            cx_alloc_free(d->alloc, chunk->data, chunk->len);
+        }
     }
+    cxarr_chunk_clear(&d->stream.chunks);
+    cxarr_u8_clear(&d->stream.rxtext);
+}
 
-    return CXOK();
+CxError wrs_decoder_dec_body(WrsDecoder* d, const WrsEnvelope* env, CxVar* body) {
+
+    cxarr_var_clear(&d->vars);
+    if (env->body == NULL) {
+        return CXERR("message body not found");
+    }
+    if (env->format == WrsFormatPack) {
+        return dec_pack(d, env->body, env->body_len, body);
+    }
+    return dec_json(d, env->body, env->body_len, body);
+}
+
+//-----------------------------------------------------------------------------
+// Fragments and streams
+//-----------------------------------------------------------------------------
+
+size_t wrs_frag_encode(void* dst, const WrsFrag* frag) {
+
+    const uint32_t fields[] = {frag->id, frag->flags};
+    return field_chunk_encode(dst, WrsChunkFrag, fields, 2, frag->data, frag->len);
+}
+
+bool wrs_frag_decode(const void* data, size_t len, WrsFrag* frag) {
+
+    uint32_t fields[2];
+    if (!field_chunk_decode(data, len, WrsChunkFrag, fields, 2, &frag->data, &frag->len)) {
+        return false;
+    }
+    frag->id = fields[0];
+    frag->flags = fields[1];
+    return true;
+}
+
+size_t wrs_stream_encode(void* dst, const WrsStreamMsg* msg) {
+
+    const uint32_t fields[] = {msg->sid, msg->kind, msg->value};
+    return field_chunk_encode(dst, WrsChunkStream, fields, 3, msg->data, msg->len);
+}
+
+bool wrs_stream_decode(const void* data, size_t len, WrsStreamMsg* msg) {
+
+    uint32_t fields[3];
+    if (!field_chunk_decode(data, len, WrsChunkStream, fields, 3, &msg->data, &msg->len)) {
+        return false;
+    }
+    msg->sid = fields[0];
+    msg->kind = fields[1];
+    msg->value = fields[2];
+    return true;
 }
 
 
@@ -326,21 +692,27 @@ static int enc_writer(void* ctx, const void* data, size_t len) {
 
 static void enc_json_replacer(CxVar* var, void* userdata) {
 
-    if (cx_var_get_type(var) != CxVarBuf) {
-        return;
-    }
-
-    // Get buffer data and len, makes a copy and saves into internal array
     WrsEncoder* e = userdata;
-    const void* data;
     size_t len;
-    cx_var_get_buf(var, &data, &len);
-    BufInfo buffer = {
-        .data = cx_alloc_malloc(e->alloc, len),
-        .len = len,
-    };
-    memcpy(buffer.data, data, len);
-    cxarr_buf_push(&e->buffers, buffer);
+    const CxVarType type = cx_var_get_type(var);
+
+    // Numeric arrays may be promoted to float64 buffers.
+    // The buffers data are copied to the encoder buffers storage, which keeps
+    // its capacity, so encoding buffers doesn't allocate memory for each message.
+    if (type == CxVarArr) {
+        if (!arr_is_numeric(var, e->promote_len, &len)) {
+            return;
+        }
+        arr_push_numbers(var, len, &e->bufdata);
+        cxarr_buf_push(&e->buffers, (BufInfo){.len = len * sizeof(double)});
+    } else if (type == CxVarBuf) {
+        const void* data;
+        cx_var_get_buf(var, &data, &len);
+        cxarr_u8_pushn(&e->bufdata, data, len);
+        cxarr_buf_push(&e->buffers, (BufInfo){.len = len});
+    } else {
+        return;
+    }
 
     // Replaces CxVar buffer with string with special prefix and buffer number
     // This will deallocate its CxVar buffer.
@@ -377,6 +749,47 @@ static void add_padding(WrsEncoder*e, size_t align) {
     cxarr_u8_pushn(&e->encoded, (char*)padbytes, npaddings);
 }
 
+// Encodes single chunk message whose data has the specified uint32 fields
+// followed by the payload, returning the padded message length.
+static size_t field_chunk_encode(void* dst, WrsChunkType type, const uint32_t* fields, size_t nfields, const void* data, size_t len) {
+
+    uint8_t* p = dst;
+    const size_t fields_size = nfields * sizeof(uint32_t);
+    const ChunkHeader header = {.type = type, .size = fields_size + len};
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, fields, fields_size);
+    p += fields_size;
+    if (len) {
+        memcpy(p, data, len);
+        p += len;
+    }
+    const size_t msg_len = p - (uint8_t*)dst;
+    const size_t padded = align_forward(msg_len, CHUNK_ALIGNMENT);
+    memset(p, 0, padded - msg_len);
+    return padded;
+}
+
+// Decodes single chunk message of the specified type encoded by field_chunk_encode().
+// Returns false if the message is not of the specified type or is invalid.
+static bool field_chunk_decode(const void* src, size_t src_len, WrsChunkType type, uint32_t* fields, size_t nfields,
+    const void** data, size_t* len) {
+
+    ChunkHeader header;
+    const size_t fields_size = nfields * sizeof(uint32_t);
+    if (src_len < sizeof(header) + fields_size) {
+        return false;
+    }
+    memcpy(&header, src, sizeof(header));
+    if (header.type != type || header.size < fields_size || header.size > src_len - sizeof(header)) {
+        return false;
+    }
+    memcpy(fields, (const uint8_t*)src + sizeof(header), fields_size);
+    *data = (const uint8_t*)src + sizeof(header) + fields_size;
+    *len = header.size - fields_size;
+    return true;
+}
+
 static void dec_json_replacer(CxVar* var, void* userdata) {
 
     if (cx_var_get_type(var) != CxVarStr) {
@@ -389,9 +802,1148 @@ static void dec_json_replacer(CxVar* var, void* userdata) {
     }
 
     WrsDecoder* d = userdata;
-    ssize_t nbuf = strtol(str + strlen(BUFFER_PREFIX), NULL, 10);
-    //printf("buffer:%ld\n", nbuf);
     cxarr_var_push(&d->vars, var);
 }
 
+// Splits binary message in its chunks, saving the buffer chunks in the
+// decoder and returning the format, pointer and length of the message chunk.
+static CxError dec_chunks(WrsDecoder* d, const void* data, size_t len, WrsFormat* format, const void** msg_data, size_t* msg_len) {
+
+    // Decode the message chunks in any order
+    const void* last = data + len;
+    const void* curr = data;
+    *msg_data = NULL;
+    while (curr < last) {
+        // Checks available size for chunk header
+        if (curr + sizeof(uint32_t)*2 > last) {
+            return CXERR("chunk size size exceeded");
+        }
+
+        // Get the chunk type and length in bytes
+        uint32_t chunk_type = *(uint32_t*)curr;
+        curr += sizeof(uint32_t);
+        uint32_t chunk_len = *(uint32_t*)curr;
+        curr += sizeof(uint32_t);
+
+        // Checks available size for chunk data
+        if (curr + chunk_len > last) {
+            return CXERR("chunk size size exceeded");
+        }
+
+        // Checks for JSON or MessagePack chunk.
+        // Only one message chunk is allowed.
+        if (chunk_type == WrsChunkMsg || chunk_type == WrsChunkPack) {
+            if (*msg_data) {
+                return CXERR("more than 1 message chunk found");
+            }
+            *format = chunk_type == WrsChunkMsg ? WrsFormatJson : WrsFormatPack;
+            *msg_data = curr;
+            *msg_len = chunk_len;
+        // Checks for Buffer chunk
+        } else if (chunk_type == WrsChunkBuf) {
+            cxarr_buf_push(&d->buffers, (BufInfo){
+                 .len = chunk_len,
+                 .data = (void*)curr,
+            });
+        // Invalid chunk type
+        } else {
+            return CXERR("invalid chunk type");
+        }
+
+        // Advance pointer to start of next possible chunk
+        curr += chunk_len;
+        curr = (void*)align_forward((uintptr_t)curr, 4);
+    }
+   
+    // Checks for exact length of binary message
+    if (curr != last) {
+        return CXERR("invalid message length");
+    }
+    if (*msg_data == NULL) {
+        return CXERR("message chunk not found");
+    }
+    return CXOK();
+}
+
+// Decodes JSON value and converts buffer references to the
+// corresponding buffers previously found in the message.
+static CxError dec_json(WrsDecoder* d, const void* data, size_t len, CxVar* var) {
+
+    if (d->promote_len) {
+        dec_promote(d, &data, &len);
+    }
+    CxJsonParseCfg cfg = {
+        .alloc = d->parse_alloc,
+        .replacer_fn = dec_json_replacer,
+        .replacer_data = d,
+    };
+    CXERR_RET(cx_json_parse(data, len, var, &cfg));
+
+    // Converts decoded string CxVars to corresponding buffers
+    for (size_t i = 0; i < cxarr_var_len(&d->vars); i++) {
+        CxVar* bvar = d->vars.data[i];
+        const char* str;
+        cx_var_get_str(bvar, &str);
+        size_t nbuf = strtoul(str + strlen(BUFFER_PREFIX), NULL, 10);
+        if (nbuf >= cxarr_buf_len(&d->buffers)) {
+            return CXERR("invalid buffer reference");
+        }
+        BufInfo* buf = &d->buffers.data[nbuf];
+        cx_var_set_buf(bvar, buf->data, buf->len);
+    }
+    return CXOK();
+}
+
+// Decodes MessagePack value which must use all the specified data
+static CxError dec_pack(WrsDecoder* d, const void* data, size_t len, CxVar* var) {
+
+    PackReader r = {.curr = data, .last = data + len};
+    CXERR_RET(dec_pack_val(d, &r, var, 0));
+    if (r.curr != r.last) {
+        return CXERR("invalid MessagePack length");
+    }
+    return CXOK();
+}
+
+// Skips JSON string starting at the current position
+static bool json_skip_str(JsonScanner* s) {
+
+    s->curr++;
+    while (s->curr < s->last) {
+        const char c = *s->curr++;
+        if (c == '\\') {
+            s->curr++;
+        } else if (c == '"') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void json_skip_ws(JsonScanner* s) {
+
+    while (s->curr < s->last && (*s->curr == ' ' || *s->curr == '\t' || *s->curr == '\n' || *s->curr == '\r')) {
+        s->curr++;
+    }
+}
+
+// Skips JSON value starting at the current position without decoding it
+static bool json_skip_val(JsonScanner* s) {
+
+    if (s->curr >= s->last) {
+        return false;
+    }
+    if (*s->curr == '"') {
+        return json_skip_str(s);
+    }
+    // Object or array: only need to balance the brackets
+    if (*s->curr == '{' || *s->curr == '[') {
+        int depth = 0;
+        while (s->curr < s->last) {
+            const char c = *s->curr;
+            if (c == '"') {
+                if (!json_skip_str(s)) {
+                    return false;
+                }
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                depth--;
+                if (depth == 0) {
+                    s->curr++;
+                    return true;
+                }
+            }
+            s->curr++;
+        }
+        return false;
+    }
+    // Number, true, false or null
+    const char* start = s->curr;
+    while (s->curr < s->last && *s->curr != ',' && *s->curr != '}' && *s->curr != ']' &&
+        *s->curr != ' ' && *s->curr != '\t' && *s->curr != '\n' && *s->curr != '\r') {
+        s->curr++;
+    }
+    return s->curr > start;
+}
+
+// Parses JSON integer which must use all the specified characters
+static bool json_parse_int(const char* str, size_t len, int64_t* val) {
+
+    const char* last = str + len;
+    bool neg = false;
+    if (str < last && *str == '-') {
+        neg = true;
+        str++;
+    }
+    if (str == last) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (; str < last; str++) {
+        if (*str < '0' || *str > '9') {
+            return false;
+        }
+        v = v*10 + (*str - '0');
+    }
+    *val = neg ? -(int64_t)v : (int64_t)v;
+    return true;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Returns if all the 8 characters loaded in little endian order are ASCII digits
+static inline bool swar_is_8digits(uint64_t v) {
+
+    return ((v & 0xF0F0F0F0F0F0F0F0) |
+        (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333;
+}
+
+// Converts 8 ASCII digits loaded in little endian order to its value
+// using SIMD within a register.
+static inline uint32_t swar_parse_8digits(uint64_t v) {
+
+    const uint64_t mask = 0x000000FF000000FF;
+    const uint64_t mul1 = 0x000F424000000064;   // 100 + (1000000 << 32)
+    const uint64_t mul2 = 0x0000271000000001;   // 1 + (10000 << 32)
+    v -= 0x3030303030303030;
+    v = (v * 10) + (v >> 8);
+    v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t)v;
+}
+#endif
+
+// Parses JSON number at the current position.
+// Integers with up to 19 digits are parsed 8 digits at a time.
+// Numbers with fraction or exponent use strtod().
+static bool json_parse_num(JsonScanner* s, double* val) {
+
+    const char* start = s->curr;
+    const char* p = start;
+    bool neg = false;
+    if (p < s->last && *p == '-') {
+        neg = true;
+        p++;
+    }
+    const char* digits = p;
+    uint64_t mant = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (s->last - p >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        if (!swar_is_8digits(v)) {
+            break;
+        }
+        mant = mant * 100000000 + swar_parse_8digits(v);
+        p += 8;
+    }
+#endif
+    while (p < s->last && *p >= '0' && *p <= '9') {
+        mant = mant * 10 + (*p - '0');
+        p++;
+    }
+    const size_t ndigits = p - digits;
+    if (ndigits == 0) {
+        return false;
+    }
+
+    // Fast path for integers
+    if (ndigits <= 19 && (p >= s->last || (*p != '.' && *p != 'e' && *p != 'E'))) {
+        *val = neg ? -(double)mant : (double)mant;
+        s->curr = p;
+        return true;
+    }
+
+    // Slow path for other numbers
+    char buf[64];
+    size_t n = 0;
+    p = start;
+    while (p < s->last && n < sizeof(buf) - 1 &&
+        ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')) {
+        buf[n++] = *p++;
+    }
+    buf[n] = 0;
+    char* end;
+    *val = strtod(buf, &end);
+    if (end != buf + n) {
+        return false;
+    }
+    s->curr = p;
+    return true;
+}
+
+// Parses JSON array starting at the current position as array of numbers
+// saving its elements in the promoted storage.
+// Returns the number of elements or zero if the array is not numeric.
+static size_t dec_promote_arr(WrsDecoder* d, JsonScanner* s) {
+
+    s->curr++;
+    json_skip_ws(s);
+    size_t count = 0;
+    while (s->curr < s->last) {
+        double v;
+        if (!json_parse_num(s, &v)) {
+            return 0;
+        }
+        cxarr_u8_pushn(&d->promoted, (uint8_t*)&v, sizeof(v));
+        count++;
+        json_skip_ws(s);
+        if (s->curr >= s->last) {
+            return 0;
+        }
+        if (*s->curr == ']') {
+            s->curr++;
+            return count;
+        }
+        if (*s->curr != ',') {
+            return 0;
+        }
+        s->curr++;
+        json_skip_ws(s);
+    }
+    return 0;
+}
+
+// Replaces homogeneous numeric arrays with at least 'promote_len' elements
+// in the JSON text by references to float64 buffers which are appended to
+// the message buffers. If any array is promoted, the data pointer and length
+// are changed to the rewritten JSON text.
+static void dec_promote(WrsDecoder* d, const void** data, size_t* len) {
+
+    cxarr_u8_clear(&d->promoted);
+    cxarr_prom_clear(&d->proms);
+    cxarr_u8_clear(&d->text);
+
+    JsonScanner s = {.curr = *data, .last = *data + *len};
+    const char* copied = s.curr;  // Start of text not copied yet
+    while (s.curr < s.last) {
+        const char c = *s.curr;
+        if (c == '"') {
+            if (!json_skip_str(&s)) {
+                break;
+            }
+            continue;
+        }
+        if (c != '[') {
+            s.curr++;
+            continue;
+        }
+
+        // Tries to parse numeric array. Elements of discarded arrays are
+        // left in the storage until the next message.
+        const char* start = s.curr;
+        const size_t offset = cxarr_u8_len(&d->promoted);
+        const size_t count = dec_promote_arr(d, &s);
+        if (count == 0 || count < d->promote_len) {
+            s.curr = start + 1;
+            continue;
+        }
+
+        // Copies the text before the array followed by the buffer reference
+        cxarr_u8_pushn(&d->text, (uint8_t*)copied, start - copied);
+        char ref[64];
+        const size_t nbuf = cxarr_buf_len(&d->buffers) + cxarr_prom_len(&d->proms);
+        const int n = snprintf(ref, sizeof(ref), "\"%s%zu\"", BUFFER_PREFIX_JSON, nbuf);
+        cxarr_u8_pushn(&d->text, (uint8_t*)ref, n);
+        cxarr_prom_push(&d->proms, (PromInfo){.offset = offset, .len = count * sizeof(double)});
+        copied = s.curr;
+    }
+    if (cxarr_prom_len(&d->proms) == 0) {
+        return;
+    }
+    cxarr_u8_pushn(&d->text, (uint8_t*)copied, (const char*)*data + *len - copied);
+
+    // Appends the promoted arrays to the message buffers
+    for (size_t i = 0; i < cxarr_prom_len(&d->proms); i++) {
+        PromInfo* prom = &d->proms.data[i];
+        cxarr_buf_push(&d->buffers, (BufInfo){
+            .data = d->promoted.data + prom->offset,
+            .len = prom->len,
+        });
+    }
+    *data = d->text.data;
+    *len = cxarr_u8_len(&d->text);
+}
+
+// Returns if the CxVar is an array of numbers with at least the specified
+// minimum length (which must not be zero).
+static bool arr_is_numeric(const CxVar* var, size_t min_len, size_t* len) {
+
+    if (min_len == 0 || !cx_var_get_arr_len(var, len) || *len < min_len) {
+        return false;
+    }
+    for (size_t i = 0; i < *len; i++) {
+        const CxVarType type = cx_var_get_type(cx_var_get_arr_val(var, i));
+        if (type != CxVarInt && type != CxVarFloat) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the value of an integer or float CxVar as float64
+static double var_get_number(const CxVar* var) {
+
+    if (cx_var_get_type(var) == CxVarInt) {
+        int64_t v;
+        cx_var_get_int(var, &v);
+        return (double)v;
+    }
+    double v;
+    cx_var_get_float(var, &v);
+    return v;
+}
+
+// Appends the elements of numeric array as float64 values
+static void arr_push_numbers(const CxVar* var, size_t len, cxarr_u8* out) {
+
+    for (size_t i = 0; i < len; i++) {
+        const double v = var_get_number(cx_var_get_arr_val(var, i));
+        cxarr_u8_pushn(out, (uint8_t*)&v, sizeof(v));
+    }
+}
+
+// Scans the top level keys of a JSON message object
+static CxError scan_json(WrsDecoder* d, const void* data, size_t len, WrsEnvelope* env) {
+
+    JsonScanner s = {.curr = data, .last = data + len};
+    json_skip_ws(&s);
+    if (s.curr >= s.last || *s.curr != '{') {
+        return CXERR("message is not a JSON object");
+    }
+    s.curr++;
+    json_skip_ws(&s);
+    if (s.curr < s.last && *s.curr == '}') {
+        return CXOK();
+    }
+
+    while (true) {
+        // Key
+        json_skip_ws(&s);
+        if (s.curr >= s.last || *s.curr != '"') {
+            return CXERR("invalid JSON object key");
+        }
+        const char* key = s.curr + 1;
+        if (!json_skip_str(&s)) {
+            return CXERR("invalid JSON object key");
+        }
+        const size_t key_len = s.curr - key - 1;
+        json_skip_ws(&s);
+        if (s.curr >= s.last || *s.curr != ':') {
+            return CXERR("invalid JSON object");
+        }
+        s.curr++;
+
+        // Value
+        json_skip_ws(&s);
+        const char* val = s.curr;
+        if (!json_skip_val(&s)) {
+            return CXERR("invalid JSON value");
+        }
+        const size_t val_len = s.curr - val;
+
+        // Saves the envelope fields
+        if (key_len == 3 && memcmp(key, "cid", 3) == 0) {
+            if (!json_parse_int(val, val_len, &env->cid)) {
+                return CXERR("invalid 'cid' field");
+            }
+            env->has_cid = true;
+        } else if (key_len == 3 && memcmp(key, "rid", 3) == 0) {
+            if (!json_parse_int(val, val_len, &env->rid)) {
+                return CXERR("invalid 'rid' field");
+            }
+            env->has_rid = true;
+        } else if (key_len == 4 && memcmp(key, "call", 4) == 0) {
+            if (*val != '"') {
+                return CXERR("invalid 'call' field");
+            }
+            env->call = val + 1;
+            env->call_len = val_len - 2;
+            // Names with escape sequences are unescaped into the decoder
+            if (memchr(env->call, '\\', env->call_len)) {
+                if (!json_unescape(env->call, env->call_len, &d->call)) {
+                    return CXERR("invalid 'call' field");
+                }
+                env->call = (const char*)d->call.data;
+                env->call_len = cxarr_u8_len(&d->call);
+            }
+        } else if ((key_len == 6 && memcmp(key, "params", 6) == 0) ||
+                   (key_len == 4 && memcmp(key, "resp", 4) == 0)) {
+            env->body = val;
+            env->body_len = val_len;
+        }
+
+        json_skip_ws(&s);
+        if (s.curr < s.last && *s.curr == ',') {
+            s.curr++;
+            continue;
+        }
+        if (s.curr < s.last && *s.curr == '}') {
+            break;
+        }
+        return CXERR("invalid JSON object");
+    }
+    return CXOK();
+}
+
+// Unescapes the contents of a JSON string into the specified array
+// converting the unicode escapes to UTF-8.
+// Returns false if the string contains an invalid escape sequence or NUL.
+static bool json_unescape(const char* src, size_t len, cxarr_u8* out) {
+
+    cxarr_u8_clear(out);
+    const char* last = src + len;
+    while (src < last) {
+        char c = *src++;
+        if (c != '\\') {
+            cxarr_u8_push(out, c);
+            continue;
+        }
+        if (src >= last) {
+            return false;
+        }
+        c = *src++;
+        switch (c) {
+            case '"': case '\\': case '/': cxarr_u8_push(out, c); continue;
+            case 'b': cxarr_u8_push(out, '\b'); continue;
+            case 'f': cxarr_u8_push(out, '\f'); continue;
+            case 'n': cxarr_u8_push(out, '\n'); continue;
+            case 'r': cxarr_u8_push(out, '\r'); continue;
+            case 't': cxarr_u8_push(out, '\t'); continue;
+            case 'u': break;
+            default: return false;
+        }
+
+        // Unicode escape with optional surrogate pair
+        uint32_t cp = 0;
+        for (int pair = 0; pair < 2; pair++) {
+            if (last - src < 4) {
+                return false;
+            }
+            uint32_t u = 0;
+            for (int i = 0; i < 4; i++) {
+                const char h = *src++;
+                u <<= 4;
+                if (h >= '0' && h <= '9') {
+                    u |= h - '0';
+                } else if (h >= 'a' && h <= 'f') {
+                    u |= h - 'a' + 10;
+                } else if (h >= 'A' && h <= 'F') {
+                    u |= h - 'A' + 10;
+                } else {
+                    return false;
+                }
+            }
+            if (pair == 0) {
+                cp = u;
+                if (u < 0xD800 || u > 0xDBFF) {
+                    break;
+                }
+                if (last - src < 2 || src[0] != '\\' || src[1] != 'u') {
+                    return false;
+                }
+                src += 2;
+            } else {
+                if (u < 0xDC00 || u > 0xDFFF) {
+                    return false;
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (u - 0xDC00);
+            }
+        }
+        if (cp == 0 || (cp >= 0xDC00 && cp <= 0xDFFF)) {
+            return false;
+        }
+        if (cp < 0x80) {
+            cxarr_u8_push(out, cp);
+        } else if (cp < 0x800) {
+            cxarr_u8_push(out, 0xC0 | (cp >> 6));
+            cxarr_u8_push(out, 0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            cxarr_u8_push(out, 0xE0 | (cp >> 12));
+            cxarr_u8_push(out, 0x80 | ((cp >> 6) & 0x3F));
+            cxarr_u8_push(out, 0x80 | (cp & 0x3F));
+        } else {
+            cxarr_u8_push(out, 0xF0 | (cp >> 18));
+            cxarr_u8_push(out, 0x80 | ((cp >> 12) & 0x3F));
+            cxarr_u8_push(out, 0x80 | ((cp >> 6) & 0x3F));
+            cxarr_u8_push(out, 0x80 | (cp & 0x3F));
+        }
+    }
+    return true;
+}
+
+// Reads MessagePack integer
+static bool pack_read_int(PackReader* r, int64_t* val) {
+
+    uint64_t tag;
+    uint64_t v;
+    if (!pack_read(r, 1, &tag)) {
+        return false;
+    }
+    if (tag <= 0x7f) {
+        *val = (int64_t)tag;
+    } else if (tag >= 0xe0) {
+        *val = (int8_t)tag;
+    } else if (tag >= 0xcc && tag <= 0xcf) {
+        if (!pack_read(r, 1 << (tag - 0xcc), &v)) {
+            return false;
+        }
+        *val = (int64_t)v;
+    } else if (tag >= 0xd0 && tag <= 0xd3) {
+        const size_t nbytes = 1 << (tag - 0xd0);
+        if (!pack_read(r, nbytes, &v)) {
+            return false;
+        }
+        const int shift = 64 - 8*nbytes;
+        *val = (int64_t)(v << shift) >> shift;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Reads MessagePack integer or float as float64
+static bool pack_read_num(PackReader* r, double* val) {
+
+    if (r->curr >= r->last) {
+        return false;
+    }
+    uint64_t v;
+    if (*r->curr == 0xca) {
+        r->curr++;
+        if (!pack_read(r, 4, &v)) {
+            return false;
+        }
+        uint32_t bits = (uint32_t)v;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        *val = f;
+        return true;
+    }
+    if (*r->curr == 0xcb) {
+        r->curr++;
+        if (!pack_read(r, 8, &v)) {
+            return false;
+        }
+        memcpy(val, &v, sizeof(*val));
+        return true;
+    }
+    int64_t i;
+    if (!pack_read_int(r, &i)) {
+        return false;
+    }
+    *val = (double)i;
+    return true;
+}
+
+// Skips MessagePack value without decoding it
+static bool pack_skip(PackReader* r, int depth) {
+
+    if (depth > PACK_MAX_DEPTH) {
+        return false;
+    }
+    uint64_t tag;
+    if (!pack_read(r, 1, &tag)) {
+        return false;
+    }
+    uint64_t nbytes = 0;    // Number of bytes to skip
+    uint64_t nvals = 0;     // Number of values to skip
+    uint64_t v;
+    if (tag <= 0x7f || tag >= 0xe0) {
+        ;
+    } else if (tag <= 0x8f) {
+        nvals = 2 * (tag & 0x0f);
+    } else if (tag <= 0x9f) {
+        nvals = tag & 0x0f;
+    } else if (tag <= 0xbf) {
+        nbytes = tag & 0x1f;
+    } else {
+        switch (tag) {
+            case 0xc0: case 0xc2: case 0xc3:
+                break;
+            case 0xc4: case 0xc5: case 0xc6:
+                if (!pack_read(r, 1 << (tag - 0xc4), &nbytes)) {
+                    return false;
+                }
+                break;
+            case 0xca:
+                nbytes = 4;
+                break;
+            case 0xcb:
+                nbytes = 8;
+                break;
+            case 0xcc: case 0xcd: case 0xce: case 0xcf:
+                nbytes = 1 << (tag - 0xcc);
+                break;
+            case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+                nbytes = 1 << (tag - 0xd0);
+                break;
+            case 0xd9: case 0xda: case 0xdb:
+                if (!pack_read(r, 1 << (tag - 0xd9), &nbytes)) {
+                    return false;
+                }
+                break;
+            case 0xdc: case 0xdd:
+                if (!pack_read(r, 2 << (tag - 0xdc), &nvals)) {
+                    return false;
+                }
+                break;
+            case 0xde: case 0xdf:
+                if (!pack_read(r, 2 << (tag - 0xde), &v)) {
+                    return false;
+                }
+                nvals = 2 * v;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (nbytes > (uint64_t)(r->last - r->curr) || nvals > (uint64_t)(r->last - r->curr)) {
+        return false;
+    }
+    r->curr += nbytes;
+    for (uint64_t i = 0; i < nvals; i++) {
+        if (!pack_skip(r, depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Scans the top level keys of a MessagePack message map
+static CxError scan_pack(WrsDecoder* d, const void* data, size_t len, WrsEnvelope* env) {
+
+    PackReader r = {.curr = data, .last = data + len};
+    uint64_t tag;
+    uint64_t count;
+    if (!pack_read(&r, 1, &tag)) {
+        return CXERR("MessagePack data truncated");
+    }
+    if (tag >= 0x80 && tag <= 0x8f) {
+        count = tag & 0x0f;
+    } else if (tag == 0xde || tag == 0xdf) {
+        if (!pack_read(&r, 2 << (tag - 0xde), &count)) {
+            return CXERR("MessagePack data truncated");
+        }
+    } else {
+        return CXERR("message is not a MessagePack map");
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        const char* key = pack_read_key(d, &r);
+        if (key == NULL) {
+            return CXERR("invalid MessagePack map key");
+        }
+        if (strcmp(key, "cid") == 0) {
+            if (!pack_read_int(&r, &env->cid)) {
+                return CXERR("invalid 'cid' field");
+            }
+            env->has_cid = true;
+            continue;
+        }
+        if (strcmp(key, "rid") == 0) {
+            if (!pack_read_int(&r, &env->rid)) {
+                return CXERR("invalid 'rid' field");
+            }
+            env->has_rid = true;
+            continue;
+        }
+        const uint8_t* val = r.curr;
+        if (!pack_skip(&r, 0)) {
+            return CXERR("invalid MessagePack value");
+        }
+        if (strcmp(key, "call") == 0) {
+            // The value must be a string: skips its tag and length
+            if (*val >= 0xa0 && *val <= 0xbf) {
+                env->call = (const char*)val + 1;
+            } else if (*val >= 0xd9 && *val <= 0xdb) {
+                env->call = (const char*)val + 1 + (1 << (*val - 0xd9));
+            } else {
+                return CXERR("invalid 'call' field");
+            }
+            env->call_len = (const char*)r.curr - env->call;
+        } else if (strcmp(key, "params") == 0 || strcmp(key, "resp") == 0) {
+            env->body = val;
+            env->body_len = r.curr - val;
+        }
+    }
+    if (r.curr != r.last) {
+        return CXERR("invalid MessagePack length");
+    }
+    return CXOK();
+}
+
+
+
+// Writes MessagePack tag followed by the specified number of bytes of
+// the value in big endian order.
+static void pack_tag(WrsEncoder* e, uint8_t tag, uint64_t val, size_t nbytes) {
+
+    uint8_t bytes[9];
+    bytes[0] = tag;
+    for (size_t i = 0; i < nbytes; i++) {
+        bytes[1+i] = (uint8_t)(val >> (8*(nbytes-1-i)));
+    }
+    cxarr_u8_pushn(&e->encoded, bytes, 1 + nbytes);
+}
+
+// Writes the tag and length for MessagePack str, bin, array or map.
+// The 32 bits tag is always the 16 bits tag plus one.
+static void pack_len(WrsEncoder* e, uint8_t fixtag, size_t fixlen, uint8_t tag8, uint8_t tag16, size_t len) {
+
+    if (len < fixlen) {
+        pack_tag(e, fixtag | (uint8_t)len, 0, 0);
+    } else if (tag8 && len <= UINT8_MAX) {
+        pack_tag(e, tag8, len, 1);
+    } else if (len <= UINT16_MAX) {
+        pack_tag(e, tag16, len, 2);
+    } else {
+        pack_tag(e, tag16 + 1, len, 4);
+    }
+}
+
+static void pack_str(WrsEncoder* e, const char* str) {
+
+    const size_t len = strlen(str);
+    pack_len(e, 0xa0, 32, 0xd9, 0xda, len);
+    cxarr_u8_pushn(&e->encoded, (uint8_t*)str, len);
+}
+
+static void pack_int(WrsEncoder* e, int64_t v) {
+
+    if (v >= 0) {
+        if (v < 128) {
+            pack_tag(e, (uint8_t)v, 0, 0);
+        } else if (v <= UINT8_MAX) {
+            pack_tag(e, 0xcc, v, 1);
+        } else if (v <= UINT16_MAX) {
+            pack_tag(e, 0xcd, v, 2);
+        } else if (v <= UINT32_MAX) {
+            pack_tag(e, 0xce, v, 4);
+        } else {
+            pack_tag(e, 0xcf, v, 8);
+        }
+        return;
+    }
+    if (v >= -32) {
+        pack_tag(e, (uint8_t)v, 0, 0);
+    } else if (v >= INT8_MIN) {
+        pack_tag(e, 0xd0, (uint64_t)v, 1);
+    } else if (v >= INT16_MIN) {
+        pack_tag(e, 0xd1, (uint64_t)v, 2);
+    } else if (v >= INT32_MIN) {
+        pack_tag(e, 0xd2, (uint64_t)v, 4);
+    } else {
+        pack_tag(e, 0xd3, (uint64_t)v, 8);
+    }
+}
+
+// Encodes CxVar as MessagePack appending to the encoded buffer
+static void enc_pack_var(WrsEncoder* e, const CxVar* var) {
+
+    switch (cx_var_get_type(var)) {
+        case CxVarNull:
+            pack_tag(e, 0xc0, 0, 0);
+            break;
+        case CxVarBool: {
+            bool v;
+            cx_var_get_bool(var, &v);
+            pack_tag(e, v ? 0xc3 : 0xc2, 0, 0);
+            break;
+        }
+        case CxVarInt: {
+            int64_t v;
+            cx_var_get_int(var, &v);
+            pack_int(e, v);
+            break;
+        }
+        case CxVarFloat: {
+            double v;
+            cx_var_get_float(var, &v);
+            uint64_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            pack_tag(e, 0xcb, bits, 8);
+            break;
+        }
+        case CxVarStr: {
+            const char* str;
+            cx_var_get_str(var, &str);
+            pack_str(e, str);
+            break;
+        }
+        case CxVarBuf: {
+            const void* data;
+            size_t len;
+            cx_var_get_buf(var, &data, &len);
+            pack_len(e, 0, 0, 0xc4, 0xc5, len);
+            cxarr_u8_pushn(&e->encoded, (uint8_t*)data, len);
+            break;
+        }
+        case CxVarArr: {
+            size_t len;
+            // Numeric arrays may be promoted to float64 buffers
+            if (arr_is_numeric(var, e->promote_len, &len)) {
+                pack_len(e, 0, 0, 0xc4, 0xc5, len * sizeof(double));
+                for (size_t i = 0; i < len; i++) {
+                    const double v = var_get_number(cx_var_get_arr_val(var, i));
+                    cxarr_u8_pushn(&e->encoded, (uint8_t*)&v, sizeof(v));
+                }
+                break;
+            }
+            cx_var_get_arr_len(var, &len);
+            pack_len(e, 0x90, 16, 0, 0xdc, len);
+            for (size_t i = 0; i < len; i++) {
+                enc_pack_var(e, cx_var_get_arr_val(var, i));
+            }
+            break;
+        }
+        case CxVarMap: {
+            size_t len;
+            cx_var_get_map_len(var, &len);
+            pack_len(e, 0x80, 16, 0, 0xde, len);
+            for (size_t i = 0; i < len; i++) {
+                const char* key;
+                CxVar* val = cx_var_get_map_index(var, i, &key);
+                pack_str(e, key);
+                enc_pack_var(e, val);
+            }
+            break;
+        }
+        default:
+            pack_tag(e, 0xc0, 0, 0);
+            break;
+    }
+}
+
+// Reads big endian unsigned value with the specified number of bytes
+static bool pack_read(PackReader* r, size_t nbytes, uint64_t* val) {
+
+    if ((size_t)(r->last - r->curr) < nbytes) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < nbytes; i++) {
+        v = (v << 8) | r->curr[i];
+    }
+    r->curr += nbytes;
+    *val = v;
+    return true;
+}
+
+// Reads MessagePack str with the specified length into the decoder scratch
+// buffer as a NUL terminated string.
+static const char* pack_read_str(WrsDecoder* d, PackReader* r, size_t len) {
+
+    if ((size_t)(r->last - r->curr) < len) {
+        return NULL;
+    }
+    cxarr_u8_clear(&d->scratch);
+    cxarr_u8_pushn(&d->scratch, r->curr, len);
+    cxarr_u8_push(&d->scratch, 0);
+    r->curr += len;
+    return (const char*)d->scratch.data;
+}
+
+// Reads MessagePack map key which must be a string
+static const char* pack_read_key(WrsDecoder* d, PackReader* r) {
+
+    uint64_t tag;
+    if (!pack_read(r, 1, &tag)) {
+        return NULL;
+    }
+    uint64_t len;
+    if (tag >= 0xa0 && tag <= 0xbf) {
+        len = tag & 0x1f;
+    } else if (tag >= 0xd9 && tag <= 0xdb) {
+        if (!pack_read(r, 1 << (tag - 0xd9), &len)) {
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+    return pack_read_str(d, r, len);
+}
+
+static CxError dec_pack_arr(WrsDecoder* d, PackReader* r, CxVar* var, uint64_t len, int depth) {
+
+    // Each element needs at least one byte
+    if (len > (uint64_t)(r->last - r->curr)) {
+        return CXERR("invalid MessagePack array length");
+    }
+
+    // Tries to decode numeric array directly as float64 buffer
+    if (d->promote_len && len >= d->promote_len) {
+        PackReader saved = *r;
+        cxarr_u8_clear(&d->scratch);
+        uint64_t i;
+        for (i = 0; i < len; i++) {
+            double v;
+            if (!pack_read_num(r, &v)) {
+                break;
+            }
+            cxarr_u8_pushn(&d->scratch, (uint8_t*)&v, sizeof(v));
+        }
+        if (i == len) {
+            cx_var_set_buf(var, d->scratch.data, len * sizeof(double));
+            return CXOK();
+        }
+        *r = saved;
+    }
+    cx_var_set_arr(var);
+    for (uint64_t i = 0; i < len; i++) {
+        CxVar* el = cx_var_push_arr_null(var);
+        CXERR_RET(dec_pack_val(d, r, el, depth + 1));
+    }
+    return CXOK();
+}
+
+static CxError dec_pack_map(WrsDecoder* d, PackReader* r, CxVar* var, uint64_t len, int depth) {
+
+    // Each entry needs at least two bytes
+    if (len > (uint64_t)(r->last - r->curr) / 2) {
+        return CXERR("invalid MessagePack map length");
+    }
+    cx_var_set_map(var);
+    for (uint64_t i = 0; i < len; i++) {
+        const char* key = pack_read_key(d, r);
+        if (key == NULL) {
+            return CXERR("invalid MessagePack map key");
+        }
+        CxVar* val = cx_var_set_map_null(var, key);
+        CXERR_RET(dec_pack_val(d, r, val, depth + 1));
+    }
+    return CXOK();
+}
+
+// Decodes MessagePack value into the specified CxVar
+static CxError dec_pack_val(WrsDecoder* d, PackReader* r, CxVar* var, int depth) {
+
+    if (depth > PACK_MAX_DEPTH) {
+        return CXERR("MessagePack nesting too deep");
+    }
+    uint64_t tag;
+    if (!pack_read(r, 1, &tag)) {
+        return CXERR("MessagePack data truncated");
+    }
+
+    // Fixed size types
+    if (tag <= 0x7f) {
+        cx_var_set_int(var, (int64_t)tag);
+        return CXOK();
+    }
+    if (tag <= 0x8f) {
+        return dec_pack_map(d, r, var, tag & 0x0f, depth);
+    }
+    if (tag <= 0x9f) {
+        return dec_pack_arr(d, r, var, tag & 0x0f, depth);
+    }
+    if (tag <= 0xbf) {
+        const char* str = pack_read_str(d, r, tag & 0x1f);
+        if (str == NULL) {
+            return CXERR("MessagePack data truncated");
+        }
+        cx_var_set_str(var, str);
+        return CXOK();
+    }
+    if (tag >= 0xe0) {
+        cx_var_set_int(var, (int8_t)tag);
+        return CXOK();
+    }
 
+    uint64_t v;
+    switch (tag) {
+        case 0xc0:
+            cx_var_set_null(var);
+            return CXOK();
+        case 0xc2:
+        case 0xc3:
+            cx_var_set_bool(var, tag == 0xc3);
+            return CXOK();
+        // bin 8/16/32
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+            if (!pack_read(r, 1 << (tag - 0xc4), &v) || v > (uint64_t)(r->last - r->curr)) {
+                return CXERR("MessagePack data truncated");
+            }
+            cx_var_set_buf(var, (void*)r->curr, v);
+            r->curr += v;
+            return CXOK();
+        // float 32
+        case 0xca: {
+            if (!pack_read(r, 4, &v)) {
+                return CXERR("MessagePack data truncated");
+            }
+            uint32_t bits = (uint32_t)v;
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            cx_var_set_float(var, f);
+            return CXOK();
+        }
+        // float 64
+        case 0xcb: {
+            if (!pack_read(r, 8, &v)) {
+                return CXERR("MessagePack data truncated");
+            }
+            double f;
+            memcpy(&f, &v, sizeof(f));
+            cx_var_set_float(var, f);
+            return CXOK();
+        }
+        // uint 8/16/32/64
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            if (!pack_read(r, 1 << (tag - 0xcc), &v)) {
+                return CXERR("MessagePack data truncated");
+            }
+            cx_var_set_int(var, (int64_t)v);
+            return CXOK();
+        // int 8/16/32/64
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3: {
+            const size_t nbytes = 1 << (tag - 0xd0);
+            if (!pack_read(r, nbytes, &v)) {
+                return CXERR("MessagePack data truncated");
+            }
+            // Sign extends the value
+            const int shift = 64 - 8*nbytes;
+            cx_var_set_int(var, (int64_t)(v << shift) >> shift);
+            return CXOK();
+        }
+        // str 8/16/32
+        case 0xd9:
+        case 0xda:
+        case 0xdb: {
+            const char* str = NULL;
+            if (pack_read(r, 1 << (tag - 0xd9), &v)) {
+                str = pack_read_str(d, r, v);
+            }
+            if (str == NULL) {
+                return CXERR("MessagePack data truncated");
+            }
+            cx_var_set_str(var, str);
+            return CXOK();
+        }
+        // array 16/32
+        case 0xdc:
+        case 0xdd:
+            if (!pack_read(r, 2 << (tag - 0xdc), &v)) {
+                return CXERR("MessagePack data truncated");
+            }
+            return dec_pack_arr(d, r, var, v, depth);
+        // map 16/32
+        case 0xde:
+        case 0xdf:
+            if (!pack_read(r, 2 << (tag - 0xde), &v)) {
+                return CXERR("MessagePack data truncated");
+            }
+            return dec_pack_map(d, r, var, v, depth);
+        default:
+            return CXERR("unsupported MessagePack type");
+    }
+}
@@ -12,9 +12,22 @@
 typedef enum {
     WrsChunkMsg = 1,
     WrsChunkBuf,
+    WrsChunkPack,
+    WrsChunkFrag,
+    WrsChunkStream,
     WrsChunkTypeInvalid,
 } WrsChunkType;
 
+// Message envelope encoding formats
+typedef enum {
+    WrsFormatJson,      // JSON message chunk plus optional buffer chunks
+    WrsFormatPack,      // Single MessagePack message chunk with embedded buffers
+} WrsFormat;
+
+// WebSocket subprotocols used to negotiate the envelope format
+#define WRS_SUBPROTOCOL_JSON    "wrs.json"
+#define WRS_SUBPROTOCOL_PACK    "wrs.pack"
+
 // Creates message encoder using specified allocator.
 typedef struct WrsEncoder WrsEncoder;
 WrsEncoder* wrs_encoder_new(const CxAllocator* alloc);
@@ -25,12 +38,85 @@ void wrs_encoder_del(WrsEncoder*);
 // Clear message encoder internal buffers, without deallocating memory
 void wrs_encoder_clear(WrsEncoder* e);
 
+// Sets the envelope format used by next encoded messages (default: WrsFormatJson)
+void wrs_encoder_set_format(WrsEncoder* e, WrsFormat format);
+
+// Sets the minimum length of numeric arrays which are encoded as float64 buffers.
+// Zero disables the promotion (default).
+void wrs_encoder_set_promote(WrsEncoder* e, size_t min_len);
+
 // Encodes message into internal buffer
 CxError wrs_encoder_enc(WrsEncoder* e, CxVar* msg);
 
 // Get the type, pointer and length of last message encoded buffer.
 void* wrs_encoder_get_msg(WrsEncoder* e, bool* text, size_t* len);
 
+// Returns the capacity in bytes of the encoder buffers
+size_t wrs_encoder_capacity(WrsEncoder* e);
+
+//-----------------------------------------------------------------------------
+// Fragments
+//-----------------------------------------------------------------------------
+
+// Application level fragment of a large message.
+// Each fragment is sent as a binary message with a single WrsChunkFrag chunk
+// whose data starts with the message id and the fragment flags followed by
+// the fragment payload. Unlike WebSocket fragments, the fragment messages
+// may be interleaved with other messages sent to the same connection.
+typedef struct WrsFrag {
+    uint32_t    id;         // Id of the fragmented message
+    uint32_t    flags;      // Fragment flags
+    const void* data;       // Fragment payload
+    size_t      len;        // Length in bytes of the fragment payload
+} WrsFrag;
+
+#define WRS_FRAG_FIRST      (1)     // First fragment of the message
+#define WRS_FRAG_LAST       (2)     // Last fragment of the message
+#define WRS_FRAG_TEXT       (4)     // The fragmented message is a text message
+#define WRS_FRAG_OVERHEAD   (20)    // Maximum number of bytes added to the fragment payload
+
+// Encodes fragment message into 'dst', which must have space for the
+// fragment payload plus WRS_FRAG_OVERHEAD bytes.
+// Returns the length in bytes of the encoded message.
+size_t wrs_frag_encode(void* dst, const WrsFrag* frag);
+
+// Decodes the headers of binary message if it is a fragment message.
+// The fragment payload points to the message data.
+// Returns false if the message is not a valid fragment message.
+bool wrs_frag_decode(const void* data, size_t len, WrsFrag* frag);
+
+//-----------------------------------------------------------------------------
+// Streams
+//-----------------------------------------------------------------------------
+
+// Stream message exchanged without the call and response envelope.
+// Each stream message is a binary message with a single WrsChunkStream chunk
+// whose data starts with the stream id, the message kind and a value
+// followed by the message payload.
+typedef struct WrsStreamMsg {
+    uint32_t    sid;        // Stream id
+    uint32_t    kind;       // Message kind
+    uint32_t    value;      // Frame sequence number or number of credits
+    const void* data;       // Stream name or frame payload
+    size_t      len;        // Length in bytes of the payload
+} WrsStreamMsg;
+
+#define WRS_STREAM_OPEN     (1)     // Server opened stream with the name in the payload
+#define WRS_STREAM_DATA     (2)     // Frame pushed by the server
+#define WRS_STREAM_CREDIT   (3)     // Client granted 'value' credits
+#define WRS_STREAM_CLOSE    (4)     // Stream closed by the server or by the client
+#define WRS_STREAM_OVERHEAD (24)    // Maximum number of bytes added to the stream payload
+
+// Encodes stream message into 'dst', which must have space for the
+// payload plus WRS_STREAM_OVERHEAD bytes.
+// Returns the length in bytes of the encoded message.
+size_t wrs_stream_encode(void* dst, const WrsStreamMsg* msg);
+
+// Decodes the headers of binary message if it is a stream message.
+// The message payload points to the message data.
+// Returns false if the message is not a valid stream message.
+bool wrs_stream_decode(const void* data, size_t len, WrsStreamMsg* msg);
+
 //-----------------------------------------------------------------------------
 // Decoder
 //-----------------------------------------------------------------------------
@@ -45,9 +131,69 @@ void wrs_decoder_del(WrsDecoder* d);
 // Clear message decoder state, without deallocating memory
 void wrs_decoder_clear(WrsDecoder* e);
 
-// Decodes message text or binary message
+// Sets the maximum size in bytes of decoded messages.
+// Zero disables the limit (default).
+void wrs_decoder_set_max_size(WrsDecoder* d, size_t max_size);
+
+// Sets the function called before the incremental decoder allocates memory
+// for the received fragments, which returns false to reject the allocation.
+// NULL disables the check (default).
+typedef bool (*WrsDecoderCheckFn)(void* ctx, size_t size);
+void wrs_decoder_set_check(WrsDecoder* d, WrsDecoderCheckFn fn, void* ctx);
+
+// Sets the minimum length of homogeneous numeric arrays which are decoded
+// directly as float64 buffers instead of arrays of numbers.
+// Zero disables the promotion (default).
+void wrs_decoder_set_promote(WrsDecoder* d, size_t min_len);
+
+// Sets the allocator used by the JSON parser, which may be an arena cleared
+// after each message is processed. NULL restores the decoder allocator (default).
+void wrs_decoder_set_parse_allocator(WrsDecoder* d, const CxAllocator* alloc);
+
+// Decodes message text or binary message.
+// Binary messages may contain either a JSON or a MessagePack message chunk.
 CxError wrs_decoder_dec(WrsDecoder* d, bool text, void* data, size_t len, CxVar* msg);
 
+// Message envelope fields found by wrs_decoder_scan().
+// Pointers refer to the scanned message data.
+typedef struct WrsEnvelope {
+    WrsFormat   format;     // Format of the message chunk
+    bool        has_cid;    // Message is a remote call
+    int64_t     cid;        // Call id
+    bool        has_rid;    // Message is a response
+    int64_t     rid;        // Response id
+    const char* call;       // Unescaped remote function name (not NUL terminated)
+    size_t      call_len;   // Length of remote function name
+    const void* body;       // Encoded 'params' or 'resp' value or NULL
+    size_t      body_len;   // Length of encoded body
+} WrsEnvelope;
+
+// Scans only the top level fields of text or binary message without
+// decoding the message body.
+CxError wrs_decoder_scan(WrsDecoder* d, bool text, void* data, size_t len, WrsEnvelope* env);
+
+// Starts incremental decoding of a message which arrives in fragments.
+// Releases the memory of the previous incrementally decoded message.
+void wrs_decoder_begin(WrsDecoder* d, bool text);
+
+// Decodes the next fragment of the message started with wrs_decoder_begin().
+// The chunks of binary messages are allocated with their exact sizes as soon
+// as their headers are received and the fragment payloads are copied in place.
+// Returns error if the message is invalid or exceeds the maximum size.
+CxError wrs_decoder_feed(WrsDecoder* d, const void* data, size_t len);
+
+// Finishes incremental decoding of the message and scans its envelope
+// as wrs_decoder_scan(). The envelope is valid until the next call to
+// wrs_decoder_begin() or wrs_decoder_release().
+CxError wrs_decoder_end(WrsDecoder* d, WrsEnvelope* env);
+
+// Releases the memory of the last incrementally decoded message.
+void wrs_decoder_release(WrsDecoder* d);
+
+// Decodes the body of the last message scanned by wrs_decoder_scan() or wrs_decoder_end().
+// The scanned message data must still be valid.
+CxError wrs_decoder_dec_body(WrsDecoder* d, const WrsEnvelope* env, CxVar* body);
+
 
 #endif
 
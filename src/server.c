@@ -3,12 +3,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <inttypes.h>
 #include "zip.h"
 #include "cx_alloc.h"
 #include "civetweb.h"
 #include "wrs.h"
 #define WRS_SERVER_IMPLEMENT
 #include "server.h"
+#include "probes.h"
+
+#define TIMER_TICK_MS       (50)    // Interval of the timer which sends the RPC keepalive pings and the store changes
 
 // Global logger
 static CxLogger* glogger = NULL;
@@ -17,6 +21,17 @@ static CxLogger* glogger = NULL;
 static int wrs_find_port(Wrs* wrs);
 static int wrs_zip_file_handler(struct mg_connection *conn, void *cbdata);
 static int wrs_start_browser(Wrs* wrs);
+static int wrs_metrics_handler(struct mg_connection *conn, void *cbdata);
+static int wrs_begin_request(struct mg_connection *conn);
+static void wrs_end_request(const struct mg_connection *conn, int status);
+static int wrs_log_access(const struct mg_connection *conn, const char *message);
+static size_t wrs_status_class(int status);
+static char* wrs_strdup(Wrs* wrs, const char* s);
+static void* wrs_mem_alloc(void* ctx, size_t size);
+static void wrs_mem_free(void* ctx, void* p, size_t size);
+static void* wrs_mem_resize(void* ctx, void* p, size_t old_size, size_t size);
+static void wrs_mem_add(Wrs* wrs, size_t size);
+static void wrs_tick_timer(CxTimer* tm, void* arg);
 
 
 CxLogger* wrs_logger_init(const CxAllocator* alloc, const char*  prefix) {
@@ -40,11 +55,23 @@ Wrs* wrs_create(const WrsConfig* cfg) {
         wrs_logger_init(NULL, "WRS");
     }
 
-    // Creates and initializes internal state
-    Wrs* wrs = cx_alloc_mallocz(NULL, sizeof(Wrs));
+    // Creates and initializes internal state.
+    // All the server allocations use the configured allocator through
+    // the server allocator, which accounts the memory used.
+    const CxAllocator* base_alloc = cfg->alloc ? cfg->alloc : cx_def_allocator();
+    Wrs* wrs = cx_alloc_mallocz(base_alloc, sizeof(Wrs));
     wrs->cfg = *cfg;
-    wrs->rpc_handlers = map_rpc_init(0);
-    assert(pthread_mutex_init(&wrs->lock, NULL) == 0);
+    wrs->base_alloc = base_alloc;
+    wrs->alloc = (CxAllocator){
+        .ctx = wrs,
+        .alloc = wrs_mem_alloc,
+        .free = wrs_mem_free,
+        .resize = wrs_mem_resize,
+    };
+    wrs_mem_add(wrs, sizeof(Wrs));
+    wrs->rpc_handlers = map_rpc_init(&wrs->alloc, 0);
+    lock_init(&wrs->lock, "wrs");
+    lock_init(&wrs->tick_lock, "wrs_tick");
 
     // If configured listening port is 0, finds an unused port
     wrs->used_port = cfg->listening_port;
@@ -57,33 +84,44 @@ Wrs* wrs_create(const WrsConfig* cfg) {
     }
 
     // Builds server options array
-    wrs->options = arr_opt_init();
+    wrs->options = arr_opt_init(&wrs->alloc);
     if (cfg->document_root) {
         arr_opt_push(&wrs->options, "document_root");
-        char* document_root = strdup(cfg->document_root);
-        strcpy(document_root, cfg->document_root);
-        arr_opt_push(&wrs->options, document_root);
+        arr_opt_push(&wrs->options, wrs_strdup(wrs, cfg->document_root));
     }
 
     // Sets listening port
-    const size_t size = 32;
-    char* listening_ports = malloc(size);
-    snprintf(listening_ports, size-1, "%u", wrs->used_port);
+    char value[32];
+    snprintf(value, sizeof(value), "%u", wrs->used_port);
     arr_opt_push(&wrs->options, "listening_ports");
-    arr_opt_push(&wrs->options, listening_ports);
+    arr_opt_push(&wrs->options, wrs_strdup(wrs, value));
+
+    // Sets number of worker threads
+    if (cfg->num_threads > 0) {
+        snprintf(value, sizeof(value), "%d", cfg->num_threads);
+        arr_opt_push(&wrs->options, "num_threads");
+        arr_opt_push(&wrs->options, wrs_strdup(wrs, value));
+    }
     // Options array terminator
     arr_opt_push(&wrs->options, NULL);
     arr_opt_push(&wrs->options, NULL);
 
     // Starts CivitWeb server
     mg_init_library(0);
-    const struct mg_callbacks callbacks = {0};
+    struct mg_callbacks callbacks = {0};
+    if (cfg->metrics) {
+        wrs->metrics = metrics_alloc(&wrs->alloc, sizeof(HttpMetrics));
+        callbacks.begin_request = wrs_begin_request;
+        callbacks.end_request = wrs_end_request;
+        callbacks.log_access = wrs_log_access;
+    }
     wrs->ctx = mg_start(&callbacks, wrs, (const char**) wrs->options.data);
 
     // Free options array allocated elements (odd indexes)
     for (size_t i = 0; i < arr_opt_len(&wrs->options); i++) {
-        if (i % 2) {
-            free((char*)wrs->options.data[i]);
+        const char* opt = wrs->options.data[i];
+        if (i % 2 && opt) {
+            cx_alloc_free(&wrs->alloc, (char*)opt, strlen(opt) + 1);
         }
     }
     arr_opt_free(&wrs->options);
@@ -94,6 +132,11 @@ Wrs* wrs_create(const WrsConfig* cfg) {
         return NULL;
     }
 
+    // Set metrics handler before the static filesystem handler which matches all urls
+    if (cfg->metrics) {
+        mg_set_request_handler(wrs->ctx, "/metrics", wrs_metrics_handler, wrs);
+    }
+
     // Open internal zipped static filesystem, if configured.
     if (cfg->use_staticfs) {
         // Creates zip source from specified zip data and length
@@ -114,11 +157,12 @@ Wrs* wrs_create(const WrsConfig* cfg) {
     }
 
     // Creates timer manager
-    wrs->tm = cx_timer_create(cx_def_allocator());
+    wrs->tm = cx_timer_create(&wrs->alloc);
     if (wrs->tm == NULL) {
         WRS_LOGE("%s: error from cx_timer_create()", __func__);
         return NULL;
     }
+    cx_timer_set(wrs->tm, TIMER_TICK_MS, wrs_tick_timer, wrs);
 
     // Starts browser, if requested
     if (wrs->cfg.browser.start) {
@@ -134,6 +178,8 @@ Wrs* wrs_create(const WrsConfig* cfg) {
 // Stops and destroy previously created wrs server
 void  wrs_destroy(Wrs* wrs) {
 
+    // Stops the timer before the endpoints used by its callbacks are closed
+    cx_timer_destroy(wrs->tm);
     mg_stop(wrs->ctx);
     wrs->ctx = NULL;
 
@@ -150,12 +196,43 @@ void  wrs_destroy(Wrs* wrs) {
     }
     map_rpc_free(&wrs->rpc_handlers);
 
-    cx_timer_destroy(wrs->tm);
     if (wrs->zip) {
         zip_close(wrs->zip);
     }
-    assert(pthread_mutex_destroy(&wrs->lock) == 0);
-    cx_alloc_free(NULL, wrs, sizeof(Wrs));
+    metrics_free(&wrs->alloc, wrs->metrics, sizeof(HttpMetrics));
+    lock_destroy(&wrs->lock);
+    lock_destroy(&wrs->tick_lock);
+    cx_alloc_free(wrs->base_alloc, wrs, sizeof(Wrs));
+}
+
+int wrs_get_port(Wrs* wrs) {
+
+    return wrs->used_port;
+}
+
+WrsMemStats wrs_mem_stats(Wrs* wrs) {
+
+    return (WrsMemStats){
+        .used = atomic_load_explicit(&wrs->mem_used, memory_order_relaxed),
+        .peak = atomic_load_explicit(&wrs->mem_peak, memory_order_relaxed),
+        .budget = wrs->cfg.mem_budget,
+        .rejected = atomic_load_explicit(&wrs->mem_rejected, memory_order_relaxed),
+    };
+}
+
+bool wrs_mem_check(Wrs* wrs, size_t size) {
+
+    const size_t budget = wrs->cfg.mem_budget;
+    if (budget == 0 || atomic_load_explicit(&wrs->mem_used, memory_order_relaxed) + size <= budget) {
+        return true;
+    }
+    atomic_fetch_add_explicit(&wrs->mem_rejected, 1, memory_order_relaxed);
+    return false;
+}
+
+CxError wrs_lock_stats(Wrs* wrs, WrsLockStats* stats) {
+
+    return lock_stats(&wrs->lock, stats);
 }
 
 //-----------------------------------------------------------------------------
@@ -208,7 +285,7 @@ static int wrs_zip_file_handler(struct mg_connection *conn, void *cbdata) {
     }
 
     // Locks access to the zip file
-    assert(pthread_mutex_lock(&wrs->lock) == 0);
+    LOCK(&wrs->lock);
     int res = 0;
 
     // Get deflated file size from zip archive
@@ -220,7 +297,12 @@ static int wrs_zip_file_handler(struct mg_connection *conn, void *cbdata) {
     }
 
     // Allocates buffer to read file deflated data
-    void *fileBuf = malloc(stats.size);
+    if (!wrs_mem_check(wrs, stats.size)) {
+        mg_send_http_error(conn, 503, "%s", "Error: Memory budget exceeded");
+        res = 1;
+        goto unlock;
+    }
+    void *fileBuf = cx_alloc_malloc(&wrs->alloc, stats.size);
     if (fileBuf == NULL) {
         mg_send_http_error(conn, 500, "%s", "Error: No memory");
         res = 1;
@@ -231,7 +313,7 @@ static int wrs_zip_file_handler(struct mg_connection *conn, void *cbdata) {
     zip_file_t* zipf = zip_fopen(wrs->zip, filepath, 0);
     if (zipf == NULL) {
         mg_send_http_error(conn, 500, "%s", "Error: Open file");
-        free(fileBuf);
+        cx_alloc_free(&wrs->alloc, fileBuf, stats.size);
         res = 1;
         goto unlock;
     }
@@ -240,14 +322,14 @@ static int wrs_zip_file_handler(struct mg_connection *conn, void *cbdata) {
     zip_int64_t nread = zip_fread(zipf, fileBuf, stats.size);
     if (nread < 0) {
         mg_send_http_error(conn, 500, "%s", "Error: Reading file");
-        free(fileBuf);
+        cx_alloc_free(&wrs->alloc, fileBuf, stats.size);
         res = 1;
         goto unlock;
     }
     zip_fclose(zipf);
 
 unlock:
-    assert(pthread_mutex_unlock(&wrs->lock) == 0);
+    UNLOCK(&wrs->lock);
     if (res) {
         return res;
     }
@@ -265,12 +347,110 @@ unlock:
     // Send file data
     res = mg_write(conn, fileBuf, stats.size);
     assert(res == (int)stats.size);
+    WRS_PROBE2(static_served, filepath, stats.size);
 
-    free(fileBuf);
-    printf("zip:%s (%s)\n", filepath, mime_type);
+    cx_alloc_free(&wrs->alloc, fileBuf, stats.size);
+    WRS_LOGD("zip:%s (%s)", filepath, mime_type);
     return res;
 }
 
+// Start time of the request being processed by the current server thread
+static _Thread_local uint64_t wrs_request_start;
+
+// Handler for the Prometheus "/metrics" endpoint
+static int wrs_metrics_handler(struct mg_connection *conn, void *cbdata) {
+
+    Wrs* wrs = cbdata;
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&buf, &len);
+    if (f == NULL) {
+        mg_send_http_error(conn, 500, "%s", "Error: No memory");
+        return 500;
+    }
+
+    // HTTP requests
+    static const char* classes[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+    const char* name = "wrs_http_request_duration_seconds";
+    metrics_write_header(f, name, "histogram", "Duration of HTTP requests by status class");
+    for (size_t i = 0; i < 5; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "code=\"%s\"", classes[i]);
+        metrics_write_histogram(f, name, label, &wrs->metrics->duration[i]);
+    }
+    name = "wrs_http_response_bytes_total";
+    metrics_write_header(f, name, "counter", "Bytes sent in HTTP responses by status class");
+    for (size_t i = 0; i < 5; i++) {
+        fprintf(f, "%s{code=\"%s\"} %"PRIu64"\n", name, classes[i], metrics_get(&wrs->metrics->bytes[i]));
+    }
+
+    // Server memory
+    const WrsMemStats mem = wrs_mem_stats(wrs);
+    metrics_write_header(f, "wrs_memory_bytes", "gauge", "Number of bytes allocated by the server");
+    fprintf(f, "wrs_memory_bytes %zu\n", mem.used);
+    metrics_write_header(f, "wrs_memory_budget_bytes", "gauge", "Memory budget of the server (0 for no limit)");
+    fprintf(f, "wrs_memory_budget_bytes %zu\n", mem.budget);
+    metrics_write_header(f, "wrs_memory_rejected_messages_total", "counter", "Number of received messages rejected by the memory budget");
+    fprintf(f, "wrs_memory_rejected_messages_total %"PRIu64"\n", mem.rejected);
+
+    // RPC endpoints
+    wrs_rpc_write_metrics(wrs, f);
+    fclose(f);
+
+    char lenStr[64];
+    snprintf(lenStr, sizeof(lenStr)-1, "%zu", len);
+    mg_response_header_start(conn, 200);
+    mg_response_header_add(conn, "Content-Type", "text/plain; version=0.0.4", -1);
+    mg_response_header_add(conn, "Content-Length", lenStr, -1);
+    mg_response_header_send(conn);
+    mg_write(conn, buf, len);
+    free(buf);
+    return 200;
+}
+
+// Called by the server before processing each request
+// Returns 0 to let the server process the request.
+static int wrs_begin_request(struct mg_connection *conn) {
+
+    wrs_request_start = metrics_now_us();
+    return 0;
+}
+
+// Called by the server after processing each request
+static void wrs_end_request(const struct mg_connection *conn, int status) {
+
+    Wrs* wrs = mg_get_user_data(mg_get_context(conn));
+    metrics_observe(&wrs->metrics->duration[wrs_status_class(status)], metrics_now_us() - wrs_request_start);
+}
+
+// Called by the server with the access log line of each request.
+// It is the only place where the number of bytes sent is available,
+// which follows the status code after the request line:
+// <addr> - <user> [<date>] "<method> <uri> HTTP/<version>" <status> <bytes> ...
+// Returns 0 to let the server also write the line to the access log file, if configured.
+static int wrs_log_access(const struct mg_connection *conn, const char *message) {
+
+    const char* p = strstr(message, " HTTP/");
+    p = p ? strchr(p, '"') : NULL;
+    int status;
+    int64_t bytes;
+    if (p == NULL || sscanf(p + 1, "%d %"SCNd64, &status, &bytes) != 2 || bytes < 0) {
+        return 0;
+    }
+    Wrs* wrs = mg_get_user_data(mg_get_context(conn));
+    metrics_add(&wrs->metrics->bytes[wrs_status_class(status)], bytes);
+    return 0;
+}
+
+// Returns the index of the HTTP status class
+static size_t wrs_status_class(int status) {
+
+    if (status < 100 || status >= 600) {
+        return 4;
+    }
+    return status / 100 - 1;
+}
+
 static int wrs_start_browser(Wrs* wrs) {
 
     // Generates URL
@@ -294,4 +474,71 @@ static int wrs_start_browser(Wrs* wrs) {
     return res;
 }
 
+// Duplicates string using the server allocator
+static char* wrs_strdup(Wrs* wrs, const char* s) {
+
+    const size_t len = strlen(s) + 1;
+    char* dup = cx_alloc_malloc(&wrs->alloc, len);
+    memcpy(dup, s, len);
+    return dup;
+}
+
+// Server allocator functions which account the memory used
+static void* wrs_mem_alloc(void* ctx, size_t size) {
 
+    Wrs* wrs = ctx;
+    void* p = cx_alloc_malloc(wrs->base_alloc, size);
+    if (p) {
+        wrs_mem_add(wrs, size);
+    }
+    return p;
+}
+
+static void wrs_mem_free(void* ctx, void* p, size_t size) {
+
+    Wrs* wrs = ctx;
+    if (p) {
+        cx_alloc_free(wrs->base_alloc, p, size);
+        atomic_fetch_sub_explicit(&wrs->mem_used, size, memory_order_relaxed);
+    }
+}
+
+static void* wrs_mem_resize(void* ctx, void* p, size_t old_size, size_t size) {
+
+    Wrs* wrs = ctx;
+    void* np = cx_alloc_realloc(wrs->base_alloc, p, old_size, size);
+    if (np) {
+        atomic_fetch_sub_explicit(&wrs->mem_used, p ? old_size : 0, memory_order_relaxed);
+        wrs_mem_add(wrs, size);
+    }
+    return np;
+}
+
+// Adds allocated size to the memory used and updates its peak
+static void wrs_mem_add(Wrs* wrs, size_t size) {
+
+    const size_t used = atomic_fetch_add_explicit(&wrs->mem_used, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&wrs->mem_peak, memory_order_relaxed);
+    while (used > peak && !atomic_compare_exchange_weak_explicit(&wrs->mem_peak, &peak, used,
+        memory_order_relaxed, memory_order_relaxed)) {
+        ;
+    }
+}
+
+// Periodic timer which sends the keepalive pings of all the RPC endpoints
+// and the changes of the state stores.
+// The endpoints and stores are only added and removed with the tick lock held,
+// so the server lock is not held while writing to the connections.
+static void wrs_tick_timer(CxTimer* tm, void* arg) {
+
+    Wrs* wrs = arg;
+    LOCK(&wrs->tick_lock);
+    map_rpc_iter iter = {0};
+    map_rpc_entry* e;
+    while ((e = map_rpc_next(&wrs->rpc_handlers, &iter)) != NULL) {
+        wrs_rpc_keepalive(e->val);
+    }
+    wrs_store_tick(wrs);
+    UNLOCK(&wrs->tick_lock);
+    cx_timer_set(tm, TIMER_TICK_MS, wrs_tick_timer, wrs);
+}
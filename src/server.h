@@ -4,6 +4,10 @@
 #include "civetweb.h"
 #include "zip.h"
 #include "wrs.h"
+#include "metrics.h"
+#include "lock.h"
+
+#include <stdatomic.h>
 
 #include "cx_pool_allocator.h"
 #include "cx_timer.h"
@@ -11,6 +15,7 @@
 // Define/declare array of server options
 #define cx_array_name arr_opt
 #define cx_array_type const char*
+#define cx_array_instance_allocator
 #ifdef WRS_SERVER_IMPLEMENT
 #   define cx_array_implement
 #endif
@@ -19,31 +24,74 @@
 
 // Define/declare hashmap from URL to WebSocket handler info
 // NOTE: it must not be static as 'map_rpc' is also used by 'rpc.c'
+// The URL keys are owned by the RPC endpoints.
 #define cx_hmap_name                map_rpc
 #define cx_hmap_key                 char*
 #define cx_hmap_val                 WrsRpc*
 #define cx_hmap_cmp_key(k1,k2,s)    strcmp(*(char**)k1,*(char**)k2)
 #define cx_hmap_hash_key(k,s)       cx_hmap_hash_fnv1a32(*((char**)k), strlen(*(char**)k))
-#define cx_hmap_free_key(k)         free(*k)
+#define cx_hmap_instance_allocator
 #ifdef WRS_SERVER_IMPLEMENT
 #   define cx_hmap_implement
 #endif
 #include "cx_hmap.h"
 
+// HTTP requests metrics
+typedef struct HttpMetrics {
+    MetricsHistogram    duration[5];    // Request durations by status class (1xx-5xx)
+    MetricsCounter      bytes[5];       // Response bytes by status class (1xx-5xx)
+} HttpMetrics;
+
 // WRS server internal state
 typedef struct Wrs {
     WrsConfig           cfg;            // Copy of user configuration
     arr_opt             options;        // Array of server options
     int                 used_port;      // Used TCP/IP listening port
     CxTimer*            tm;             // Timer manager
-    pthread_mutex_t     lock;           // For exclusive access to this state
+    Lock                lock;           // For exclusive access to this state
+    Lock                tick_lock;      // Serializes the timer ticks with the changes of the endpoints and stores
     struct mg_context*  ctx;            // CivitWeb context
     zip_source_t*       zip_src;        // For zip static filesystem
     zip_t*              zip;            // For zip static filesystem
     map_rpc             rpc_handlers;   // Map url to web socket rpc handler
     void*               userdata;       // Optional userdata
+    HttpMetrics*        metrics;        // HTTP metrics if enabled or NULL
+    CxAllocator         alloc;          // Allocator for all the server allocations which accounts the memory used
+    const CxAllocator*  base_alloc;     // Configured allocator
+    _Atomic size_t      mem_used;       // Number of bytes allocated
+    _Atomic size_t      mem_peak;       // Maximum number of bytes allocated
+    _Atomic uint64_t    mem_rejected;   // Number of received messages rejected by the memory budget
+    WrsStore*           stores;         // List of the state stores whose changes are sent by the timer
 } Wrs;
 
+// Writes the metrics of all the server RPC endpoints
+void wrs_rpc_write_metrics(Wrs* wrs, FILE* f);
+
+// Sends the keepalive pings of the RPC endpoint connections which are due
+// and closes the connections which didn't answer the previous pings.
+// Called periodically by the server timer with the server tick lock held.
+void wrs_rpc_keepalive(WrsRpc* rpc);
+
+// Returns the server of the RPC endpoint or NULL for loopback only endpoints
+Wrs* wrs_rpc_get_server(WrsRpc* rpc);
+
+// Returns the serial number of the open connection, which is unique in the
+// endpoint, or 0 if the connection is closed.
+uint64_t wrs_rpc_conn_serial(WrsRpc* rpc, size_t connid);
+
+// Calls remote function without response callback.
+// Returns error if the connection is closed or was replaced by a connection
+// with a different serial number.
+CxError wrs_rpc_call_serial(WrsRpc* rpc, size_t connid, uint64_t serial, const char* remote_name, CxVar* params);
+
+// Sends the changes of the server state stores whose intervals elapsed.
+// Called periodically by the server timer with the server tick lock held.
+void wrs_store_tick(Wrs* wrs);
+
+// Checks if a new received message of the specified size fits in the memory budget.
+// Returns false and counts the rejected message if it doesn't.
+bool wrs_mem_check(Wrs* wrs, size_t size);
+
 
 #endif
 
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cx_alloc.h"
+#include "cx_var.h"
+
+#include "wrs.h"
+#include "server.h"
+
+// Connection subscribed to the store
+typedef struct StoreSub {
+    struct StoreSub*    next;       // Next subscriber or NULL
+    size_t              connid;     // Connection id
+    uint64_t            serial;     // Connection serial number, which detects reused connection ids
+} StoreSub;
+
+// Path changed since the last batch of changes was sent
+typedef struct StorePath {
+    struct StorePath*   next;       // Next changed path or NULL
+    size_t              len;        // Path length
+    char                path[];     // Nul terminated path
+} StorePath;
+
+// State store
+typedef struct WrsStore {
+    Lock                lock;       // For exclusive access to this state
+    WrsRpc*             rpc;        // Associated RPC endpoint
+    Wrs*                wrs;        // Server of the endpoint or NULL
+    const CxAllocator*  alloc;      // Allocator of the store state
+    char*               name;       // Store name
+    CxVar*              state;      // Store state map
+    StoreSub*           subs;       // List of subscribed connections
+    StorePath*          changed;    // List of changed paths not sent
+    uint64_t            interval;   // Minimum interval in microseconds between batches of changes
+    uint64_t            last_sent;  // Time in microseconds when the last batch of changes was sent
+    struct WrsStore*    next;       // Next store of the server
+} WrsStore;
+
+#define STORE_CALL          "wrs_store" // Remote function called with the snapshots and changes
+#define STORE_MAX_PATH      (256)       // Maximum length of the paths
+
+// Forward declarations of local functions
+static CxVar* store_lookup(WrsStore* store, const char* path);
+static CxError store_split(const char* path, char* keys, size_t* nkeys);
+static void store_mark(WrsStore* store, const char* path);
+static bool store_covers(const char* a, size_t alen, const char* b, size_t blen);
+static void store_send(WrsStore* store);
+static void store_call(WrsStore* store, CxVar* params);
+
+
+WrsStore* wrs_store_open(WrsRpc* rpc, const char* name, size_t interval_ms) {
+
+    Wrs* wrs = wrs_rpc_get_server(rpc);
+    const CxAllocator* alloc = wrs ? &wrs->alloc : cx_def_allocator();
+    WrsStore* store = cx_alloc_mallocz(alloc, sizeof(WrsStore));
+    const size_t name_len = strlen(name);
+    *store = (WrsStore){
+        .rpc = rpc,
+        .wrs = wrs,
+        .alloc = alloc,
+        .name = cx_alloc_malloc(alloc, name_len + 1),
+        .state = cx_var_new(alloc),
+        .interval = (uint64_t)interval_ms * 1000,
+    };
+    memcpy(store->name, name, name_len + 1);
+    cx_var_set_map(store->state);
+    lock_init(&store->lock, store->name);
+
+    // Adds the store to the list of stores of the server timer
+    if (wrs) {
+        LOCK(&wrs->tick_lock);
+        store->next = wrs->stores;
+        wrs->stores = store;
+        UNLOCK(&wrs->tick_lock);
+    }
+    return store;
+}
+
+void wrs_store_close(WrsStore* store) {
+
+    if (store->wrs) {
+        LOCK(&store->wrs->tick_lock);
+        WrsStore** prev = &store->wrs->stores;
+        while (*prev != store) {
+            prev = &(*prev)->next;
+        }
+        *prev = store->next;
+        UNLOCK(&store->wrs->tick_lock);
+    }
+
+    while (store->subs) {
+        StoreSub* sub = store->subs;
+        store->subs = sub->next;
+        cx_alloc_free(store->alloc, sub, sizeof(StoreSub));
+    }
+    while (store->changed) {
+        StorePath* p = store->changed;
+        store->changed = p->next;
+        cx_alloc_free(store->alloc, p, sizeof(StorePath) + p->len + 1);
+    }
+    cx_var_del(store->state);
+    lock_destroy(&store->lock);
+    cx_alloc_free(store->alloc, store->name, strlen(store->name) + 1);
+    cx_alloc_free(store->alloc, store, sizeof(WrsStore));
+}
+
+CxError wrs_store_set(WrsStore* store, const char* path, const CxVar* val) {
+
+    char keys[STORE_MAX_PATH];
+    size_t nkeys;
+    CxError err = store_split(path, keys, &nkeys);
+    if (err.code) {
+        return err;
+    }
+
+    // Walks the path creating or replacing the intermediate maps
+    LOCK(&store->lock);
+    CxVar* map = store->state;
+    const char* key = keys;
+    for (size_t i = 0; i < nkeys - 1; i++) {
+        CxVar* next = cx_var_get_map_map(map, key);
+        map = next ? next : cx_var_set_map_map(map, key);
+        key += strlen(key) + 1;
+    }
+    cx_var_cpy_val(val, cx_var_set_map_null(map, key));
+    store_mark(store, path);
+
+    // Sends the change now if the interval elapsed since the last batch
+    if (metrics_now_us() - store->last_sent >= store->interval) {
+        store_send(store);
+    }
+    UNLOCK(&store->lock);
+    return err;
+}
+
+CxError wrs_store_get(WrsStore* store, const char* path, CxVar* val) {
+
+    LOCK(&store->lock);
+    CxError err = {};
+    CxVar* src = store_lookup(store, path);
+    if (src == NULL) {
+        err = CXERR("path not found");
+        goto exit;
+    }
+    cx_var_cpy_val(src, val);
+
+exit:
+    UNLOCK(&store->lock);
+    return err;
+}
+
+CxError wrs_store_subscribe(WrsStore* store, size_t connid) {
+
+    const uint64_t serial = wrs_rpc_conn_serial(store->rpc, connid);
+    if (serial == 0) {
+        return CXERR("invalid connection id");
+    }
+
+    LOCK(&store->lock);
+    CxError err = {};
+    StoreSub* sub;
+    for (sub = store->subs; sub; sub = sub->next) {
+        if (sub->connid == connid) {
+            break;
+        }
+    }
+    if (sub == NULL) {
+        sub = cx_alloc_malloc(store->alloc, sizeof(StoreSub));
+        sub->next = store->subs;
+        store->subs = sub;
+    }
+    *sub = (StoreSub){.next = sub->next, .connid = connid, .serial = serial};
+
+    // Sends the snapshot of the state.
+    // The changes not sent yet are already in the snapshot and are sent again later.
+    CxVar* params = cx_var_new(store->alloc);
+    cx_var_set_map(params);
+    cx_var_set_map_str(params, "name", store->name);
+    cx_var_cpy_val(store->state, cx_var_set_map_map(params, "snap"));
+    err = wrs_rpc_call_serial(store->rpc, connid, serial, STORE_CALL, params);
+    cx_var_del(params);
+    UNLOCK(&store->lock);
+    if (err.code) {
+        wrs_store_unsubscribe(store, connid);
+    }
+    return err;
+}
+
+CxError wrs_store_unsubscribe(WrsStore* store, size_t connid) {
+
+    LOCK(&store->lock);
+    CxError err = CXERR("connection not subscribed");
+    StoreSub** prev = &store->subs;
+    while (*prev) {
+        StoreSub* sub = *prev;
+        if (sub->connid == connid) {
+            *prev = sub->next;
+            cx_alloc_free(store->alloc, sub, sizeof(StoreSub));
+            err = (CxError){0};
+            break;
+        }
+        prev = &sub->next;
+    }
+    UNLOCK(&store->lock);
+    return err;
+}
+
+void wrs_store_flush(WrsStore* store) {
+
+    LOCK(&store->lock);
+    store_send(store);
+    UNLOCK(&store->lock);
+}
+
+void wrs_store_tick(Wrs* wrs) {
+
+    const uint64_t now = metrics_now_us();
+    for (WrsStore* store = wrs->stores; store; store = store->next) {
+        LOCK(&store->lock);
+        if (store->changed && now - store->last_sent >= store->interval) {
+            store_send(store);
+        }
+        UNLOCK(&store->lock);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Returns the state value at the specified path or NULL if not found
+static CxVar* store_lookup(WrsStore* store, const char* path) {
+
+    char keys[STORE_MAX_PATH];
+    size_t nkeys;
+    if (store_split(path, keys, &nkeys).code) {
+        return NULL;
+    }
+    CxVar* val = store->state;
+    const char* key = keys;
+    for (size_t i = 0; i < nkeys && val; i++) {
+        val = cx_var_get_type(val) == CxVarMap ? cx_var_get_map_val(val, key) : NULL;
+        key += strlen(key) + 1;
+    }
+    return val;
+}
+
+// Copies path to 'keys' replacing the separators by nuls
+static CxError store_split(const char* path, char* keys, size_t* nkeys) {
+
+    const size_t len = strlen(path);
+    if (len == 0 || len >= STORE_MAX_PATH) {
+        return CXERR("invalid path length");
+    }
+    memcpy(keys, path, len + 1);
+    *nkeys = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (keys[i] != '.') {
+            continue;
+        }
+        if (i == 0 || i == len - 1 || keys[i-1] == 0) {
+            return CXERR("path with empty key");
+        }
+        keys[i] = 0;
+        (*nkeys)++;
+    }
+    return (CxError){0};
+}
+
+// Adds path to the list of changed paths.
+// The paths already covered by a changed parent path are not added and the
+// changed paths covered by the new path are removed, as the values of the
+// parent paths include all their children.
+static void store_mark(WrsStore* store, const char* path) {
+
+    const size_t len = strlen(path);
+    StorePath** prev = &store->changed;
+    while (*prev) {
+        StorePath* p = *prev;
+        if (store_covers(p->path, p->len, path, len)) {
+            return;
+        }
+        if (store_covers(path, len, p->path, p->len)) {
+            *prev = p->next;
+            cx_alloc_free(store->alloc, p, sizeof(StorePath) + p->len + 1);
+            continue;
+        }
+        prev = &p->next;
+    }
+    StorePath* p = cx_alloc_malloc(store->alloc, sizeof(StorePath) + len + 1);
+    p->next = NULL;
+    p->len = len;
+    memcpy(p->path, path, len + 1);
+    *prev = p;
+}
+
+// Returns if path 'a' is equal to or a parent of path 'b'
+static bool store_covers(const char* a, size_t alen, const char* b, size_t blen) {
+
+    return alen <= blen && memcmp(a, b, alen) == 0 && (alen == blen || b[alen] == '.');
+}
+
+// Sends the values of the changed paths to the subscribed connections
+static void store_send(WrsStore* store) {
+
+    store->last_sent = metrics_now_us();
+    if (store->changed == NULL) {
+        return;
+    }
+    CxVar* params = NULL;
+    if (store->subs) {
+        params = cx_var_new(store->alloc);
+        cx_var_set_map(params);
+        cx_var_set_map_str(params, "name", store->name);
+    }
+    CxVar* delta = params ? cx_var_set_map_map(params, "delta") : NULL;
+    while (store->changed) {
+        StorePath* p = store->changed;
+        store->changed = p->next;
+        CxVar* val = delta ? store_lookup(store, p->path) : NULL;
+        if (val) {
+            cx_var_cpy_val(val, cx_var_set_map_null(delta, p->path));
+        }
+        cx_alloc_free(store->alloc, p, sizeof(StorePath) + p->len + 1);
+    }
+    if (params) {
+        store_call(store, params);
+        cx_var_del(params);
+    }
+}
+
+// Calls the store function of all the subscribed connections,
+// removing the connections which were closed.
+static void store_call(WrsStore* store, CxVar* params) {
+
+    StoreSub** prev = &store->subs;
+    while (*prev) {
+        StoreSub* sub = *prev;
+        CxError err = wrs_rpc_call_serial(store->rpc, sub->connid, sub->serial, STORE_CALL, params);
+        if (err.code) {
+            *prev = sub->next;
+            cx_alloc_free(store->alloc, sub, sizeof(StoreSub));
+            continue;
+        }
+        prev = &sub->next;
+    }
+}
+
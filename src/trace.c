@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cx_error.h"
+#include "wrs.h"
+#include "trace.h"
+
+// Trace event
+typedef struct TraceEvent {
+    const char* name;           // Static event name
+    uint64_t    ts;             // Start time in nanoseconds
+    uint64_t    dur;            // Duration in nanoseconds for complete events
+    size_t      connid;         // Connection id
+    int64_t     cid;            // Call id or -1
+    char        phase;          // Event phase
+    char        detail[23];     // Optional detail (binding name)
+} TraceEvent;
+
+// Ring buffer of the events of one thread.
+// Only the owner thread writes events, so the buffer is not locked.
+typedef struct TraceBuf {
+    TraceEvent*         events;     // Events ring buffer
+    size_t              cap;        // Capacity in number of events
+    atomic_size_t       count;      // Total number of events written
+    atomic_bool         in_use;     // Buffer owned by a running thread
+    unsigned            tid;        // Buffer index used as thread id in the dump
+    struct TraceBuf*    next;       // Next buffer in the list of all buffers
+} TraceBuf;
+
+#define TRACE_DEFAULT_EVENTS    (8192)  // Default number of events of each thread
+
+atomic_bool trace_enabled = false;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  // Protects the list of buffers
+static TraceBuf* trace_bufs = NULL;                             // List of all buffers
+static unsigned trace_nbufs = 0;                                // Number of buffers
+static size_t trace_nevents = TRACE_DEFAULT_EVENTS;             // Capacity of new buffers
+static pthread_key_t trace_key;                                 // Releases the buffer at thread exit
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local TraceBuf* trace_buf = NULL;                // Buffer of the current thread
+
+// Forward declarations of local functions
+static TraceBuf* trace_get_buf(void);
+static void trace_key_create(void);
+static void trace_release_buf(void* arg);
+static void trace_write_str(FILE* f, const char* s);
+
+
+void wrs_trace_start(size_t nevents) {
+
+    CXCHKZ(pthread_mutex_lock(&trace_lock));
+    trace_nevents = nevents ? nevents : TRACE_DEFAULT_EVENTS;
+    for (TraceBuf* buf = trace_bufs; buf; buf = buf->next) {
+        atomic_store(&buf->count, 0);
+    }
+    CXCHKZ(pthread_mutex_unlock(&trace_lock));
+    atomic_store(&trace_enabled, true);
+}
+
+void wrs_trace_stop(void) {
+
+    atomic_store(&trace_enabled, false);
+}
+
+CxError wrs_trace_dump(const char* path) {
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        return CXERR("error creating trace file");
+    }
+
+    CXCHKZ(pthread_mutex_lock(&trace_lock));
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+    size_t nwritten = 0;
+    TraceEvent* events = NULL;
+    size_t events_cap = 0;
+    for (TraceBuf* buf = trace_bufs; buf; buf = buf->next) {
+
+        // Copies the most recent events of the buffer, which may be concurrently written
+        const size_t count = atomic_load_explicit(&buf->count, memory_order_acquire);
+        size_t first = count > buf->cap ? count - buf->cap : 0;
+        if (events_cap < buf->cap) {
+            events_cap = buf->cap;
+            events = realloc(events, events_cap * sizeof(TraceEvent));
+        }
+        for (size_t i = first; i < count; i++) {
+            events[i - first] = buf->events[i % buf->cap];
+        }
+
+        // Discards the events which were overwritten during the copy
+        const size_t count2 = atomic_load_explicit(&buf->count, memory_order_acquire);
+        const size_t valid = count2 > buf->cap ? count2 - buf->cap : 0;
+        size_t start = 0;
+        if (valid > first) {
+            start = valid - first;
+        }
+
+        for (size_t i = start; i < count - first; i++) {
+            const TraceEvent* ev = &events[i];
+            fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"rpc\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                nwritten ? ",\n" : "", ev->name, ev->phase, buf->tid, ev->ts / 1e3);
+            if (ev->phase == TRACE_COMPLETE) {
+                fprintf(f, ",\"dur\":%.3f", ev->dur / 1e3);
+            } else {
+                fprintf(f, ",\"id\":\"%zu.%"PRId64"\"", ev->connid, ev->cid);
+            }
+            fprintf(f, ",\"args\":{\"connid\":%zu", ev->connid);
+            if (ev->cid >= 0) {
+                fprintf(f, ",\"cid\":%"PRId64, ev->cid);
+            }
+            if (ev->detail[0]) {
+                fputs(",\"detail\":", f);
+                trace_write_str(f, ev->detail);
+            }
+            fputs("}}", f);
+            nwritten++;
+        }
+    }
+    fputs("\n]}\n", f);
+    CXCHKZ(pthread_mutex_unlock(&trace_lock));
+    free(events);
+
+    if (fclose(f) != 0) {
+        return CXERR("error writing trace file");
+    }
+    return (CxError){0};
+}
+
+uint64_t trace_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_event(const char* name, char phase, uint64_t start, size_t connid, int64_t cid, const char* detail) {
+
+    TraceBuf* buf = trace_get_buf();
+    const size_t count = atomic_load_explicit(&buf->count, memory_order_relaxed);
+    TraceEvent* ev = &buf->events[count % buf->cap];
+    ev->name = name;
+    ev->phase = phase;
+    ev->ts = start;
+    ev->dur = phase == TRACE_COMPLETE ? trace_now() - start : 0;
+    ev->connid = connid;
+    ev->cid = cid;
+    ev->detail[0] = 0;
+    if (detail) {
+        strncat(ev->detail, detail, sizeof(ev->detail) - 1);
+    }
+    atomic_store_explicit(&buf->count, count + 1, memory_order_release);
+}
+
+
+//-----------------------------------------------------------------------------
+// Local functions
+//-----------------------------------------------------------------------------
+
+
+// Returns the buffer of the current thread, reusing the buffer
+// of a finished thread or creating a new buffer.
+static TraceBuf* trace_get_buf(void) {
+
+    if (trace_buf) {
+        return trace_buf;
+    }
+
+    CXCHKZ(pthread_once(&trace_key_once, trace_key_create));
+    CXCHKZ(pthread_mutex_lock(&trace_lock));
+    TraceBuf* buf;
+    for (buf = trace_bufs; buf; buf = buf->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&buf->in_use, &expected, true)) {
+            break;
+        }
+    }
+    if (buf == NULL) {
+        buf = calloc(1, sizeof(TraceBuf));
+        buf->cap = trace_nevents;
+        buf->events = malloc(buf->cap * sizeof(TraceEvent));
+        buf->tid = trace_nbufs++;
+        atomic_init(&buf->in_use, true);
+        buf->next = trace_bufs;
+        trace_bufs = buf;
+    }
+    CXCHKZ(pthread_mutex_unlock(&trace_lock));
+
+    CXCHKZ(pthread_setspecific(trace_key, buf));
+    trace_buf = buf;
+    return buf;
+}
+
+static void trace_key_create(void) {
+
+    CXCHKZ(pthread_key_create(&trace_key, trace_release_buf));
+}
+
+// Called when a thread which recorded events exits.
+// The buffer keeps its events and may be reused by a new thread.
+static void trace_release_buf(void* arg) {
+
+    TraceBuf* buf = arg;
+    atomic_store(&buf->in_use, false);
+}
+
+// Writes JSON string
+static void trace_write_str(FILE* f, const char* s) {
+
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Tracing of the RPC message processing stages.
+// When enabled by wrs_trace_start(), each stage is recorded as an event in
+// the ring buffer of the current thread, without locks.
+// When disabled, each trace point costs one relaxed atomic load.
+
+// Trace event phases (Chrome trace event format)
+#define TRACE_COMPLETE      'X'     // Stage with start time and duration
+#define TRACE_ASYNC_BEGIN   'b'     // Begin of call round trip
+#define TRACE_ASYNC_END     'e'     // End of call round trip
+
+// Tracing enabled flag
+extern atomic_bool trace_enabled;
+
+// Returns monotonic time in nanoseconds
+uint64_t trace_now(void);
+
+// Records event in the ring buffer of the current thread
+// name - static event name
+// phase - event phase
+// start - start time in nanoseconds
+// connid - connection id
+// cid - call id or -1
+// detail - optional event detail or NULL
+void trace_event(const char* name, char phase, uint64_t start, size_t connid, int64_t cid, const char* detail);
+
+// Returns the start time of a stage or 0 if tracing is disabled
+static inline uint64_t trace_begin(void) {
+
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? trace_now() : 0;
+}
+
+// Records stage started at the time returned by trace_begin()
+static inline void trace_end(const char* name, uint64_t start, size_t connid, int64_t cid, const char* detail) {
+
+    if (start) {
+        trace_event(name, TRACE_COMPLETE, start, connid, cid, detail);
+    }
+}
+
+// Records the begin or end of a call round trip correlated by connection and call id
+static inline void trace_async(const char* name, char phase, size_t connid, int64_t cid) {
+
+    if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        trace_event(name, phase, trace_now(), connid, cid, NULL);
+    }
+}
+
+#endif
+
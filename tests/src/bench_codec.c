@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cx_alloc.h"
+#include "cx_pool_allocator.h"
+#include "cx_json_parse.h"
+
+#include "argparse.h"
+#include "rpc_codec.h"
+
+// Micro benchmark of the RPC message encoder and decoder.
+// Measures messages/s, MB/s and allocations per message for a matrix of
+// message shapes and writes the results as JSON, optionally comparing
+// them with the results of a previous run (baseline).
+
+// Benchmark options
+typedef struct Options {
+    int         cpu;            // CPU to pin the benchmark thread (-1 to not pin)
+    int         min_ms;         // Minimum measuring time per case in milliseconds
+    int         max_mb;         // Maximum size of buffer cases in MB
+    const char* filter;         // Optional substring of the cases to run
+    const char* out;            // Optional output file (default stdout)
+    const char* baseline;       // Optional baseline results file
+} Options;
+
+// Allocation counter used as the codec allocator
+typedef struct AllocCounter {
+    size_t  count;              // Number of allocations and resizes
+} AllocCounter;
+
+// Benchmark case
+typedef struct BenchCase {
+    const char* name;           // Case name
+    CxVar*      (*build)(size_t n);  // Builds message
+    size_t      n;              // Message shape parameter
+    WrsFormat   format;         // Envelope format
+    size_t      promote;        // Numeric arrays promotion length (0 to disable)
+} BenchCase;
+
+// Result of one case
+typedef struct BenchResult {
+    size_t  msg_bytes;          // Encoded message size
+    double  enc_msgs_s;         // Encoded messages per second
+    double  enc_mb_s;           // Encoded MB per second
+    double  enc_allocs;         // Allocations per encoded message
+    double  dec_msgs_s;         // Decoded messages per second
+    double  dec_mb_s;           // Decoded MB per second
+    double  dec_allocs;         // Allocations per decoded message
+} BenchResult;
+
+// Forward declarations
+static int parse_options(int argc, const char* argv[], Options* opts);
+static CxVar* build_small_call(size_t n);
+static CxVar* build_map(size_t n);
+static CxVar* build_num_array(size_t n);
+static CxVar* build_buffer(size_t n);
+static BenchResult run_case(const Options* opts, const BenchCase* bc);
+static void write_result(FILE* f, const BenchCase* bc, const BenchResult* r, bool first);
+static void compare_baseline(const Options* opts, const BenchCase* cases, const BenchResult* results, size_t ncases);
+static void* count_alloc(void* ctx, size_t size);
+static void count_free(void* ctx, void* p, size_t size);
+static void* count_resize(void* ctx, void* p, size_t old_size, size_t size);
+static double now_s(void);
+
+#define MB (1024*1024)
+
+static BenchCase cases[] = {
+    {.name = "small_call_json",         .build = build_small_call, .n = 0,      .format = WrsFormatJson},
+    {.name = "small_call_pack",         .build = build_small_call, .n = 0,      .format = WrsFormatPack},
+    {.name = "map_256_fields_json",     .build = build_map,        .n = 256,    .format = WrsFormatJson},
+    {.name = "map_256_fields_pack",     .build = build_map,        .n = 256,    .format = WrsFormatPack},
+    {.name = "num_array_100k_json",     .build = build_num_array,  .n = 100000, .format = WrsFormatJson},
+    {.name = "num_array_100k_promoted", .build = build_num_array,  .n = 100000, .format = WrsFormatJson, .promote = 64},
+    {.name = "num_array_100k_pack",     .build = build_num_array,  .n = 100000, .format = WrsFormatPack},
+    {.name = "buffer_1mb_json",         .build = build_buffer,     .n = 1*MB,   .format = WrsFormatJson},
+    {.name = "buffer_4mb_json",         .build = build_buffer,     .n = 4*MB,   .format = WrsFormatJson},
+    {.name = "buffer_16mb_json",        .build = build_buffer,     .n = 16*MB,  .format = WrsFormatJson},
+    {.name = "buffer_64mb_json",        .build = build_buffer,     .n = 64*MB,  .format = WrsFormatJson},
+    {.name = "buffer_16mb_pack",        .build = build_buffer,     .n = 16*MB,  .format = WrsFormatPack},
+};
+
+
+int main(int argc, const char* argv[]) {
+
+    Options opts = {
+        .cpu = 0,
+        .min_ms = 500,
+        .max_mb = 64,
+    };
+    parse_options(argc, argv, &opts);
+
+    // Runs on a single pinned core to reduce noise
+    if (opts.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(opts.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            fprintf(stderr, "could not pin to cpu:%d\n", opts.cpu);
+        }
+    }
+
+    FILE* f = stdout;
+    if (opts.out) {
+        f = fopen(opts.out, "w");
+        if (f == NULL) {
+            fprintf(stderr, "could not create:%s\n", opts.out);
+            return 1;
+        }
+    }
+
+    // Runs the selected cases
+    const size_t ncases = sizeof(cases)/sizeof(cases[0]);
+    BenchResult results[sizeof(cases)/sizeof(cases[0])] = {0};
+    bool selected[sizeof(cases)/sizeof(cases[0])] = {0};
+    fprintf(f, "{\n  \"benchmark\": \"codec\",\n  \"cpu\": %d,\n  \"results\": [\n", opts.cpu);
+    bool first = true;
+    for (size_t i = 0; i < ncases; i++) {
+        const BenchCase* bc = &cases[i];
+        if (opts.filter && strstr(bc->name, opts.filter) == NULL) {
+            continue;
+        }
+        if (bc->build == build_buffer && bc->n > (size_t)opts.max_mb * MB) {
+            continue;
+        }
+        results[i] = run_case(&opts, bc);
+        selected[i] = true;
+        write_result(f, bc, &results[i], first);
+        first = false;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (f != stdout) {
+        fclose(f);
+    }
+
+    // Compares with baseline results
+    if (opts.baseline) {
+        for (size_t i = 0; i < ncases; i++) {
+            if (!selected[i]) {
+                results[i].msg_bytes = 0;
+            }
+        }
+        compare_baseline(&opts, cases, results, ncases);
+    }
+    return 0;
+}
+
+static int parse_options(int argc, const char* argv[], Options* opts) {
+
+    static const char* usages[] = {
+        "bench_codec [options]",
+        NULL,
+    };
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_INTEGER('c', "cpu", &opts->cpu, "CPU to pin the benchmark (-1 to not pin)", NULL, 0, 0),
+        OPT_INTEGER('t', "time", &opts->min_ms, "Minimum measuring time per case in ms", NULL, 0, 0),
+        OPT_INTEGER('m', "max-mb", &opts->max_mb, "Maximum size of buffer cases in MB", NULL, 0, 0),
+        OPT_STRING('f', "filter", &opts->filter, "Runs only cases containing this string", NULL, 0, 0),
+        OPT_STRING('o', "out", &opts->out, "Output JSON file (default stdout)", NULL, 0, 0),
+        OPT_STRING('b', "baseline", &opts->baseline, "Baseline JSON file to compare", NULL, 0, 0),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "WRS codec benchmark", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    return 0;
+}
+
+// Small remote call as sent by browser clients
+static CxVar* build_small_call(size_t n) {
+
+    CxVar* msg = cx_var_new(cx_def_allocator());
+    cx_var_set_map(msg);
+    cx_var_set_map_int(msg, "cid", 1234);
+    cx_var_set_map_str(msg, "call", "rpc_server_audio_set");
+    CxVar* params = cx_var_set_map_map(msg, "params");
+    cx_var_set_map_int(params, "sample_rate", 44100);
+    cx_var_set_map_int(params, "nsamples", 1024);
+    cx_var_set_map_int(params, "gain", 50);
+    cx_var_set_map_int(params, "freq", 440);
+    cx_var_set_map_int(params, "noise", 10);
+    return msg;
+}
+
+// Remote call with many fields of mixed types
+static CxVar* build_map(size_t n) {
+
+    CxVar* msg = build_small_call(0);
+    CxVar* params = cx_var_set_map_map(msg, "params");
+    char key[32];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "field_%zu", i);
+        switch (i % 4) {
+            case 0:
+                cx_var_set_map_int(params, key, i * 1000);
+                break;
+            case 1:
+                cx_var_set_map_float(params, key, i * 0.25);
+                break;
+            case 2:
+                cx_var_set_map_str(params, key, "some string value");
+                break;
+            default:
+                cx_var_set_map_bool(params, key, i & 1);
+                break;
+        }
+    }
+    return msg;
+}
+
+// Remote call with large numeric array
+static CxVar* build_num_array(size_t n) {
+
+    CxVar* msg = build_small_call(0);
+    CxVar* params = cx_var_set_map_map(msg, "params");
+    CxVar* arr = cx_var_set_map_arr(params, "samples");
+    for (size_t i = 0; i < n; i++) {
+        cx_var_push_arr_int(arr, (i * 7919) % 100000);
+    }
+    return msg;
+}
+
+// Remote call with large binary buffer
+static CxVar* build_buffer(size_t n) {
+
+    CxVar* msg = build_small_call(0);
+    CxVar* params = cx_var_set_map_map(msg, "params");
+    CxVar* buf = cx_var_set_map_buf(params, "data", NULL, n);
+    void* data;
+    size_t len;
+    cx_var_get_buf(buf, (const void**)&data, &len);
+    memset(data, 0x5a, len);
+    return msg;
+}
+
+// Measures encoding and decoding of the case message
+static BenchResult run_case(const Options* opts, const BenchCase* bc) {
+
+    AllocCounter counter = {0};
+    const CxAllocator alloc = {
+        .ctx = &counter,
+        .alloc = count_alloc,
+        .free = count_free,
+        .resize = count_resize,
+    };
+    WrsEncoder* e = wrs_encoder_new(&alloc);
+    WrsDecoder* d = wrs_decoder_new(&alloc);
+    CxPoolAllocator* pool = cx_pool_allocator_create(4*4096, &alloc);
+    wrs_encoder_set_format(e, bc->format);
+    wrs_encoder_set_promote(e, bc->promote);
+    wrs_decoder_set_promote(d, bc->promote);
+    CxVar* msg = bc->build(bc->n);
+    BenchResult r = {0};
+    const double min_time = opts->min_ms / 1000.0;
+
+    // Warm up which also gets the encoded message size
+    CXERR_CHK(wrs_encoder_enc(e, msg));
+    bool text;
+    size_t len;
+    wrs_encoder_get_msg(e, &text, &len);
+    r.msg_bytes = len;
+
+    // Encoding
+    size_t iters = 0;
+    size_t allocs = counter.count;
+    double start = now_s();
+    double elapsed;
+    do {
+        CXERR_CHK(wrs_encoder_enc(e, msg));
+        wrs_encoder_get_msg(e, &text, &len);
+        iters++;
+        elapsed = now_s() - start;
+    } while (elapsed < min_time || iters < 3);
+    r.enc_msgs_s = iters / elapsed;
+    r.enc_mb_s = r.enc_msgs_s * r.msg_bytes / MB;
+    r.enc_allocs = (double)(counter.count - allocs) / iters;
+
+    // Decoding of the last encoded message into pool allocated CxVar
+    // as done by the RPC connections.
+    void* data = wrs_encoder_get_msg(e, &text, &len);
+    CxVar* var = cx_var_new(cx_pool_allocator_iface(pool));
+    CXERR_CHK(wrs_decoder_dec(d, text, data, len, var));
+    cx_pool_allocator_clear(pool);
+    iters = 0;
+    allocs = counter.count;
+    start = now_s();
+    do {
+        var = cx_var_new(cx_pool_allocator_iface(pool));
+        CXERR_CHK(wrs_decoder_dec(d, text, data, len, var));
+        cx_pool_allocator_clear(pool);
+        iters++;
+        elapsed = now_s() - start;
+    } while (elapsed < min_time || iters < 3);
+    r.dec_msgs_s = iters / elapsed;
+    r.dec_mb_s = r.dec_msgs_s * r.msg_bytes / MB;
+    r.dec_allocs = (double)(counter.count - allocs) / iters;
+
+    cx_var_del(msg);
+    cx_pool_allocator_destroy(pool);
+    wrs_decoder_del(d);
+    wrs_encoder_del(e);
+    return r;
+}
+
+static void write_result(FILE* f, const BenchCase* bc, const BenchResult* r, bool first) {
+
+    fprintf(f, "%s    {\"name\": \"%s\", \"msg_bytes\": %zu, "
+        "\"enc_msgs_s\": %.3f, \"enc_mb_s\": %.3f, \"enc_allocs_msg\": %.3f, "
+        "\"dec_msgs_s\": %.3f, \"dec_mb_s\": %.3f, \"dec_allocs_msg\": %.3f}",
+        first ? "" : ",\n", bc->name, r->msg_bytes,
+        r->enc_msgs_s, r->enc_mb_s, r->enc_allocs,
+        r->dec_msgs_s, r->dec_mb_s, r->dec_allocs);
+    fflush(f);
+}
+
+// Prints the relative change of the results in relation to the baseline results
+static void compare_baseline(const Options* opts, const BenchCase* cases, const BenchResult* results, size_t ncases) {
+
+    // Reads and parses the baseline file
+    FILE* f = fopen(opts->baseline, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "could not open baseline:%s\n", opts->baseline);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* text = malloc(size);
+    const size_t nread = fread(text, 1, size, f);
+    fclose(f);
+    CxVar* base = cx_var_new(cx_def_allocator());
+    CxJsonParseCfg cfg = {.alloc = cx_def_allocator()};
+    CxError err = cx_json_parse(text, nread, base, &cfg);
+    free(text);
+    CxVar* bresults = err.code ? NULL : cx_var_get_map_arr(base, "results");
+    size_t nbase;
+    if (bresults == NULL || !cx_var_get_arr_len(bresults, &nbase)) {
+        fprintf(stderr, "invalid baseline:%s\n", opts->baseline);
+        cx_var_del(base);
+        return;
+    }
+
+    fprintf(stderr, "%-26s %12s %12s %12s %12s\n", "case", "enc_mb_s", "change", "dec_mb_s", "change");
+    for (size_t i = 0; i < ncases; i++) {
+        if (results[i].msg_bytes == 0) {
+            continue;
+        }
+        for (size_t j = 0; j < nbase; j++) {
+            CxVar* b = cx_var_get_arr_val(bresults, j);
+            const char* name;
+            double enc_mb_s, dec_mb_s;
+            if (!cx_var_get_map_str(b, "name", &name) || strcmp(name, cases[i].name) != 0) {
+                continue;
+            }
+            if (!cx_var_get_map_float(b, "enc_mb_s", &enc_mb_s) || !cx_var_get_map_float(b, "dec_mb_s", &dec_mb_s)) {
+                break;
+            }
+            fprintf(stderr, "%-26s %12.1f %+11.1f%% %12.1f %+11.1f%%\n", cases[i].name,
+                results[i].enc_mb_s, 100.0 * (results[i].enc_mb_s - enc_mb_s) / enc_mb_s,
+                results[i].dec_mb_s, 100.0 * (results[i].dec_mb_s - dec_mb_s) / dec_mb_s);
+            break;
+        }
+    }
+    cx_var_del(base);
+}
+
+static void* count_alloc(void* ctx, size_t size) {
+
+    AllocCounter* counter = ctx;
+    counter->count++;
+    return malloc(size);
+}
+
+static void count_free(void* ctx, void* p, size_t size) {
+
+    free(p);
+}
+
+static void* count_resize(void* ctx, void* p, size_t old_size, size_t size) {
+
+    AllocCounter* counter = ctx;
+    counter->count++;
+    return realloc(p, size);
+}
+
+static double now_s(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "argparse.h"
+#include "wrs.h"
+#include "wrs_client.h"
+
+// Connection scaling benchmark.
+// Measures the server memory (RSS) and threads used by each WebSocket client
+// of an RPC endpoint. The clients run in a child process so that only the server
+// resources are measured. For each step the clients are opened and kept idle,
+// then each one makes calls. After all the steps the clients are closed and
+// the server memory should return to near the initial baseline.
+
+#define BENCH_URL   "/bench"
+#define BENCH_ECHO  "bench_echo"
+#define MAX_STEPS   (16)
+
+// Benchmark options
+typedef struct Options {
+    const char* steps;          // List of number of connections
+    int         active_ms;      // Duration of the active phase in milliseconds
+    int         size;           // Payload size of the calls in the active phase
+    bool        pack;           // Use MessagePack envelope
+    const char* out;            // Optional JSON output file
+} Options;
+
+// Server process resources sample
+typedef struct Sample {
+    size_t  rss_kb;             // Resident set size in KB
+    size_t  threads;            // Number of threads
+} Sample;
+
+// State of the client process
+typedef struct Clients {
+    const Options*  opts;
+    int             port;       // Server port
+    WrsClient**     conns;      // Opened clients
+    size_t          nconns;     // Number of opened clients
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    size_t          pending;    // Number of calls waiting for response
+    uint64_t        nerrors;    // Number of call errors
+} Clients;
+
+// Forward declarations
+static int parse_options(int argc, const char* argv[], Options* opts);
+static size_t parse_list(const char* s, int* vals);
+static void clients_process(const Options* opts, int port, FILE* cmd, FILE* resp);
+static void clients_open(Clients* cs, size_t n, FILE* resp);
+static void clients_active(Clients* cs, FILE* resp);
+static void clients_close(Clients* cs, FILE* resp);
+static int clients_response(WrsClient* client, CxVar* resp, void* cbdata);
+static int bench_server_echo(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
+static bool wait_conns(WrsRpc* rpc, size_t n, int timeout_ms);
+static Sample sample(void);
+static void raise_nofile(void);
+static uint64_t now_us(void);
+static void sleep_ms(int ms);
+static int cmp_u32(const void* a, const void* b);
+
+
+int main(int argc, const char* argv[]) {
+
+    Options opts = {
+        .steps = "100,1000,10000",
+        .active_ms = 2000,
+        .size = 1024,
+    };
+    parse_options(argc, argv, &opts);
+    int steps[MAX_STEPS];
+    const size_t nsteps = parse_list(opts.steps, steps);
+    if (nsteps == 0) {
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+    int max_conns = 0;
+    for (size_t i = 0; i < nsteps; i++) {
+        max_conns = steps[i] > max_conns ? steps[i] : max_conns;
+    }
+    raise_nofile();
+
+    // Creates pipes and the clients process before the server threads are started
+    int cmdpipe[2], resppipe[2], portpipe[2];
+    if (pipe(cmdpipe) < 0 || pipe(resppipe) < 0 || pipe(portpipe) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(cmdpipe[1]);
+        close(resppipe[0]);
+        close(portpipe[1]);
+        int port;
+        if (read(portpipe[0], &port, sizeof(port)) != sizeof(port)) {
+            _exit(1);
+        }
+        FILE* cmd = fdopen(cmdpipe[0], "r");
+        FILE* resp = fdopen(resppipe[1], "w");
+        clients_process(&opts, port, cmd, resp);
+        _exit(0);
+    }
+    close(cmdpipe[0]);
+    close(resppipe[1]);
+    close(portpipe[0]);
+    FILE* cmd = fdopen(cmdpipe[1], "w");
+    FILE* resp = fdopen(resppipe[0], "r");
+
+    // Starts the server with one worker thread per connection plus a margin
+    wrs_logger_init(NULL, "BENCH");
+    WrsConfig cfg = {.listening_port = 0, .num_threads = max_conns + 16};
+    Wrs* wrs = wrs_create(&cfg);
+    if (wrs == NULL) {
+        fprintf(stderr, "error starting server\n");
+        kill(pid, SIGTERM);
+        return 1;
+    }
+    WrsRpc* rpc = wrs_rpc_open(wrs, BENCH_URL, max_conns, NULL);
+    CXERR_CHK(wrs_rpc_bind(rpc, BENCH_ECHO, bench_server_echo));
+    const int port = wrs_get_port(wrs);
+    if (write(portpipe[1], &port, sizeof(port)) != sizeof(port)) {
+        return 1;
+    }
+    close(portpipe[1]);
+
+    FILE* f = NULL;
+    if (opts.out) {
+        f = fopen(opts.out, "w");
+        if (f == NULL) {
+            fprintf(stderr, "could not create:%s\n", opts.out);
+            return 1;
+        }
+    }
+
+    // Baseline after the server is started
+    malloc_trim(0);
+    const Sample base = sample();
+    printf("baseline: rss:%zu KB threads:%zu\n", base.rss_kb, base.threads);
+    printf("%7s %7s %10s %12s %8s %12s %12s %7s\n",
+        "conns", "phase", "rss_kb", "rss_kb/conn", "threads", "connect_p50", "connect_p99", "errors");
+    if (f) {
+        fprintf(f, "{\n  \"benchmark\": \"conns\",\n  \"baseline_rss_kb\": %zu,\n  \"baseline_threads\": %zu,\n  \"results\": [\n",
+            base.rss_kb, base.threads);
+    }
+
+    bool first = true;
+    for (size_t i = 0; i < nsteps; i++) {
+        for (int phase = 0; phase < 2; phase++) {
+            unsigned int p50 = 0, p99 = 0;
+            unsigned long nconns = 0, nerrors = 0;
+            if (phase == 0) {
+                // Opens connections up to the step count and waits for the server to accept them
+                fprintf(cmd, "open %d\n", steps[i]);
+                fflush(cmd);
+                if (fscanf(resp, "%lu %u %u %lu", &nconns, &p50, &p99, &nerrors) != 4) {
+                    fprintf(stderr, "clients process error\n");
+                    return 1;
+                }
+                wait_conns(rpc, nconns, 10000);
+            } else {
+                // Each connection makes calls
+                fprintf(cmd, "active\n");
+                fflush(cmd);
+                if (fscanf(resp, "%lu %lu", &nconns, &nerrors) != 2) {
+                    fprintf(stderr, "clients process error\n");
+                    return 1;
+                }
+            }
+            malloc_trim(0);
+            const Sample s = sample();
+            const char* pname = phase == 0 ? "idle" : "active";
+            const double per_conn = nconns ? ((double)s.rss_kb - base.rss_kb) / nconns : 0;
+            printf("%7lu %7s %10zu %12.1f %8zu %12u %12u %7lu\n",
+                nconns, pname, s.rss_kb, per_conn, s.threads, p50, p99, nerrors);
+            fflush(stdout);
+            if (f) {
+                fprintf(f, "%s    {\"conns\": %lu, \"phase\": \"%s\", \"rss_kb\": %zu, \"rss_kb_conn\": %.3f, "
+                    "\"threads\": %zu, \"connect_p50_us\": %u, \"connect_p99_us\": %u, \"errors\": %lu}",
+                    first ? "" : ",\n", nconns, pname, s.rss_kb, per_conn, s.threads, p50, p99, nerrors);
+                first = false;
+            }
+        }
+    }
+
+    // Closes all connections and checks that the memory returned to baseline
+    fprintf(cmd, "close\n");
+    fflush(cmd);
+    unsigned long closed;
+    if (fscanf(resp, "%lu", &closed) != 1) {
+        fprintf(stderr, "clients process error\n");
+        return 1;
+    }
+    const bool all_closed = wait_conns(rpc, 0, 10000);
+    malloc_trim(0);
+    const Sample end = sample();
+    printf("after close: rss:%zu KB (%+ld KB from baseline) threads:%zu connections:%zu\n",
+        end.rss_kb, (long)end.rss_kb - (long)base.rss_kb, end.threads, wrs_rpc_info(rpc).nconns);
+    if (f) {
+        fprintf(f, "\n  ],\n  \"closed_rss_kb\": %zu,\n  \"closed_threads\": %zu\n}\n", end.rss_kb, end.threads);
+        fclose(f);
+    }
+
+    fprintf(cmd, "exit\n");
+    fclose(cmd);
+    fclose(resp);
+    waitpid(pid, NULL, 0);
+    wrs_destroy(wrs);
+    cx_logger_del(wrs_logger());
+    return all_closed ? 0 : 1;
+}
+
+static int parse_options(int argc, const char* argv[], Options* opts) {
+
+    static const char* usages[] = {
+        "bench_conns [options]",
+        NULL,
+    };
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('n', "steps", &opts->steps, "Comma separated list of number of connections", NULL, 0, 0),
+        OPT_INTEGER('a', "active", &opts->active_ms, "Duration of the active phase in ms", NULL, 0, 0),
+        OPT_INTEGER('s', "size", &opts->size, "Payload size in bytes of the calls in the active phase", NULL, 0, 0),
+        OPT_BOOLEAN('m', "pack", &opts->pack, "Use MessagePack envelope", NULL, 0, 0),
+        OPT_STRING('o', "out", &opts->out, "Output JSON file", NULL, 0, 0),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "WRS connection scaling benchmark", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    return 0;
+}
+
+// Parses comma separated list of increasing positive integers.
+// Returns the number of values or 0 on error.
+static size_t parse_list(const char* s, int* vals) {
+
+    size_t count = 0;
+    while (*s) {
+        char* end;
+        const long v = strtol(s, &end, 10);
+        if (end == s || v <= 0 || count >= MAX_STEPS || (count > 0 && v <= vals[count-1])) {
+            return 0;
+        }
+        vals[count++] = v;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Executes the commands received from the server process
+static void clients_process(const Options* opts, int port, FILE* cmd, FILE* resp) {
+
+    Clients cs = {.opts = opts, .port = port};
+    CXCHKZ(pthread_mutex_init(&cs.lock, NULL));
+    CXCHKZ(pthread_cond_init(&cs.cond, NULL));
+    wrs_logger_init(NULL, "CLIENTS");
+    char line[64];
+    while (fgets(line, sizeof(line), cmd)) {
+        size_t n;
+        if (sscanf(line, "open %zu", &n) == 1) {
+            clients_open(&cs, n, resp);
+        } else if (strncmp(line, "active", 6) == 0) {
+            clients_active(&cs, resp);
+        } else if (strncmp(line, "close", 5) == 0) {
+            clients_close(&cs, resp);
+        } else {
+            break;
+        }
+        fflush(resp);
+    }
+    clients_close(&cs, NULL);
+    free(cs.conns);
+    cx_logger_del(wrs_logger());
+}
+
+// Opens clients up to the specified number and reports the connect latencies
+static void clients_open(Clients* cs, size_t n, FILE* resp) {
+
+    cs->conns = realloc(cs->conns, n * sizeof(WrsClient*));
+    uint32_t* lat = malloc((n + 1) * sizeof(uint32_t));
+    size_t nlat = 0;
+    unsigned long nerrors = 0;
+    for (size_t i = cs->nconns; i < n; i++) {
+        WrsClientConfig cfg = {
+            .host = "127.0.0.1",
+            .port = cs->port,
+            .url = BENCH_URL,
+            .pack = cs->opts->pack,
+            .userdata = cs,
+        };
+        const uint64_t start = now_us();
+        WrsClient* client = wrs_client_connect(&cfg);
+        if (client == NULL) {
+            nerrors++;
+            continue;
+        }
+        lat[nlat++] = now_us() - start;
+        cs->conns[cs->nconns++] = client;
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+    const unsigned int p50 = nlat ? lat[(size_t)(0.50 * (nlat - 1))] : 0;
+    const unsigned int p99 = nlat ? lat[(size_t)(0.99 * (nlat - 1))] : 0;
+    free(lat);
+    fprintf(resp, "%zu %u %u %lu\n", cs->nconns, p50, p99, nerrors);
+}
+
+// Makes one call in each connection at a time until the active phase ends
+static void clients_active(Clients* cs, FILE* resp) {
+
+    CxVar* params = cx_var_new(cx_def_allocator());
+    cx_var_set_map(params);
+    CxVar* buf = cx_var_set_map_buf(params, "data", NULL, cs->opts->size);
+    void* data;
+    size_t len;
+    cx_var_get_buf(buf, (const void**)&data, &len);
+    memset(data, 0x5a, len);
+
+    cs->nerrors = 0;
+    const uint64_t end = now_us() + (uint64_t)cs->opts->active_ms * 1000;
+    do {
+        for (size_t i = 0; i < cs->nconns; i++) {
+            CXCHKZ(pthread_mutex_lock(&cs->lock));
+            cs->pending++;
+            CXCHKZ(pthread_mutex_unlock(&cs->lock));
+            CxError err = wrs_client_call(cs->conns[i], BENCH_ECHO, params, clients_response, NULL);
+            if (err.code) {
+                CXCHKZ(pthread_mutex_lock(&cs->lock));
+                cs->pending--;
+                cs->nerrors++;
+                CXCHKZ(pthread_mutex_unlock(&cs->lock));
+            }
+        }
+
+        // Waits for the responses of this round
+        CXCHKZ(pthread_mutex_lock(&cs->lock));
+        while (cs->pending > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 5;
+            if (pthread_cond_timedwait(&cs->cond, &cs->lock, &ts)) {
+                cs->nerrors += cs->pending;
+                cs->pending = 0;
+            }
+        }
+        CXCHKZ(pthread_mutex_unlock(&cs->lock));
+    } while (now_us() < end);
+
+    cx_var_del(params);
+    fprintf(resp, "%zu %lu\n", cs->nconns, cs->nerrors);
+}
+
+// Closes all clients and reports the number of closed clients if requested
+static void clients_close(Clients* cs, FILE* resp) {
+
+    const size_t nconns = cs->nconns;
+    for (size_t i = 0; i < cs->nconns; i++) {
+        wrs_client_close(cs->conns[i]);
+    }
+    cs->nconns = 0;
+    if (resp) {
+        fprintf(resp, "%zu\n", nconns);
+    }
+}
+
+static int clients_response(WrsClient* client, CxVar* resp, void* cbdata) {
+
+    Clients* cs = wrs_client_get_userdata(client);
+    CXCHKZ(pthread_mutex_lock(&cs->lock));
+    if (cx_var_get_map_val(resp, "data") == NULL) {
+        cs->nerrors++;
+    }
+    if (cs->pending > 0) {
+        cs->pending--;
+    }
+    CXCHKZ(pthread_cond_signal(&cs->cond));
+    CXCHKZ(pthread_mutex_unlock(&cs->lock));
+    return 0;
+}
+
+static int bench_server_echo(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp) {
+
+    cx_var_cpy_val(params, cx_var_set_map_map(resp, "data"));
+    return 0;
+}
+
+// Waits for the endpoint to have the specified number of connections
+static bool wait_conns(WrsRpc* rpc, size_t n, int timeout_ms) {
+
+    for (int i = 0; i < timeout_ms; i++) {
+        if (wrs_rpc_info(rpc).nconns == n) {
+            return true;
+        }
+        sleep_ms(1);
+    }
+    return false;
+}
+
+// Reads the resident set size and number of threads of this process
+static Sample sample(void) {
+
+    Sample s = {0};
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return s;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %zu", &s.rss_kb);
+        sscanf(line, "Threads: %zu", &s.threads);
+    }
+    fclose(f);
+    return s;
+}
+
+// Raises the limit of open files to allow thousands of connections
+static void raise_nofile(void) {
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static uint64_t now_us(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_ms(int ms) {
+
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int cmp_u32(const void* a, const void* b) {
+
+    const uint32_t va = *(const uint32_t*)a;
+    const uint32_t vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cx_alloc.h"
+#include "cx_logger.h"
+
+#include "argparse.h"
+#include "wrs.h"
+#include "wrs_client.h"
+#include "rpc_codec.h"
+
+// End to end RPC benchmark.
+// Starts a WRS server in process with echo bindings, connects clients over
+// loopback and measures round trip latency percentiles and throughput for
+// a sweep of payload sizes, calls in flight, number of connections and
+// call direction (client to server and server to client).
+// Also measures the RPC core alone, without sockets, using a loopback connection.
+
+#define MAX_LIST    (16)    // Maximum number of values in each sweep list
+#define BENCH_URL   "/bench"
+#define BENCH_ECHO  "bench_echo"
+
+// Benchmark options
+typedef struct Options {
+    const char* sizes;          // List of payload sizes in bytes
+    const char* depths;         // List of calls in flight per connection
+    const char* conns;          // List of number of connections
+    const char* dirs;           // List of call directions and/or loopback
+    int         duration;       // Duration of each run in milliseconds
+    bool        pack;           // Use MessagePack envelope
+    const char* out;            // Optional JSON output file
+} Options;
+
+// Call sender for one connection.
+// For client to server calls the sender uses its client to call the server.
+// For server to client calls the sender calls the client using its connection id.
+typedef struct Sender {
+    struct Bench*   bench;
+    WrsClient*      client;     // Client connection
+    size_t          connid;     // Server connection id
+    bool            s2c;        // Server to client calls
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    CxVar*          params;     // Call parameters
+    int             inflight;   // Number of calls waiting for response
+    uint64_t        nresps;     // Number of responses received
+    uint64_t        nerrors;    // Number of errors
+    uint32_t*       lat;        // Latencies in microseconds
+    size_t          nlat;       // Number of latencies
+    size_t          caplat;     // Capacity of latencies array
+} Sender;
+
+// Benchmark state
+typedef struct Bench {
+    const Options*  opts;
+    Wrs*            wrs;
+    WrsRpc*         rpc;
+    pthread_mutex_t lock;
+    bool*           ready;      // Ready state of each server connection id
+    Sender**        senders;    // Server to client sender of each connection id
+    size_t          max_conns;  // Maximum number of connections
+    int             depth;      // Calls in flight of the current run
+    atomic_bool     run;        // Run flag of the current run
+} Bench;
+
+// Result of one run
+typedef struct RunResult {
+    double      msgs_s;         // Round trips per second
+    double      mb_s;           // Payload MB per second in each direction
+    uint64_t    nerrors;        // Number of errors
+    uint32_t    p50;            // Latency percentiles in microseconds
+    uint32_t    p99;
+    uint32_t    p999;
+    uint32_t    max;
+} RunResult;
+
+// Output of the loopback connection
+typedef struct LoopOutput {
+    uint64_t    nmsgs;          // Number of messages written by the endpoint
+    uint64_t    nbytes;         // Number of bytes written by the endpoint
+} LoopOutput;
+
+// Global benchmark state used by the callbacks
+static Bench gbench;
+
+// Forward declarations
+static int parse_options(int argc, const char* argv[], Options* opts);
+static size_t parse_list(const char* s, int* vals);
+static RunResult bench_run(Bench* b, int size, int depth, int nconns, bool s2c);
+static RunResult bench_loop(Bench* b, int size);
+static void bench_loop_output(void* ctx, bool text, const void* data, size_t len);
+static void* sender_thread(void* arg);
+static void sender_response(Sender* s, CxVar* resp);
+static void bench_event(WrsRpc* rpc, size_t connid, WrsEvent ev);
+static int bench_server_echo(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
+static int bench_server_response(WrsRpc* rpc, size_t connid, CxVar* resp);
+static int bench_client_echo(WrsClient* client, CxVar* params, CxVar* resp);
+static int bench_client_response(WrsClient* client, CxVar* resp, void* cbdata);
+static size_t bench_ready_count(Bench* b);
+static uint64_t now_us(void);
+static void sleep_ms(int ms);
+static int cmp_u32(const void* a, const void* b);
+
+
+int main(int argc, const char* argv[]) {
+
+    Options opts = {
+        .sizes = "64,1024,65536,1048576",
+        .depths = "1,16",
+        .conns = "1,4",
+        .dirs = "c2s,s2c",
+        .duration = 2000,
+    };
+    parse_options(argc, argv, &opts);
+
+    int sizes[MAX_LIST], depths[MAX_LIST], conns[MAX_LIST];
+    const size_t nsizes = parse_list(opts.sizes, sizes);
+    const size_t ndepths = parse_list(opts.depths, depths);
+    const size_t nconns = parse_list(opts.conns, conns);
+    const bool c2s = strstr(opts.dirs, "c2s") != NULL;
+    const bool s2c = strstr(opts.dirs, "s2c") != NULL;
+    const bool loop = strstr(opts.dirs, "loop") != NULL;
+    if (nsizes == 0 || ndepths == 0 || nconns == 0 || (!c2s && !s2c && !loop)) {
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+
+    // Starts server with auto port and opens the benchmark endpoint
+    Bench* b = &gbench;
+    b->opts = &opts;
+    CXCHKZ(pthread_mutex_init(&b->lock, NULL));
+    for (size_t i = 0; i < nconns; i++) {
+        if ((size_t)conns[i] > b->max_conns) {
+            b->max_conns = conns[i];
+        }
+    }
+    b->ready = calloc(b->max_conns, sizeof(bool));
+    b->senders = calloc(b->max_conns, sizeof(Sender*));
+    wrs_logger_init(NULL, "BENCH");
+    WrsConfig cfg = {.listening_port = 0};
+    b->wrs = wrs_create(&cfg);
+    if (b->wrs == NULL) {
+        fprintf(stderr, "error starting server\n");
+        return 1;
+    }
+    b->rpc = wrs_rpc_open(b->wrs, BENCH_URL, b->max_conns, bench_event);
+    CXERR_CHK(wrs_rpc_bind(b->rpc, BENCH_ECHO, bench_server_echo));
+
+    FILE* f = NULL;
+    if (opts.out) {
+        f = fopen(opts.out, "w");
+        if (f == NULL) {
+            fprintf(stderr, "could not create:%s\n", opts.out);
+            return 1;
+        }
+        fprintf(f, "{\n  \"benchmark\": \"rpc\",\n  \"results\": [\n");
+    }
+
+    // Runs the sweep
+    printf("%-4s %10s %6s %6s %12s %10s %8s %8s %8s %8s %7s\n",
+        "dir", "size", "depth", "conns", "msgs/s", "MB/s", "p50", "p99", "p999", "max", "errors");
+    // The loopback runs use a single connection with one call in flight
+    bool first = true;
+    for (int dir = 0; dir < 3; dir++) {
+        if ((dir == 0 && !c2s) || (dir == 1 && !s2c) || (dir == 2 && !loop)) {
+            continue;
+        }
+        const char* dname = dir == 0 ? "c2s" : dir == 1 ? "s2c" : "loop";
+        for (size_t ic = 0; ic < (dir == 2 ? 1 : nconns); ic++) {
+            for (size_t id = 0; id < (dir == 2 ? 1 : ndepths); id++) {
+                for (size_t is = 0; is < nsizes; is++) {
+                    const int depth = dir == 2 ? 1 : depths[id];
+                    const int nc = dir == 2 ? 1 : conns[ic];
+                    const RunResult r = dir == 2 ? bench_loop(b, sizes[is]) : bench_run(b, sizes[is], depth, nc, dir == 1);
+                    printf("%-4s %10d %6d %6d %12.1f %10.2f %8u %8u %8u %8u %7lu\n",
+                        dname, sizes[is], depth, nc, r.msgs_s, r.mb_s, r.p50, r.p99, r.p999, r.max, r.nerrors);
+                    fflush(stdout);
+                    if (f) {
+                        fprintf(f, "%s    {\"dir\": \"%s\", \"size\": %d, \"depth\": %d, \"conns\": %d, "
+                            "\"msgs_s\": %.3f, \"mb_s\": %.3f, \"p50_us\": %u, \"p99_us\": %u, \"p999_us\": %u, "
+                            "\"max_us\": %u, \"errors\": %lu}",
+                            first ? "" : ",\n", dname, sizes[is], depth, nc,
+                            r.msgs_s, r.mb_s, r.p50, r.p99, r.p999, r.max, r.nerrors);
+                        first = false;
+                    }
+                }
+            }
+        }
+    }
+    if (f) {
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+    }
+
+    wrs_destroy(b->wrs);
+    free(b->ready);
+    free(b->senders);
+    CXCHKZ(pthread_mutex_destroy(&b->lock));
+    cx_logger_del(wrs_logger());
+    return 0;
+}
+
+static int parse_options(int argc, const char* argv[], Options* opts) {
+
+    static const char* usages[] = {
+        "bench_rpc [options]",
+        NULL,
+    };
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('s', "sizes", &opts->sizes, "Comma separated list of payload sizes in bytes", NULL, 0, 0),
+        OPT_STRING('q', "depths", &opts->depths, "Comma separated list of calls in flight per connection", NULL, 0, 0),
+        OPT_STRING('n', "conns", &opts->conns, "Comma separated list of number of connections", NULL, 0, 0),
+        OPT_STRING('D', "dirs", &opts->dirs, "Call directions: c2s (client to server), s2c (server to client), loop (loopback without sockets)", NULL, 0, 0),
+        OPT_INTEGER('d', "duration", &opts->duration, "Duration of each run in ms", NULL, 0, 0),
+        OPT_BOOLEAN('m', "pack", &opts->pack, "Use MessagePack envelope", NULL, 0, 0),
+        OPT_STRING('o', "out", &opts->out, "Output JSON file", NULL, 0, 0),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "WRS RPC end to end benchmark", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    return 0;
+}
+
+// Parses comma separated list of positive integers.
+// Returns the number of values or 0 on error.
+static size_t parse_list(const char* s, int* vals) {
+
+    size_t count = 0;
+    while (*s) {
+        char* end;
+        const long v = strtol(s, &end, 10);
+        if (end == s || v <= 0 || count >= MAX_LIST) {
+            return 0;
+        }
+        vals[count++] = v;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Executes one run of the sweep
+static RunResult bench_run(Bench* b, int size, int depth, int nconns, bool s2c) {
+
+    RunResult r = {0};
+    b->depth = depth;
+    Sender* senders = calloc(nconns, sizeof(Sender));
+
+    // Connects clients and waits for their server connections to be ready
+    for (int i = 0; i < nconns; i++) {
+        Sender* s = &senders[i];
+        s->bench = b;
+        s->s2c = s2c;
+        CXCHKZ(pthread_mutex_init(&s->lock, NULL));
+        CXCHKZ(pthread_cond_init(&s->cond, NULL));
+        s->params = cx_var_new(cx_def_allocator());
+        cx_var_set_map(s->params);
+        cx_var_set_map_int(s->params, "t", 0);
+        CxVar* buf = cx_var_set_map_buf(s->params, "data", NULL, size);
+        void* data;
+        size_t len;
+        cx_var_get_buf(buf, (const void**)&data, &len);
+        memset(data, 0x5a, len);
+        WrsClientConfig cfg = {
+            .host = "127.0.0.1",
+            .port = wrs_get_port(b->wrs),
+            .url = BENCH_URL,
+            .pack = b->opts->pack,
+            .userdata = s,
+        };
+        s->client = wrs_client_connect(&cfg);
+        if (s->client == NULL) {
+            fprintf(stderr, "error opening connection:%d\n", i);
+            exit(1);
+        }
+        CXERR_CHK(wrs_client_bind(s->client, BENCH_ECHO, bench_client_echo));
+    }
+    while (bench_ready_count(b) < (size_t)nconns) {
+        sleep_ms(1);
+    }
+
+    // For server to client calls, associates each sender with a server connection id
+    if (s2c) {
+        CXCHKZ(pthread_mutex_lock(&b->lock));
+        size_t next = 0;
+        for (size_t connid = 0; connid < b->max_conns; connid++) {
+            if (b->ready[connid]) {
+                senders[next].connid = connid;
+                b->senders[connid] = &senders[next];
+                next++;
+            }
+        }
+        CXCHKZ(pthread_mutex_unlock(&b->lock));
+    }
+
+    // Starts the sender threads and waits for the run duration
+    b->run = true;
+    const uint64_t start = now_us();
+    for (int i = 0; i < nconns; i++) {
+        CXCHKZ(pthread_create(&senders[i].thread, NULL, sender_thread, &senders[i]));
+    }
+    sleep_ms(b->opts->duration);
+    b->run = false;
+    for (int i = 0; i < nconns; i++) {
+        CXCHKZ(pthread_join(senders[i].thread, NULL));
+    }
+    const double elapsed = (now_us() - start) / 1e6;
+
+    // Waits for the calls in flight before closing the connections
+    for (int i = 0; i < nconns; i++) {
+        Sender* s = &senders[i];
+        CXCHKZ(pthread_mutex_lock(&s->lock));
+        while (s->inflight > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            if (pthread_cond_timedwait(&s->cond, &s->lock, &ts)) {
+                s->nerrors += s->inflight;
+                break;
+            }
+        }
+        CXCHKZ(pthread_mutex_unlock(&s->lock));
+    }
+    CXCHKZ(pthread_mutex_lock(&b->lock));
+    memset(b->senders, 0, b->max_conns * sizeof(Sender*));
+    CXCHKZ(pthread_mutex_unlock(&b->lock));
+
+    // Merges latencies of all senders
+    uint64_t nresps = 0;
+    size_t nlat = 0;
+    for (int i = 0; i < nconns; i++) {
+        nresps += senders[i].nresps;
+        r.nerrors += senders[i].nerrors;
+        nlat += senders[i].nlat;
+    }
+    uint32_t* lat = malloc((nlat + 1) * sizeof(uint32_t));
+    size_t pos = 0;
+    for (int i = 0; i < nconns; i++) {
+        memcpy(lat + pos, senders[i].lat, senders[i].nlat * sizeof(uint32_t));
+        pos += senders[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+    r.msgs_s = nresps / elapsed;
+    r.mb_s = r.msgs_s * size / (1024*1024);
+    if (nlat > 0) {
+        r.p50 = lat[(size_t)(0.50 * (nlat - 1))];
+        r.p99 = lat[(size_t)(0.99 * (nlat - 1))];
+        r.p999 = lat[(size_t)(0.999 * (nlat - 1))];
+        r.max = lat[nlat - 1];
+    }
+    free(lat);
+
+    // Closes connections and waits for the server to close them
+    for (int i = 0; i < nconns; i++) {
+        Sender* s = &senders[i];
+        wrs_client_close(s->client);
+        cx_var_del(s->params);
+        free(s->lat);
+        CXCHKZ(pthread_mutex_destroy(&s->lock));
+        CXCHKZ(pthread_cond_destroy(&s->cond));
+    }
+    while (wrs_rpc_info(b->rpc).nconns > 0) {
+        sleep_ms(1);
+    }
+    free(senders);
+    return r;
+}
+
+// Executes one run injecting calls in a loopback connection of an endpoint without server.
+// The response is written synchronously, so the latency is the time spent in the RPC core.
+static RunResult bench_loop(Bench* b, int size) {
+
+    RunResult r = {0};
+    WrsRpc* rpc = wrs_rpc_open(NULL, BENCH_URL, 1, NULL);
+    CXERR_CHK(wrs_rpc_bind(rpc, BENCH_ECHO, bench_server_echo));
+    LoopOutput out = {0};
+    size_t connid;
+    CXERR_CHK(wrs_rpc_loopback_open(rpc, b->opts->pack, bench_loop_output, &out, &connid));
+
+    // Encodes the call message once
+    CxVar* msg = cx_var_new(cx_def_allocator());
+    cx_var_set_map(msg);
+    cx_var_set_map_int(msg, "cid", 1);
+    cx_var_set_map_str(msg, "call", BENCH_ECHO);
+    CxVar* params = cx_var_set_map_map(msg, "params");
+    cx_var_set_map_int(params, "t", 0);
+    CxVar* buf = cx_var_set_map_buf(params, "data", NULL, size);
+    void* data;
+    size_t len;
+    cx_var_get_buf(buf, (const void**)&data, &len);
+    memset(data, 0x5a, len);
+    WrsEncoder* e = wrs_encoder_new(cx_def_allocator());
+    wrs_encoder_set_format(e, b->opts->pack ? WrsFormatPack : WrsFormatJson);
+    CXERR_CHK(wrs_encoder_enc(e, msg));
+    bool text;
+    const void* encoded = wrs_encoder_get_msg(e, &text, &len);
+
+    // Injects the call until the run ends
+    size_t caplat = 4096;
+    size_t nlat = 0;
+    uint32_t* lat = malloc(caplat * sizeof(uint32_t));
+    const uint64_t start = now_us();
+    const uint64_t end = start + (uint64_t)b->opts->duration * 1000;
+    uint64_t now = start;
+    while (now < end) {
+        const uint64_t sent = now;
+        CxError err = wrs_rpc_loopback_send(rpc, connid, text, encoded, len);
+        now = now_us();
+        if (err.code) {
+            r.nerrors++;
+            break;
+        }
+        if (nlat >= caplat) {
+            caplat *= 2;
+            lat = realloc(lat, caplat * sizeof(uint32_t));
+        }
+        lat[nlat++] = now - sent;
+    }
+    const double elapsed = (now - start) / 1e6;
+    r.nerrors += nlat - out.nmsgs;
+    r.msgs_s = out.nmsgs / elapsed;
+    r.mb_s = r.msgs_s * size / (1024*1024);
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+    if (nlat > 0) {
+        r.p50 = lat[(size_t)(0.50 * (nlat - 1))];
+        r.p99 = lat[(size_t)(0.99 * (nlat - 1))];
+        r.p999 = lat[(size_t)(0.999 * (nlat - 1))];
+        r.max = lat[nlat - 1];
+    }
+
+    free(lat);
+    wrs_encoder_del(e);
+    cx_var_del(msg);
+    wrs_rpc_loopback_close(rpc, connid);
+    wrs_rpc_close(rpc);
+    return r;
+}
+
+// Counts the responses written to the loopback connection
+static void bench_loop_output(void* ctx, bool text, const void* data, size_t len) {
+
+    LoopOutput* out = ctx;
+    out->nmsgs++;
+    out->nbytes += len;
+}
+
+// Sends calls keeping the configured number of calls in flight until the run ends
+static void* sender_thread(void* arg) {
+
+    Sender* s = arg;
+    Bench* b = s->bench;
+    while (b->run) {
+        // Waits for free slot for call in flight
+        CXCHKZ(pthread_mutex_lock(&s->lock));
+        while (b->run && s->inflight >= b->depth) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10*1000*1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+        }
+        if (!b->run) {
+            CXCHKZ(pthread_mutex_unlock(&s->lock));
+            break;
+        }
+        s->inflight++;
+        CXCHKZ(pthread_mutex_unlock(&s->lock));
+
+        // The send time is echoed back in the response
+        cx_var_set_map_int(s->params, "t", now_us());
+        CxError err;
+        if (s->s2c) {
+            err = wrs_rpc_call(b->rpc, s->connid, BENCH_ECHO, s->params, bench_server_response);
+        } else {
+            err = wrs_client_call(s->client, BENCH_ECHO, s->params, bench_client_response, s);
+        }
+        if (err.code) {
+            CXCHKZ(pthread_mutex_lock(&s->lock));
+            s->nerrors++;
+            s->inflight--;
+            CXCHKZ(pthread_mutex_unlock(&s->lock));
+        }
+    }
+    return NULL;
+}
+
+// Saves the latency of a received response
+static void sender_response(Sender* s, CxVar* resp) {
+
+    const uint64_t now = now_us();
+    CxVar* data = cx_var_get_map_map(resp, "data");
+    int64_t sent;
+    CXCHKZ(pthread_mutex_lock(&s->lock));
+    if (data && cx_var_get_map_int(data, "t", &sent)) {
+        const uint64_t elapsed = now - sent;
+        if (s->nlat >= s->caplat) {
+            s->caplat = s->caplat ? s->caplat * 2 : 4096;
+            s->lat = realloc(s->lat, s->caplat * sizeof(uint32_t));
+        }
+        s->lat[s->nlat++] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+        s->nresps++;
+    } else {
+        s->nerrors++;
+    }
+    s->inflight--;
+    CXCHKZ(pthread_cond_signal(&s->cond));
+    CXCHKZ(pthread_mutex_unlock(&s->lock));
+}
+
+// Keeps the ready state of the server connections
+static void bench_event(WrsRpc* rpc, size_t connid, WrsEvent ev) {
+
+    Bench* b = &gbench;
+    CXCHKZ(pthread_mutex_lock(&b->lock));
+    if (connid < b->max_conns) {
+        if (ev == WrsEventReady) {
+            b->ready[connid] = true;
+        } else if (ev == WrsEventClose) {
+            b->ready[connid] = false;
+        }
+    }
+    CXCHKZ(pthread_mutex_unlock(&b->lock));
+}
+
+static int bench_server_echo(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp) {
+
+    cx_var_cpy_val(params, cx_var_set_map_map(resp, "data"));
+    return 0;
+}
+
+static int bench_server_response(WrsRpc* rpc, size_t connid, CxVar* resp) {
+
+    Bench* b = &gbench;
+    CXCHKZ(pthread_mutex_lock(&b->lock));
+    Sender* s = connid < b->max_conns ? b->senders[connid] : NULL;
+    CXCHKZ(pthread_mutex_unlock(&b->lock));
+    if (s) {
+        sender_response(s, resp);
+    }
+    return 0;
+}
+
+static int bench_client_echo(WrsClient* client, CxVar* params, CxVar* resp) {
+
+    cx_var_cpy_val(params, cx_var_set_map_map(resp, "data"));
+    return 0;
+}
+
+static int bench_client_response(WrsClient* client, CxVar* resp, void* cbdata) {
+
+    sender_response(cbdata, resp);
+    return 0;
+}
+
+static size_t bench_ready_count(Bench* b) {
+
+    size_t count = 0;
+    CXCHKZ(pthread_mutex_lock(&b->lock));
+    for (size_t i = 0; i < b->max_conns; i++) {
+        count += b->ready[i];
+    }
+    CXCHKZ(pthread_mutex_unlock(&b->lock));
+    return count;
+}
+
+static uint64_t now_us(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_ms(int ms) {
+
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int cmp_u32(const void* a, const void* b) {
+
+    const uint32_t va = *(const uint32_t*)a;
+    const uint32_t vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "argparse.h"
+#include "wrs.h"
+
+// Static file serving benchmark.
+// Starts the server using the embedded zip static filesystem and using the
+// document root and replays the page load request set formed by all the files
+// of the static filesystem directory with concurrent HTTP clients, reporting
+// requests/s, bytes/s, latency percentiles and server CPU per request.
+// Must be executed from the 'tests' directory.
+
+// Static filesystem zip embedded by staticfs.c
+extern const unsigned char gStaticfsZipData[];
+extern const unsigned int  gStaticfsZipSize;
+
+#define STATICFS_DIR    "./src/staticfs"
+
+// Benchmark options
+typedef struct Options {
+    const char* modes;          // Modes to run: zip and/or root
+    int         conc;           // Number of concurrent clients
+    int         duration;       // Duration of each run in milliseconds
+    const char* out;            // Optional JSON output file
+} Options;
+
+// State of each client
+typedef struct Client {
+    struct Bench*   bench;
+    pthread_t       thread;
+    size_t          next;       // Index of next file to request
+    uint64_t        nreqs;      // Number of successful requests
+    uint64_t        nerrors;    // Number of failed requests
+    uint64_t        nbytes;     // Number of bytes received
+    uint64_t        cpu_ns;     // CPU used by the client thread
+    uint32_t*       lat;        // Latencies in microseconds
+    size_t          nlat;       // Number of latencies
+    size_t          caplat;     // Capacity of latencies array
+} Client;
+
+// Benchmark state
+typedef struct Bench {
+    const Options*  opts;
+    int             port;       // Server port
+    char**          uris;       // Request set
+    size_t          nuris;      // Number of requests in the set
+    size_t          capuris;    // Capacity of request set
+    atomic_bool     run;        // Run flag
+} Bench;
+
+// Result of one run
+typedef struct RunResult {
+    double      reqs_s;         // Requests per second
+    double      mb_s;           // Received MB per second
+    double      cpu_us_req;     // Server CPU microseconds per request
+    uint64_t    nerrors;        // Number of failed requests
+    uint32_t    p50;            // Latency percentiles in microseconds
+    uint32_t    p99;
+    uint32_t    p999;
+    uint32_t    max;
+} RunResult;
+
+// Global benchmark state used by the directory walker
+static Bench gbench;
+
+// Forward declarations
+static int parse_options(int argc, const char* argv[], Options* opts);
+static int add_file(const char* path, const struct stat* sb, int type, struct FTW* ftw);
+static RunResult bench_run(Bench* b, bool zip);
+static void* client_thread(void* arg);
+static int client_get(Client* c, const char* uri, uint64_t* nbytes);
+static uint64_t now_us(void);
+static uint64_t process_cpu_ns(void);
+static uint64_t thread_cpu_ns(void);
+static int cmp_u32(const void* a, const void* b);
+
+
+int main(int argc, const char* argv[]) {
+
+    Options opts = {
+        .modes = "zip,root",
+        .conc = 8,
+        .duration = 5000,
+    };
+    parse_options(argc, argv, &opts);
+
+    // Builds the request set from the static filesystem directory
+    Bench* b = &gbench;
+    b->opts = &opts;
+    if (nftw(STATICFS_DIR, add_file, 16, FTW_PHYS) != 0 || b->nuris == 0) {
+        fprintf(stderr, "error reading static files from:%s\n", STATICFS_DIR);
+        return 1;
+    }
+
+    FILE* f = NULL;
+    if (opts.out) {
+        f = fopen(opts.out, "w");
+        if (f == NULL) {
+            fprintf(stderr, "could not create:%s\n", opts.out);
+            return 1;
+        }
+        fprintf(f, "{\n  \"benchmark\": \"static\",\n  \"files\": %zu,\n  \"conc\": %d,\n  \"results\": [\n", b->nuris, opts.conc);
+    }
+
+    printf("files: %zu concurrency: %d\n", b->nuris, opts.conc);
+    printf("%-5s %10s %10s %10s %8s %8s %8s %8s %7s\n",
+        "mode", "reqs/s", "MB/s", "cpu_us/req", "p50", "p99", "p999", "max", "errors");
+    bool first = true;
+    for (int mode = 0; mode < 2; mode++) {
+        const char* mname = mode == 0 ? "zip" : "root";
+        if (strstr(opts.modes, mname) == NULL) {
+            continue;
+        }
+        const RunResult r = bench_run(b, mode == 0);
+        printf("%-5s %10.1f %10.2f %10.1f %8u %8u %8u %8u %7lu\n",
+            mname, r.reqs_s, r.mb_s, r.cpu_us_req, r.p50, r.p99, r.p999, r.max, r.nerrors);
+        fflush(stdout);
+        if (f) {
+            fprintf(f, "%s    {\"mode\": \"%s\", \"reqs_s\": %.3f, \"mb_s\": %.3f, \"cpu_us_req\": %.3f, "
+                "\"p50_us\": %u, \"p99_us\": %u, \"p999_us\": %u, \"max_us\": %u, \"errors\": %lu}",
+                first ? "" : ",\n", mname, r.reqs_s, r.mb_s, r.cpu_us_req, r.p50, r.p99, r.p999, r.max, r.nerrors);
+            first = false;
+        }
+    }
+    if (f) {
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+    }
+
+    for (size_t i = 0; i < b->nuris; i++) {
+        free(b->uris[i]);
+    }
+    free(b->uris);
+    return 0;
+}
+
+static int parse_options(int argc, const char* argv[], Options* opts) {
+
+    static const char* usages[] = {
+        "bench_static [options]",
+        NULL,
+    };
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('m', "modes", &opts->modes, "Serving modes: zip (embedded staticfs), root (document root)", NULL, 0, 0),
+        OPT_INTEGER('c', "conc", &opts->conc, "Number of concurrent clients", NULL, 0, 0),
+        OPT_INTEGER('d', "duration", &opts->duration, "Duration of each run in ms", NULL, 0, 0),
+        OPT_STRING('o', "out", &opts->out, "Output JSON file", NULL, 0, 0),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "WRS static file serving benchmark", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    if (opts->conc < 1) {
+        fprintf(stderr, "invalid options\n");
+        exit(1);
+    }
+    return 0;
+}
+
+// Adds the uri of each regular file to the request set
+static int add_file(const char* path, const struct stat* sb, int type, struct FTW* ftw) {
+
+    if (type != FTW_F) {
+        return 0;
+    }
+    Bench* b = &gbench;
+    if (b->nuris >= b->capuris) {
+        b->capuris = b->capuris ? b->capuris * 2 : 64;
+        b->uris = realloc(b->uris, b->capuris * sizeof(char*));
+    }
+    b->uris[b->nuris++] = strdup(path + strlen(STATICFS_DIR));
+    return 0;
+}
+
+// Starts the server in the specified mode and replays the request set
+static RunResult bench_run(Bench* b, bool zip) {
+
+    RunResult r = {0};
+    WrsConfig cfg = {
+        .document_root  = zip ? NULL : STATICFS_DIR,
+        .listening_port = 0,
+        .use_staticfs   = zip,
+        .staticfs_prefix= "staticfs",
+        .staticfs_data  = gStaticfsZipData,
+        .staticfs_len   = gStaticfsZipSize,
+    };
+    Wrs* wrs = wrs_create(&cfg);
+    if (wrs == NULL) {
+        fprintf(stderr, "error starting server\n");
+        exit(1);
+    }
+    b->port = wrs_get_port(wrs);
+
+    // Starts the clients, each one replaying the request set from a different file
+    Client* clients = calloc(b->opts->conc, sizeof(Client));
+    b->run = true;
+    const uint64_t start = now_us();
+    const uint64_t cpu_start = process_cpu_ns();
+    for (int i = 0; i < b->opts->conc; i++) {
+        Client* c = &clients[i];
+        c->bench = b;
+        c->next = (i * b->nuris) / b->opts->conc;
+        CXCHKZ(pthread_create(&c->thread, NULL, client_thread, c));
+    }
+    struct timespec ts = {.tv_sec = b->opts->duration / 1000, .tv_nsec = (b->opts->duration % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+    b->run = false;
+    for (int i = 0; i < b->opts->conc; i++) {
+        CXCHKZ(pthread_join(clients[i].thread, NULL));
+    }
+    const double elapsed = (now_us() - start) / 1e6;
+    const uint64_t cpu_ns = process_cpu_ns() - cpu_start;
+    wrs_destroy(wrs);
+
+    // Merges the results of all clients.
+    // The server CPU is the process CPU minus the CPU used by the client threads.
+    uint64_t nreqs = 0, nbytes = 0, client_cpu_ns = 0;
+    size_t nlat = 0;
+    for (int i = 0; i < b->opts->conc; i++) {
+        nreqs += clients[i].nreqs;
+        nbytes += clients[i].nbytes;
+        r.nerrors += clients[i].nerrors;
+        client_cpu_ns += clients[i].cpu_ns;
+        nlat += clients[i].nlat;
+    }
+    uint32_t* lat = malloc((nlat + 1) * sizeof(uint32_t));
+    size_t pos = 0;
+    for (int i = 0; i < b->opts->conc; i++) {
+        memcpy(lat + pos, clients[i].lat, clients[i].nlat * sizeof(uint32_t));
+        pos += clients[i].nlat;
+        free(clients[i].lat);
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+    r.reqs_s = nreqs / elapsed;
+    r.mb_s = nbytes / elapsed / (1024*1024);
+    if (nreqs > 0) {
+        const uint64_t server_cpu_ns = cpu_ns > client_cpu_ns ? cpu_ns - client_cpu_ns : 0;
+        r.cpu_us_req = server_cpu_ns / 1e3 / nreqs;
+    }
+    if (nlat > 0) {
+        r.p50 = lat[(size_t)(0.50 * (nlat - 1))];
+        r.p99 = lat[(size_t)(0.99 * (nlat - 1))];
+        r.p999 = lat[(size_t)(0.999 * (nlat - 1))];
+        r.max = lat[nlat - 1];
+    }
+    free(lat);
+    free(clients);
+    return r;
+}
+
+// Requests the files of the request set until the run ends
+static void* client_thread(void* arg) {
+
+    Client* c = arg;
+    Bench* b = c->bench;
+    const uint64_t cpu_start = thread_cpu_ns();
+    while (b->run) {
+        const char* uri = b->uris[c->next];
+        c->next = (c->next + 1) % b->nuris;
+        const uint64_t sent = now_us();
+        uint64_t nbytes;
+        if (client_get(c, uri, &nbytes)) {
+            c->nerrors++;
+            continue;
+        }
+        const uint64_t elapsed = now_us() - sent;
+        c->nreqs++;
+        c->nbytes += nbytes;
+        if (c->nlat >= c->caplat) {
+            c->caplat = c->caplat ? c->caplat * 2 : 4096;
+            c->lat = realloc(c->lat, c->caplat * sizeof(uint32_t));
+        }
+        c->lat[c->nlat++] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    }
+    c->cpu_ns = thread_cpu_ns() - cpu_start;
+    return NULL;
+}
+
+// Requests one file using a new connection, as the server does not keep connections alive,
+// and reads the complete response.
+// Returns 0 if the response status is 200.
+static int client_get(Client* c, const char* uri, uint64_t* nbytes) {
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(c->bench->port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int res = -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        goto exit;
+    }
+    char req[512];
+    const int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", uri);
+    if (len >= (int)sizeof(req) || send(fd, req, len, MSG_NOSIGNAL) != len) {
+        goto exit;
+    }
+
+    // Reads the response until the server closes the connection
+    char buf[64*1024];
+    char status[16] = {0};
+    size_t total = 0;
+    while (true) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (total < sizeof(status) - 1) {
+            const size_t ncopy = sizeof(status) - 1 - total < (size_t)n ? sizeof(status) - 1 - total : (size_t)n;
+            memcpy(status + total, buf, ncopy);
+        }
+        total += n;
+    }
+    *nbytes = total;
+    res = strncmp(status, "HTTP/1.1 200", 12) == 0 ? 0 : -1;
+
+exit:
+    close(fd);
+    return res;
+}
+
+static uint64_t now_us(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t process_cpu_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+
+    const uint32_t va = *(const uint32_t*)a;
+    const uint32_t vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cx_alloc.h"
+#include "cx_logger.h"
+
+#include "argparse.h"
+#include "wrs.h"
+#include "wrs_client.h"
+
+// Load generator for WRS RPC endpoints.
+// Opens N client connections and calls the test server bindings
+// 'rpc_server_bin_msg' and 'rpc_server_text_msg' with the configured
+// mix, message size and rate, reporting throughput and latency percentiles.
+
+// Load generator options
+typedef struct Options {
+    const char* host;           // Server host
+    int         port;           // Server port
+    const char* url;            // RPC endpoint url
+    int         nconns;         // Number of connections
+    int         duration;       // Test duration in seconds
+    int         rate;           // Calls per second per connection (0 for closed loop)
+    int         depth;          // Maximum number of calls in flight per connection
+    int         size;           // Number of elements of each array parameter
+    int         bin_weight;     // Relative weight of binary calls
+    int         text_weight;    // Relative weight of text calls
+    bool        pack;           // Use MessagePack envelope
+} Options;
+
+// State of each connection
+typedef struct Conn {
+    const Options*  opts;
+    WrsClient*      client;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             inflight;   // Number of calls waiting for response
+    uint64_t        ncalls;     // Number of calls sent
+    uint64_t        nresps;     // Number of responses received
+    uint64_t        nerrors;    // Number of errors
+    uint64_t        nbytes;     // Number of parameter bytes sent
+    uint32_t*       lat;        // Latencies in microseconds
+    size_t          nlat;       // Number of latencies
+    size_t          caplat;     // Capacity of latencies array
+    CxVar*          bin_params; // Parameters for binary calls
+    CxVar*          text_params;// Parameters for text calls
+    size_t          bin_bytes;  // Size of binary call parameters
+    size_t          text_bytes; // Approximate size of text call parameters
+} Conn;
+
+// Global run flag
+static atomic_bool grun = true;
+
+// Forward declarations
+static int parse_options(int argc, const char* argv[], Options* opts);
+static void* conn_thread(void* arg);
+static int conn_response(WrsClient* client, CxVar* resp, void* cbdata);
+static CxVar* build_params(int size, bool bin, size_t* nbytes);
+static uint64_t now_us(void);
+static int cmp_u32(const void* a, const void* b);
+
+
+int main(int argc, const char* argv[]) {
+
+    Options opts = {
+        .host = "127.0.0.1",
+        .port = 8888,
+        .url = "/rpc1",
+        .nconns = 1,
+        .duration = 10,
+        .rate = 0,
+        .depth = 1,
+        .size = 1000,
+        .bin_weight = 1,
+        .text_weight = 0,
+    };
+    parse_options(argc, argv, &opts);
+    wrs_logger_init(NULL, "LOADGEN");
+
+    // Opens connections
+    Conn* conns = calloc(opts.nconns, sizeof(Conn));
+    for (int i = 0; i < opts.nconns; i++) {
+        Conn* c = &conns[i];
+        c->opts = &opts;
+        CXCHKZ(pthread_mutex_init(&c->lock, NULL));
+        CXCHKZ(pthread_cond_init(&c->cond, NULL));
+        c->bin_params = build_params(opts.size, true, &c->bin_bytes);
+        c->text_params = build_params(opts.size, false, &c->text_bytes);
+        WrsClientConfig cfg = {
+            .host = opts.host,
+            .port = opts.port,
+            .url = opts.url,
+            .pack = opts.pack,
+            .userdata = c,
+        };
+        c->client = wrs_client_connect(&cfg);
+        if (c->client == NULL) {
+            fprintf(stderr, "error opening connection:%d\n", i);
+            return 1;
+        }
+    }
+
+    // Starts the connection threads and waits for the test duration
+    const uint64_t start = now_us();
+    for (int i = 0; i < opts.nconns; i++) {
+        CXCHKZ(pthread_create(&conns[i].thread, NULL, conn_thread, &conns[i]));
+    }
+    struct timespec ts = {.tv_sec = opts.duration};
+    nanosleep(&ts, NULL);
+    grun = false;
+    for (int i = 0; i < opts.nconns; i++) {
+        CXCHKZ(pthread_join(conns[i].thread, NULL));
+    }
+    const double elapsed = (now_us() - start) / 1e6;
+
+    // Merges statistics of all connections
+    uint64_t ncalls = 0, nresps = 0, nerrors = 0, nbytes = 0;
+    size_t nlat = 0;
+    for (int i = 0; i < opts.nconns; i++) {
+        Conn* c = &conns[i];
+        CXCHKZ(pthread_mutex_lock(&c->lock));
+        ncalls += c->ncalls;
+        nresps += c->nresps;
+        nerrors += c->nerrors;
+        nbytes += c->nbytes;
+        nlat += c->nlat;
+        CXCHKZ(pthread_mutex_unlock(&c->lock));
+    }
+    uint32_t* lat = malloc((nlat + 1) * sizeof(uint32_t));
+    size_t pos = 0;
+    for (int i = 0; i < opts.nconns; i++) {
+        Conn* c = &conns[i];
+        CXCHKZ(pthread_mutex_lock(&c->lock));
+        memcpy(lat + pos, c->lat, c->nlat * sizeof(uint32_t));
+        pos += c->nlat;
+        CXCHKZ(pthread_mutex_unlock(&c->lock));
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+
+    // Prints report
+    printf("connections:   %d\n", opts.nconns);
+    printf("duration:      %.2f s\n", elapsed);
+    printf("calls:         %lu\n", ncalls);
+    printf("responses:     %lu\n", nresps);
+    printf("errors:        %lu\n", nerrors);
+    printf("throughput:    %.1f calls/s %.2f MB/s\n", nresps / elapsed, nbytes / elapsed / (1024*1024));
+    if (nlat > 0) {
+        const double pcts[] = {50, 90, 99, 99.9};
+        for (size_t i = 0; i < sizeof(pcts)/sizeof(pcts[0]); i++) {
+            size_t idx = (size_t)(pcts[i] / 100.0 * (nlat - 1));
+            printf("latency p%-5g %u us\n", pcts[i], lat[idx]);
+        }
+        printf("latency max    %u us\n", lat[nlat-1]);
+    }
+
+    // Closes connections
+    for (int i = 0; i < opts.nconns; i++) {
+        Conn* c = &conns[i];
+        wrs_client_close(c->client);
+        cx_var_del(c->bin_params);
+        cx_var_del(c->text_params);
+        free(c->lat);
+        CXCHKZ(pthread_mutex_destroy(&c->lock));
+        CXCHKZ(pthread_cond_destroy(&c->cond));
+    }
+    free(lat);
+    free(conns);
+    cx_logger_del(wrs_logger());
+    return 0;
+}
+
+static int parse_options(int argc, const char* argv[], Options* opts) {
+
+    static const char* usages[] = {
+        "wrs_loadgen [options]",
+        NULL,
+    };
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('H', "host", &opts->host, "Server host", NULL, 0, 0),
+        OPT_INTEGER('p', "port", &opts->port, "Server port", NULL, 0, 0),
+        OPT_STRING('u', "url", &opts->url, "RPC endpoint url", NULL, 0, 0),
+        OPT_INTEGER('n', "conns", &opts->nconns, "Number of connections", NULL, 0, 0),
+        OPT_INTEGER('d', "duration", &opts->duration, "Test duration in seconds", NULL, 0, 0),
+        OPT_INTEGER('r', "rate", &opts->rate, "Calls per second per connection (0 for closed loop)", NULL, 0, 0),
+        OPT_INTEGER('q', "depth", &opts->depth, "Maximum calls in flight per connection", NULL, 0, 0),
+        OPT_INTEGER('s', "size", &opts->size, "Number of elements of each array parameter", NULL, 0, 0),
+        OPT_INTEGER('b', "bin", &opts->bin_weight, "Weight of binary calls in the mix", NULL, 0, 0),
+        OPT_INTEGER('t', "text", &opts->text_weight, "Weight of text calls in the mix", NULL, 0, 0),
+        OPT_BOOLEAN('m', "pack", &opts->pack, "Use MessagePack envelope", NULL, 0, 0),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "WRS RPC load generator", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    if (opts->nconns < 1 || opts->depth < 1 || opts->bin_weight + opts->text_weight <= 0) {
+        fprintf(stderr, "invalid options\n");
+        exit(1);
+    }
+    return 0;
+}
+
+// Sends calls for one connection until the test ends
+static void* conn_thread(void* arg) {
+
+    Conn* c = arg;
+    const Options* opts = c->opts;
+    const int weights = opts->bin_weight + opts->text_weight;
+    const uint64_t interval = opts->rate > 0 ? 1000000 / opts->rate : 0;
+    uint64_t next = now_us();
+    unsigned int seed = (uintptr_t)c;
+
+    while (grun) {
+        // Waits for free slot for call in flight
+        CXCHKZ(pthread_mutex_lock(&c->lock));
+        while (grun && c->inflight >= opts->depth) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10*1000*1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+        }
+        c->inflight++;
+        CXCHKZ(pthread_mutex_unlock(&c->lock));
+        if (!grun) {
+            break;
+        }
+
+        // Waits for the next scheduled call time if rate limited
+        if (interval) {
+            const uint64_t now = now_us();
+            if (next > now) {
+                struct timespec ts = {.tv_sec = (next - now) / 1000000, .tv_nsec = ((next - now) % 1000000) * 1000};
+                nanosleep(&ts, NULL);
+            }
+            next += interval;
+        }
+
+        // Selects call type from the configured mix
+        const bool bin = (int)(rand_r(&seed) % weights) < opts->bin_weight;
+        const char* name = bin ? "rpc_server_bin_msg" : "rpc_server_text_msg";
+        CxVar* params = bin ? c->bin_params : c->text_params;
+        const uint64_t sent = now_us();
+        CxError err = wrs_client_call(c->client, name, params, conn_response, (void*)(uintptr_t)sent);
+        CXCHKZ(pthread_mutex_lock(&c->lock));
+        if (err.code) {
+            c->nerrors++;
+            c->inflight--;
+        } else {
+            c->ncalls++;
+            c->nbytes += bin ? c->bin_bytes : c->text_bytes;
+        }
+        CXCHKZ(pthread_mutex_unlock(&c->lock));
+    }
+    return NULL;
+}
+
+// Receives call response and saves its latency
+static int conn_response(WrsClient* client, CxVar* resp, void* cbdata) {
+
+    Conn* c = wrs_client_get_userdata(client);
+    const uint64_t elapsed = now_us() - (uintptr_t)cbdata;
+    CXCHKZ(pthread_mutex_lock(&c->lock));
+    if (cx_var_get_map_val(resp, "data")) {
+        c->nresps++;
+    } else {
+        c->nerrors++;
+    }
+    if (c->nlat >= c->caplat) {
+        c->caplat = c->caplat ? c->caplat * 2 : 4096;
+        c->lat = realloc(c->lat, c->caplat * sizeof(uint32_t));
+    }
+    c->lat[c->nlat++] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    c->inflight--;
+    CXCHKZ(pthread_cond_signal(&c->cond));
+    CXCHKZ(pthread_mutex_unlock(&c->lock));
+    return 0;
+}
+
+// Builds call parameters in the format expected by the test server bindings
+static CxVar* build_params(int size, bool bin, size_t* nbytes) {
+
+    CxVar* params = cx_var_new(NULL);
+    cx_var_set_map(params);
+    cx_var_set_map_int(params, "size", size);
+    const char* names[] = {"u8", "u16", "u32", "f32", "f64"};
+    const size_t elsizes[] = {1, 2, 4, 4, 8};
+    *nbytes = 0;
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+        if (bin) {
+            CxVar* buf = cx_var_set_map_buf(params, names[i], NULL, size * elsizes[i]);
+            void* data;
+            size_t len;
+            cx_var_get_buf(buf, (const void**)&data, &len);
+            memset(data, 1, len);
+            *nbytes += len;
+        } else {
+            CxVar* arr = cx_var_set_map_arr(params, names[i]);
+            for (int j = 0; j < size; j++) {
+                cx_var_push_arr_int(arr, j % 100);
+            }
+            *nbytes += size * 3;
+        }
+    }
+    return params;
+}
+
+static uint64_t now_us(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+
+    const uint32_t va = *(const uint32_t*)a;
+    const uint32_t vb = *(const uint32_t*)b;
+    return va < vb ? -1 : va > vb;
+}
+
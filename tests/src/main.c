@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <inttypes.h>
 
 #include "cx_alloc.h"
 #include "cx_logger.h"
@@ -22,6 +24,8 @@ typedef struct Audio {
     int64_t noise;          // noise ampliture (0-100%)
     int64_t nsamples;       // number of samples to generate
     double  phase;
+    float*  frame;          // frame pushed to the audio stream
+    size_t  frame_len;      // number of samples of the frame buffer
 } Audio;
 
 // Application state
@@ -30,10 +34,14 @@ typedef struct AppState {
     Wrs*            wrs;
     WrsRpc*         rpc1;
     WrsRpc*         rpc2;
+    WrsStore*       audio_store;        // Audio parameters replicated to the /rpc2 clients
     int             server_port;        // HTTP server listening port
+    int             max_conns;          // Maximum number of connections of /rpc1
     bool            use_staticfs;       // Use external app file system for development
     bool            webkit;             // Uses internal webkit gtk view
     bool            start_browser;   
+    bool            metrics;            // Serves Prometheus metrics at /metrics
+    int             mem_budget;         // Server memory budget in KB (0 for no limit)
     _Atomic bool    run_server;
     size_t          test_bin_count;
     Audio           audio;
@@ -49,8 +57,15 @@ static int rpc_server_text_msg(WrsRpc* rpc, size_t connid, CxVar* params, CxVar*
 static int rpc_server_bin_msg(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
 static int rpc_server_audio_set(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
 static int rpc_server_audio_run(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
+static void audio_stream_credit(WrsRpc* rpc, size_t connid, size_t sid, size_t credits);
+static void audio_generate(Audio* audio, float* signal, float* label);
 static int rpc_server_exit(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
 static int cmd_test_bin(Cli* cli, void* udata);
+static int cmd_conn_stats(Cli* cli, void* udata);
+static int cmd_trace(Cli* cli, void* udata);
+static int cmd_lock_stats(Cli* cli, void* udata);
+static void print_lock_stats(const WrsLockStats* st);
+static int cmd_mem_stats(Cli* cli, void* udata);
 static void call_test_bin(WrsRpc* rpc, size_t size);
 static int resp_test_bin(WrsRpc* rpc, size_t connid, CxVar* resp);
 
@@ -64,6 +79,7 @@ int main(int argc, const char* argv[]) {
     // Initialize app state
     AppState app = {
         .server_port = 8888,
+        .max_conns = 2,
         .run_server = true,
     };
     app.cli = cli_create(cmds);
@@ -81,6 +97,8 @@ int main(int argc, const char* argv[]) {
         .document_root       = "./src/staticfs",
         .listening_port      = app.server_port,
         .use_staticfs        = app.use_staticfs,
+        .metrics             = app.metrics,
+        .mem_budget          = (size_t)app.mem_budget * 1024,
         .staticfs_prefix     = "staticfs",
         .staticfs_data       = gStaticfsZipData,
         .staticfs_len        = gStaticfsZipSize,
@@ -99,17 +117,20 @@ int main(int argc, const char* argv[]) {
     app.wrs = wrs_create(&cfg);
 
     // Creates RPC 1
-    app.rpc1 = wrs_rpc_open(app.wrs, "/rpc1", 2, rpc_event);
+    app.rpc1 = wrs_rpc_open(app.wrs, "/rpc1", app.max_conns, rpc_event);
     wrs_rpc_set_userdata(app.rpc1, &app);
+    wrs_rpc_set_options(app.rpc1, &(WrsRpcOptions){.ping_interval_ms = 5000, .frag_size = 64*1024});
     CXERR_CHK(wrs_rpc_bind(app.rpc1, "rpc_server_text_msg", rpc_server_text_msg));
     CXERR_CHK(wrs_rpc_bind(app.rpc1, "rpc_server_bin_msg", rpc_server_bin_msg));
     CXERR_CHK(wrs_rpc_bind(app.rpc1, "rpc_server_exit", rpc_server_exit));
+    CXERR_CHK(wrs_rpc_bind_priority(app.rpc1, "rpc_server_text_msg", WrsPriorityHigh));
 
     // Creates RPC 2
     app.rpc2 = wrs_rpc_open(app.wrs, "/rpc2", 2, rpc_event);
     wrs_rpc_set_userdata(app.rpc2, &app);
     CXERR_CHK(wrs_rpc_bind(app.rpc2, "rpc_server_audio_set", rpc_server_audio_set));
     CXERR_CHK(wrs_rpc_bind(app.rpc2, "rpc_server_audio_run", rpc_server_audio_run));
+    app.audio_store = wrs_store_open(app.rpc2, "audio", 100);
 
     // Blocks processing commands
     command_line_loop(&app);
@@ -117,7 +138,9 @@ int main(int argc, const char* argv[]) {
 
     // Terminates application
     WRS_LOGI("Terminating...");
+    wrs_store_close(app.audio_store);
     wrs_destroy(app.wrs);
+    free(app.audio.frame);
     cli_destroy(app.cli);
     cx_logger_del(wrs_logger());
     return 0;
@@ -148,6 +171,26 @@ static CliCmd cmds[] = {
         .help = "Call browser with binary arrays: [<count> [<size>]]",
         .handler = cmd_test_bin,
     },
+    {
+        .name = "conn_stats",
+        .help = "Show statistics of the /rpc1 connections",
+        .handler = cmd_conn_stats,
+    },
+    {
+        .name = "trace",
+        .help = "Trace RPC messages: start|stop|dump [<file>]",
+        .handler = cmd_trace,
+    },
+    {
+        .name = "lock_stats",
+        .help = "Show statistics of the server and /rpc1 locks",
+        .handler = cmd_lock_stats,
+    },
+    {
+        .name = "mem_stats",
+        .help = "Show the server memory usage",
+        .handler = cmd_mem_stats,
+    },
     {0}
 };
 
@@ -163,6 +206,9 @@ static int parse_options(int argc, const char* argv[], AppState* apps) {
         OPT_BOOLEAN('s', "staticfs", &apps->use_staticfs, "Use internal static filesystem", NULL, 0, 0),
         OPT_BOOLEAN('w', "webview", &apps->webkit, "Uses internal Webkit GTK view", NULL, 0, 0),
         OPT_BOOLEAN('b', "browser", &apps->start_browser, "Starts default browser", NULL, 0, 0),
+        OPT_INTEGER('c', "conns", &apps->max_conns, "Maximum number of connections of /rpc1", NULL, 0, 0),
+        OPT_BOOLEAN('m', "metrics", &apps->metrics, "Serves Prometheus metrics at /metrics", NULL, 0, 0),
+        OPT_INTEGER('M', "mem-budget", &apps->mem_budget, "Server memory budget in KB", NULL, 0, 0),
         OPT_END(),
     };
     struct argparse argparse;
@@ -380,9 +426,49 @@ static int rpc_server_audio_set(WrsRpc* rpc, size_t connid, CxVar* params, CxVar
     cx_var_get_map_int(params, "freq", &app->audio.freq);
     cx_var_get_map_int(params, "noise", &app->audio.noise);
     WRS_LOGD("%s: freq:%ld, nsamples:%ld", __func__, app->audio.freq, app->audio.nsamples);
+
+    // Replicates the changed parameters to the subscribed clients
+    const char* keys[] = {"gain", "freq", "noise"};
+    for (size_t i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+        CxVar* val = cx_var_get_map_val(params, keys[i]);
+        if (val) {
+            wrs_store_set(app->audio_store, keys[i], val);
+        }
+    }
+
+    // The initial call from the client opens the stream of audio frames
+    // and subscribes the client to the audio parameters.
+    if (cx_var_get_map_val(params, "nsamples")) {
+        size_t sid;
+        CxError err = wrs_rpc_stream_open(rpc, connid, "audio", audio_stream_credit, &sid);
+        if (err.code) {
+            WRS_LOGE("%s: error opening audio stream: %s", __func__, err.msg);
+        }
+        err = wrs_store_subscribe(app->audio_store, connid);
+        if (err.code) {
+            WRS_LOGE("%s: error subscribing to audio store: %s", __func__, err.msg);
+        }
+    }
     return 0;
 }
 
+// Pushes one audio frame for each credit granted by the client
+static void audio_stream_credit(WrsRpc* rpc, size_t connid, size_t sid, size_t credits) {
+
+    AppState* app = wrs_rpc_get_userdata(rpc);
+    Audio* audio = &app->audio;
+    if (audio->frame_len != (size_t)audio->nsamples) {
+        audio->frame_len = audio->nsamples;
+        audio->frame = realloc(audio->frame, audio->frame_len * sizeof(float));
+    }
+    for (size_t i = 0; i < credits; i++) {
+        audio_generate(audio, audio->frame, NULL);
+        if (wrs_rpc_stream_push(rpc, connid, sid, audio->frame, audio->frame_len * sizeof(float)).code) {
+            break;
+        }
+    }
+}
+
 static int rpc_server_audio_run(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp) {
 
     //WRS_LOGD("%s:", __func__);
@@ -398,20 +484,26 @@ static int rpc_server_audio_run(WrsRpc* rpc, size_t connid, CxVar* params, CxVar
     float* label_data;
     cx_var_get_buf(label, (void*)&label_data, &len);
 
-    // Generates signal and labels
-    const double delta = 2*M_PI * (double)app->audio.freq / (double)app->audio.sample_rate;
-    for (size_t i = 0; i < app->audio.nsamples; i++) {
-        signal_data[i] = ((double)app->audio.gain/100.0) * sin(app->audio.phase);
-        const float noise = (50-(rand() % 100)) * app->audio.noise / 20000.0;
-        signal_data[i] += noise;
-        label_data[i] = i;
-        app->audio.phase += delta;
-        if (app->audio.phase >= 2*M_PI) {
-            app->audio.phase = 2*M_PI-app->audio.phase;
+    audio_generate(&app->audio, signal_data, label_data);
+    return 0;
+}
+
+// Generates signal and optional labels
+static void audio_generate(Audio* audio, float* signal, float* label) {
+
+    const double delta = 2*M_PI * (double)audio->freq / (double)audio->sample_rate;
+    for (size_t i = 0; i < audio->nsamples; i++) {
+        signal[i] = ((double)audio->gain/100.0) * sin(audio->phase);
+        const float noise = (50-(rand() % 100)) * audio->noise / 20000.0;
+        signal[i] += noise;
+        if (label) {
+            label[i] = i;
+        }
+        audio->phase += delta;
+        if (audio->phase >= 2*M_PI) {
+            audio->phase = 2*M_PI-audio->phase;
         }
     }
-
-    return 0;
 }
 
 static int rpc_server_exit(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp) {
@@ -437,6 +529,79 @@ static int cmd_test_bin(Cli* cli, void* udata) {
    return CliOk;
 }
 
+static int cmd_conn_stats(Cli* cli, void* udata) {
+
+    AppState* app = udata;
+    const WrsRpcInfo info = wrs_rpc_info(app->rpc1);
+    for (size_t connid = 0; connid < info.max_connid; connid++) {
+        WrsRpcConnStats st;
+        if (wrs_rpc_conn_stats(app->rpc1, connid, &st).code) {
+            continue;
+        }
+        printf("conn:%zu msgs:%"PRIu64"/%"PRIu64" bytes:%"PRIu64"/%"PRIu64" rx:%zu/%zu tx:%zu/%zu pending:%zu rtt:%"PRId64"us idle:%"PRIu64"ms\n",
+            connid, st.msgs_in, st.msgs_out, st.bytes_in, st.bytes_out, st.rx_bytes, st.rx_peak,
+            st.tx_cap, st.tx_peak, st.pending, st.last_rtt_us, st.idle_ms);
+        printf("  ping rtt:%"PRId64"us min:%"PRId64"us max:%"PRId64"us missed:%u tx queued:%zu\n",
+            st.ping_rtt_us, st.ping_rtt_min_us, st.ping_rtt_max_us, st.pings_missed, st.tx_queued);
+    }
+    return CliOk;
+}
+
+static int cmd_trace(Cli* cli, void* udata) {
+
+    const char* cmd = cli_argc(cli) > 1 ? cli_argv(cli, 1) : "";
+    if (strcmp(cmd, "start") == 0) {
+        wrs_trace_start(0);
+    } else if (strcmp(cmd, "stop") == 0) {
+        wrs_trace_stop();
+    } else if (strcmp(cmd, "dump") == 0) {
+        const char* path = cli_argc(cli) > 2 ? cli_argv(cli, 2) : "trace.json";
+        CxError err = wrs_trace_dump(path);
+        if (err.code) {
+            printf("%s\n", err.msg);
+        }
+    } else {
+        printf("Invalid trace command\n");
+    }
+    return CliOk;
+}
+
+static int cmd_lock_stats(Cli* cli, void* udata) {
+
+    AppState* app = udata;
+    WrsLockStats st;
+    CxError err = wrs_lock_stats(app->wrs, &st);
+    if (err.code) {
+        printf("%s\n", err.msg);
+        return CliOk;
+    }
+    print_lock_stats(&st);
+    if (wrs_rpc_lock_stats(app->rpc1, &st).code == 0) {
+        print_lock_stats(&st);
+    }
+    return CliOk;
+}
+
+static void print_lock_stats(const WrsLockStats* st) {
+
+    printf("%s: count:%"PRIu64" contended:%"PRIu64" wait:%"PRIu64"ns hold:%"PRIu64"ns max_hold:%"PRIu64"ns at %s:%d\n",
+        st->name, st->count, st->contended, st->wait_ns, st->hold_ns, st->max_hold_ns,
+        st->max_hold_func ? st->max_hold_func : "-", st->max_hold_line);
+    printf("  wait/hold <2^i us:");
+    for (size_t i = 0; i < WRS_LOCK_HIST; i++) {
+        printf(" %"PRIu64"/%"PRIu64, st->wait_hist[i], st->hold_hist[i]);
+    }
+    printf("\n");
+}
+
+static int cmd_mem_stats(Cli* cli, void* udata) {
+
+    AppState* app = udata;
+    const WrsMemStats st = wrs_mem_stats(app->wrs);
+    printf("used:%zu peak:%zu budget:%zu rejected:%"PRIu64"\n", st.used, st.peak, st.budget, st.rejected);
+    return CliOk;
+}
+
 static void call_test_bin(WrsRpc* rpc, size_t size) {
 
     // Create parameters with non-initialized buffers
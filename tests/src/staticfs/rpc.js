@@ -17,10 +17,38 @@
 //       data: <any>            // Only present if NO error occured
 //    }
 // }
+//
+// If the MessagePack format is requested and accepted by the server
+// (subprotocol "wrs.pack") all messages sent and received are binary
+// messages with a single MessagePack chunk with embedded buffers.
+//
+// Large messages may be received in fragments, each one a binary message with
+// a single fragment chunk containing the message id, the fragment flags and
+// the fragment data. The fragments are concatenated and decoded as a text or
+// binary message when the last fragment arrives.
+//
+// Streams opened by the server push frames without the call and response
+// envelope. Each stream message is a binary message with a single stream chunk
+// containing the stream id, the message kind, a value and the payload.
+// The server only pushes frames while the client has credits for the stream,
+// coalescing the frames pushed without credits to the latest one.
 
 // Binary chunk types
 const ChunkTypeMsg    = 1;
 const ChunkTypeBuffer = 2;
+const ChunkTypePack   = 3;
+const ChunkTypeFrag   = 4;
+const FragFirst       = 1;
+const FragLast        = 2;
+const FragText        = 4;
+const ChunkTypeStream = 5;
+const StreamOpen      = 1;
+const StreamData      = 2;
+const StreamCredit    = 3;
+const StreamClose     = 4;
+const StreamFieldsSize = 3 * ChunkHeaderFieldSize;
+const SubprotocolJson = "wrs.json";
+const SubprotocolPack = "wrs.pack";
 const BufferPrefix = "\b\b\b\b\b\b";
 const ChunkHeaderFieldSize = 4;
 const ChunkHeaderSize = 2 * ChunkHeaderFieldSize;
@@ -58,15 +86,306 @@ function checkBuffer(buffer) {
     return BufferTypes.get(buffer.constructor.name);
 }
 
+// Minimal MessagePack encoder for RPC messages.
+// Encodes the message as a single chunk binary message.
+class PackEncoder {
+
+    encode(msg) {
+
+        this.#len = 0;
+        this.#reserve(ChunkHeaderSize);
+        this.#len = ChunkHeaderSize;
+        this.#value(msg);
+        const size = this.#len - ChunkHeaderSize;
+        this.#reserve(4);
+        this.#len = alignOffset(this.#len);
+        this.#view.setUint32(0, ChunkTypePack, true);
+        this.#view.setUint32(ChunkHeaderFieldSize, size, true);
+        return this.#buf.buffer.slice(0, this.#len);
+    }
+
+    #reserve(n) {
+
+        if (this.#buf && this.#len + n <= this.#buf.byteLength) {
+            return;
+        }
+        let cap = this.#buf ? this.#buf.byteLength * 2 : 1024;
+        while (cap < this.#len + n) {
+            cap *= 2;
+        }
+        const buf = new Uint8Array(cap);
+        if (this.#buf) {
+            buf.set(this.#buf.subarray(0, this.#len));
+        }
+        this.#buf = buf;
+        this.#view = new DataView(buf.buffer);
+    }
+
+    #tag(tag, value, nbytes) {
+
+        this.#reserve(9);
+        this.#view.setUint8(this.#len++, tag);
+        switch (nbytes) {
+            case 1: this.#view.setUint8(this.#len, value); break;
+            case 2: this.#view.setUint16(this.#len, value); break;
+            case 4: this.#view.setUint32(this.#len, value); break;
+        }
+        this.#len += nbytes;
+    }
+
+    // Writes tag and length for str, bin, array or map
+    #length(fixTag, fixLen, tag8, tag16, len) {
+
+        if (len < fixLen) {
+            this.#tag(fixTag | len, 0, 0);
+        } else if (tag8 && len <= 0xff) {
+            this.#tag(tag8, len, 1);
+        } else if (len <= 0xffff) {
+            this.#tag(tag16, len, 2);
+        } else {
+            this.#tag(tag16 + 1, len, 4);
+        }
+    }
+
+    #bytes(u8) {
+
+        this.#reserve(u8.byteLength);
+        this.#buf.set(u8, this.#len);
+        this.#len += u8.byteLength;
+    }
+
+    #str(str) {
+
+        const u8 = this.#textEncoder.encode(str);
+        this.#length(0xa0, 32, 0xd9, 0xda, u8.byteLength);
+        this.#bytes(u8);
+    }
+
+    #number(v) {
+
+        if (!Number.isSafeInteger(v)) {
+            this.#reserve(9);
+            this.#view.setUint8(this.#len, 0xcb);
+            this.#view.setFloat64(this.#len + 1, v);
+            this.#len += 9;
+            return;
+        }
+        if (v >= 0) {
+            if (v < 128) {
+                this.#tag(v, 0, 0);
+            } else if (v <= 0xff) {
+                this.#tag(0xcc, v, 1);
+            } else if (v <= 0xffff) {
+                this.#tag(0xcd, v, 2);
+            } else if (v <= 0xffffffff) {
+                this.#tag(0xce, v, 4);
+            } else {
+                this.#reserve(9);
+                this.#view.setUint8(this.#len, 0xcf);
+                this.#view.setBigUint64(this.#len + 1, BigInt(v));
+                this.#len += 9;
+            }
+            return;
+        }
+        if (v >= -32) {
+            this.#tag(v & 0xff, 0, 0);
+        } else if (v >= -0x80) {
+            this.#tag(0xd0, v & 0xff, 1);
+        } else if (v >= -0x8000) {
+            this.#tag(0xd1, v & 0xffff, 2);
+        } else if (v >= -0x80000000) {
+            this.#tag(0xd2, v >>> 0, 4);
+        } else {
+            this.#reserve(9);
+            this.#view.setUint8(this.#len, 0xd3);
+            this.#view.setBigInt64(this.#len + 1, BigInt(v));
+            this.#len += 9;
+        }
+    }
+
+    #value(v) {
+
+        if (v === null || v === undefined) {
+            this.#tag(0xc0, 0, 0);
+        } else if (typeof(v) == 'boolean') {
+            this.#tag(v ? 0xc3 : 0xc2, 0, 0);
+        } else if (typeof(v) == 'number') {
+            this.#number(v);
+        } else if (typeof(v) == 'string') {
+            this.#str(v);
+        } else if (checkBuffer(v)) {
+            const u8 = (v instanceof ArrayBuffer) ? new Uint8Array(v) :
+                new Uint8Array(v.buffer, v.byteOffset, v.byteLength);
+            this.#length(0, 0, 0xc4, 0xc5, u8.byteLength);
+            this.#bytes(u8);
+        } else if (Array.isArray(v)) {
+            this.#length(0x90, 16, 0, 0xdc, v.length);
+            for (let i = 0; i < v.length; i++) {
+                this.#value(v[i]);
+            }
+        } else if (typeof(v) == 'object') {
+            // Undefined fields are not encoded as in JSON.stringify()
+            const keys = Object.keys(v).filter(k => v[k] !== undefined);
+            this.#length(0x80, 16, 0, 0xde, keys.length);
+            for (const key of keys) {
+                this.#str(key);
+                this.#value(v[key]);
+            }
+        } else {
+            this.#tag(0xc0, 0, 0);
+        }
+    }
+
+    #buf            = null;
+    #view           = null;
+    #len            = 0;
+    #textEncoder    = new TextEncoder();
+};
+
+// Minimal MessagePack decoder for RPC messages.
+// Decoded 'bin' objects are returned as ArrayBuffer.
+class PackDecoder {
+
+    decode(buffer, offset, len) {
+
+        this.#buffer = buffer;
+        this.#view = new DataView(buffer, offset, len);
+        this.#pos = 0;
+        const value = this.#value();
+        if (this.#pos != len) {
+            throw new Error("invalid MessagePack chunk length");
+        }
+        return value;
+    }
+
+    #uint(nbytes) {
+
+        const pos = this.#pos;
+        this.#pos += nbytes;
+        switch (nbytes) {
+            case 1: return this.#view.getUint8(pos);
+            case 2: return this.#view.getUint16(pos);
+            case 4: return this.#view.getUint32(pos);
+            case 8: return Number(this.#view.getBigUint64(pos));
+        }
+    }
+
+    #int(nbytes) {
+
+        const pos = this.#pos;
+        this.#pos += nbytes;
+        switch (nbytes) {
+            case 1: return this.#view.getInt8(pos);
+            case 2: return this.#view.getInt16(pos);
+            case 4: return this.#view.getInt32(pos);
+            case 8: return Number(this.#view.getBigInt64(pos));
+        }
+    }
+
+    #str(len) {
+
+        const u8 = new Uint8Array(this.#buffer, this.#view.byteOffset + this.#pos, len);
+        this.#pos += len;
+        return this.#textDecoder.decode(u8);
+    }
+
+    #bin(len) {
+
+        const start = this.#view.byteOffset + this.#pos;
+        this.#pos += len;
+        return this.#buffer.slice(start, start + len);
+    }
+
+    #arr(len) {
+
+        const arr = new Array(len);
+        for (let i = 0; i < len; i++) {
+            arr[i] = this.#value();
+        }
+        return arr;
+    }
+
+    #map(len) {
+
+        const map = {};
+        for (let i = 0; i < len; i++) {
+            const key = this.#value();
+            map[key] = this.#value();
+        }
+        return map;
+    }
+
+    #value() {
+
+        const tag = this.#uint(1);
+        if (tag <= 0x7f) {
+            return tag;
+        }
+        if (tag <= 0x8f) {
+            return this.#map(tag & 0x0f);
+        }
+        if (tag <= 0x9f) {
+            return this.#arr(tag & 0x0f);
+        }
+        if (tag <= 0xbf) {
+            return this.#str(tag & 0x1f);
+        }
+        if (tag >= 0xe0) {
+            return tag - 0x100;
+        }
+        switch (tag) {
+            case 0xc0: return null;
+            case 0xc2: return false;
+            case 0xc3: return true;
+            case 0xc4: return this.#bin(this.#uint(1));
+            case 0xc5: return this.#bin(this.#uint(2));
+            case 0xc6: return this.#bin(this.#uint(4));
+            case 0xca: {
+                const v = this.#view.getFloat32(this.#pos);
+                this.#pos += 4;
+                return v;
+            }
+            case 0xcb: {
+                const v = this.#view.getFloat64(this.#pos);
+                this.#pos += 8;
+                return v;
+            }
+            case 0xcc: return this.#uint(1);
+            case 0xcd: return this.#uint(2);
+            case 0xce: return this.#uint(4);
+            case 0xcf: return this.#uint(8);
+            case 0xd0: return this.#int(1);
+            case 0xd1: return this.#int(2);
+            case 0xd2: return this.#int(4);
+            case 0xd3: return this.#int(8);
+            case 0xd9: return this.#str(this.#uint(1));
+            case 0xda: return this.#str(this.#uint(2));
+            case 0xdb: return this.#str(this.#uint(4));
+            case 0xdc: return this.#arr(this.#uint(2));
+            case 0xdd: return this.#arr(this.#uint(4));
+            case 0xde: return this.#map(this.#uint(2));
+            case 0xdf: return this.#map(this.#uint(4));
+        }
+        throw new Error(`unsupported MessagePack type: ${tag}`);
+    }
+
+    #buffer         = null;
+    #view           = null;
+    #pos            = 0;
+    #textDecoder    = new TextDecoder();
+};
+
 export class RPC extends EventTarget {
 
     // Creates RPC manager for specified server URL
     // url - Server URL
     // retryMS - Optional number of milliseconds to retry connection
-    constructor(url, retryMS) {
+    // pack - Optional request to use MessagePack message format
+    constructor(url, retryMS, pack=false) {
         super();
         this.#url = url;
         this.#retryMS = retryMS;
+        this.#pack = pack;
     }
 
     // Open RPC WebSocket connection 
@@ -79,7 +398,11 @@ export class RPC extends EventTarget {
 
         // Open web socket connection with server using the supplied relative URL
         const url = 'ws://' + document.location.host + "/" + this.#url;
-        this.#socket = new WebSocket(url);
+        if (this.#pack) {
+            this.#socket = new WebSocket(url, [SubprotocolPack, SubprotocolJson]);
+        } else {
+            this.#socket = new WebSocket(url);
+        }
         this.#socket.binaryType = 'arraybuffer';
 
         // Sets event handlers
@@ -135,6 +458,60 @@ export class RPC extends EventTarget {
         }
     }
 
+    // Sets the function which receives the frames pushed by the server in the named stream.
+    // onFrame(data, seq) receives the frame data as an ArrayBuffer and its sequence number,
+    // which skips the numbers of the frames coalesced by the server.
+    // The server only pushes frames after credits are granted by credit().
+    stream(name, onFrame) {
+
+        if (onFrame) {
+            this.#streams.set(name, {onFrame: onFrame, sid: null, credits: 0});
+        } else {
+            const s = this.#streams.get(name);
+            if (s && s.sid !== null && this.#socket && this.#socket.readyState == WebSocket.OPEN) {
+                this.#sendStreamMsg(s.sid, StreamClose, 0);
+                this.#sids.delete(s.sid);
+            }
+            this.#streams.delete(name);
+        }
+    }
+
+    // Grants credits to the named stream allowing the server to push more frames.
+    // Credits granted before the server opens the stream are sent when it is opened.
+    credit(name, credits) {
+
+        const s = this.#streams.get(name);
+        if (!s) {
+            return "stream not found";
+        }
+        if (s.sid === null || !this.#socket || this.#socket.readyState != WebSocket.OPEN) {
+            s.credits += credits;
+            return;
+        }
+        this.#sendStreamMsg(s.sid, StreamCredit, credits);
+    }
+
+    // Sets the function called when the local mirror of the named server state store changes.
+    // onChange(state, paths) receives the mirrored state and the array of the changed
+    // paths or null when the state was replaced by a snapshot.
+    // The server only sends the store state to the connections it subscribes.
+    mirror(name, onChange) {
+
+        if (onChange) {
+            const m = this.#mirrors.get(name);
+            this.#mirrors.set(name, {state: m ? m.state : {}, onChange: onChange});
+        } else {
+            this.#mirrors.delete(name);
+        }
+    }
+
+    // Returns the local mirror of the named server state store
+    mirrorState(name) {
+
+        const m = this.#mirrors.get(name);
+        return m ? m.state : undefined;
+    }
+
     // Returns the time in milliseconds of the elapsed time between
     // the call request and the callback response.
     lastCallElapsed() {
@@ -144,6 +521,15 @@ export class RPC extends EventTarget {
 
     #onOpen(ev) {
 
+        // Uses MessagePack if accepted by the server
+        if (this.#socket.protocol == SubprotocolPack) {
+            this.#packEncoder = new PackEncoder();
+            this.#packDecoder = new PackDecoder();
+        } else {
+            this.#packEncoder = null;
+            this.#packDecoder = null;
+        }
+
         const cev = new CustomEvent(RPC.EV_OPENED, {
             detail: {
                 url: this.#url,
@@ -172,6 +558,11 @@ export class RPC extends EventTarget {
         this.dispatchEvent(cev); 
 
         this.#socket = null;
+        this.#frags.clear();
+        this.#sids.clear();
+        for (const s of this.#streams.values()) {
+            s.sid = null;
+        }
         if (this.#closed || this.#retryMS === undefined) {
             return;
         }
@@ -181,6 +572,13 @@ export class RPC extends EventTarget {
     // Encodes and sends call or response message
     #sendMsg(msg) {
   
+        // MessagePack message with embedded buffers
+        if (this.#packEncoder) {
+            this.#socket.send(this.#packEncoder.encode(msg));
+            this.#callTime = performance.now();
+            return;
+        }
+
         // Stringify JSON replacing references to arraybuffers or typed arrays
         // fields to a special string plus the buffer number.
         const buffers = [];
@@ -280,6 +678,11 @@ export class RPC extends EventTarget {
                 return buffers[bufn];
             });
         }
+        this.#dispatchMsg(msg);
+    }
+
+    // Process decoded call or response message
+    #dispatchMsg(msg) {
 
         // Checks for response id from previous call
         if (msg.rid !== undefined) {
@@ -311,6 +714,10 @@ export class RPC extends EventTarget {
                 console.log("RPC remote call without 'call' field");
                 return;
             }
+            if (msg.call == "wrs_store") {
+                this.#applyStore(msg.params);
+                return;
+            }
             const localFn = this.#binds.get(msg.call);
             if (localFn === undefined) {
                 console.log(`RPC remote call ${msg.call} not binded`);
@@ -331,6 +738,33 @@ export class RPC extends EventTarget {
         console.log("RPC invalid JSON call or response");
     }
 
+    // Applies snapshot or changes of server state store to its local mirror
+    #applyStore(params) {
+
+        const m = this.#mirrors.get(params.name);
+        if (!m) {
+            return;
+        }
+        if (params.snap !== undefined) {
+            m.state = params.snap;
+            m.onChange(m.state, null);
+            return;
+        }
+        const paths = Object.keys(params.delta);
+        for (const path of paths) {
+            const keys = path.split(".");
+            let obj = m.state;
+            for (let i = 0; i < keys.length - 1; i++) {
+                if (typeof obj[keys[i]] !== "object" || obj[keys[i]] === null) {
+                    obj[keys[i]] = {};
+                }
+                obj = obj[keys[i]];
+            }
+            obj[keys[keys.length-1]] = params.delta[path];
+        }
+        m.onChange(m.state, paths);
+    }
+
     #decodeBinMsg(ev) {
 
         const msg = ev.data;
@@ -359,6 +793,31 @@ export class RPC extends EventTarget {
                 return;
             }
 
+            // Processes stream message
+            if (chunkType == ChunkTypeStream) {
+                this.#decodeStream(msg, curr, chunkLen);
+                return;
+            } else
+            // Accumulates fragment of a large message
+            if (chunkType == ChunkTypeFrag) {
+                this.#decodeFrag(msg, curr, chunkLen);
+                return;
+            } else
+            // Decodes MessagePack chunk and dispatch it
+            if (chunkType == ChunkTypePack) {
+                if (!this.#packDecoder) {
+                    this.#packDecoder = new PackDecoder();
+                }
+                let packMsg = null;
+                try {
+                    packMsg = this.#packDecoder.decode(msg, curr, chunkLen);
+                } catch (err) {
+                    console.log("invalid MessagePack chunk", err);
+                    return;
+                }
+                this.#dispatchMsg(packMsg);
+                return;
+            } else
             // Decodes JSON chunk
             if (chunkType == ChunkTypeMsg) {
                 const chunkView = new DataView(msg, curr, chunkLen);
@@ -387,6 +846,94 @@ export class RPC extends EventTarget {
         this.#decodeJSON(json_text, buffers);
     }
 
+    // Processes stream message from the server
+    #decodeStream(msg, offset, len) {
+
+        const view = new DataView(msg, offset, len);
+        const sid = view.getUint32(0, true);
+        const kind = view.getUint32(ChunkHeaderFieldSize, true);
+        const value = view.getUint32(2 * ChunkHeaderFieldSize, true);
+        const data = msg.slice(offset + StreamFieldsSize, offset + len);
+
+        // Associates the stream id with the local stream and sends the saved credits
+        if (kind == StreamOpen) {
+            const name = new TextDecoder().decode(data);
+            const s = this.#streams.get(name);
+            if (!s) {
+                console.log(`RPC stream ${name} not set`);
+                this.#sendStreamMsg(sid, StreamClose, 0);
+                return;
+            }
+            s.sid = sid;
+            this.#sids.set(sid, s);
+            if (s.credits) {
+                this.#sendStreamMsg(sid, StreamCredit, s.credits);
+                s.credits = 0;
+            }
+            return;
+        }
+
+        const s = this.#sids.get(sid);
+        if (!s) {
+            return;
+        }
+        if (kind == StreamData) {
+            s.onFrame(data, value);
+        } else if (kind == StreamClose) {
+            this.#sids.delete(sid);
+            s.sid = null;
+        }
+    }
+
+    // Sends stream message without payload to the server
+    #sendStreamMsg(sid, kind, value) {
+
+        const msg = new ArrayBuffer(ChunkHeaderSize + StreamFieldsSize);
+        const view = new DataView(msg);
+        view.setUint32(0, ChunkTypeStream, true);
+        view.setUint32(ChunkHeaderFieldSize, StreamFieldsSize, true);
+        view.setUint32(ChunkHeaderSize, sid, true);
+        view.setUint32(ChunkHeaderSize + ChunkHeaderFieldSize, kind, true);
+        view.setUint32(ChunkHeaderSize + 2 * ChunkHeaderFieldSize, value, true);
+        this.#socket.send(msg);
+    }
+
+    // Saves fragment of a large message and decodes the message
+    // when its last fragment is received.
+    #decodeFrag(msg, offset, len) {
+
+        const view = new DataView(msg, offset, len);
+        const id = view.getUint32(0, true);
+        const flags = view.getUint32(ChunkHeaderFieldSize, true);
+        const data = msg.slice(offset + 2 * ChunkHeaderFieldSize, offset + len);
+        if (flags & FragFirst) {
+            this.#frags.set(id, []);
+        }
+        const parts = this.#frags.get(id);
+        if (!parts) {
+            console.log("fragment received for unknown message", id);
+            return;
+        }
+        parts.push(data);
+        if (!(flags & FragLast)) {
+            return;
+        }
+        this.#frags.delete(id);
+
+        // Concatenates the fragments
+        const full = new Uint8Array(parts.reduce((size, part) => size + part.byteLength, 0));
+        let pos = 0;
+        for (const part of parts) {
+            full.set(new Uint8Array(part), pos);
+            pos += part.byteLength;
+        }
+        if (flags & FragText) {
+            this.#decodeJSON(new TextDecoder().decode(full));
+        } else {
+            this.#decodeBinMsg({data: full.buffer});
+        }
+    }
+
 
     // Public static properties
     static EV_OPENED    = "rpc.opened";
@@ -396,10 +943,17 @@ export class RPC extends EventTarget {
     // Private instance properties
     #url            = null;
     #retryMS        = null;
+    #pack           = false;        // MessagePack format requested
+    #packEncoder    = null;         // MessagePack encoder if format accepted
+    #packDecoder    = null;         // MessagePack decoder
     #socket         = null;
     #closed         = false;
     #cid            = 1;            // Next call id
     #callbacks      = new Map();
+    #frags          = new Map();    // Fragments of the messages being received by message id
+    #streams        = new Map();    // Streams by name
+    #sids           = new Map();    // Streams opened by the server by stream id
+    #mirrors        = new Map();    // Mirrors of the server state stores by name
     #binds          = new Map();
     #callTime       = undefined;    // Time of last call
     #callElapsed    = undefined;
@@ -132,10 +132,8 @@ class AudioStream extends EventTarget {
 let audio = new AudioStream();
 audio.addEventListener(AudioStream.EV_NEED_DATA, (ev) => {
     //console.log("request audio bufCount:", ev.detail.bufCount);
-    while (ev.detail.bufCount > 0) {
-        requestAudio();
-        ev.detail.bufCount--;
-    }
+    // Allows the server to push the number of audio frames needed
+    rpc.credit("audio", ev.detail.bufCount);
 });
 
 let chartUpdate = false;
@@ -180,18 +178,25 @@ function stopUpdateChart() {
 }
 
 
-function requestAudio() {
+// Receives the audio frames pushed by the server
+rpc.stream("audio", (data) => {
 
-    rpc.call("rpc_server_audio_run", {}, (resp) => {
- 
-        // Get audio labels and signal
-        lastLabels = new Float32Array(resp.data.label);
-        lastSignal = new Float32Array(resp.data.signal);
-        audio.appendData(lastSignal);
+    // Get audio signal and creates its labels
+    lastSignal = new Float32Array(data);
+    if (!lastLabels || lastLabels.length != lastSignal.length) {
+        lastLabels = Float32Array.from(lastSignal.keys());
+    }
+    audio.appendData(lastSignal);
 
-        updateChart();
-    });
-}
+    updateChart();
+});
+
+// Shows the audio parameters replicated by the server in the chart title
+rpc.mirror("audio", (state) => {
+
+    const title = $$(CHART_ID).chart.options.plugins.title;
+    title.text = `Signal gain:${state.gain}% freq:${state.freq}Hz noise:${state.noise}%`;
+});
 
 function rpcEvents(ev) {
 
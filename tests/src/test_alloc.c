@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "cx_alloc.h"
+
+#include "wrs.h"
+#include "rpc_codec.h"
+
+// Allocation regression test.
+// Runs warmed-up echo loops through a loopback connection of an RPC endpoint
+// and fails if the endpoint makes any heap allocation in the measured loop.
+// Both directions are checked: calls received from the client and calls
+// sent to the client with their responses, using JSON and MessagePack envelopes.
+// The loops run with a loopback only endpoint, checking the allocations counted
+// by the endpoint, and with an endpoint of a server whose configured allocator
+// counts every allocation made through the server.
+
+#define TEST_URL        "/test"
+#define TEST_ECHO       "test_echo"
+#define WARMUP_LOOPS    (100)
+#define MEASURED_LOOPS  (1000)
+#define BUFFER_SIZE     (1024)
+
+// Loopback connection output
+typedef struct LoopOutput {
+    size_t  nmsgs;              // Number of messages written by the endpoint
+    size_t  nresps;             // Number of responses received by the response callback
+} LoopOutput;
+
+// Allocations made through the server allocator
+static atomic_uint_fast64_t base_allocs;
+
+// Forward declarations
+static bool test_format(Wrs* wrs, bool pack);
+static void* count_alloc(void* ctx, size_t size);
+static void count_free(void* ctx, void* p, size_t size);
+static void* count_resize(void* ctx, void* p, size_t old_size, size_t size);
+static void encode_call(WrsEncoder* e, int64_t cid, CxVar* params);
+static void encode_response(WrsEncoder* e, int64_t rid, CxVar* params);
+static void loop_output(void* ctx, bool text, const void* data, size_t len);
+static int test_echo(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp);
+static int test_response(WrsRpc* rpc, size_t connid, CxVar* resp);
+
+int main(int argc, const char* argv[]) {
+
+    bool ok = test_format(NULL, false);
+    ok = test_format(NULL, true) && ok;
+
+    // Server with counting allocator
+    const CxAllocator alloc = {
+        .alloc = count_alloc,
+        .free = count_free,
+        .resize = count_resize,
+    };
+    Wrs* wrs = wrs_create(&(WrsConfig){.listening_port = 0, .alloc = &alloc});
+    if (wrs == NULL) {
+        printf("FAIL: error starting server\n");
+        return 1;
+    }
+    ok = test_format(wrs, false) && ok;
+    ok = test_format(wrs, true) && ok;
+    wrs_destroy(wrs);
+    return ok ? 0 : 1;
+}
+
+// Runs the echo loops with the specified envelope format using an endpoint
+// of the specified server or a loopback only endpoint if NULL.
+// Returns true if the measured loops didn't allocate.
+static bool test_format(Wrs* wrs, bool pack) {
+
+    WrsRpc* rpc = wrs_rpc_open(wrs, TEST_URL, 1, NULL);
+    CXERR_CHK(wrs_rpc_bind(rpc, TEST_ECHO, test_echo));
+    LoopOutput out = {0};
+    wrs_rpc_set_userdata(rpc, &out);
+    size_t connid;
+    CXERR_CHK(wrs_rpc_loopback_open(rpc, pack, loop_output, &out, &connid));
+
+    // Parameters with scalar, string and buffer fields
+    CxVar* params = cx_var_new(cx_def_allocator());
+    cx_var_set_map(params);
+    cx_var_set_map_int(params, "t", 1);
+    cx_var_set_map_str(params, "name", "allocation test");
+    CxVar* buf = cx_var_set_map_buf(params, "data", NULL, BUFFER_SIZE);
+    void* data;
+    size_t len;
+    cx_var_get_buf(buf, (const void**)&data, &len);
+    memset(data, 0x5a, len);
+
+    // Encodes the call received from the client once.
+    // The responses to the calls sent to the client are encoded in each loop
+    // as their ids change, using an encoder which is not counted.
+    WrsEncoder* call_enc = wrs_encoder_new(cx_def_allocator());
+    WrsEncoder* resp_enc = wrs_encoder_new(cx_def_allocator());
+    wrs_encoder_set_format(call_enc, pack ? WrsFormatPack : WrsFormatJson);
+    wrs_encoder_set_format(resp_enc, pack ? WrsFormatPack : WrsFormatJson);
+    encode_call(call_enc, 1, params);
+    bool call_text;
+    size_t call_len;
+    const void* call = wrs_encoder_get_msg(call_enc, &call_text, &call_len);
+
+    // Call ids of the connection start at 100
+    int64_t cid = 100;
+    uint64_t allocs = 0;
+    uint64_t base = 0;
+    for (size_t i = 0; i < WARMUP_LOOPS + MEASURED_LOOPS; i++) {
+        if (i == WARMUP_LOOPS) {
+            allocs = wrs_rpc_info(rpc).allocs;
+            base = atomic_load(&base_allocs);
+        }
+
+        // Call received from the client and its response
+        CXERR_CHK(wrs_rpc_loopback_send(rpc, connid, call_text, call, call_len));
+
+        // Call sent to the client and its response
+        CXERR_CHK(wrs_rpc_call(rpc, connid, TEST_ECHO, params, test_response));
+        encode_response(resp_enc, cid++, params);
+        bool text;
+        const void* resp = wrs_encoder_get_msg(resp_enc, &text, &len);
+        CXERR_CHK(wrs_rpc_loopback_send(rpc, connid, text, resp, len));
+    }
+    allocs = wrs_rpc_info(rpc).allocs - allocs;
+    base = atomic_load(&base_allocs) - base;
+
+    const size_t nloops = WARMUP_LOOPS + MEASURED_LOOPS;
+    bool ok = allocs == 0 && base == 0 && out.nmsgs == 2 * nloops && out.nresps == nloops;
+    printf("%s: %s %s allocations:%lu server allocations:%lu messages:%zu responses:%zu\n", ok ? "PASS" : "FAIL",
+        wrs ? "server" : "loopback", pack ? "pack" : "json", (unsigned long)allocs, (unsigned long)base,
+        out.nmsgs, out.nresps);
+
+    wrs_encoder_del(call_enc);
+    wrs_encoder_del(resp_enc);
+    cx_var_del(params);
+    wrs_rpc_loopback_close(rpc, connid);
+    wrs_rpc_close(rpc);
+    return ok;
+}
+
+// Encodes call message with copy of the specified parameters
+static void encode_call(WrsEncoder* e, int64_t cid, CxVar* params) {
+
+    CxVar* msg = cx_var_new(cx_def_allocator());
+    cx_var_set_map(msg);
+    cx_var_set_map_int(msg, "cid", cid);
+    cx_var_set_map_str(msg, "call", TEST_ECHO);
+    cx_var_cpy_val(params, cx_var_set_map_map(msg, "params"));
+    CXERR_CHK(wrs_encoder_enc(e, msg));
+    cx_var_del(msg);
+}
+
+// Encodes response message with copy of the specified data
+static void encode_response(WrsEncoder* e, int64_t rid, CxVar* data) {
+
+    CxVar* msg = cx_var_new(cx_def_allocator());
+    cx_var_set_map(msg);
+    cx_var_set_map_int(msg, "rid", rid);
+    CxVar* resp = cx_var_set_map_map(msg, "resp");
+    cx_var_cpy_val(data, cx_var_set_map_map(resp, "data"));
+    CXERR_CHK(wrs_encoder_enc(e, msg));
+    cx_var_del(msg);
+}
+
+// Server allocator which counts the allocations and resizes
+static void* count_alloc(void* ctx, size_t size) {
+
+    atomic_fetch_add(&base_allocs, 1);
+    return malloc(size);
+}
+
+static void count_free(void* ctx, void* p, size_t size) {
+
+    free(p);
+}
+
+static void* count_resize(void* ctx, void* p, size_t old_size, size_t size) {
+
+    atomic_fetch_add(&base_allocs, 1);
+    return realloc(p, size);
+}
+
+static void loop_output(void* ctx, bool text, const void* data, size_t len) {
+
+    LoopOutput* out = ctx;
+    out->nmsgs++;
+}
+
+static int test_echo(WrsRpc* rpc, size_t connid, CxVar* params, CxVar* resp) {
+
+    cx_var_cpy_val(params, cx_var_set_map_map(resp, "data"));
+    return 0;
+}
+
+static int test_response(WrsRpc* rpc, size_t connid, CxVar* resp) {
+
+    LoopOutput* out = wrs_rpc_get_userdata(rpc);
+    if (cx_var_get_map_map(resp, "data")) {
+        out->nresps++;
+    }
+    return 0;
+}
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cx_alloc.h"
+#include "cx_var.h"
+
+#include "rpc_codec.h"
+
+// Message codec regression test.
+// Encodes messages with nested maps, arrays and buffers using the JSON and
+// the MessagePack envelopes and checks that they decode to the original
+// messages, that truncated messages are rejected and that messages declaring
+// lengths larger than their data are rejected without allocating them.
+// Also checks the envelope fields found by the message scanner and the
+// incremental decoding of messages received in fragments.
+
+#define BUFFER_SIZE     (100)
+#define MAX_MSG_LEN     (64*1024)
+
+// Forward declarations
+static bool test_roundtrip(WrsEncoder* e, WrsDecoder* d);
+static bool test_truncated(WrsEncoder* e, WrsDecoder* d, bool pack);
+static bool test_oversized(WrsDecoder* d);
+static bool test_scan(WrsEncoder* e, WrsDecoder* d);
+static bool test_feed(WrsEncoder* e, WrsDecoder* d);
+static CxVar* new_message(bool bufs);
+static bool encode(WrsEncoder* e, bool pack, CxVar* msg, bool* text, uint8_t* data, size_t* len);
+static bool decode(WrsDecoder* d, bool text, const void* data, size_t len, CxVar* msg);
+static size_t chunk_message(uint32_t type, const void* payload, size_t len, uint8_t* data);
+static bool var_equal(const CxVar* a, const CxVar* b);
+
+int main(int argc, const char* argv[]) {
+
+    WrsEncoder* e = wrs_encoder_new(cx_def_allocator());
+    WrsDecoder* d = wrs_decoder_new(cx_def_allocator());
+
+    bool ok = test_roundtrip(e, d);
+    ok = test_truncated(e, d, false) && ok;
+    ok = test_truncated(e, d, true) && ok;
+    ok = test_oversized(d) && ok;
+    ok = test_scan(e, d) && ok;
+    ok = test_feed(e, d) && ok;
+
+    wrs_encoder_del(e);
+    wrs_decoder_del(d);
+    return ok ? 0 : 1;
+}
+
+// Checks that the message decodes to the original message with both
+// envelope formats and that both decoded messages are equal.
+static bool test_roundtrip(WrsEncoder* e, WrsDecoder* d) {
+
+    static uint8_t data[MAX_MSG_LEN];
+    CxVar* msg = new_message(true);
+    CxVar* json = cx_var_new(cx_def_allocator());
+    CxVar* pack = cx_var_new(cx_def_allocator());
+
+    bool text;
+    size_t len;
+    const bool json_ok = encode(e, false, msg, &text, data, &len) && !text &&
+        decode(d, text, data, len, json) && var_equal(msg, json);
+    const bool pack_ok = encode(e, true, msg, &text, data, &len) && !text &&
+        decode(d, text, data, len, pack) && var_equal(msg, pack);
+    const bool equal = var_equal(json, pack);
+
+    // Messages without buffers are encoded as text in the JSON format
+    CxVar* plain = new_message(false);
+    const bool text_ok = encode(e, false, plain, &text, data, &len) && text &&
+        decode(d, text, data, len, json) && var_equal(plain, json);
+    cx_var_del(plain);
+
+    const bool ok = json_ok && pack_ok && equal && text_ok;
+    printf("%s: roundtrip json:%d pack:%d equal:%d text:%d\n", ok ? "PASS" : "FAIL", json_ok, pack_ok, equal, text_ok);
+    cx_var_del(msg);
+    cx_var_del(json);
+    cx_var_del(pack);
+    return ok;
+}
+
+// Checks that all the truncations of the encoded message are rejected,
+// both of the message data and of the message chunk with its header adjusted.
+static bool test_truncated(WrsEncoder* e, WrsDecoder* d, bool pack) {
+
+    static uint8_t data[MAX_MSG_LEN];
+    static uint8_t trunc[MAX_MSG_LEN];
+    CxVar* msg = new_message(true);
+    CxVar* out = cx_var_new(cx_def_allocator());
+
+    bool text;
+    size_t len;
+    bool ok = encode(e, pack, msg, &text, data, &len);
+    size_t accepted = 0;
+    for (size_t i = 0; ok && i < len; i++) {
+        if (decode(d, text, data, i, out)) {
+            accepted++;
+        }
+    }
+
+    // Truncations of the message chunk payload
+    uint32_t type;
+    uint32_t size;
+    memcpy(&type, data, sizeof(type));
+    memcpy(&size, data + sizeof(type), sizeof(size));
+    for (size_t i = 0; ok && i < size; i++) {
+        const size_t tlen = chunk_message(type, data + 2*sizeof(uint32_t), i, trunc);
+        if (decode(d, false, trunc, tlen, out)) {
+            accepted++;
+        }
+    }
+
+    ok = ok && accepted == 0;
+    printf("%s: truncated %s length:%zu accepted:%zu\n", ok ? "PASS" : "FAIL", pack ? "pack" : "json", len, accepted);
+    cx_var_del(msg);
+    cx_var_del(out);
+    return ok;
+}
+
+// Checks that chunks and MessagePack values declaring lengths larger
+// than the message are rejected.
+static bool test_oversized(WrsDecoder* d) {
+
+    static const uint8_t values[][5] = {
+        {0xdb, 0xff, 0xff, 0xff, 0xff},     // str 32
+        {0xc6, 0xff, 0xff, 0xff, 0xff},     // bin 32
+        {0xdd, 0xff, 0xff, 0xff, 0xff},     // array 32
+        {0xdf, 0xff, 0xff, 0xff, 0xff},     // map 32
+    };
+    uint8_t data[64];
+    CxVar* out = cx_var_new(cx_def_allocator());
+    size_t accepted = 0;
+
+    // Chunk larger than the message
+    const size_t len = chunk_message(WrsChunkMsg, "{}", 2, data);
+    const uint32_t size = UINT32_MAX - 16;
+    memcpy(data + sizeof(uint32_t), &size, sizeof(size));
+    if (decode(d, false, data, len, out)) {
+        accepted++;
+    }
+
+    // MessagePack values larger than the message chunk
+    for (size_t i = 0; i < sizeof(values)/sizeof(values[0]); i++) {
+        uint8_t payload[16] = {0x81, 0xa1, 'a'};
+        memcpy(payload + 3, values[i], sizeof(values[i]));
+        const size_t len = chunk_message(WrsChunkPack, payload, 3 + sizeof(values[i]), data);
+        if (decode(d, false, data, len, out)) {
+            accepted++;
+        }
+    }
+
+    const bool ok = accepted == 0;
+    printf("%s: oversized accepted:%zu\n", ok ? "PASS" : "FAIL", accepted);
+    cx_var_del(out);
+    return ok;
+}
+
+// Checks the envelope fields scanned from both formats and the
+// unescaping of the JSON call names.
+static bool test_scan(WrsEncoder* e, WrsDecoder* d) {
+
+    static uint8_t data[MAX_MSG_LEN];
+    CxVar* msg = new_message(true);
+    CxVar* body = cx_var_new(cx_def_allocator());
+    WrsEnvelope env;
+
+    // Envelope and body of both formats
+    bool fields_ok = true;
+    for (int pack = 0; pack < 2; pack++) {
+        bool text;
+        size_t len;
+        fields_ok = fields_ok && encode(e, pack, msg, &text, data, &len) &&
+            wrs_decoder_scan(d, text, data, len, &env).code == 0 &&
+            env.has_cid && env.cid == 1234567 && !env.has_rid &&
+            env.call_len == strlen("test_codec") && memcmp(env.call, "test_codec", env.call_len) == 0 &&
+            wrs_decoder_dec_body(d, &env, body).code == 0 &&
+            var_equal(cx_var_get_map_map(msg, "params"), body);
+    }
+
+    // Call names with escape sequences
+    const char* escaped = "{\"cid\":1,\"call\":\"a\\\"b\\\\c\\u00e9\\ud83d\\ude00\",\"params\":{}}";
+    const char* unescaped = "a\"b\\c\xc3\xa9\xf0\x9f\x98\x80";
+    strcpy((char*)data, escaped);
+    const bool escape_ok = wrs_decoder_scan(d, true, data, strlen(escaped), &env).code == 0 &&
+        env.call_len == strlen(unescaped) && memcmp(env.call, unescaped, env.call_len) == 0;
+
+    // Invalid escape sequences
+    const char* invalid[] = {"\\x", "\\u00", "\\u0000", "\\ud83d", "\\ude00", "\\ud83dx\\ude00"};
+    size_t accepted = 0;
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++) {
+        const int len = snprintf((char*)data, MAX_MSG_LEN, "{\"cid\":1,\"call\":\"f%s\",\"params\":{}}", invalid[i]);
+        if (wrs_decoder_scan(d, true, data, len, &env).code == 0) {
+            accepted++;
+        }
+    }
+
+    const bool ok = fields_ok && escape_ok && accepted == 0;
+    printf("%s: scan fields:%d escapes:%d invalid accepted:%zu\n", ok ? "PASS" : "FAIL", fields_ok, escape_ok, accepted);
+    cx_var_del(msg);
+    cx_var_del(body);
+    return ok;
+}
+
+// Checks that messages fed in small fragments decode to the original
+// message and that the maximum message size is enforced.
+static bool test_feed(WrsEncoder* e, WrsDecoder* d) {
+
+    static uint8_t data[MAX_MSG_LEN];
+    CxVar* msg = new_message(true);
+    CxVar* plain = new_message(false);
+    CxVar* body = cx_var_new(cx_def_allocator());
+    WrsEnvelope env;
+
+    // Binary messages of both formats and text message
+    bool feed_ok = true;
+    for (int i = 0; i < 3; i++) {
+        bool text;
+        size_t len;
+        CxVar* src = i < 2 ? msg : plain;
+        feed_ok = feed_ok && encode(e, i == 1, src, &text, data, &len);
+        wrs_decoder_begin(d, text);
+        for (size_t pos = 0; feed_ok && pos < len; pos += 7) {
+            feed_ok = wrs_decoder_feed(d, data + pos, len - pos < 7 ? len - pos : 7).code == 0;
+        }
+        feed_ok = feed_ok && wrs_decoder_end(d, &env).code == 0 &&
+            wrs_decoder_dec_body(d, &env, body).code == 0 &&
+            var_equal(cx_var_get_map_map(src, "params"), body);
+        wrs_decoder_release(d);
+    }
+
+    // Messages and declared chunks larger than the maximum size
+    bool text;
+    size_t len;
+    size_t accepted = 0;
+    encode(e, false, msg, &text, data, &len);
+    wrs_decoder_set_max_size(d, len - 1);
+    if (decode(d, text, data, len, body)) {
+        accepted++;
+    }
+    wrs_decoder_begin(d, text);
+    if (wrs_decoder_feed(d, data, 2*sizeof(uint32_t)).code == 0) {
+        const uint32_t size = len;
+        memcpy(data + sizeof(uint32_t), &size, sizeof(size));
+        wrs_decoder_release(d);
+        wrs_decoder_begin(d, text);
+        if (wrs_decoder_feed(d, data, 2*sizeof(uint32_t)).code == 0) {
+            accepted++;
+        }
+    }
+    wrs_decoder_release(d);
+    wrs_decoder_set_max_size(d, 0);
+
+    const bool ok = feed_ok && accepted == 0;
+    printf("%s: feed fragments:%d oversized accepted:%zu\n", ok ? "PASS" : "FAIL", feed_ok, accepted);
+    cx_var_del(msg);
+    cx_var_del(plain);
+    cx_var_del(body);
+    return ok;
+}
+
+// Returns new call message with nested maps, arrays and optional buffers
+static CxVar* new_message(bool bufs) {
+
+    CxVar* msg = cx_var_new(cx_def_allocator());
+    cx_var_set_map(msg);
+    cx_var_set_map_int(msg, "cid", 1234567);
+    cx_var_set_map_str(msg, "call", "test_codec");
+
+    CxVar* params = cx_var_set_map_map(msg, "params");
+    cx_var_set_map_null(params, "null");
+    cx_var_set_map_bool(params, "true", true);
+    cx_var_set_map_bool(params, "false", false);
+    cx_var_set_map_int(params, "small", -5);
+    cx_var_set_map_int(params, "large", -5000000000LL);
+    cx_var_set_map_int(params, "u32", 4000000000LL);
+    cx_var_set_map_float(params, "float", 1.5);
+    cx_var_set_map_str(params, "str", "string \"with\" escapes\n");
+    cx_var_set_map_str(params, "empty", "");
+
+    // Nested maps and arrays
+    CxVar* arr = cx_var_set_map_arr(params, "arr");
+    for (int i = 0; i < 20; i++) {
+        cx_var_push_arr_int(arr, i * 1000 - 3000);
+    }
+    cx_var_push_arr_float(arr, -0.25);
+    cx_var_push_arr_str(arr, "elem");
+    CxVar* inner = cx_var_push_arr_arr(arr);
+    cx_var_push_arr_arr(inner);
+    cx_var_push_arr_map(inner);
+    CxVar* elem = cx_var_push_arr_map(arr);
+    cx_var_set_map_int(cx_var_set_map_map(cx_var_set_map_map(elem, "a"), "b"), "c", 3);
+    cx_var_set_map_map(params, "empty_map");
+    cx_var_set_map_arr(params, "empty_arr");
+    if (!bufs) {
+        return msg;
+    }
+
+    // Buffers at several levels
+    uint8_t buf[BUFFER_SIZE];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 7;
+    }
+    cx_var_set_map_buf(msg, "data", buf, sizeof(buf));
+    CxVar* arrbufs = cx_var_set_map_arr(params, "bufs");
+    cx_var_push_arr_buf(arrbufs, buf, 1);
+    cx_var_push_arr_buf(arrbufs, buf, 3);
+    cx_var_set_map_buf(cx_var_push_arr_map(arrbufs), "b", buf, 0);
+    return msg;
+}
+
+// Encodes copy of the message with the specified format into 'data'
+// as the JSON encoder replaces the message buffers.
+static bool encode(WrsEncoder* e, bool pack, CxVar* msg, bool* text, uint8_t* data, size_t* len) {
+
+    wrs_encoder_set_format(e, pack ? WrsFormatPack : WrsFormatJson);
+    CxVar* copy = cx_var_new(cx_def_allocator());
+    cx_var_cpy_val(msg, copy);
+    const CxError err = wrs_encoder_enc(e, copy);
+    cx_var_del(copy);
+    if (err.code) {
+        return false;
+    }
+    const void* encoded = wrs_encoder_get_msg(e, text, len);
+    if (*len > MAX_MSG_LEN) {
+        return false;
+    }
+    memcpy(data, encoded, *len);
+    return true;
+}
+
+// Decodes copy of the data as the decoder may change it
+static bool decode(WrsDecoder* d, bool text, const void* data, size_t len, CxVar* msg) {
+
+    void* copy = malloc(len + 1);
+    memcpy(copy, data, len);
+    const bool ok = wrs_decoder_dec(d, text, copy, len, msg).code == 0;
+    free(copy);
+    return ok;
+}
+
+// Builds binary message with a single chunk with the specified payload.
+// Returns the length of the message.
+static size_t chunk_message(uint32_t type, const void* payload, size_t len, uint8_t* data) {
+
+    const uint32_t size = len;
+    memcpy(data, &type, sizeof(type));
+    memcpy(data + sizeof(type), &size, sizeof(size));
+    memcpy(data + 2*sizeof(uint32_t), payload, len);
+    size_t total = 2*sizeof(uint32_t) + len;
+    while (total % 4) {
+        data[total++] = 0;
+    }
+    return total;
+}
+
+// Returns if the values are equal, including nested values
+static bool var_equal(const CxVar* a, const CxVar* b) {
+
+    const CxVarType type = cx_var_get_type(a);
+    if (type != cx_var_get_type(b)) {
+        return false;
+    }
+    switch (type) {
+        case CxVarNull:
+            return true;
+        case CxVarBool: {
+            bool va, vb;
+            return cx_var_get_bool(a, &va) && cx_var_get_bool(b, &vb) && va == vb;
+        }
+        case CxVarInt: {
+            int64_t va, vb;
+            return cx_var_get_int(a, &va) && cx_var_get_int(b, &vb) && va == vb;
+        }
+        case CxVarFloat: {
+            double va, vb;
+            return cx_var_get_float(a, &va) && cx_var_get_float(b, &vb) && va == vb;
+        }
+        case CxVarStr: {
+            const char* va;
+            const char* vb;
+            return cx_var_get_str(a, &va) && cx_var_get_str(b, &vb) && strcmp(va, vb) == 0;
+        }
+        case CxVarBuf: {
+            const void* va;
+            const void* vb;
+            size_t la, lb;
+            return cx_var_get_buf(a, &va, &la) && cx_var_get_buf(b, &vb, &lb) && la == lb &&
+                (la == 0 || memcmp(va, vb, la) == 0);
+        }
+        case CxVarArr: {
+            size_t la, lb;
+            if (!cx_var_get_arr_len(a, &la) || !cx_var_get_arr_len(b, &lb) || la != lb) {
+                return false;
+            }
+            for (size_t i = 0; i < la; i++) {
+                if (!var_equal(cx_var_get_arr_val(a, i), cx_var_get_arr_val(b, i))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case CxVarMap: {
+            size_t la, lb;
+            if (!cx_var_get_map_len(a, &la) || !cx_var_get_map_len(b, &lb) || la != lb) {
+                return false;
+            }
+            for (size_t i = 0; i < la; i++) {
+                const char* key;
+                const CxVar* va = cx_var_get_map_index(a, i, &key);
+                const CxVar* vb = cx_var_get_map_val(b, key);
+                if (vb == NULL || !var_equal(va, vb)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "cx_alloc.h"
+
+#include "wrs.h"
+#include "rpc_codec.h"
+
+// Fragmented sending regression test.
+// Sends a large call to a loopback connection of an RPC endpoint with a small
+// fragment size and checks that the fragments reassemble to the original call
+// and that a high priority call made while the fragments are being sent is
+// written between them.
+
+#define TEST_URL        "/test"
+#define TEST_BIG        "test_big"
+#define TEST_HIGH       "test_high"
+#define FRAG_SIZE       (1024)
+#define BUFFER_SIZE     (64*1024)
+#define FRAG_DELAY_US   (1000)
+#define TIMEOUT_US      (10*1000*1000)
+
+// Loopback connection output
+typedef struct LoopOutput {
+    atomic_size_t   nfrags;     // Number of fragment messages received
+    atomic_bool     done;       // Last fragment received
+    size_t          nmsgs;      // Number of messages received
+    size_t          high_pos;   // Position of the high priority message or 0
+    size_t          first_pos;  // Position of the first fragment
+    size_t          last_pos;   // Position of the last fragment
+    uint32_t        id;         // Id of the fragmented message
+    bool            text;       // Fragmented message is a text message
+    bool            error;      // Invalid fragment received
+    uint8_t*        buf;        // Reassembled message
+    size_t          len;        // Length of the reassembled message
+    size_t          cap;        // Capacity of the reassembled message buffer
+} LoopOutput;
+
+// Forward declarations
+static bool test_format(bool pack);
+static bool check_message(LoopOutput* out);
+static void loop_output(void* ctx, bool text, const void* data, size_t len);
+
+int main(int argc, const char* argv[]) {
+
+    bool ok = test_format(false);
+    ok = test_format(true) && ok;
+    return ok ? 0 : 1;
+}
+
+// Runs the test with the specified envelope format.
+// Returns true if the test passed.
+static bool test_format(bool pack) {
+
+    WrsRpc* rpc = wrs_rpc_open(NULL, TEST_URL, 1, NULL);
+    wrs_rpc_set_options(rpc, &(WrsRpcOptions){.frag_size = FRAG_SIZE});
+    LoopOutput out = {0};
+    size_t connid;
+    CXERR_CHK(wrs_rpc_loopback_open(rpc, pack, loop_output, &out, &connid));
+
+    // Large call parameters with known buffer contents
+    CxVar* params = cx_var_new(cx_def_allocator());
+    cx_var_set_map(params);
+    CxVar* buf = cx_var_set_map_buf(params, "data", NULL, BUFFER_SIZE);
+    uint8_t* data;
+    size_t len;
+    cx_var_get_buf(buf, (const void**)&data, &len);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = i % 251;
+    }
+    CXERR_CHK(wrs_rpc_call(rpc, connid, TEST_BIG, params, NULL));
+
+    // Makes the high priority call after the first fragment was written
+    size_t waited = 0;
+    while (atomic_load(&out.nfrags) == 0 && waited < TIMEOUT_US) {
+        usleep(100);
+        waited += 100;
+    }
+    CxVar* small = cx_var_new(cx_def_allocator());
+    cx_var_set_map(small);
+    cx_var_set_map_int(small, "t", 1);
+    CXERR_CHK(wrs_rpc_call_priority(rpc, connid, TEST_HIGH, small, NULL, WrsPriorityHigh));
+
+    // Waits for the last fragment
+    while (!atomic_load(&out.done) && waited < TIMEOUT_US) {
+        usleep(1000);
+        waited += 1000;
+    }
+    wrs_rpc_loopback_close(rpc, connid);
+    wrs_rpc_close(rpc);
+
+    const bool reassembled = atomic_load(&out.done) && !out.error && check_message(&out);
+    const bool interleaved = out.high_pos > out.first_pos && out.high_pos < out.last_pos;
+    const bool ok = reassembled && interleaved;
+    printf("%s: %s fragments:%zu reassembled:%d high priority position:%zu\n", ok ? "PASS" : "FAIL",
+        pack ? "pack" : "json", atomic_load(&out.nfrags), reassembled, out.high_pos);
+
+    cx_var_del(params);
+    cx_var_del(small);
+    free(out.buf);
+    return ok;
+}
+
+// Decodes the reassembled message and checks its call name and buffer contents.
+static bool check_message(LoopOutput* out) {
+
+    WrsDecoder* dec = wrs_decoder_new(cx_def_allocator());
+    CxVar* params = cx_var_new(cx_def_allocator());
+    bool ok = false;
+    WrsEnvelope env;
+    if (wrs_decoder_scan(dec, out->text, out->buf, out->len, &env).code ||
+        env.call_len != strlen(TEST_BIG) || memcmp(env.call, TEST_BIG, env.call_len) ||
+        wrs_decoder_dec_body(dec, &env, params).code) {
+        goto exit;
+    }
+    const uint8_t* data;
+    size_t len;
+    if (!cx_var_get_map_buf(params, "data", (const void**)&data, &len) || len != BUFFER_SIZE) {
+        goto exit;
+    }
+    ok = true;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != i % 251) {
+            ok = false;
+            break;
+        }
+    }
+
+exit:
+    cx_var_del(params);
+    wrs_decoder_del(dec);
+    return ok;
+}
+
+// Reassembles the fragments and records the position of the other messages.
+// The fragments are delayed to give time for the high priority call.
+static void loop_output(void* ctx, bool text, const void* data, size_t len) {
+
+    LoopOutput* out = ctx;
+    out->nmsgs++;
+    WrsFrag frag;
+    if (text || !wrs_frag_decode(data, len, &frag)) {
+        if (out->high_pos == 0) {
+            out->high_pos = out->nmsgs;
+        }
+        return;
+    }
+    if (frag.flags & WRS_FRAG_FIRST) {
+        out->first_pos = out->nmsgs;
+        out->id = frag.id;
+        out->text = (frag.flags & WRS_FRAG_TEXT) != 0;
+    } else if (frag.id != out->id) {
+        out->error = true;
+    }
+    if (out->len + frag.len > out->cap) {
+        out->cap = (out->len + frag.len) * 2;
+        out->buf = realloc(out->buf, out->cap);
+    }
+    memcpy(out->buf + out->len, frag.data, frag.len);
+    out->len += frag.len;
+    atomic_fetch_add(&out->nfrags, 1);
+    if (frag.flags & WRS_FRAG_LAST) {
+        out->last_pos = out->nmsgs;
+        atomic_store(&out->done, true);
+        return;
+    }
+    usleep(FRAG_DELAY_US);
+}
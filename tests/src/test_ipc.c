@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cx_alloc.h"
+
+#include "ipc.h"
+
+// IPC transport regression test.
+// Sends frames written in small pieces to an IPC server which echoes the
+// received messages and checks the echoed frames, that connections sending
+// messages bigger than the maximum size are closed and that stopping the
+// server closes the opened connections.
+
+#define OPCODE_TEXT     (0x1)
+#define OPCODE_BINARY   (0x2)
+#define FIN_MASK        (0x80)
+#define MAX_MSG_SIZE    (256*1024)
+#define WRITE_PIECE     (3)
+
+// Frame header as defined in ipc.h
+typedef struct Frame {
+    uint32_t    opcode;
+    uint32_t    size;
+} Frame;
+
+// Server handlers state
+typedef struct Handlers {
+    atomic_size_t   nconns;     // Number of accepted connections
+    atomic_size_t   nmsgs;      // Number of messages received
+    atomic_size_t   ncloses;    // Number of connections closed
+    atomic_bool     nofin;      // Message received without the FIN bit
+} Handlers;
+
+// Forward declarations
+static bool test_echo(const char* path, Handlers* h);
+static bool test_oversized(const char* path, Handlers* h);
+static bool test_stop(IpcServer* srv, const char* path, Handlers* h);
+static int conn_open(const char* path);
+static bool conn_write(int fd, const void* data, size_t len, size_t piece);
+static bool conn_read(int fd, void* data, size_t len);
+static bool wait_count(atomic_size_t* count, size_t expected);
+static int on_connect(IpcConn* conn, void* userdata);
+static int on_data(IpcConn* conn, int opcode, char* data, size_t len, void* userdata);
+static void on_close(IpcConn* conn, void* userdata);
+
+int main(int argc, const char* argv[]) {
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/wrs_test_ipc_%d.sock", (int)getpid());
+    Handlers h = {0};
+    const IpcHandlers handlers = {.connect = on_connect, .data = on_data, .close = on_close};
+    IpcServer* srv = ipc_server_start(path, &handlers, cx_def_allocator(), &h);
+    if (srv == NULL) {
+        printf("FAIL: server start\n");
+        return 1;
+    }
+    ipc_server_set_max_msg_size(srv, MAX_MSG_SIZE);
+
+    bool ok = test_echo(path, &h);
+    ok = test_oversized(path, &h) && ok;
+    ok = test_stop(srv, path, &h) && ok;
+    return ok ? 0 : 1;
+}
+
+// Checks the echo of text and binary messages of several sizes,
+// including empty messages and messages bigger than the kept receive buffer.
+static bool test_echo(const char* path, Handlers* h) {
+
+    static const size_t sizes[] = {5, 0, 1, 100000, 3, MAX_MSG_SIZE};
+    const size_t count = sizeof(sizes)/sizeof(sizes[0]);
+    uint8_t* data = malloc(MAX_MSG_SIZE);
+    uint8_t* echo = malloc(MAX_MSG_SIZE);
+    const int fd = conn_open(path);
+    size_t nechoed = 0;
+    for (size_t i = 0; fd >= 0 && i < count; i++) {
+        for (size_t j = 0; j < sizes[i]; j++) {
+            data[j] = i + j * 13;
+        }
+
+        // Small frames are written in pieces splitting the header
+        const Frame frame = {.opcode = i % 2 ? OPCODE_BINARY : OPCODE_TEXT, .size = sizes[i]};
+        const size_t piece = sizes[i] < 1024 ? WRITE_PIECE : sizes[i];
+        Frame rx;
+        if (!conn_write(fd, &frame, sizeof(frame), piece) || !conn_write(fd, data, sizes[i], piece) ||
+            !conn_read(fd, &rx, sizeof(rx)) || rx.opcode != frame.opcode || rx.size != frame.size ||
+            !conn_read(fd, echo, rx.size) || memcmp(data, echo, rx.size)) {
+            break;
+        }
+        nechoed++;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    const bool closed = wait_count(&h->ncloses, 1);
+
+    const bool ok = nechoed == count && !atomic_load(&h->nofin) && closed;
+    printf("%s: echo messages:%zu/%zu closed:%d\n", ok ? "PASS" : "FAIL", nechoed, count, closed);
+    free(data);
+    free(echo);
+    return ok;
+}
+
+// Checks that the connection is closed when the frame header declares
+// a message bigger than the maximum size, without calling the data handler.
+static bool test_oversized(const char* path, Handlers* h) {
+
+    const size_t nmsgs = atomic_load(&h->nmsgs);
+    const int fd = conn_open(path);
+    const Frame frame = {.opcode = OPCODE_BINARY, .size = MAX_MSG_SIZE + 1};
+    Frame rx;
+    const bool closed = fd >= 0 && conn_write(fd, &frame, sizeof(frame), sizeof(frame)) &&
+        !conn_read(fd, &rx, sizeof(rx)) && wait_count(&h->ncloses, 2);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    const bool ok = closed && atomic_load(&h->nmsgs) == nmsgs;
+    printf("%s: oversized closed:%d\n", ok ? "PASS" : "FAIL", closed);
+    return ok;
+}
+
+// Checks that stopping the server closes the opened connections
+static bool test_stop(IpcServer* srv, const char* path, Handlers* h) {
+
+    const int fd1 = conn_open(path);
+    const int fd2 = conn_open(path);
+    const bool accepted = fd1 >= 0 && fd2 >= 0 && wait_count(&h->nconns, 4);
+    ipc_server_stop(srv);
+
+    Frame rx;
+    const bool closed = accepted && !conn_read(fd1, &rx, sizeof(rx)) && !conn_read(fd2, &rx, sizeof(rx)) &&
+        atomic_load(&h->ncloses) == 4;
+    if (fd1 >= 0) {
+        close(fd1);
+    }
+    if (fd2 >= 0) {
+        close(fd2);
+    }
+
+    const bool ok = accepted && closed && access(path, F_OK) != 0;
+    printf("%s: stop accepted:%d closed:%d\n", ok ? "PASS" : "FAIL", accepted, closed);
+    return ok;
+}
+
+// Connects to the server socket and returns the socket or -1
+static int conn_open(const char* path) {
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Writes the data in pieces of the specified size
+static bool conn_write(int fd, const void* data, size_t len, size_t piece) {
+
+    const uint8_t* curr = data;
+    while (len > 0) {
+        const ssize_t n = write(fd, curr, len < piece ? len : piece);
+        if (n <= 0) {
+            return false;
+        }
+        curr += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Reads the specified number of bytes.
+// Returns false if the connection was closed.
+static bool conn_read(int fd, void* data, size_t len) {
+
+    uint8_t* curr = data;
+    while (len > 0) {
+        const ssize_t n = read(fd, curr, len);
+        if (n <= 0) {
+            return false;
+        }
+        curr += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Waits for the counter to reach the expected value
+static bool wait_count(atomic_size_t* count, size_t expected) {
+
+    for (int i = 0; i < 1000 && atomic_load(count) < expected; i++) {
+        usleep(1000);
+    }
+    return atomic_load(count) == expected;
+}
+
+static int on_connect(IpcConn* conn, void* userdata) {
+
+    Handlers* h = userdata;
+    atomic_fetch_add(&h->nconns, 1);
+    return 0;
+}
+
+// Echoes the received message
+static int on_data(IpcConn* conn, int opcode, char* data, size_t len, void* userdata) {
+
+    Handlers* h = userdata;
+    atomic_fetch_add(&h->nmsgs, 1);
+    if ((opcode & FIN_MASK) == 0) {
+        atomic_store(&h->nofin, true);
+    }
+    return ipc_conn_write(conn, opcode & ~FIN_MASK, data, len) == 1;
+}
+
+static void on_close(IpcConn* conn, void* userdata) {
+
+    Handlers* h = userdata;
+    atomic_fetch_add(&h->ncloses, 1);
+}
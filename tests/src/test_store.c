@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cx_alloc.h"
+#include "cx_var.h"
+
+#include "wrs.h"
+#include "rpc_codec.h"
+
+// State store regression test.
+// Subscribes a loopback connection of an RPC endpoint to a state store and
+// checks the path handling, the absorption of the changed paths covered by
+// their parent paths and the sequence of snapshot and delta calls received.
+
+#define TEST_URL        "/test"
+#define TEST_STORE      "test_store"
+#define STORE_CALL      "wrs_store"
+#define STORE_INTERVAL  (3600*1000)
+#define MAX_MSGS        (8)
+
+// Loopback connection output
+typedef struct LoopOutput {
+    WrsDecoder* dec;                // Message decoder
+    CxVar*      msgs[MAX_MSGS];     // Decoded messages received
+    size_t      nmsgs;              // Number of messages received
+} LoopOutput;
+
+// Forward declarations
+static bool test_paths(WrsStore* store);
+static bool test_sequence(WrsStore* store, LoopOutput* out, size_t connid);
+static CxVar* store_params(LoopOutput* out, size_t index);
+static bool check_int(const CxVar* map, const char* key, int64_t expected);
+static CxError set_int(WrsStore* store, const char* path, int64_t value);
+static void loop_output(void* ctx, bool text, const void* data, size_t len);
+
+int main(int argc, const char* argv[]) {
+
+    WrsRpc* rpc = wrs_rpc_open(NULL, TEST_URL, 1, NULL);
+    LoopOutput out = {.dec = wrs_decoder_new(cx_def_allocator())};
+    size_t connid;
+    CXERR_CHK(wrs_rpc_loopback_open(rpc, false, loop_output, &out, &connid));
+    WrsStore* store = wrs_store_open(rpc, TEST_STORE, STORE_INTERVAL);
+
+    bool ok = test_paths(store);
+    ok = test_sequence(store, &out, connid) && ok;
+
+    wrs_store_close(store);
+    wrs_rpc_loopback_close(rpc, connid);
+    wrs_rpc_close(rpc);
+    for (size_t i = 0; i < out.nmsgs; i++) {
+        cx_var_del(out.msgs[i]);
+    }
+    wrs_decoder_del(out.dec);
+    return ok ? 0 : 1;
+}
+
+// Checks that invalid paths are rejected and that the path keys
+// address the nested maps of the state.
+static bool test_paths(WrsStore* store) {
+
+    bool ok = true;
+    const char* invalid[] = {"", ".a", "a.", "a..b"};
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++) {
+        ok = ok && set_int(store, invalid[i], 1).code != 0;
+    }
+    char long_path[512];
+    memset(long_path, 'a', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = 0;
+    ok = ok && set_int(store, long_path, 1).code != 0;
+
+    CXERR_CHK(set_int(store, "a.b.c", 1));
+    CxVar* val = cx_var_new(cx_def_allocator());
+    ok = ok && wrs_store_get(store, "a.b", val).code == 0 && check_int(val, "c", 1);
+    ok = ok && wrs_store_get(store, "a.b.x", val).code != 0;
+    ok = ok && wrs_store_get(store, "a.b.c.d", val).code != 0;
+    cx_var_del(val);
+    printf("%s: paths\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+// Checks the snapshot sent on subscription and the deltas sent by the flushes
+static bool test_sequence(WrsStore* store, LoopOutput* out, size_t connid) {
+
+    // Snapshot of the current state
+    CXERR_CHK(wrs_store_subscribe(store, connid));
+    CxVar* params = store_params(out, 0);
+    CxVar* snap = params ? cx_var_get_map_map(params, "snap") : NULL;
+    CxVar* snap_b = snap ? cx_var_get_map_map(cx_var_get_map_map(snap, "a"), "b") : NULL;
+    const bool snap_ok = snap_b && check_int(snap_b, "c", 1) && cx_var_get_map_val(params, "delta") == NULL;
+
+    // Children changed before their parent are replaced by the parent and
+    // children changed after their parent are not added.
+    CXERR_CHK(set_int(store, "a.b.c", 2));
+    CXERR_CHK(set_int(store, "a.b.d", 3));
+    CxVar* map = cx_var_new(cx_def_allocator());
+    cx_var_set_map(map);
+    cx_var_set_map_int(map, "c", 4);
+    CXERR_CHK(wrs_store_set(store, "a.b", map));
+    CXERR_CHK(set_int(store, "a.b.e", 5));
+    CXERR_CHK(set_int(store, "k", 6));
+    cx_var_del(map);
+    wrs_store_flush(store);
+    params = store_params(out, 1);
+    CxVar* delta = params ? cx_var_get_map_map(params, "delta") : NULL;
+    size_t nkeys = 0;
+    if (delta) {
+        cx_var_get_map_len(delta, &nkeys);
+    }
+    CxVar* delta_b = delta ? cx_var_get_map_map(delta, "a.b") : NULL;
+    size_t nb = 0;
+    if (delta_b) {
+        cx_var_get_map_len(delta_b, &nb);
+    }
+    const bool delta_ok = nkeys == 2 && nb == 2 && check_int(delta_b, "c", 4) && check_int(delta_b, "e", 5) &&
+        check_int(delta, "k", 6);
+
+    // Flush without changes sends nothing and unsubscribed connections receive nothing
+    wrs_store_flush(store);
+    const size_t nmsgs = out->nmsgs;
+    CXERR_CHK(wrs_store_unsubscribe(store, connid));
+    CXERR_CHK(set_int(store, "k", 7));
+    wrs_store_flush(store);
+    const bool seq_ok = nmsgs == 2 && out->nmsgs == 2;
+
+    const bool ok = snap_ok && delta_ok && seq_ok;
+    printf("%s: sequence snapshot:%d delta:%d messages:%zu\n", ok ? "PASS" : "FAIL", snap_ok, delta_ok, out->nmsgs);
+    return ok;
+}
+
+// Returns the parameters of the store call received at the specified index or NULL
+static CxVar* store_params(LoopOutput* out, size_t index) {
+
+    if (index >= out->nmsgs) {
+        return NULL;
+    }
+    const char* call;
+    const char* name;
+    CxVar* params = cx_var_get_map_map(out->msgs[index], "params");
+    if (!cx_var_get_map_str(out->msgs[index], "call", &call) || strcmp(call, STORE_CALL) ||
+        params == NULL || !cx_var_get_map_str(params, "name", &name) || strcmp(name, TEST_STORE)) {
+        return NULL;
+    }
+    return params;
+}
+
+static bool check_int(const CxVar* map, const char* key, int64_t expected) {
+
+    int64_t value;
+    return cx_var_get_map_int(map, key, &value) && value == expected;
+}
+
+static CxError set_int(WrsStore* store, const char* path, int64_t value) {
+
+    CxVar* val = cx_var_new(cx_def_allocator());
+    cx_var_set_int(val, value);
+    CxError err = wrs_store_set(store, path, val);
+    cx_var_del(val);
+    return err;
+}
+
+// Decodes and keeps the messages written to the connection
+static void loop_output(void* ctx, bool text, const void* data, size_t len) {
+
+    LoopOutput* out = ctx;
+    if (out->nmsgs >= MAX_MSGS) {
+        return;
+    }
+    void* copy = malloc(len);
+    memcpy(copy, data, len);
+    CxVar* msg = cx_var_new(cx_def_allocator());
+    CXERR_CHK(wrs_decoder_dec(out->dec, text, copy, len, msg));
+    out->msgs[out->nmsgs++] = msg;
+    free(copy);
+}